@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_BENCH_RANDOM_H
+#define PASH_BENCH_RANDOM_H
+
+/***********************************************************************
+ * BenchRandom.h
+ * Seeded pseudo-random numbers of the benchmarks (xorshift64*), so that
+ * the same seed generates the same genome, reads and kernel inputs on
+ * every platform and build.
+ ***********************************************************************/
+
+#include <glib.h>
+
+typedef struct {
+	guint64 state;
+} BenchRandom;
+
+static inline void seedBenchRandom(BenchRandom* random, guint64 seed) {
+	// the state of xorshift must not be 0
+	random->state = seed*0x9E3779B97F4A7C15ULL+1;
+}
+
+static inline guint64 nextBenchRandom(BenchRandom* random) {
+	random->state ^= random->state>>12;
+	random->state ^= random->state<<25;
+	random->state ^= random->state>>27;
+	return random->state*0x2545F4914F6CDD1DULL;
+}
+
+/** Uniform integer in [0, bound).*/
+static inline guint32 benchRandomBelow(BenchRandom* random, guint32 bound) {
+	return (guint32) ((nextBenchRandom(random)>>32)*bound>>32);
+}
+
+/** Uniform real number in [0, 1).*/
+static inline double benchRandomUniform(BenchRandom* random) {
+	return (nextBenchRandom(random)>>11)*(1.0/9007199254740992.0);
+}
+
+static inline char benchRandomBase(BenchRandom* random) {
+	return "ACGT"[benchRandomBelow(random, 4)];
+}
+
+/** A base other than the given one.*/
+static inline char benchRandomSubstitution(BenchRandom* random, char base) {
+	char substitution;
+	do {
+		substitution = benchRandomBase(random);
+	} while (substitution==base);
+	return substitution;
+}
+
+static inline char benchComplementBase(char base) {
+	switch (base) {
+	case 'A': return 'T';
+	case 'C': return 'G';
+	case 'G': return 'C';
+	case 'T': return 'A';
+	default: return 'N';
+	}
+}
+
+#endif
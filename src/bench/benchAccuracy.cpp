@@ -0,0 +1,144 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+/* benchAccuracy.cpp
+   Compares the SAM output of pash3 for reads made by pash3_benchGenerate against their true origin:
+   a read is placed correctly if one of its mappings is on its chromosome, starting within a tolerance
+   of its true leftmost position.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <glib.h>
+#include "err.h"
+
+#define ACCURACY_LINE_LENGTH (1<<16)
+
+/** True origin of a read, and what its mappings were found to be.*/
+typedef struct {
+	char chromosome[64];
+	guint32 position;
+	guint32 mappings;
+	int correct;
+} TruthRecord;
+
+void printUsage() {
+	fprintf(stderr, "benchAccuracy - tool distributed with Pash version 3.01.03\n"
+			"Reports the fraction of the reads made by pash3_benchGenerate that pash3 maps to their origin.\n"
+			"Usage:\n"
+			"pash3_benchAccuracy -t <truth file> -s <SAM file> [-w <tolerance in bases>; default 20]\n"
+			"\n");
+}
+
+/** Number of a read named by pash3_benchGenerate; 0 if the name is not one of them.*/
+static guint32 readNumber(const char* readName) {
+	if (strncmp(readName, "read", 4)!=0) {
+		return 0;
+	}
+	return (guint32) strtoul(readName+4, NULL, 10);
+}
+
+int main(int argc, char** argv) {
+	const char* truthFile = NULL;
+	const char* samFile = NULL;
+	long tolerance = 20;
+	int opt;
+	if (argc==1) {
+		printUsage();
+		exit(0);
+	}
+	while ((opt=getopt(argc, argv, "t:s:w:"))!=-1) {
+		switch (opt) {
+		case 't': truthFile = optarg; break;
+		case 's': samFile = optarg; break;
+		case 'w': tolerance = atol(optarg); break;
+		default: die("unknown option");
+		}
+	}
+	if (truthFile==NULL || samFile==NULL) die("must specify the truth and the SAM files");
+
+	char* line = (char*) malloc(ACCURACY_LINE_LENGTH);
+	if (line==NULL) dieNoUsage("could not allocate memory for the input lines");
+	FILE* truthPtr = fopen(truthFile, "rt");
+	if (truthPtr==NULL) dieNoUsage("could not open the truth file");
+	guint32 numberOfReads = 0, truthCapacity = 1024;
+	TruthRecord* truth = (TruthRecord*) calloc(truthCapacity+1, sizeof(TruthRecord));
+	if (truth==NULL) dieNoUsage("could not allocate memory for the truth records");
+	while (fgets(line, ACCURACY_LINE_LENGTH, truthPtr)!=NULL) {
+		char readName[64], chromosome[64];
+		unsigned position;
+		if (sscanf(line, "%63s %63s %u", readName, chromosome, &position)!=3) {
+			continue;
+		}
+		guint32 read = readNumber(readName);
+		if (read==0) dieNoUsage("the truth file was not made by pash3_benchGenerate");
+		if (read>truthCapacity) {
+			guint32 previousCapacity = truthCapacity;
+			while (read>truthCapacity) {
+				truthCapacity *= 2;
+			}
+			truth = (TruthRecord*) realloc(truth, (truthCapacity+1)*sizeof(TruthRecord));
+			if (truth==NULL) dieNoUsage("could not allocate memory for the truth records");
+			memset(truth+previousCapacity+1, 0, (truthCapacity-previousCapacity)*sizeof(TruthRecord));
+		}
+		strcpy(truth[read].chromosome, chromosome);
+		truth[read].position = position;
+		if (read>numberOfReads) {
+			numberOfReads = read;
+		}
+	}
+	fclose(truthPtr);
+
+	FILE* samPtr = fopen(samFile, "rt");
+	if (samPtr==NULL) dieNoUsage("could not open the SAM file");
+	unsigned long unknownReads = 0;
+	while (fgets(line, ACCURACY_LINE_LENGTH, samPtr)!=NULL) {
+		char readName[256], chromosome[256];
+		unsigned flag;
+		long position;
+		if (line[0]=='@' || sscanf(line, "%255s %u %255s %ld", readName, &flag, chromosome, &position)!=4) {
+			continue;
+		}
+		guint32 read = readNumber(readName);
+		if (read==0 || read>numberOfReads || truth[read].position==0) {
+			unknownReads++;
+			continue;
+		}
+		TruthRecord* record = &truth[read];
+		record->mappings++;
+		if (!strcmp(record->chromosome, chromosome) && labs(position-(long)record->position)<=tolerance) {
+			record->correct = 1;
+		}
+	}
+	fclose(samPtr);
+
+	guint32 read, mappedReads = 0, correctReads = 0, multipleMappings = 0;
+	for (read=1; read<=numberOfReads; read++) {
+		if (truth[read].mappings>0) {
+			mappedReads++;
+		}
+		if (truth[read].mappings>1) {
+			multipleMappings++;
+		}
+		if (truth[read].correct) {
+			correctReads++;
+		}
+	}
+	double reads = numberOfReads>0 ? numberOfReads : 1;
+	printf("reads\t%u\n", numberOfReads);
+	printf("mapped\t%u\t%.2f%%\n", mappedReads, 100.0*mappedReads/reads);
+	printf("correct\t%u\t%.2f%%\n", correctReads, 100.0*correctReads/reads);
+	printf("misplaced\t%u\t%.2f%%\n", mappedReads-correctReads, 100.0*(mappedReads-correctReads)/reads);
+	printf("multiple mappings\t%u\n", multipleMappings);
+	if (unknownReads>0) {
+		printf("mappings of unknown reads\t%lu\n", unknownReads);
+	}
+	free(truth);
+	free(line);
+	return 0;
+}
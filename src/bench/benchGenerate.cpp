@@ -0,0 +1,282 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+/* benchGenerate.cpp
+   Generates a synthetic benchmark data set: a random reference with families of diverged repeats, and
+   reads sampled from it with substitutions, short indels and optionally bisulfite conversion. The true
+   origin of every read is written next to them, for pash3_benchAccuracy. The same seed always generates
+   the same data set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <glib.h>
+#include "someConstants.h"
+#include "BenchRandom.h"
+#include "err.h"
+
+/** Number of repeat families; the copies of a family differ from its unit by the repeat divergence.*/
+#define REPEAT_FAMILIES 8
+#define MAX_REPEAT_UNIT_LENGTH 10000
+#define FASTA_LINE_LENGTH 60
+
+typedef struct {
+	const char* outputPrefix;
+	guint64 seed;
+	guint32 genomeLength;
+	guint32 numberOfChromosomes;
+	double repeatFraction;
+	guint32 repeatUnitLength;
+	double repeatDivergence;
+	guint32 numberOfReads;
+	guint32 readLength;
+	double substitutionRate;
+	double indelRate;
+	int bisulfite;
+	double cpgMethylation;
+} GeneratorParameters;
+
+void printUsage() {
+	fprintf(stderr, "benchGenerate - tool distributed with Pash version 3.01.03\n"
+			"Generates a reference and reads sampled from it, with their true positions, to benchmark pash3.\n"
+			"Usage:\n"
+			"pash3_benchGenerate -o <output prefix> [options]\n"
+			"  writes <prefix>.fa, <prefix>.fastq and <prefix>.truth\n"
+			"  -s <seed>                  random seed; default 1\n"
+			"  -g <bases>                 reference length; default 1000000\n"
+			"  -c <number>                number of chromosomes; default 1\n"
+			"  -r <fraction>              fraction of the reference covered by repeats; default 0.1\n"
+			"  -u <bases>                 repeat unit length; default 300\n"
+			"  -d <fraction>              divergence of the repeat copies; default 0.02\n"
+			"  -n <number>                number of reads; default 10000\n"
+			"  -l <bases>                 read length; default 100\n"
+			"  -x <fraction>              substitution rate per read base; default 0.01\n"
+			"  -e <fraction>              indel rate per read base; default 0.001\n"
+			"  -B                         bisulfite convert the reads, and add the reverse complement\n"
+			"                             strands of the chromosomes, as pash3_getRCChrom.rb does\n"
+			"  -m <fraction>              methylation of the CpG sites of bisulfite reads; default 0.7\n"
+			"\n");
+}
+
+static void parseGeneratorParameters(int argc, char** argv, GeneratorParameters* gp) {
+	int opt;
+	gp->outputPrefix = NULL;
+	gp->seed = 1;
+	gp->genomeLength = 1000000;
+	gp->numberOfChromosomes = 1;
+	gp->repeatFraction = 0.1;
+	gp->repeatUnitLength = 300;
+	gp->repeatDivergence = 0.02;
+	gp->numberOfReads = 10000;
+	gp->readLength = 100;
+	gp->substitutionRate = 0.01;
+	gp->indelRate = 0.001;
+	gp->bisulfite = 0;
+	gp->cpgMethylation = 0.7;
+	if (argc==1) {
+		printUsage();
+		exit(0);
+	}
+	while ((opt=getopt(argc, argv, "o:s:g:c:r:u:d:n:l:x:e:Bm:"))!=-1) {
+		switch (opt) {
+		case 'o': gp->outputPrefix = optarg; break;
+		case 's': gp->seed = strtoull(optarg, NULL, 10); break;
+		case 'g': gp->genomeLength = atoi(optarg); break;
+		case 'c': gp->numberOfChromosomes = atoi(optarg); break;
+		case 'r': gp->repeatFraction = atof(optarg); break;
+		case 'u': gp->repeatUnitLength = atoi(optarg); break;
+		case 'd': gp->repeatDivergence = atof(optarg); break;
+		case 'n': gp->numberOfReads = atoi(optarg); break;
+		case 'l': gp->readLength = atoi(optarg); break;
+		case 'x': gp->substitutionRate = atof(optarg); break;
+		case 'e': gp->indelRate = atof(optarg); break;
+		case 'B': gp->bisulfite = 1; break;
+		case 'm': gp->cpgMethylation = atof(optarg); break;
+		default: die("unknown option");
+		}
+	}
+	if (gp->outputPrefix==NULL) die("must specify the output prefix with -o");
+	if (gp->numberOfChromosomes<1) die("the number of chromosomes should be positive");
+	if (gp->readLength<20 || gp->readLength>MAX_READ_SIZE) die("the read length should be between 20 and 2000");
+	if (gp->repeatUnitLength<1 || gp->repeatUnitLength>MAX_REPEAT_UNIT_LENGTH) {
+		die("the repeat unit length should be between 1 and 10000");
+	}
+	if (gp->genomeLength/gp->numberOfChromosomes<4*gp->readLength+gp->repeatUnitLength) {
+		die("the chromosomes are too short for the read length and the repeat unit");
+	}
+}
+
+/** Random chromosome, with copies of the repeat families covering the repeat fraction of it.*/
+static char* generateChromosome(BenchRandom* random, const GeneratorParameters* gp, guint32 length,
+		char repeatUnits[REPEAT_FAMILIES][MAX_REPEAT_UNIT_LENGTH]) {
+	char* sequence = (char*) malloc(length+1);
+	if (sequence==NULL) dieNoUsage("could not allocate memory for the reference");
+	guint32 i, copy;
+	for (i=0; i<length; i++) {
+		sequence[i] = benchRandomBase(random);
+	}
+	sequence[length] = '\0';
+	guint32 unitLength = gp->repeatUnitLength;
+	guint32 numberOfCopies = (guint32) (gp->repeatFraction*length/unitLength);
+	for (copy=0; copy<numberOfCopies; copy++) {
+		const char* unit = repeatUnits[benchRandomBelow(random, REPEAT_FAMILIES)];
+		guint32 start = benchRandomBelow(random, length-unitLength+1);
+		for (i=0; i<unitLength; i++) {
+			sequence[start+i] = benchRandomUniform(random)<gp->repeatDivergence ?
+					benchRandomSubstitution(random, unit[i]) : unit[i];
+		}
+	}
+	return sequence;
+}
+
+static void writeFastaSequence(FILE* filePtr, const char* name, const char* sequence, guint32 length) {
+	fprintf(filePtr, ">%s\n", name);
+	for (guint32 i=0; i<length; i+=FASTA_LINE_LENGTH) {
+		fprintf(filePtr, "%.*s\n", (int) (length-i<FASTA_LINE_LENGTH ? length-i : FASTA_LINE_LENGTH), sequence+i);
+	}
+}
+
+/** Bisulfite conversion of a reference base, as read on the strand the read comes from: the unmethylated
+ * cytosines of the strand become thymines, which on the reverse strand are guanines becoming adenines.*/
+static char bisulfiteBase(BenchRandom* random, const GeneratorParameters* gp, const char* chromosome,
+		guint32 chromosomeLength, guint32 position, int reverseStrand) {
+	char base = chromosome[position];
+	if (!reverseStrand && base=='C') {
+		int cpg = position+1<chromosomeLength && chromosome[position+1]=='G';
+		return cpg && benchRandomUniform(random)<gp->cpgMethylation ? 'C' : 'T';
+	}
+	if (reverseStrand && base=='G') {
+		int cpg = position>0 && chromosome[position-1]=='C';
+		return cpg && benchRandomUniform(random)<gp->cpgMethylation ? 'G' : 'A';
+	}
+	return base;
+}
+
+/** Sample a read from a chromosome, on the forward strand, with its errors.
+@param read read bases, of the read length
+@param substitutions number of substituted bases
+@param indels number of inserted or deleted bases
+@return number of reference bases the read spans*/
+static guint32 sampleRead(BenchRandom* random, const GeneratorParameters* gp, const char* chromosome,
+		guint32 chromosomeLength, guint32 start, int reverseStrand, char* read, guint32* substitutions, guint32* indels) {
+	guint32 readPosition = 0, referencePosition = start;
+	*substitutions = 0;
+	*indels = 0;
+	while (readPosition<gp->readLength && referencePosition<chromosomeLength) {
+		double error = benchRandomUniform(random);
+		if (error<gp->indelRate/2 && readPosition>0) {
+			read[readPosition++] = benchRandomBase(random);
+			(*indels)++;
+			continue;
+		}
+		if (error<gp->indelRate && readPosition>0) {
+			referencePosition++;
+			(*indels)++;
+			continue;
+		}
+		char base = gp->bisulfite ? bisulfiteBase(random, gp, chromosome, chromosomeLength, referencePosition, reverseStrand) :
+				chromosome[referencePosition];
+		if (benchRandomUniform(random)<gp->substitutionRate) {
+			base = benchRandomSubstitution(random, base);
+			(*substitutions)++;
+		}
+		read[readPosition++] = base;
+		referencePosition++;
+	}
+	read[readPosition] = '\0';
+	return referencePosition-start;
+}
+
+int main(int argc, char** argv) {
+	GeneratorParameters gp;
+	BenchRandom random;
+	static char repeatUnits[REPEAT_FAMILIES][MAX_REPEAT_UNIT_LENGTH];
+	guint32 chrom, i, r;
+
+	parseGeneratorParameters(argc, argv, &gp);
+	size_t fileNameSize = strlen(gp.outputPrefix)+16;
+	char* fileName = (char*) malloc(fileNameSize);
+	if (fileName==NULL) dieNoUsage("could not allocate memory for the file names");
+	seedBenchRandom(&random, gp.seed);
+	for (r=0; r<REPEAT_FAMILIES; r++) {
+		for (i=0; i<gp.repeatUnitLength; i++) {
+			repeatUnits[r][i] = benchRandomBase(&random);
+		}
+	}
+
+	guint32 chromosomeLength = gp.genomeLength/gp.numberOfChromosomes;
+	char** chromosomes = (char**) malloc(sizeof(char*)*gp.numberOfChromosomes);
+	if (chromosomes==NULL) dieNoUsage("could not allocate memory for the reference");
+	snprintf(fileName, fileNameSize, "%s.fa", gp.outputPrefix);
+	FILE* fastaPtr = fopen(fileName, "wt");
+	if (fastaPtr==NULL) dieNoUsage("could not open the reference output file");
+	char* reverseComplement = gp.bisulfite ? (char*) malloc(chromosomeLength+1) : NULL;
+	for (chrom=0; chrom<gp.numberOfChromosomes; chrom++) {
+		char name[64];
+		chromosomes[chrom] = generateChromosome(&random, &gp, chromosomeLength, repeatUnits);
+		sprintf(name, "chr%u", chrom+1);
+		writeFastaSequence(fastaPtr, name, chromosomes[chrom], chromosomeLength);
+		if (gp.bisulfite) {
+			if (reverseComplement==NULL) dieNoUsage("could not allocate memory for the reference");
+			for (i=0; i<chromosomeLength; i++) {
+				reverseComplement[i] = benchComplementBase(chromosomes[chrom][chromosomeLength-1-i]);
+			}
+			sprintf(name, "#RC.pash.chr%u", chrom+1);
+			writeFastaSequence(fastaPtr, name, reverseComplement, chromosomeLength);
+		}
+	}
+	fclose(fastaPtr);
+	free(reverseComplement);
+
+	snprintf(fileName, fileNameSize, "%s.fastq", gp.outputPrefix);
+	FILE* fastqPtr = fopen(fileName, "wt");
+	snprintf(fileName, fileNameSize, "%s.truth", gp.outputPrefix);
+	FILE* truthPtr = fopen(fileName, "wt");
+	if (fastqPtr==NULL || truthPtr==NULL) dieNoUsage("could not open the reads output files");
+	char* read = (char*) malloc(gp.readLength+1);
+	char* strandRead = (char*) malloc(gp.readLength+1);
+	char* qualities = (char*) malloc(gp.readLength+1);
+	if (read==NULL || strandRead==NULL || qualities==NULL) dieNoUsage("could not allocate memory for the reads");
+	memset(qualities, 'I', gp.readLength);
+	qualities[gp.readLength] = '\0';
+	for (r=1; r<=gp.numberOfReads; r++) {
+		chrom = benchRandomBelow(&random, gp.numberOfChromosomes);
+		int reverseStrand = benchRandomBelow(&random, 2);
+		// leave room for the deletions at the end of the chromosome
+		guint32 start = benchRandomBelow(&random, chromosomeLength-2*gp.readLength);
+		guint32 substitutions, indels;
+		guint32 span = sampleRead(&random, &gp, chromosomes[chrom], chromosomeLength, start, reverseStrand,
+				read, &substitutions, &indels);
+		guint32 readLength = strlen(read);
+		if (reverseStrand) {
+			for (i=0; i<readLength; i++) {
+				strandRead[i] = benchComplementBase(read[readLength-1-i]);
+			}
+			strandRead[readLength] = '\0';
+		} else {
+			strcpy(strandRead, read);
+		}
+		fprintf(fastqPtr, "@read%u\n%s\n+\n%.*s\n", r, strandRead, (int) readLength, qualities);
+		fprintf(truthPtr, "read%u\tchr%u\t%u\t%u\t%c\t%u\t%u\n", r, chrom+1, start+1, span,
+				reverseStrand ? '-' : '+', substitutions, indels);
+	}
+	fclose(fastqPtr);
+	fclose(truthPtr);
+	fprintf(stderr, "generated %u bases in %u chromosomes and %u reads of %u bases to %s.fa, %s.fastq and %s.truth\n",
+			chromosomeLength*gp.numberOfChromosomes, gp.numberOfChromosomes, gp.numberOfReads, gp.readLength,
+			gp.outputPrefix, gp.outputPrefix, gp.outputPrefix);
+	for (chrom=0; chrom<gp.numberOfChromosomes; chrom++) {
+		free(chromosomes[chrom]);
+	}
+	free(chromosomes);
+	free(fileName);
+	free(read);
+	free(strandRead);
+	free(qualities);
+	return 0;
+}
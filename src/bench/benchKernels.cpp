@@ -0,0 +1,298 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+/* benchKernels.cpp
+   Micro-benchmarks of the kernels of the mapping, on a reads and reference pair such as the ones made by
+   pash3_benchGenerate: the reads are hashed as pash3 hashes them, and the reference is scanned with the
+   same windows, one kernel at a time:
+     getKeyForSeq            keys of the sampled bases of every reference kmer
+     getIntListRunner        hive hash lookups of the keys
+     heap collator           merging the match streams of every reference window through the heap
+     bandedSWAlignmentInfo   banded alignments with traceback of reference stretches with random errors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <glib.h>
+#include "PashLib.h"
+#include "Collator.h"
+#include "FastQUtil.h"
+#include "FastaUtil.h"
+#include "FixedHashKey.h"
+#include "HiveHash.h"
+#include "InputReader.h"
+#include "PackedReference.h"
+#include "Metrics.h"
+#include "BenchRandom.h"
+#include "err.h"
+
+typedef struct {
+	const char* readsFile;
+	const char* referenceFile;
+	const char* samplingPattern;
+	guint32 numberOfAlignments;
+	guint32 alignmentLength;
+	int band;
+	guint64 seed;
+} KernelParameters;
+
+void printUsage() {
+	fprintf(stderr, "benchKernels - tool distributed with Pash version 3.01.03\n"
+			"Times the kernels of pash3 on a reads file and a reference.\n"
+			"Usage:\n"
+			"pash3_benchKernels -r <reads fastq> -g <reference fasta> [options]\n"
+			"  -p <sampling pattern>       as for pash3; default 12from18\n"
+			"  -a <number>                 number of banded alignments; default 100000\n"
+			"  -l <bases>                  length of the aligned reads; default 100\n"
+			"  -w <bases>                  band of the alignments; default 9\n"
+			"  -s <seed>                   random seed of the alignments; default 1\n"
+			"\n");
+}
+
+static void parseKernelParameters(int argc, char** argv, KernelParameters* kp) {
+	int opt;
+	kp->readsFile = NULL;
+	kp->referenceFile = NULL;
+	kp->samplingPattern = NULL;
+	kp->numberOfAlignments = 100000;
+	kp->alignmentLength = 100;
+	kp->band = 9;
+	kp->seed = 1;
+	if (argc==1) {
+		printUsage();
+		exit(0);
+	}
+	while ((opt=getopt(argc, argv, "r:g:p:a:l:w:s:"))!=-1) {
+		switch (opt) {
+		case 'r': kp->readsFile = optarg; break;
+		case 'g': kp->referenceFile = optarg; break;
+		case 'p': kp->samplingPattern = optarg; break;
+		case 'a': kp->numberOfAlignments = atoi(optarg); break;
+		case 'l': kp->alignmentLength = atoi(optarg); break;
+		case 'w': kp->band = atoi(optarg); break;
+		case 's': kp->seed = strtoull(optarg, NULL, 10); break;
+		default: die("unknown option");
+		}
+	}
+	if (kp->readsFile==NULL || kp->referenceFile==NULL) die("must specify the reads and the reference");
+	if (kp->alignmentLength<20 || kp->alignmentLength>MAX_READ_SIZE) die("the alignment length should be between 20 and 2000");
+	if (kp->band<1 || kp->band>=20) die("the band should be between 1 and 19, as the bands of pash3");
+}
+
+static void reportKernel(const char* kernel, unsigned long operations, const char* unit, double seconds) {
+	printf("%-24s %12lu %-10s %10.3f s %10.1f ns/%s\n", kernel, operations, unit, seconds,
+			operations>0 ? seconds*1e9/operations : 0.0, unit);
+}
+
+/** Hash the reads as pash3 does, with the sampling pattern and sensitivity of its command line.*/
+static PashParameters* hashReads(const KernelParameters* kp) {
+	char* pashArguments[16];
+	int numberOfArguments = 0;
+	pashArguments[numberOfArguments++] = (char*) "pash3";
+	pashArguments[numberOfArguments++] = (char*) "-r";
+	pashArguments[numberOfArguments++] = (char*) kp->readsFile;
+	pashArguments[numberOfArguments++] = (char*) "-g";
+	pashArguments[numberOfArguments++] = (char*) kp->referenceFile;
+	pashArguments[numberOfArguments++] = (char*) "-o";
+	pashArguments[numberOfArguments++] = (char*) "/dev/null";
+	if (kp->samplingPattern!=NULL) {
+		pashArguments[numberOfArguments++] = (char*) "-p";
+		pashArguments[numberOfArguments++] = (char*) kp->samplingPattern;
+	}
+	pashArguments[numberOfArguments] = NULL;
+	// the options of the benchmark were parsed already; have getopt start over
+	optind = 0;
+	PashParameters* pp = parseCommandLine(numberOfArguments, pashArguments);
+
+	double startTime = metricTime();
+	pp->verticalFastqUtil = new PashFastqUtil(pp->verticalFile, FastaAndQualityScores);
+	pp->verticalFastqUtil->loadSequences(1, pp->packedReads);
+	guint32 numberOfReads = pp->verticalFastqUtil->getNumberOfSequences();
+	pp->verticalSequencesInfos = (SequenceInfo*) malloc((numberOfReads+1)*sizeof(SequenceInfo));
+	if (pp->verticalSequencesInfos==NULL) dieNoUsage("could not allocate memory for the reads");
+	pp->lastVerticalSequenceMapped = 0;
+	loadIgnoreList(pp);
+	sizeCurrentVerticalSequencesBatch(pp);
+	hashCurrentVerticalSequencesBatch(pp);
+	reportKernel("load and hash reads", numberOfReads, "read", metricTime()-startTime);
+	return pp;
+}
+
+/** Key of the sampled bases of every kmer of a sequence, BAD_KEY if the kmer holds bases other than ACGT.*/
+static void computeKmerKeys(const Mask* mask, const char* sequence, guint32 numberOfKmers, guint32* keys) {
+	char kmer[MAX_MASK_LEN+1];
+	guint32 position, maskPosition, kmerPosition;
+	kmer[mask->keyLen] = '\0';
+	for (position=0; position<numberOfKmers; position++) {
+		int validKmer = 1;
+		for (maskPosition=0, kmerPosition=0; kmerPosition<mask->keyLen; maskPosition++) {
+			if (mask->mask[maskPosition]) {
+				char base = sequence[position+maskPosition];
+				validKmer &= base=='A' || base=='C' || base=='G' || base=='T';
+				kmer[kmerPosition++] = base;
+			}
+		}
+		getKeyForSeq(kmer, &keys[position]);
+		if (!validKmer) {
+			keys[position] = BAD_KEY;
+		}
+	}
+}
+
+/** Merge the match streams of every window of the keys, with the windows of the scan of pash3.
+@param kmerSpan span of the sampling pattern
+@return number of matches taken off the heap*/
+static unsigned long collateWindows(CollatorControl* cc, HiveHash* hiveHash, const guint32* keys, guint32 kmerSpan,
+		guint32 sequenceLength, int numberOfDiagonals, guint64* checksum) {
+	unsigned long collatedMatches = 0;
+	guint32 chunk, numberOfChunks = (sequenceLength-1)/numberOfDiagonals+1;
+	for (chunk=0; chunk<numberOfChunks; chunk++) {
+		guint32 chunkStart = numberOfDiagonals*chunk;
+		guint32 chunkStop = chunkStart+2*numberOfDiagonals-1;
+		if (chunkStop>=sequenceLength) {
+			chunkStop = sequenceLength-1;
+		}
+		resetCollatorControl(cc);
+		for (guint32 position=chunkStart; position+kmerSpan<=chunkStop+1; position++) {
+			if (keys[position]!=BAD_KEY && hiveHash->hasEntries(keys[position])) {
+				addMatchStreamCollatorControl(cc, keys[position], hiveHash, position-chunkStart);
+			}
+		}
+		while (cc->validMatchStreams>0) {
+			*checksum += cc->matchStreamPtrs[1]->verticalSeqID+cc->matchStreamPtrs[1]->okey;
+			collatedMatches++;
+			if (advanceTopMatchStream(cc->matchStreamPtrs, cc->validMatchStreams, cc->numberOfDiagonals+10)==1) {
+				cc->validMatchStreams--;
+			}
+		}
+	}
+	return collatedMatches;
+}
+
+/** Time the scan kernels on every sequence of the reference.*/
+static void benchScanKernels(PashParameters* pp, PackedReference* reference, guint64* checksum) {
+	HiveHash* hiveHash = (HiveHash*) pp->hiveHash;
+	CollatorControl* cc = initCollatorControl(pp->numberOfDiagonals, 0);
+	double keySeconds = 0, lookupSeconds = 0, collationSeconds = 0;
+	unsigned long numberOfKeys = 0, collatedMatches = 0;
+	guint32 sequence;
+	for (sequence=1; sequence<=reference->numberOfSequences; sequence++) {
+		guint32 sequenceLength = reference->sequences[sequence].length;
+		if (sequenceLength<pp->mask.maskLen) {
+			continue;
+		}
+		guint32 numberOfKmers = sequenceLength-pp->mask.maskLen+1;
+		char* bases = (char*) malloc(sequenceLength+1);
+		guint32* keys = (guint32*) malloc(sizeof(guint32)*numberOfKmers);
+		if (bases==NULL || keys==NULL) dieNoUsage("could not allocate memory for the reference");
+		decodePackedReference(reference, sequence, 0, sequenceLength, bases);
+		bases[sequenceLength] = '\0';
+
+		double startTime = metricTime();
+		computeKmerKeys(&pp->mask, bases, numberOfKmers, keys);
+		keySeconds += metricTime()-startTime;
+		numberOfKeys += numberOfKmers;
+
+		startTime = metricTime();
+		for (guint32 position=0; position<numberOfKmers; position++) {
+			IntListRunner runner;
+			hiveHash->getIntListRunner(keys[position], &runner);
+			*checksum += runner.left;
+		}
+		lookupSeconds += metricTime()-startTime;
+
+		startTime = metricTime();
+		collatedMatches += collateWindows(cc, hiveHash, keys, pp->mask.maskLen, sequenceLength, pp->numberOfDiagonals, checksum);
+		collationSeconds += metricTime()-startTime;
+		free(bases);
+		free(keys);
+	}
+	freeCollatorControl(cc);
+	reportKernel("getKeyForSeq", numberOfKeys, "key", keySeconds);
+	reportKernel("getIntListRunner", numberOfKeys, "lookup", lookupSeconds);
+	reportKernel("heap collator", collatedMatches, "match", collationSeconds);
+}
+
+/** Time bandedSWAlignmentInfo on stretches of the first reference sequence, aligned with substitutions and
+ * at most one indel to the reference around them.*/
+static void benchBandedAlignments(const KernelParameters* kp, PackedReference* reference, guint64* checksum) {
+	BenchRandom random;
+	guint32 length = kp->alignmentLength;
+	int band = kp->band;
+	guint32 sequenceLength = reference->sequences[1].length;
+	if (sequenceLength<length+band+1) {
+		fprintf(stderr, "the first reference sequence is too short for the alignments\n");
+		return;
+	}
+	seedBenchRandom(&random, kp->seed);
+	char* bases = (char*) malloc(sequenceLength+1);
+	char* reads = (char*) malloc((size_t)kp->numberOfAlignments*(length+1));
+	guint32* starts = (guint32*) malloc(sizeof(guint32)*kp->numberOfAlignments);
+	int* scoringMatrix = (int*) malloc(sizeof(int)*((MAX_READ_SIZE+1)*(band+2)+8));
+	if (bases==NULL || reads==NULL || starts==NULL || scoringMatrix==NULL) {
+		dieNoUsage("could not allocate memory for the alignments");
+	}
+	decodePackedReference(reference, 1, 0, sequenceLength, bases);
+	bases[sequenceLength] = '\0';
+	for (guint32 a=0; a<kp->numberOfAlignments; a++) {
+		char* read = reads+(size_t)a*(length+1);
+		starts[a] = benchRandomBelow(&random, sequenceLength-length-band);
+		// the read starts on the middle diagonal of the band, with an indel somewhere half of the time
+		const char* origin = bases+starts[a]+band/2;
+		guint32 indel = benchRandomBelow(&random, 2) ? benchRandomBelow(&random, length) : length;
+		int insertion = benchRandomBelow(&random, 2);
+		guint32 originPosition = 0;
+		for (guint32 i=0; i<length; i++) {
+			if (i==indel) {
+				if (insertion) {
+					read[i] = benchRandomBase(&random);
+					continue;
+				}
+				originPosition++;
+			}
+			char base = origin[originPosition++];
+			read[i] = benchRandomUniform(&random)<0.02 ? benchRandomSubstitution(&random, base) : base;
+		}
+		read[length] = '\0';
+	}
+	double startTime = metricTime();
+	for (guint32 a=0; a<kp->numberOfAlignments; a++) {
+		AlignmentSummary alignmentSummary;
+		*checksum += bandedSWAlignmentInfo(scoringMatrix, reads+(size_t)a*(length+1), bases+starts[a], length, band,
+				0, &alignmentSummary);
+		*checksum += alignmentSummary.numBlocks;
+	}
+	double seconds = metricTime()-startTime;
+	reportKernel("bandedSWAlignmentInfo", kp->numberOfAlignments, "alignment", seconds);
+	reportKernel("bandedSWAlignmentInfo", (unsigned long)kp->numberOfAlignments*length*band, "cell", seconds);
+	free(bases);
+	free(reads);
+	free(starts);
+	free(scoringMatrix);
+}
+
+int main(int argc, char** argv) {
+	KernelParameters kp;
+	guint64 checksum = 0;
+	parseKernelParameters(argc, argv, &kp);
+	PashParameters* pp = hashReads(&kp);
+	PackedReference* reference;
+	if (isPackedReferenceFile(pp->horizontalFile)) {
+		reference = mapPackedReference(pp->horizontalFile);
+	} else {
+		FastaUtil* fastaUtil = initFastaUtil(pp->horizontalFile);
+		reference = packFastaUtil(fastaUtil);
+	}
+	if (reference==NULL || reference->numberOfSequences==0) dieNoUsage("could not load the reference");
+	benchScanKernels(pp, reference, &checksum);
+	benchBandedAlignments(&kp, reference, &checksum);
+	// keeps the results of the kernels alive
+	printf("checksum %llu\n", (unsigned long long) checksum);
+	freePackedReference(reference);
+	return 0;
+}
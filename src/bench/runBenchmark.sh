@@ -0,0 +1,50 @@
+#!/bin/sh
+# Copyright (c) 2004-2016 Baylor College of Medicine.
+# Use of this software is governed by a license.
+# See the included file LICENSE for details.
+#
+# runBenchmark.sh
+# End-to-end benchmark of pash3: generates a reference and reads with a known origin, maps the reads,
+# and reports the mapping rate in reads per second and the accuracy of the mappings.
+# Options after -- are passed to pash3, the others to pash3_benchGenerate; -K also runs the kernel benchmarks.
+#
+# Usage: runBenchmark.sh [-K] [-w <work directory>] [generator options] [-- pash3 options]
+
+BENCH_DIR=`dirname "$0"`
+PASH="$BENCH_DIR/../pash/pash3"
+WORK_DIR=benchmarkRun
+RUN_KERNELS=0
+GENERATOR_OPTIONS=""
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+	-K) RUN_KERNELS=1 ;;
+	-w) WORK_DIR="$2"; shift ;;
+	--) shift; break ;;
+	*) GENERATOR_OPTIONS="$GENERATOR_OPTIONS $1" ;;
+	esac
+	shift
+done
+
+mkdir -p "$WORK_DIR" || exit 1
+PREFIX="$WORK_DIR/bench"
+"$BENCH_DIR/pash3_benchGenerate" -o "$PREFIX" $GENERATOR_OPTIONS || exit 1
+# bisulfite data is mapped as such
+case "$GENERATOR_OPTIONS" in
+*-B*) set -- -B "$@" ;;
+esac
+
+"$PASH" -r "$PREFIX.fastq" -g "$PREFIX.fa" -o "$PREFIX.sam" -J "$PREFIX.metrics.json" "$@" > "$PREFIX.log" 2>&1 || {
+	echo "pash3 failed, see $PREFIX.log" >&2
+	exit 1
+}
+
+READS=`grep -c . "$PREFIX.truth"`
+WALL_SECONDS=`sed -n 's/.*"wallSeconds": *\([0-9.]*\).*/\1/p' "$PREFIX.metrics.json"`
+awk -v reads="$READS" -v seconds="$WALL_SECONDS" \
+	'BEGIN { printf("wall seconds\t%.3f\nreads/sec\t%.0f\n", seconds, seconds>0 ? reads/seconds : 0) }'
+"$BENCH_DIR/pash3_benchAccuracy" -t "$PREFIX.truth" -s "$PREFIX.sam" || exit 1
+
+if [ $RUN_KERNELS -eq 1 ]; then
+	"$BENCH_DIR/pash3_benchKernels" -r "$PREFIX.fastq" -g "$PREFIX.fa" 2>> "$PREFIX.log"
+fi
@@ -18,33 +18,6 @@ See the included file LICENSE for details.
 
 #define DEB_PARSE_COMMA_LIST  0
 #define DEB_PARSE_INTLIST     0
-#define DEB_ZIP 0
-
-/** Open a gzip-ed or a bzip-ed file by setting up a pipe between (b)zcat and the current process.
- * @return a FILE pointer to current file
- * @param fileName name of the file to open
- */
-FILE* BRLGenericUtils::openTextGzipBzipFile(char* fileName) {
-  char catCommand[2*MAX_FILE_NAME];
-  FILE *inputFilePtr;
-  
-  if (!strcmp( &fileName[strlen(fileName)-3], ".gz")) {
-    sprintf(catCommand, "gzip -d -c %s", fileName);
-    xDEBUG(DEB_ZIP, fprintf(stderr, "about to open gzip-ed file %s\n", catCommand));
-    inputFilePtr = popen(catCommand, "r");
-  } else {
-    if (!strcmp(&fileName[strlen(fileName)-4], ".bz2")) {
-      sprintf(catCommand, "bunzip2 -c  %s", fileName);
-      xDEBUG(DEB_ZIP, fprintf(stderr, "about to open bzip-ed file %s\n", catCommand));
-      inputFilePtr = popen(catCommand, "r");
-    } else {
-      xDEBUG(DEB_ZIP, fprintf(stderr, "opening text file %s\n", fileName));
-      inputFilePtr = fopen(fileName, "rt");
-    }
-  }
-
-  return inputFilePtr; 
-}
 
 /** Print current time
  * @param outPtr file stream to print to
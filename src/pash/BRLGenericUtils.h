@@ -12,7 +12,6 @@ See the included file LICENSE for details.
 
 class BRLGenericUtils {
 public:
-  static FILE* openTextGzipBzipFile(char* fileName);
   static void printNow(FILE* outPtr);
   static int parseCommaSeparatedList(char* commaSeparatedList,
                                      char*** stringArray, guint32 *numberOfStrings);
@@ -0,0 +1,134 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+/***********************************************************************
+ * BamOutput.cpp
+ * BAM header and record encoding
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "PashDebug.h"
+#include "BamOutput.h"
+
+/** 4 bit codes of the bases, as BAM packs them; other characters are N.*/
+static const guint8 bamBaseCodes[256] = {
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  0, 15, 15,
+	15,  1, 14,  2, 13, 15, 15,  4, 11, 15, 15, 12, 15,  3, 15, 15,
+	15, 15,  5,  6,  8, 15,  7,  9, 15, 10, 15, 15, 15, 15, 15, 15,
+	15,  1, 14,  2, 13, 15, 15,  4, 11, 15, 15, 12, 15,  3, 15, 15,
+	15, 15,  5,  6,  8, 15,  7,  9, 15, 10, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+};
+
+static inline char* putBamInt32(char* buffer, guint32 value) {
+	buffer[0] = value&0xff;
+	buffer[1] = (value>>8)&0xff;
+	buffer[2] = (value>>16)&0xff;
+	buffer[3] = (value>>24)&0xff;
+	return buffer+4;
+}
+
+static inline char* putBamInt16(char* buffer, guint16 value) {
+	buffer[0] = value&0xff;
+	buffer[1] = (value>>8)&0xff;
+	return buffer+2;
+}
+
+/** Smallest bin of the BAM binning scheme holding the 0-based region [begin, end).*/
+static int bamRegionBin(gint32 begin, gint32 end) {
+	end--;
+	if (begin>>14==end>>14) return ((1<<15)-1)/7+(begin>>14);
+	if (begin>>17==end>>17) return ((1<<12)-1)/7+(begin>>17);
+	if (begin>>20==end>>20) return ((1<<9)-1)/7+(begin>>20);
+	if (begin>>23==end>>23) return ((1<<6)-1)/7+(begin>>23);
+	if (begin>>26==end>>26) return ((1<<3)-1)/7+(begin>>26);
+	return 0;
+}
+
+static void writeBamBytes(FILE* filePtr, const void* bytes, size_t size) {
+	if (fwrite(bytes, 1, size, filePtr)!=size) {
+		xDie(fprintf(stderr, "could not write the BAM header\n"), 2);
+	}
+}
+
+void writeBamHeader(FILE* filePtr, const char* headerText, guint32 numberOfReferences,
+		const char* const* referenceNames, const guint32* referenceLengths) {
+	char buffer[4];
+	writeBamBytes(filePtr, "BAM\1", 4);
+	guint32 headerTextLength = strlen(headerText);
+	writeBamBytes(filePtr, buffer, putBamInt32(buffer, headerTextLength)-buffer);
+	writeBamBytes(filePtr, headerText, headerTextLength);
+	writeBamBytes(filePtr, buffer, putBamInt32(buffer, numberOfReferences)-buffer);
+	for (guint32 i=0; i<numberOfReferences; i++) {
+		guint32 nameLength = strlen(referenceNames[i])+1;
+		writeBamBytes(filePtr, buffer, putBamInt32(buffer, nameLength)-buffer);
+		writeBamBytes(filePtr, referenceNames[i], nameLength);
+		writeBamBytes(filePtr, buffer, putBamInt32(buffer, referenceLengths[i])-buffer);
+	}
+}
+
+int encodeBamRecord(char* record, const char* readName, guint16 flag, gint32 referenceId, gint32 position,
+		guint8 mappingQuality, const guint32* cigar, int cigarLength, const char* sequence, const char* qualities) {
+	// the length of the name, with its null character, is stored in a byte
+	int readNameLength = MIN(strlen(readName), 254)+1;
+	int sequenceLength = strlen(sequence);
+	gint32 referenceLength = 0;
+	for (int i=0; i<cigarLength; i++) {
+		int operation = cigar[i]&0xf;
+		if (operation==BAM_CIGAR_MATCH || operation==BAM_CIGAR_DELETION) {
+			referenceLength += cigar[i]>>4;
+		}
+	}
+	char* field = record+4;
+	field = putBamInt32(field, referenceId);
+	field = putBamInt32(field, position);
+	*field++ = readNameLength;
+	*field++ = mappingQuality;
+	field = putBamInt16(field, bamRegionBin(position, position+(referenceLength>0 ? referenceLength : 1)));
+	field = putBamInt16(field, cigarLength);
+	field = putBamInt16(field, flag);
+	field = putBamInt32(field, sequenceLength);
+	// no mate
+	field = putBamInt32(field, (guint32) -1);
+	field = putBamInt32(field, (guint32) -1);
+	field = putBamInt32(field, 0);
+	memcpy(field, readName, readNameLength-1);
+	field[readNameLength-1] = '\0';
+	field += readNameLength;
+	for (int i=0; i<cigarLength; i++) {
+		field = putBamInt32(field, cigar[i]);
+	}
+	for (int i=0; i<sequenceLength; i+=2) {
+		guint8 packedBases = bamBaseCodes[(guint8) sequence[i]]<<4;
+		if (i+1<sequenceLength) {
+			packedBases |= bamBaseCodes[(guint8) sequence[i+1]];
+		}
+		*field++ = packedBases;
+	}
+	if (qualities==NULL || strlen(qualities)!=(size_t) sequenceLength) {
+		memset(field, 0xff, sequenceLength);
+	} else {
+		for (int i=0; i<sequenceLength; i++) {
+			field[i] = qualities[i]-33;
+		}
+	}
+	field += sequenceLength;
+	int recordSize = field-record;
+	putBamInt32(record, recordSize-4);
+	return recordSize;
+}
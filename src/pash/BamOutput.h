@@ -0,0 +1,64 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_BAM_OUTPUT_H
+#define PASH_BAM_OUTPUT_H
+
+/***********************************************************************
+ * BamOutput.h
+ * Binary encoding of the SAM header and alignment records, as laid out
+ * by the BAM specification; the encoded bytes are written to a BGZF
+ * stream. All the integers of BAM are little endian.
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <glib.h>
+
+/// CIGAR operations, with their BAM codes.
+#define BAM_CIGAR_MATCH 0
+#define BAM_CIGAR_INSERTION 1
+#define BAM_CIGAR_DELETION 2
+#define BAM_CIGAR_SOFT_CLIP 4
+/// CIGAR operation characters, indexed by BAM code.
+#define BAM_CIGAR_OPERATIONS "MIDNSHP=X"
+
+/// Flag of an alignment on the reverse strand.
+#define BAM_FLAG_REVERSE 16
+
+/** Pack a CIGAR operation as BAM stores it.*/
+static inline guint32 bamCigarOperation(guint32 length, int operation) {
+	return length<<4 | operation;
+}
+
+/** Write the BAM header: magic, SAM header text and reference sequences.
+@param filePtr BGZF output stream
+@param headerText SAM header lines
+@param numberOfReferences number of reference sequences
+@param referenceNames names of the reference sequences
+@param referenceLengths lengths of the reference sequences
+ */
+void writeBamHeader(FILE* filePtr, const char* headerText, guint32 numberOfReferences,
+		const char* const* referenceNames, const guint32* referenceLengths);
+
+/** Encode an alignment as a BAM record, starting with its block size. The record has no tags, no
+ * mate, and the same fields as the SAM lines of Pash.
+@param record buffer of the record
+@param readName read name
+@param flag SAM flag
+@param referenceId index of the reference sequence in the header
+@param position 0-based leftmost reference position
+@param mappingQuality mapping quality
+@param cigar CIGAR operations, packed by bamCigarOperation
+@param cigarLength number of CIGAR operations
+@param sequence read bases, on the strand of the alignment
+@param qualities phred+33 quality scores, as in the fastq file; missing unless there is one per base
+@return size of the record
+ */
+int encodeBamRecord(char* record, const char* readName, guint16 flag, gint32 referenceId, gint32 position,
+		guint8 mappingQuality, const guint32* cigar, int cigarLength, const char* sequence, const char* qualities);
+
+#endif
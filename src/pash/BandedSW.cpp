@@ -0,0 +1,746 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+/*******************************************************
+ * NAME: BandedSW.cpp
+ *
+ * Banded local alignment matrix fill: scalar kernel, and SSE4.1/AVX2
+ * kernels selected at runtime. Batches of alignments are scored with
+ * one alignment per lane of SSE4.1, AVX2 or AVX-512 vectors.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "BandedSW.h"
+#include "someConstants.h"
+#include "PashDebug.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BANDED_SW_X86 1
+// the kernels dispatched at run time use intrinsics outside the build's instruction set, which needs
+// GCC 4.9; older compilers keep the scalar kernels
+#if defined(__clang__) || __GNUC__>4 || (__GNUC__==4 && __GNUC_MINOR__>=9)
+#define BANDED_SW_DISPATCH 1
+#endif
+// the AVX-512BW intrinsics need GCC 6; older compilers score the batches with the AVX2 lanes
+#if defined(__clang__) || __GNUC__>=6
+#define BANDED_SW_AVX512 1
+#endif
+#endif
+
+#define DEB_BSW 0
+
+#define SW_MATCH_GAIN 1
+#define SW_MISMATCH_PENALTY -2
+#define SW_GAP_PENALTY -3
+
+typedef int (*BandedSWKernel)(int* scoringMatrix, const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int band, int bisulfiteSequencing, int* bestScoreRow, int* bestScoreCol);
+
+/** Reference base matched by a read base.*/
+static inline int swBasesMatch(char verticalBase, char horizontalBase, int bisulfiteSequencing) {
+	return verticalBase==horizontalBase || (bisulfiteSequencing && verticalBase=='T' && horizontalBase=='C');
+}
+
+/** Highest score an alignment can still reach, from its best score so far, the best score of its last
+ * row and the number of rows left: each row adds at most one match to the cells of the row above.*/
+#define SW_SCORE_BOUND(bestScore, rowBestScore, rowsLeft) \
+	((rowBestScore)+(rowsLeft)*SW_MATCH_GAIN>(bestScore) ? (rowBestScore)+(rowsLeft)*SW_MATCH_GAIN : (bestScore))
+
+static int fillBandedSWMatrixScalar(int* scoringMatrix, const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int band, int bisulfiteSequencing, int* bestScoreRow, int* bestScoreCol) {
+	int i, j, leftVal, upVal, diagVal;
+	int *prevLineH, *currentLineH;
+	int bestScore = 0;
+	int bandPlus1 = band+1;
+	int bestGlobalScore = 0;
+
+	*bestScoreRow = 0;
+	*bestScoreCol = 0;
+	prevLineH = scoringMatrix;
+	for (j=0; j<=bandPlus1; j++) {
+		prevLineH[j]=0;
+	}
+	for (i=0; i<sizeVerticalSequence;i++) {
+		currentLineH = prevLineH+band+2;
+		currentLineH[0]=0;
+		for (j=1; j<=band; j++) {
+			leftVal = currentLineH[j-1]+SW_GAP_PENALTY;
+			upVal = prevLineH[j+1]+SW_GAP_PENALTY;
+			if (swBasesMatch(verticalSequence[i], horizontalSequence[i+j-1], bisulfiteSequencing)) {
+				diagVal = prevLineH[j]+SW_MATCH_GAIN;
+			} else {
+				diagVal = prevLineH[j]+SW_MISMATCH_PENALTY;
+			}
+			if (diagVal>upVal) {
+				bestScore = diagVal;
+			} else {
+				bestScore = upVal;
+			}
+			if (bestScore<leftVal) {
+				bestScore = leftVal;
+			}
+			if (bestScore>0) {
+				currentLineH[j]=bestScore;
+				if (bestScore>bestGlobalScore) {
+					*bestScoreCol = j;
+					*bestScoreRow = i;
+					bestGlobalScore=bestScore;
+				}
+			} else {
+				currentLineH[j]=0;
+			}
+			xDEBUG(DEB_BSW, fprintf(stderr, "[%d][%d] cmp %c vs %c leftVal=%d upVal=%d  diagH %d, diagVal=%d bestScore=%d\n",
+					i, j, verticalSequence[i], horizontalSequence[i+j-1], leftVal, upVal, prevLineH[j], diagVal, currentLineH[j]));
+		}
+		currentLineH[bandPlus1]=0;
+		prevLineH = currentLineH;
+	}
+	return bestGlobalScore;
+}
+
+/** Best score of an alignment, computed with two rows instead of the whole matrix.
+@param targetScore the scoring stops once the alignment cannot reach this score anymore
+@param stoppedEarly set if the scoring stopped before the last row*/
+static int scoreBandedSWScalar(const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int band, int bisulfiteSequencing, int targetScore, int* stoppedEarly) {
+	int rowBuffers[2][MAX_SIMD_SW_BAND+2];
+	int *prevLineH = rowBuffers[0], *currentLineH = rowBuffers[1], *swapLineH;
+	int i, j, score, rowBestScore;
+	int bestGlobalScore = 0;
+
+	*stoppedEarly = 0;
+	memset(rowBuffers, 0, sizeof(rowBuffers));
+	for (i=0; i<sizeVerticalSequence; i++) {
+		rowBestScore = 0;
+		for (j=1; j<=band; j++) {
+			score = prevLineH[j] + (swBasesMatch(verticalSequence[i], horizontalSequence[i+j-1], bisulfiteSequencing) ?
+					SW_MATCH_GAIN : SW_MISMATCH_PENALTY);
+			if (score<prevLineH[j+1]+SW_GAP_PENALTY) {
+				score = prevLineH[j+1]+SW_GAP_PENALTY;
+			}
+			if (score<currentLineH[j-1]+SW_GAP_PENALTY) {
+				score = currentLineH[j-1]+SW_GAP_PENALTY;
+			}
+			if (score<0) {
+				score = 0;
+			}
+			currentLineH[j] = score;
+			if (score>rowBestScore) {
+				rowBestScore = score;
+			}
+		}
+		if (rowBestScore>bestGlobalScore) {
+			bestGlobalScore = rowBestScore;
+		}
+		if (SW_SCORE_BOUND(bestGlobalScore, rowBestScore, sizeVerticalSequence-1-i)<targetScore) {
+			*stoppedEarly = i<sizeVerticalSequence-1;
+			break;
+		}
+		swapLineH = prevLineH;
+		prevLineH = currentLineH;
+		currentLineH = swapLineH;
+	}
+	return bestGlobalScore;
+}
+
+/** Mismatching read bases first..last of an alignment without gaps, compared 16 at a time.
+@param maxMismatches the comparison stops after maxMismatches+1 mismatches
+@param mismatchPositions positions of the first maxMismatches mismatches
+@return number of mismatches, at most maxMismatches+1*/
+static int countUngappedMismatches(const char* verticalSequence, const char* horizontalSequence, int first, int last,
+		int bisulfiteSequencing, int maxMismatches, int* mismatchPositions) {
+	int i = first, numMismatches = 0;
+#if defined(BANDED_SW_X86) && defined(__SSE2__)
+	const __m128i baseT = _mm_set1_epi8('T');
+	const __m128i baseC = _mm_set1_epi8('C');
+	for (; i+16<=last+1; i+=16) {
+		__m128i verticalBases = _mm_loadu_si128((const __m128i*)(verticalSequence+i));
+		__m128i horizontalBases = _mm_loadu_si128((const __m128i*)(horizontalSequence+i));
+		__m128i match = _mm_cmpeq_epi8(verticalBases, horizontalBases);
+		if (bisulfiteSequencing) {
+			match = _mm_or_si128(match, _mm_and_si128(_mm_cmpeq_epi8(verticalBases, baseT),
+					_mm_cmpeq_epi8(horizontalBases, baseC)));
+		}
+		unsigned mismatches = ~(unsigned)_mm_movemask_epi8(match) & 0xFFFF;
+		for (; mismatches!=0; mismatches &= mismatches-1) {
+			if (numMismatches<maxMismatches) {
+				mismatchPositions[numMismatches] = i+__builtin_ctz(mismatches);
+			}
+			if (++numMismatches>maxMismatches) {
+				return numMismatches;
+			}
+		}
+	}
+#endif
+	for (; i<=last; i++) {
+		if (!swBasesMatch(verticalSequence[i], horizontalSequence[i], bisulfiteSequencing)) {
+			if (numMismatches<maxMismatches) {
+				mismatchPositions[numMismatches] = i;
+			}
+			if (++numMismatches>maxMismatches) {
+				return numMismatches;
+			}
+		}
+	}
+	return numMismatches;
+}
+
+/* An alignment on a band of 3 columns is the ungapped alignment of the read on the middle column when
+ * the read matches it end to end with at most one mismatch, at position p, and the other two diagonals
+ * mismatch at the right places. A path of the band scores at most one per read base it crosses,
+ * minus 3 per mismatch or gap, and a cell of row i scores at most i+1. With n read bases:
+ * - no mismatch: the middle column scores i+1 on row i, which no gap improves on. The best score n is
+ *   only reached on the last row, and column 1 only reaches it if its diagonal is a perfect match.
+ * - one mismatch, 3<=p<=n-4: the middle column keeps a positive score, so the traceback runs back to
+ *   the first read base, and no gap improves on it as the neighbours of row i score at most i+1. Its
+ *   score n-3 on the last row is higher than on any other row. Another column only ties it on an
+ *   earlier row with a match run of n-3 bases, which a mismatch in rows 2..n-4 of its diagonal
+ *   rules out; column 1 only ties it on the last row with a match run of n-3 bases or with an end to
+ *   end alignment with one mismatch, which a mismatch in rows 3..n-1 and a second mismatch rule out.
+ *   Column 3 may tie it on the last row, but comes after it.
+ * The traceback then takes the diagonal all the way, matches being tried before gaps. */
+
+int scoreUngappedAlignment(const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int bisulfiteSequencing) {
+	int n = sizeVerticalSequence;
+	int mismatchPosition, position;
+	switch (countUngappedMismatches(verticalSequence, horizontalSequence+1, 0, n-1, bisulfiteSequencing,
+			1, &mismatchPosition)) {
+	case 0:
+		if (countUngappedMismatches(verticalSequence, horizontalSequence, 0, n-1, bisulfiteSequencing, 0, &position)==0) {
+			return -1;
+		}
+		return n*SW_MATCH_GAIN;
+	case 1:
+		if (mismatchPosition<3 || mismatchPosition>n-4 ||
+				countUngappedMismatches(verticalSequence, horizontalSequence, 2, n-4, bisulfiteSequencing, 0, &position)==0 ||
+				countUngappedMismatches(verticalSequence, horizontalSequence+2, 2, n-4, bisulfiteSequencing, 0, &position)==0 ||
+				countUngappedMismatches(verticalSequence, horizontalSequence, 3, n-1, bisulfiteSequencing, 0, &position)==0 ||
+				countUngappedMismatches(verticalSequence, horizontalSequence, 0, n-1, bisulfiteSequencing, 1, &position)<2) {
+			return -1;
+		}
+		return (n-1)*SW_MATCH_GAIN+SW_MISMATCH_PENALTY;
+	default:
+		return -1;
+	}
+}
+
+/// Widest batch of alignments scored together: 32 lanes of 16 bits in an AVX-512 vector.
+#define MAX_SW_BATCH_LANES 32
+/// Padding of the interleaved reads and references; the two never match each other or a base.
+#define SW_BATCH_VERTICAL_PAD 1
+#define SW_BATCH_HORIZONTAL_PAD 2
+
+typedef int (*BandedSWBatchKernel)(const char* verticalLanes, const char* horizontalLanes,
+		int rows, int band, int bisulfiteSequencing, const gint16* laneSizes, const gint16* laneTargets, int* bestScores);
+
+/// Rows between two checks of whether the alignments of a batch can still reach their target scores.
+#define SW_BATCH_BOUND_ROWS 8
+
+/** Interleave the sequences of up to lanes alignments, one alignment per lane: lane k of row i holds
+ * base i of read k, and lane k of row i+j-1 of the references the base of column j of that read base.
+ * Past the end of its read, a lane is padded with bases matching nothing, which only lowers scores.
+@return number of rows, the length of the longest read*/
+static int interleaveSWBatch(char* verticalLanes, char* horizontalLanes, int lanes,
+		const char* const* verticalSequences, const char* const* horizontalSequences,
+		const int* sizeVerticalSequences, int numberOfAlignments, int band) {
+	int k, i, rows = 0;
+	for (k=0; k<numberOfAlignments; k++) {
+		if (sizeVerticalSequences[k]>rows) {
+			rows = sizeVerticalSequences[k];
+		}
+	}
+	memset(verticalLanes, SW_BATCH_VERTICAL_PAD, rows*lanes);
+	memset(horizontalLanes, SW_BATCH_HORIZONTAL_PAD, (rows+band-1)*lanes);
+	for (k=0; k<numberOfAlignments; k++) {
+		const char* verticalSequence = verticalSequences[k];
+		const char* horizontalSequence = horizontalSequences[k];
+		int sizeVerticalSequence = sizeVerticalSequences[k];
+		for (i=0; i<sizeVerticalSequence; i++) {
+			verticalLanes[i*lanes+k] = verticalSequence[i];
+		}
+		for (i=0; sizeVerticalSequence>0 && i<sizeVerticalSequence+band-1; i++) {
+			horizontalLanes[i*lanes+k] = horizontalSequence[i];
+		}
+	}
+	return rows;
+}
+
+#ifdef BANDED_SW_DISPATCH
+
+/** Best cell of the matrix from the best score of each column and the first row reaching it: the first
+ * cell in row-major order holding the best score, as in the scalar kernel.*/
+static inline int bestCellOfColumns(const int* columnBestScores, const int* columnBestRows, int band,
+		int* bestScoreRow, int* bestScoreCol) {
+	int k, bestGlobalScore = 0;
+	*bestScoreRow = 0;
+	*bestScoreCol = 0;
+	for (k=0; k<band; k++) {
+		if (columnBestScores[k]>bestGlobalScore) {
+			bestGlobalScore = columnBestScores[k];
+		}
+	}
+	if (bestGlobalScore==0) {
+		return 0;
+	}
+	*bestScoreRow = -1;
+	for (k=0; k<band; k++) {
+		if (columnBestScores[k]==bestGlobalScore && (*bestScoreRow<0 || columnBestRows[k]<*bestScoreRow)) {
+			*bestScoreRow = columnBestRows[k];
+			*bestScoreCol = k+1;
+		}
+	}
+	return bestGlobalScore;
+}
+
+/** Copy the reference bases of the band, padded so that the kernels can load whole vectors.*/
+static inline void padHorizontalSequence(char* paddedSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int band, int padding) {
+	memcpy(paddedSequence, horizontalSequence, sizeVerticalSequence+band-1);
+	memset(paddedSequence+sizeVerticalSequence+band-1, 0, padding);
+}
+
+/* Each row is computed in vectors of consecutive columns. The diagonal and vertical moves only
+ * depend on the previous row, which is kept in an aligned row buffer rather than reloaded from the
+ * matrix; the horizontal gaps are then propagated along the row with a max-plus prefix scan over
+ * the lanes, continued from the last column of the previous vector. Columns past the band are kept
+ * at zero, and each column keeps its best score and the first row reaching it. The matrix itself
+ * is only written, for the traceback. */
+
+__attribute__((target("sse4.1")))
+static int fillBandedSWMatrixSSE41(int* scoringMatrix, const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int band, int bisulfiteSequencing, int* bestScoreRow, int* bestScoreCol) {
+	char paddedSequence[MAX_READ_SIZE+MAX_SIMD_SW_BAND+4];
+	int rowBuffers[2][MAX_SIMD_SW_BAND+4] __attribute__((aligned(16)));
+	int columnBestScores[MAX_SIMD_SW_BAND] __attribute__((aligned(16)));
+	int columnBestRows[MAX_SIMD_SW_BAND] __attribute__((aligned(16)));
+	int i, j, v;
+	int numberOfVectors = (band+3)/4;
+	int *prevRow = rowBuffers[0], *currentRow = rowBuffers[1], *swapRow;
+	int *currentLineH = scoringMatrix;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i matchGain = _mm_set1_epi32(SW_MATCH_GAIN);
+	const __m128i mismatchPenalty = _mm_set1_epi32(SW_MISMATCH_PENALTY);
+	const __m128i gapPenalty = _mm_set1_epi32(SW_GAP_PENALTY);
+	const __m128i bisulfiteBase = _mm_set1_epi32('C');
+	const __m128i carryPenalty = _mm_setr_epi32(SW_GAP_PENALTY, 2*SW_GAP_PENALTY, 3*SW_GAP_PENALTY, 4*SW_GAP_PENALTY);
+	const __m128i lastColumns = _mm_cmpgt_epi32(_mm_set1_epi32(band-4*(numberOfVectors-1)), _mm_setr_epi32(0, 1, 2, 3));
+	__m128i previousH = zero;
+
+	padHorizontalSequence(paddedSequence, horizontalSequence, sizeVerticalSequence, band, 4);
+	memset(rowBuffers, 0, sizeof(rowBuffers));
+	memset(columnBestScores, 0, sizeof(columnBestScores));
+	memset(columnBestRows, 0, sizeof(columnBestRows));
+	for (j=0; j<=band+1; j++) {
+		currentLineH[j]=0;
+	}
+	for (i=0; i<sizeVerticalSequence; i++) {
+		currentLineH += band+2;
+		currentLineH[0] = 0;
+		__m128i verticalBase = _mm_set1_epi32((unsigned char)verticalSequence[i]);
+		__m128i row = _mm_set1_epi32(i);
+		int matchesC = bisulfiteSequencing && verticalSequence[i]=='T';
+		__m128i carry = zero;
+		// a band of a single vector keeps the previous row in a register
+		__m128i diagonal = numberOfVectors==1 ? previousH : _mm_load_si128((const __m128i*)prevRow);
+		for (v=0, j=1; v<numberOfVectors; v++, j+=4) {
+			__m128i nextDiagonal = v<numberOfVectors-1 ? _mm_load_si128((const __m128i*)(prevRow+j+3)) : zero;
+			__m128i up = _mm_alignr_epi8(nextDiagonal, diagonal, 4);
+			int packedBases;
+			memcpy(&packedBases, paddedSequence+i+j-1, sizeof(int));
+			__m128i horizontalBases = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packedBases));
+			__m128i match = _mm_cmpeq_epi32(horizontalBases, verticalBase);
+			if (matchesC) {
+				match = _mm_or_si128(match, _mm_cmpeq_epi32(horizontalBases, bisulfiteBase));
+			}
+			__m128i score = _mm_blendv_epi8(mismatchPenalty, matchGain, match);
+			__m128i H = _mm_max_epi32(_mm_add_epi32(diagonal, score), _mm_add_epi32(up, gapPenalty));
+			H = _mm_max_epi32(H, zero);
+			// horizontal gaps within the vector, then from the column before it
+			H = _mm_max_epi32(H, _mm_add_epi32(_mm_slli_si128(H, 4), gapPenalty));
+			H = _mm_max_epi32(H, _mm_add_epi32(_mm_slli_si128(H, 8), _mm_add_epi32(gapPenalty, gapPenalty)));
+			H = _mm_max_epi32(H, _mm_add_epi32(carry, carryPenalty));
+			if (v==numberOfVectors-1) {
+				H = _mm_and_si128(H, lastColumns);
+			}
+			_mm_store_si128((__m128i*)(currentRow+j-1), H);
+			_mm_storeu_si128((__m128i*)(currentLineH+j), H);
+			__m128i bestScores = _mm_load_si128((const __m128i*)(columnBestScores+j-1));
+			__m128i improved = _mm_cmpgt_epi32(H, bestScores);
+			_mm_store_si128((__m128i*)(columnBestScores+j-1), _mm_max_epi32(H, bestScores));
+			__m128i bestRows = _mm_load_si128((const __m128i*)(columnBestRows+j-1));
+			_mm_store_si128((__m128i*)(columnBestRows+j-1), _mm_blendv_epi8(bestRows, row, improved));
+			carry = _mm_shuffle_epi32(H, _MM_SHUFFLE(3, 3, 3, 3));
+			diagonal = nextDiagonal;
+			previousH = H;
+		}
+		currentLineH[band+1] = 0;
+		swapRow = prevRow;
+		prevRow = currentRow;
+		currentRow = swapRow;
+	}
+	return bestCellOfColumns(columnBestScores, columnBestRows, band, bestScoreRow, bestScoreCol);
+}
+
+/** Shift the lanes of a vector up by one, two or three lanes, shifting in zeros.*/
+#define SHIFT_LANES_256(x, lanes) _mm256_alignr_epi8((x), _mm256_permute2x128_si256((x), (x), 0x08), 16-4*(lanes))
+
+__attribute__((target("avx2")))
+static int fillBandedSWMatrixAVX2(int* scoringMatrix, const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int band, int bisulfiteSequencing, int* bestScoreRow, int* bestScoreCol) {
+	char paddedSequence[MAX_READ_SIZE+MAX_SIMD_SW_BAND+8];
+	int rowBuffers[2][MAX_SIMD_SW_BAND+8] __attribute__((aligned(32)));
+	int columnBestScores[MAX_SIMD_SW_BAND] __attribute__((aligned(32)));
+	int columnBestRows[MAX_SIMD_SW_BAND] __attribute__((aligned(32)));
+	int i, j, v;
+	int numberOfVectors = (band+7)/8;
+	int *prevRow = rowBuffers[0], *currentRow = rowBuffers[1], *swapRow;
+	int *currentLineH = scoringMatrix;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i matchGain = _mm256_set1_epi32(SW_MATCH_GAIN);
+	const __m256i mismatchPenalty = _mm256_set1_epi32(SW_MISMATCH_PENALTY);
+	const __m256i gapPenalty = _mm256_set1_epi32(SW_GAP_PENALTY);
+	const __m256i bisulfiteBase = _mm256_set1_epi32('C');
+	const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i carryPenalty = _mm256_mullo_epi32(_mm256_add_epi32(laneIndex, _mm256_set1_epi32(1)), gapPenalty);
+	const __m256i lastColumns = _mm256_cmpgt_epi32(_mm256_set1_epi32(band-8*(numberOfVectors-1)), laneIndex);
+	const __m256i lastLane = _mm256_set1_epi32(7);
+	__m256i previousH = zero;
+
+	padHorizontalSequence(paddedSequence, horizontalSequence, sizeVerticalSequence, band, 8);
+	memset(rowBuffers, 0, sizeof(rowBuffers));
+	memset(columnBestScores, 0, sizeof(columnBestScores));
+	memset(columnBestRows, 0, sizeof(columnBestRows));
+	for (j=0; j<=band+1; j++) {
+		currentLineH[j]=0;
+	}
+	for (i=0; i<sizeVerticalSequence; i++) {
+		currentLineH += band+2;
+		currentLineH[0] = 0;
+		__m256i verticalBase = _mm256_set1_epi32((unsigned char)verticalSequence[i]);
+		__m256i row = _mm256_set1_epi32(i);
+		int matchesC = bisulfiteSequencing && verticalSequence[i]=='T';
+		__m256i carry = zero;
+		// a band of a single vector keeps the previous row in a register
+		__m256i diagonal = numberOfVectors==1 ? previousH : _mm256_load_si256((const __m256i*)prevRow);
+		for (v=0, j=1; v<numberOfVectors; v++, j+=8) {
+			__m256i nextDiagonal = v<numberOfVectors-1 ? _mm256_load_si256((const __m256i*)(prevRow+j+7)) : zero;
+			__m256i up = _mm256_alignr_epi8(_mm256_permute2x128_si256(diagonal, nextDiagonal, 0x21), diagonal, 4);
+			__m256i horizontalBases = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(paddedSequence+i+j-1)));
+			__m256i match = _mm256_cmpeq_epi32(horizontalBases, verticalBase);
+			if (matchesC) {
+				match = _mm256_or_si256(match, _mm256_cmpeq_epi32(horizontalBases, bisulfiteBase));
+			}
+			__m256i score = _mm256_blendv_epi8(mismatchPenalty, matchGain, match);
+			__m256i H = _mm256_max_epi32(_mm256_add_epi32(diagonal, score), _mm256_add_epi32(up, gapPenalty));
+			H = _mm256_max_epi32(H, zero);
+			// horizontal gaps within the vector, then from the column before it
+			H = _mm256_max_epi32(H, _mm256_add_epi32(SHIFT_LANES_256(H, 1), gapPenalty));
+			H = _mm256_max_epi32(H, _mm256_add_epi32(SHIFT_LANES_256(H, 2), _mm256_slli_epi32(gapPenalty, 1)));
+			H = _mm256_max_epi32(H, _mm256_add_epi32(_mm256_permute2x128_si256(H, H, 0x08), _mm256_slli_epi32(gapPenalty, 2)));
+			H = _mm256_max_epi32(H, _mm256_add_epi32(carry, carryPenalty));
+			if (v==numberOfVectors-1) {
+				H = _mm256_and_si256(H, lastColumns);
+			}
+			_mm256_store_si256((__m256i*)(currentRow+j-1), H);
+			_mm256_storeu_si256((__m256i*)(currentLineH+j), H);
+			__m256i bestScores = _mm256_load_si256((const __m256i*)(columnBestScores+j-1));
+			__m256i improved = _mm256_cmpgt_epi32(H, bestScores);
+			_mm256_store_si256((__m256i*)(columnBestScores+j-1), _mm256_max_epi32(H, bestScores));
+			__m256i bestRows = _mm256_load_si256((const __m256i*)(columnBestRows+j-1));
+			_mm256_store_si256((__m256i*)(columnBestRows+j-1), _mm256_blendv_epi8(bestRows, row, improved));
+			carry = _mm256_permutevar8x32_epi32(H, lastLane);
+			diagonal = nextDiagonal;
+			previousH = H;
+		}
+		currentLineH[band+1] = 0;
+		swapRow = prevRow;
+		prevRow = currentRow;
+		currentRow = swapRow;
+	}
+	return bestCellOfColumns(columnBestScores, columnBestRows, band, bestScoreRow, bestScoreCol);
+}
+
+/* The batch kernels score one alignment per lane of 16 bit scores: the whole band of a row is kept
+ * in registers, cell j of the band depending on cell j of the previous row (diagonal), cell j+1 of the
+ * previous row (vertical gap) and cell j-1 of the current row (horizontal gap), as in the scalar
+ * kernel. Read lengths are bounded by MAX_READ_SIZE, so 16 bit scores cannot overflow. Every few
+ * rows, the batch stops if none of its alignments can reach its target score anymore; they return
+ * the number of rows computed. */
+
+__attribute__((target("sse4.1")))
+static int scoreSWBatchSSE41(const char* verticalLanes, const char* horizontalLanes,
+		int rows, int band, int bisulfiteSequencing, const gint16* laneSizes, const gint16* laneTargets, int* bestScores) {
+	__m128i rowBuffers[2][MAX_SIMD_SW_BAND+2];
+	__m128i *prevRow = rowBuffers[0], *currentRow = rowBuffers[1], *swapRow;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i matchGain = _mm_set1_epi16(SW_MATCH_GAIN);
+	const __m128i mismatchPenalty = _mm_set1_epi16(SW_MISMATCH_PENALTY);
+	const __m128i gapPenalty = _mm_set1_epi16(SW_GAP_PENALTY);
+	const __m128i baseT = _mm_set1_epi8('T');
+	const __m128i baseC = _mm_set1_epi8('C');
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i targets = _mm_loadu_si128((const __m128i*)laneTargets);
+	__m128i rowsLeft = _mm_loadu_si128((const __m128i*)laneSizes);
+	__m128i best = zero;
+	gint16 laneScores[8];
+	int i, j;
+
+	for (j=0; j<=band+1; j++) {
+		rowBuffers[0][j] = zero;
+		rowBuffers[1][j] = zero;
+	}
+	for (i=0; i<rows; i++) {
+		__m128i verticalBases = _mm_loadl_epi64((const __m128i*)(verticalLanes+8*i));
+		__m128i matchesC = bisulfiteSequencing ? _mm_cmpeq_epi8(verticalBases, baseT) : zero;
+		__m128i rowBest = zero;
+		for (j=1; j<=band; j++) {
+			__m128i horizontalBases = _mm_loadl_epi64((const __m128i*)(horizontalLanes+8*(i+j-1)));
+			__m128i match = _mm_cmpeq_epi8(verticalBases, horizontalBases);
+			match = _mm_or_si128(match, _mm_and_si128(matchesC, _mm_cmpeq_epi8(horizontalBases, baseC)));
+			__m128i score = _mm_blendv_epi8(mismatchPenalty, matchGain, _mm_cvtepi8_epi16(match));
+			__m128i H = _mm_max_epi16(_mm_add_epi16(prevRow[j], score), _mm_add_epi16(prevRow[j+1], gapPenalty));
+			H = _mm_max_epi16(H, _mm_add_epi16(currentRow[j-1], gapPenalty));
+			H = _mm_max_epi16(H, zero);
+			currentRow[j] = H;
+			rowBest = _mm_max_epi16(rowBest, H);
+		}
+		best = _mm_max_epi16(best, rowBest);
+		rowsLeft = _mm_sub_epi16(rowsLeft, one);
+		if (i%SW_BATCH_BOUND_ROWS==SW_BATCH_BOUND_ROWS-1) {
+			__m128i bound = _mm_max_epi16(best, _mm_add_epi16(rowBest, rowsLeft));
+			if (_mm_movemask_epi8(_mm_cmplt_epi16(bound, targets))==0xFFFF) {
+				i++;
+				break;
+			}
+		}
+		swapRow = prevRow;
+		prevRow = currentRow;
+		currentRow = swapRow;
+	}
+	_mm_storeu_si128((__m128i*)laneScores, best);
+	for (j=0; j<8; j++) {
+		bestScores[j] = laneScores[j];
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int scoreSWBatchAVX2(const char* verticalLanes, const char* horizontalLanes,
+		int rows, int band, int bisulfiteSequencing, const gint16* laneSizes, const gint16* laneTargets, int* bestScores) {
+	__m256i rowBuffers[2][MAX_SIMD_SW_BAND+2];
+	__m256i *prevRow = rowBuffers[0], *currentRow = rowBuffers[1], *swapRow;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i matchGain = _mm256_set1_epi16(SW_MATCH_GAIN);
+	const __m256i mismatchPenalty = _mm256_set1_epi16(SW_MISMATCH_PENALTY);
+	const __m256i gapPenalty = _mm256_set1_epi16(SW_GAP_PENALTY);
+	const __m128i baseT = _mm_set1_epi8('T');
+	const __m128i baseC = _mm_set1_epi8('C');
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i targets = _mm256_loadu_si256((const __m256i*)laneTargets);
+	__m256i rowsLeft = _mm256_loadu_si256((const __m256i*)laneSizes);
+	__m256i best = zero;
+	gint16 laneScores[16];
+	int i, j;
+
+	for (j=0; j<=band+1; j++) {
+		rowBuffers[0][j] = zero;
+		rowBuffers[1][j] = zero;
+	}
+	for (i=0; i<rows; i++) {
+		__m128i verticalBases = _mm_loadu_si128((const __m128i*)(verticalLanes+16*i));
+		__m128i matchesC = bisulfiteSequencing ? _mm_cmpeq_epi8(verticalBases, baseT) : _mm_setzero_si128();
+		__m256i rowBest = zero;
+		for (j=1; j<=band; j++) {
+			__m128i horizontalBases = _mm_loadu_si128((const __m128i*)(horizontalLanes+16*(i+j-1)));
+			__m128i match = _mm_cmpeq_epi8(verticalBases, horizontalBases);
+			match = _mm_or_si128(match, _mm_and_si128(matchesC, _mm_cmpeq_epi8(horizontalBases, baseC)));
+			__m256i score = _mm256_blendv_epi8(mismatchPenalty, matchGain, _mm256_cvtepi8_epi16(match));
+			__m256i H = _mm256_max_epi16(_mm256_add_epi16(prevRow[j], score), _mm256_add_epi16(prevRow[j+1], gapPenalty));
+			H = _mm256_max_epi16(H, _mm256_add_epi16(currentRow[j-1], gapPenalty));
+			H = _mm256_max_epi16(H, zero);
+			currentRow[j] = H;
+			rowBest = _mm256_max_epi16(rowBest, H);
+		}
+		best = _mm256_max_epi16(best, rowBest);
+		rowsLeft = _mm256_sub_epi16(rowsLeft, one);
+		if (i%SW_BATCH_BOUND_ROWS==SW_BATCH_BOUND_ROWS-1) {
+			__m256i bound = _mm256_max_epi16(best, _mm256_add_epi16(rowBest, rowsLeft));
+			if ((unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi16(targets, bound))==0xFFFFFFFFu) {
+				i++;
+				break;
+			}
+		}
+		swapRow = prevRow;
+		prevRow = currentRow;
+		currentRow = swapRow;
+	}
+	_mm256_storeu_si256((__m256i*)laneScores, best);
+	for (j=0; j<16; j++) {
+		bestScores[j] = laneScores[j];
+	}
+	return i;
+}
+
+#ifdef BANDED_SW_AVX512
+__attribute__((target("avx512bw,avx512vl")))
+static int scoreSWBatchAVX512(const char* verticalLanes, const char* horizontalLanes,
+		int rows, int band, int bisulfiteSequencing, const gint16* laneSizes, const gint16* laneTargets, int* bestScores) {
+	__m512i rowBuffers[2][MAX_SIMD_SW_BAND+2];
+	__m512i *prevRow = rowBuffers[0], *currentRow = rowBuffers[1], *swapRow;
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i matchGain = _mm512_set1_epi16(SW_MATCH_GAIN);
+	const __m512i mismatchPenalty = _mm512_set1_epi16(SW_MISMATCH_PENALTY);
+	const __m512i gapPenalty = _mm512_set1_epi16(SW_GAP_PENALTY);
+	const __m256i baseT = _mm256_set1_epi8('T');
+	const __m256i baseC = _mm256_set1_epi8('C');
+	const __m512i one = _mm512_set1_epi16(1);
+	const __m512i targets = _mm512_loadu_si512((const void*)laneTargets);
+	__m512i rowsLeft = _mm512_loadu_si512((const void*)laneSizes);
+	__m512i best = zero;
+	gint16 laneScores[32];
+	int i, j;
+
+	for (j=0; j<=band+1; j++) {
+		rowBuffers[0][j] = zero;
+		rowBuffers[1][j] = zero;
+	}
+	for (i=0; i<rows; i++) {
+		__m256i verticalBases = _mm256_loadu_si256((const __m256i*)(verticalLanes+32*i));
+		__mmask32 matchesC = bisulfiteSequencing ? _mm256_cmpeq_epi8_mask(verticalBases, baseT) : 0;
+		__m512i rowBest = zero;
+		for (j=1; j<=band; j++) {
+			__m256i horizontalBases = _mm256_loadu_si256((const __m256i*)(horizontalLanes+32*(i+j-1)));
+			__mmask32 match = _mm256_cmpeq_epi8_mask(verticalBases, horizontalBases) |
+					(matchesC & _mm256_cmpeq_epi8_mask(horizontalBases, baseC));
+			__m512i score = _mm512_mask_blend_epi16(match, mismatchPenalty, matchGain);
+			__m512i H = _mm512_max_epi16(_mm512_add_epi16(prevRow[j], score), _mm512_add_epi16(prevRow[j+1], gapPenalty));
+			H = _mm512_max_epi16(H, _mm512_add_epi16(currentRow[j-1], gapPenalty));
+			H = _mm512_max_epi16(H, zero);
+			currentRow[j] = H;
+			rowBest = _mm512_max_epi16(rowBest, H);
+		}
+		best = _mm512_max_epi16(best, rowBest);
+		rowsLeft = _mm512_sub_epi16(rowsLeft, one);
+		if (i%SW_BATCH_BOUND_ROWS==SW_BATCH_BOUND_ROWS-1) {
+			__m512i bound = _mm512_max_epi16(best, _mm512_add_epi16(rowBest, rowsLeft));
+			if (_mm512_cmplt_epi16_mask(bound, targets)==0xFFFFFFFFu) {
+				i++;
+				break;
+			}
+		}
+		swapRow = prevRow;
+		prevRow = currentRow;
+		currentRow = swapRow;
+	}
+	_mm512_storeu_si512((void*)laneScores, best);
+	for (j=0; j<32; j++) {
+		bestScores[j] = laneScores[j];
+	}
+	return i;
+}
+#endif
+
+#endif
+
+static const char* selectedKernelName = "scalar";
+/// Kernel for bands of at most 4 columns, and kernel for wider bands.
+static BandedSWKernel narrowBandKernel = fillBandedSWMatrixScalar;
+static BandedSWKernel wideBandKernel = fillBandedSWMatrixScalar;
+/// Kernel scoring a batch of alignments, and the number of alignments it scores at once; none without SIMD.
+static BandedSWBatchKernel batchKernel = NULL;
+static int batchLanes = 1;
+
+/** Pick the kernels supported by the CPU: a band of a few columns fits a single SSE vector, which is
+ * cheaper to scan than an AVX2 vector; wider bands use the widest vectors available.*/
+static int selectBandedSWKernels() {
+#ifdef BANDED_SW_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		selectedKernelName = "sse4.1";
+		narrowBandKernel = fillBandedSWMatrixSSE41;
+		wideBandKernel = fillBandedSWMatrixSSE41;
+		batchKernel = scoreSWBatchSSE41;
+		batchLanes = 8;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		selectedKernelName = "sse4.1/avx2";
+		wideBandKernel = fillBandedSWMatrixAVX2;
+		batchKernel = scoreSWBatchAVX2;
+		batchLanes = 16;
+	}
+#ifdef BANDED_SW_AVX512
+	if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+		batchKernel = scoreSWBatchAVX512;
+		batchLanes = 32;
+	}
+#endif
+#endif
+	return 0;
+}
+
+static const int bandedSWKernelsSelected = selectBandedSWKernels();
+
+int fillBandedSWMatrix(int* scoringMatrix, const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int band, int bisulfiteSequencing, int* bestScoreRow, int* bestScoreCol) {
+	BandedSWKernel kernel = band<=4 ? narrowBandKernel : wideBandKernel;
+	if (band>MAX_SIMD_SW_BAND || sizeVerticalSequence>MAX_READ_SIZE || sizeVerticalSequence<1) {
+		kernel = fillBandedSWMatrixScalar;
+	}
+	return kernel(scoringMatrix, verticalSequence, horizontalSequence,
+			sizeVerticalSequence, band, bisulfiteSequencing, bestScoreRow, bestScoreCol);
+}
+
+int scoreBandedSWBatch(const char* const* verticalSequences, const char* const* horizontalSequences,
+		const int* sizeVerticalSequences, const int* targetScores, int numberOfAlignments, int band,
+		int bisulfiteSequencing, int* bestScores) {
+	char verticalLanes[MAX_READ_SIZE*MAX_SW_BATCH_LANES];
+	char horizontalLanes[(MAX_READ_SIZE+MAX_SIMD_SW_BAND)*MAX_SW_BATCH_LANES];
+	gint16 laneSizes[MAX_SW_BATCH_LANES], laneTargets[MAX_SW_BATCH_LANES];
+	int laneScores[MAX_SW_BATCH_LANES];
+	int first, k, rows, lanesUsed, stoppedEarly;
+	int numberStoppedEarly = 0;
+
+	for (first=0; first<numberOfAlignments; first+=lanesUsed) {
+		lanesUsed = numberOfAlignments-first<batchLanes ? numberOfAlignments-first : batchLanes;
+		// a single alignment is not worth interleaving
+		if (batchKernel==NULL || lanesUsed==1) {
+			bestScores[first] = scoreBandedSWScalar(verticalSequences[first], horizontalSequences[first],
+					sizeVerticalSequences[first], band, bisulfiteSequencing,
+					targetScores==NULL ? 0 : targetScores[first], &stoppedEarly);
+			numberStoppedEarly += stoppedEarly;
+			lanesUsed = 1;
+			continue;
+		}
+		rows = interleaveSWBatch(verticalLanes, horizontalLanes, batchLanes, verticalSequences+first,
+				horizontalSequences+first, sizeVerticalSequences+first, lanesUsed, band);
+		for (k=0; k<batchLanes; k++) {
+			// lanes past the batch never hold the kernel back
+			laneSizes[k] = k<lanesUsed ? sizeVerticalSequences[first+k] : 0;
+			laneTargets[k] = k>=lanesUsed ? G_MAXINT16 :
+					targetScores==NULL ? 0 : MIN(targetScores[first+k], G_MAXINT16);
+		}
+		rows = batchKernel(verticalLanes, horizontalLanes, rows, band, bisulfiteSequencing,
+				laneSizes, laneTargets, laneScores);
+		for (k=0; k<lanesUsed; k++) {
+			bestScores[first+k] = laneScores[k];
+			numberStoppedEarly += laneSizes[k]>rows;
+		}
+	}
+	return numberStoppedEarly;
+}
+
+const char* bandedSWKernelName() {
+	return selectedKernelName;
+}
+
+int bandedSWBatchLanes() {
+	return batchLanes;
+}
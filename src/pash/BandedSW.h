@@ -0,0 +1,85 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_BANDED_SW_H
+#define PASH_BANDED_SW_H
+
+/***********************************************************************
+ * BandedSW.h
+ * Fill of the banded local alignment matrix traced back by the Collator.
+ *
+ * Row i of the matrix holds the scores of read base i against the band
+ * of reference bases i..i+band-1 (columns 1..band), framed by zero
+ * columns 0 and band+1; row 0 of the matrix is all zero and read base i
+ * is on matrix row i+1. Scores are +1 for a match, -2 for a mismatch and
+ * -3 per gap base, floored at 0.
+ *
+ * The SSE4.1 and AVX2 kernels compute a whole row at a time, resolving
+ * the gaps along the row with a prefix scan; they are chosen at runtime
+ * from the CPU features, and produce the same matrix as the scalar one.
+ *
+ * Alignments that only need their score are scored in batches, one
+ * alignment per 16 bit lane: 8 with SSE4.1, 16 with AVX2, 32 with AVX-512;
+ * the matrix is only filled for the alignments that are traced back.
+ * Reads matching the middle diagonal of a 3 column band with at most one
+ * mismatch are usually recognized from mismatch counts on the diagonals.
+ ***********************************************************************/
+
+/// Widest band filled by the vector kernels; wider bands use the scalar kernel.
+#define MAX_SIMD_SW_BAND 64
+
+/** Fill the banded alignment matrix.
+@param scoringMatrix (sizeVerticalSequence+1)*(band+2) scores, followed by 8 more that the vector kernels may read
+@param verticalSequence read
+@param horizontalSequence reference, starting with the first base of the band of read base 0
+@param sizeVerticalSequence read length
+@param band number of reference bases aligned to each read base
+@param bisulfiteSequencing whether a read T also matches a reference C
+@param bestScoreRow read base of the first cell, in row-major order, holding the best score
+@param bestScoreCol band column of that cell
+@return best score of the matrix
+ */
+int fillBandedSWMatrix(int* scoringMatrix, const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int band, int bisulfiteSequencing, int* bestScoreRow, int* bestScoreCol);
+
+/** Best scores of a batch of alignments with the same band, as fillBandedSWMatrix returns them,
+ * without filling any matrix. Only two rows of each alignment are kept, and the scoring of an
+ * alignment stops once its best score so far plus one match per read base left falls below its
+ * target score: its best score is then lower than the target, but not exact.
+@param verticalSequences reads, of at most MAX_READ_SIZE bases
+@param horizontalSequences references, each starting with the first base of the band of read base 0
+@param sizeVerticalSequences read lengths
+@param targetScores lowest score of interest of each alignment; NULL to compute all the scores exactly
+@param numberOfAlignments number of alignments in the batch
+@param band number of reference bases aligned to each read base, at most MAX_SIMD_SW_BAND
+@param bisulfiteSequencing whether a read T also matches a reference C
+@param bestScores best score of each alignment
+@return number of alignments whose scoring stopped before their last read base
+ */
+int scoreBandedSWBatch(const char* const* verticalSequences, const char* const* horizontalSequences,
+		const int* sizeVerticalSequences, const int* targetScores, int numberOfAlignments, int band,
+		int bisulfiteSequencing, int* bestScores);
+
+/** Score of a read on a band of 3 columns, when the banded alignment is the ungapped alignment of
+ * the read on the middle column with at most one mismatch, whose traceback is then a single block
+ * covering the whole read.
+@param verticalSequence read
+@param horizontalSequence reference, starting with the first base of the band of read base 0
+@param sizeVerticalSequence read length
+@param bisulfiteSequencing whether a read T also matches a reference C
+@return the score fillBandedSWMatrix would return, or -1 if the banded alignment may be another one
+ */
+int scoreUngappedAlignment(const char* verticalSequence, const char* horizontalSequence,
+		int sizeVerticalSequence, int bisulfiteSequencing);
+
+/// Name of the kernel selected for this CPU.
+const char* bandedSWKernelName();
+
+/// Number of alignments scoreBandedSWBatch scores at once on this CPU.
+int bandedSWBatchLanes();
+
+#endif
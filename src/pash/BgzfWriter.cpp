@@ -0,0 +1,278 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+/***********************************************************************
+ * BgzfWriter.cpp
+ * stdio stream deflating its bytes into BGZF blocks on a thread pool
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "PashDebug.h"
+#include "BgzfWriter.h"
+
+#define DEB_BGZF_WRITER 0
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+#define BGZF_MAX_BLOCK_SIZE 65536
+/// Bytes deflated in a block; bgzip uses the same size, so that an incompressible block still fits.
+#define BGZF_BLOCK_DATA_SIZE 0xff00
+/// Blocks filled ahead of the writing of the file, per deflating thread.
+#define BGZF_BLOCKS_PER_THREAD 8
+/// Size of the stdio buffer of the stream.
+#define BGZF_STREAM_BUFFER_SIZE (1<<16)
+
+static const unsigned char bgzfEndOfFileBlock[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+	0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+typedef struct {
+	char* data;
+	int dataSize;
+	unsigned char* compressed;
+	int compressedSize;
+	/// Whether the block has been deflated.
+	int ready;
+} BgzfOutputBlock;
+
+typedef struct {
+	FILE* filePtr;
+	char* fileName;
+	int numberOfWorkers;
+	pthread_t* workers;
+	pthread_mutex_t lock;
+	pthread_cond_t blockSubmitted;
+	pthread_cond_t blockDeflated;
+	BgzfOutputBlock* blocks;
+	int numberOfBlocks;
+	/// Blocks handed to the workers; the block after them is being filled.
+	unsigned long submittedBlocks;
+	unsigned long claimedBlocks;
+	unsigned long writtenBlocks;
+	int stop;
+	/// Deflate stream of the writing thread, when there are no workers.
+	z_stream stream;
+	/// Bytes of a filled block following its last line end, moved to the next block.
+	char* carriedData;
+} BgzfWriter;
+
+static void initBgzfStream(z_stream* stream) {
+	memset(stream, 0, sizeof(z_stream));
+	if (deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY)!=Z_OK) {
+		xDie(fprintf(stderr, "could not initialize the BGZF compression\n"), 2);
+	}
+}
+
+static void deflateBgzfBlock(z_stream* stream, BgzfOutputBlock* block) {
+	deflateReset(stream);
+	stream->next_in = (Bytef*) block->data;
+	stream->avail_in = block->dataSize;
+	stream->next_out = block->compressed+BGZF_HEADER_SIZE;
+	stream->avail_out = BGZF_MAX_BLOCK_SIZE-BGZF_HEADER_SIZE-BGZF_FOOTER_SIZE;
+	if (deflate(stream, Z_FINISH)!=Z_STREAM_END) {
+		xDie(fprintf(stderr, "could not compress a BGZF block\n"), 2);
+	}
+	block->compressedSize = BGZF_HEADER_SIZE+stream->total_out+BGZF_FOOTER_SIZE;
+	unsigned char* header = block->compressed;
+	memcpy(header, bgzfEndOfFileBlock, BGZF_HEADER_SIZE);
+	header[16] = (block->compressedSize-1)&0xff;
+	header[17] = (block->compressedSize-1)>>8;
+	unsigned char* footer = block->compressed+block->compressedSize-BGZF_FOOTER_SIZE;
+	uLong crc = crc32(0, (const Bytef*) block->data, block->dataSize);
+	for (int i=0; i<4; i++) {
+		footer[i] = (crc>>(8*i))&0xff;
+		footer[4+i] = (block->dataSize>>(8*i))&0xff;
+	}
+}
+
+static void* bgzfWriterWorker(void* arg) {
+	BgzfWriter* writer = (BgzfWriter*) arg;
+	z_stream stream;
+	initBgzfStream(&stream);
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		while (!writer->stop && writer->claimedBlocks==writer->submittedBlocks) {
+			pthread_cond_wait(&writer->blockSubmitted, &writer->lock);
+		}
+		if (writer->claimedBlocks==writer->submittedBlocks) {
+			break;
+		}
+		BgzfOutputBlock* block = &writer->blocks[writer->claimedBlocks%writer->numberOfBlocks];
+		writer->claimedBlocks++;
+		pthread_mutex_unlock(&writer->lock);
+		deflateBgzfBlock(&stream, block);
+		pthread_mutex_lock(&writer->lock);
+		block->ready = 1;
+		pthread_cond_signal(&writer->blockDeflated);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	deflateEnd(&stream);
+	return NULL;
+}
+
+/** Write the oldest submitted block, once deflated, and hand its buffers back to the filling.*/
+static void writeOldestBgzfBlock(BgzfWriter* writer) {
+	BgzfOutputBlock* block = &writer->blocks[writer->writtenBlocks%writer->numberOfBlocks];
+	pthread_mutex_lock(&writer->lock);
+	while (!block->ready) {
+		pthread_cond_wait(&writer->blockDeflated, &writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	if (fwrite(block->compressed, 1, block->compressedSize, writer->filePtr)!=(size_t) block->compressedSize) {
+		xDie(fprintf(stderr, "could not write output file %s: %s\n", writer->fileName, strerror(errno)), 2);
+	}
+	block->ready = 0;
+	block->dataSize = 0;
+	writer->writtenBlocks++;
+}
+
+/** Hand the block being filled to the workers, and start filling the next one with the bytes following
+ * the last line end of the block.*/
+static void submitBgzfBlock(BgzfWriter* writer, int cutAtLineEnd) {
+	BgzfOutputBlock* block = &writer->blocks[writer->submittedBlocks%writer->numberOfBlocks];
+	int carriedSize = 0;
+	if (cutAtLineEnd) {
+		char* lastLineEnd = (char*) memrchr(block->data, '\n', block->dataSize);
+		if (lastLineEnd!=NULL) {
+			carriedSize = block->data+block->dataSize-(lastLineEnd+1);
+			memcpy(writer->carriedData, lastLineEnd+1, carriedSize);
+			block->dataSize -= carriedSize;
+		}
+	}
+	if (writer->numberOfWorkers==0) {
+		deflateBgzfBlock(&writer->stream, block);
+		block->ready = 1;
+		writer->submittedBlocks++;
+	} else {
+		pthread_mutex_lock(&writer->lock);
+		writer->submittedBlocks++;
+		pthread_cond_signal(&writer->blockSubmitted);
+		pthread_mutex_unlock(&writer->lock);
+	}
+	if (writer->submittedBlocks-writer->writtenBlocks==(unsigned long) writer->numberOfBlocks) {
+		writeOldestBgzfBlock(writer);
+	}
+	BgzfOutputBlock* nextBlock = &writer->blocks[writer->submittedBlocks%writer->numberOfBlocks];
+	memcpy(nextBlock->data, writer->carriedData, carriedSize);
+	nextBlock->dataSize = carriedSize;
+	xDEBUG(DEB_BGZF_WRITER, fprintf(stderr, "submitted BGZF block %lu of %d bytes\n",
+			writer->submittedBlocks-1, block->dataSize));
+}
+
+static ssize_t writeBgzfStream(void* cookie, const char* buffer, size_t size) {
+	BgzfWriter* writer = (BgzfWriter*) cookie;
+	size_t writtenChars = 0;
+	while (writtenChars<size) {
+		BgzfOutputBlock* block = &writer->blocks[writer->submittedBlocks%writer->numberOfBlocks];
+		size_t copiedChars = BGZF_BLOCK_DATA_SIZE-block->dataSize;
+		if (copiedChars>size-writtenChars) {
+			copiedChars = size-writtenChars;
+		}
+		memcpy(block->data+block->dataSize, buffer+writtenChars, copiedChars);
+		block->dataSize += copiedChars;
+		writtenChars += copiedChars;
+		if (block->dataSize==BGZF_BLOCK_DATA_SIZE) {
+			submitBgzfBlock(writer, 1);
+		}
+	}
+	return (ssize_t) size;
+}
+
+static int closeBgzfStream(void* cookie) {
+	BgzfWriter* writer = (BgzfWriter*) cookie;
+	if (writer->blocks[writer->submittedBlocks%writer->numberOfBlocks].dataSize>0) {
+		submitBgzfBlock(writer, 0);
+	}
+	while (writer->writtenBlocks<writer->submittedBlocks) {
+		writeOldestBgzfBlock(writer);
+	}
+	pthread_mutex_lock(&writer->lock);
+	writer->stop = 1;
+	pthread_cond_broadcast(&writer->blockSubmitted);
+	pthread_mutex_unlock(&writer->lock);
+	for (int i=0; i<writer->numberOfWorkers; i++) {
+		pthread_join(writer->workers[i], NULL);
+	}
+	if (writer->numberOfWorkers==0) {
+		deflateEnd(&writer->stream);
+	}
+	if (fwrite(bgzfEndOfFileBlock, 1, sizeof(bgzfEndOfFileBlock), writer->filePtr)!=sizeof(bgzfEndOfFileBlock)
+			|| fclose(writer->filePtr)!=0) {
+		xDie(fprintf(stderr, "could not write output file %s: %s\n", writer->fileName, strerror(errno)), 2);
+	}
+	for (int i=0; i<writer->numberOfBlocks; i++) {
+		free(writer->blocks[i].data);
+		free(writer->blocks[i].compressed);
+	}
+	free(writer->blocks);
+	free(writer->workers);
+	free(writer->carriedData);
+	free(writer->fileName);
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->blockSubmitted);
+	pthread_cond_destroy(&writer->blockDeflated);
+	free(writer);
+	return 0;
+}
+
+FILE* openBgzfOutputFile(const char* fileName, int numberOfThreads) {
+	FILE* filePtr = fopen(fileName, "wb");
+	if (filePtr==NULL) {
+		return NULL;
+	}
+	BgzfWriter* writer = (BgzfWriter*) malloc(sizeof(BgzfWriter));
+	xDieIfNULL(writer, fprintf(stderr, "could not allocate memory for writing %s\n", fileName), 2);
+	writer->filePtr = filePtr;
+	writer->fileName = strdup(fileName);
+	writer->numberOfWorkers = numberOfThreads>1 ? numberOfThreads : 0;
+	writer->numberOfBlocks = numberOfThreads>1 ? numberOfThreads*BGZF_BLOCKS_PER_THREAD : 2;
+	writer->blocks = (BgzfOutputBlock*) malloc(sizeof(BgzfOutputBlock)*writer->numberOfBlocks);
+	xDieIfNULL(writer->blocks, fprintf(stderr, "could not allocate memory for writing %s\n", fileName), 2);
+	for (int i=0; i<writer->numberOfBlocks; i++) {
+		writer->blocks[i].data = (char*) malloc(BGZF_BLOCK_DATA_SIZE);
+		xDieIfNULL(writer->blocks[i].data, fprintf(stderr, "could not allocate memory for writing %s\n", fileName), 2);
+		writer->blocks[i].compressed = (unsigned char*) malloc(BGZF_MAX_BLOCK_SIZE);
+		xDieIfNULL(writer->blocks[i].compressed, fprintf(stderr, "could not allocate memory for writing %s\n", fileName), 2);
+		writer->blocks[i].dataSize = 0;
+		writer->blocks[i].ready = 0;
+	}
+	writer->carriedData = (char*) malloc(BGZF_BLOCK_DATA_SIZE);
+	xDieIfNULL(writer->carriedData, fprintf(stderr, "could not allocate memory for writing %s\n", fileName), 2);
+	writer->submittedBlocks = 0;
+	writer->claimedBlocks = 0;
+	writer->writtenBlocks = 0;
+	writer->stop = 0;
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->blockSubmitted, NULL);
+	pthread_cond_init(&writer->blockDeflated, NULL);
+	writer->workers = NULL;
+	if (writer->numberOfWorkers==0) {
+		initBgzfStream(&writer->stream);
+	} else {
+		writer->workers = (pthread_t*) malloc(sizeof(pthread_t)*writer->numberOfWorkers);
+		xDieIfNULL(writer->workers, fprintf(stderr, "could not allocate memory for writing %s\n", fileName), 2);
+		for (int i=0; i<writer->numberOfWorkers; i++) {
+			if (pthread_create(&writer->workers[i], NULL, bgzfWriterWorker, writer)!=0) {
+				xDie(fprintf(stderr, "could not create the compression threads of %s\n", fileName), 2);
+			}
+		}
+	}
+	cookie_io_functions_t functions;
+	memset(&functions, 0, sizeof(functions));
+	functions.write = writeBgzfStream;
+	functions.close = closeBgzfStream;
+	FILE* stream = fopencookie(writer, "w", functions);
+	xDieIfNULL(stream, fprintf(stderr, "could not open output stream for %s\n", fileName), 2);
+	setvbuf(stream, NULL, _IOFBF, BGZF_STREAM_BUFFER_SIZE);
+	return stream;
+}
@@ -0,0 +1,33 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_BGZF_WRITER_H
+#define PASH_BGZF_WRITER_H
+
+/***********************************************************************
+ * BgzfWriter.h
+ * BGZF compressed output, as written by bgzip and read by samtools and
+ * htslib: a series of gzip members of at most 64KB, each holding the
+ * size of the member in its header, followed by an empty end of file
+ * member.
+ *
+ * The output is a regular stdio stream; its bytes are cut into blocks
+ * ending on a line end whenever a block holds one, so that only records
+ * longer than a block span two blocks; the blocks are deflated on a pool
+ * of threads and written in order.
+ ***********************************************************************/
+
+#include <stdio.h>
+
+/** Open a BGZF output file; fclose flushes the last block and writes the end of file member.
+@param fileName output file
+@param numberOfThreads threads deflating the blocks; with 1 the blocks are deflated by the writing thread
+@return the output stream; NULL if the file could not be opened
+ */
+FILE* openBgzfOutputFile(const char* fileName, int numberOfThreads);
+
+#endif
@@ -39,14 +39,19 @@ See the included file LICENSE for details.
 #include <unistd.h>
 #include <ctype.h>
 #include <limits.h>
+#include <pthread.h>
 
 
 #include "PashLib.h"
 #include "Collator.h"
 #include "PashDebug.h"
 #include "FixedHashKey.h"
+#include "SpacedSeed.h"
 #include "IgnoreList.h"
 #include "SAMInfo.h"
+#include "BandedSW.h"
+#include "BamOutput.h"
+#include "Metrics.h"
 
 #define DEB_PROGRESS               0
 #define DEB_SCAN_HORIZONTAL_SEQ	   0
@@ -74,36 +79,23 @@ See the included file LICENSE for details.
 #define DEB_MiX_2S_AND_REG_PASH    0
 #define DEB_TOPPERCENT             0
 #define DEB_CHH_VARIANTS           0
-
-typedef struct {
-	int horizontalStart;
-	int horizontalStop;
-	int verticalStart;
-	int verticalStop;
-	int numMatches;
-	int numMismatches;
-	int numVerticalGaps;
-	int numHorizontalGaps;
-	int numGapBases;
-	int numBlocks;
-	unsigned int blockSizes[MAX_NUMBER_BLOCKS];
-	unsigned int horizontalBlockStarts[MAX_NUMBER_BLOCKS];
-	unsigned int verticalBlockStarts[MAX_NUMBER_BLOCKS];
-} AlignmentSummary;
+#define DEB_SCAN_THREADS           0
 
 typedef enum {InBlock, InGap} TraceStatus;
 
-unsigned long swCalls;
-unsigned long kswCalls;
-unsigned long failedSWCalls;
-unsigned long reallyPoorAnchorings;
-unsigned long predSkelScore, tSkelScore;
+/** Whether a traced back alignment has the minimum read identity of a mapping.*/
+static inline int hasMinimumReadIdentity(const AlignmentSummary* alignmentSummary, int sizeVerticalSequence) {
+	float minIdentity = 0.9;
+	if (alignmentSummary->numMatches < sizeVerticalSequence*minIdentity) {
+		return 0;
+	}
+	if ( (alignmentSummary->numMismatches + alignmentSummary->numGapBases) > (1-minIdentity)*alignmentSummary->numMatches) {
+		return 0;
+	}
+	return 1;
+}
 
 inline int bandedSW(int *scoringMatrix, char* verticalSequence, char *horizontalSequence, int sizeVerticalSequence, int band);
-int bandedSWAlignmentInfo(int *scoringMatrix,
-		char* verticalSequence, char *horizontalSequence,
-		int sizeVerticalSequence, int band,
-		float targetScore, AlignmentSummary* alignmentSummary);
 
 int bandedSWAlignmentInfoBisulfiteSeq(int *scoringMatrix,
 		char* verticalSequence, char *horizontalSequence,
@@ -115,16 +107,17 @@ void resetSamInfo(SAMInfo* samInfo);
 int callVariants(char* readSequence, char* templateSequence,
 		SAMInfo *samInfo, AlignmentSummary* alignmentSummary, int bisulfiteSequencing);
 int outputRegularPashLine(guint32 sequenceId, int swScore, SequenceInfo* sequenceInfo,
-		guint32 chromLength, char* currentSequence,
+		guint32 chromLength, char* currentSequence, guint32 currentChrom,
 		guint32 alignmentHorizontalStart,
 		AlignmentSummary* alignmentSummary,
-		char strand, char *outputLine, SAMInfo* samInfo, PashParameters* pp);
+		char strand, char *outputLine, SAMInfo* samInfo, PashParameters* pp,
+		int reverseStrandDnaMethMapping);
 int outputBisulfiteMappingLine(guint32 sequenceId, int swScore, SequenceInfo* sequenceInfo,
-		guint32 chromLength, char* currentSequence,
+		guint32 chromLength, char* currentSequence, guint32 currentChrom,
 		guint32 alignmentHorizontalStart,
 		AlignmentSummary* alignmentSummary,
 		char *outputLine, SAMInfo* samInfo,
-		PashParameters* pp);
+		PashParameters* pp, int reverseStrandDnaMethMapping);
 
 
 static inline char revComplementQuick(char base)
@@ -399,59 +392,345 @@ int advanceTopMatchStream(MatchStream** matchStreamPriorityQueue, int numStreams
 	return 1;
 }
 
-inline CollatorControl* initCollatorControl(int numberOfDiagonals) {
+/** Grow the match pairs and the match runs of the collator geometrically, to hold at least the given
+ * number of match pairs. The collator keeps them for the following windows, so a thread only reallocates
+ * them when a read has more matches than any before it.*/
+static void growMatchPairs(CollatorControl* c, guint32 numberOfMatchPairs) {
+	guint32 capacity = c->matchPairsCapacity>0 ? c->matchPairsCapacity : numberOfMatchPairs;
+	while (capacity<numberOfMatchPairs) {
+		capacity *= 2;
+	}
+	c->matchPairs = (MatchPair*) realloc(c->matchPairs, sizeof(MatchPair)*capacity);
+	c->matchRunStarts = (guint32*) realloc(c->matchRunStarts, sizeof(guint32)*capacity);
+	c->matchRunScores = (guint32*) realloc(c->matchRunScores, sizeof(guint32)*capacity);
+	xDieIfNULL(c->matchPairs, fprintf(stderr, "could not allocate memory for %u match pairs at %s:%d\n",
+			capacity, __FILE__, __LINE__), 1);
+	xDieIfNULL(c->matchRunStarts, fprintf(stderr, "could not allocate memory for %u match runs at %s:%d\n",
+			capacity, __FILE__, __LINE__), 1);
+	xDieIfNULL(c->matchRunScores, fprintf(stderr, "could not allocate memory for %u match runs at %s:%d\n",
+			capacity, __FILE__, __LINE__), 1);
+	c->matchPairsCapacity = capacity;
+}
+
+/** Double the match streams of the collator while the current window is being seeded. The priority
+ * queue points into the match streams, so its pointers are moved to the new streams.*/
+static void growMatchStreams(CollatorControl* c) {
+	guint32 capacity = 2*c->maxMatchStreams;
+	guint32 i;
+	MatchStream* matchStreams = (MatchStream*) malloc(sizeof(MatchStream)*capacity);
+	MatchStream** matchStreamPtrs = (MatchStream**) calloc(capacity, sizeof(MatchStream*));
+	xDieIfNULL(matchStreams, fprintf(stderr, "could not allocate memory for %u match streams at %s:%d\n",
+			capacity, __FILE__, __LINE__), 1);
+	xDieIfNULL(matchStreamPtrs, fprintf(stderr, "could not allocate memory for %u match streams at %s:%d\n",
+			capacity, __FILE__, __LINE__), 1);
+	memcpy(matchStreams, c->matchStreams, sizeof(MatchStream)*c->maxMatchStreams);
+	for (i=0; i<c->maxMatchStreams; i++) {
+		if (c->matchStreamPtrs[i]!=NULL) {
+			matchStreamPtrs[i] = matchStreams+(c->matchStreamPtrs[i]-c->matchStreams);
+		}
+	}
+	free(c->matchStreams);
+	free(c->matchStreamPtrs);
+	c->matchStreams = matchStreams;
+	c->matchStreamPtrs = matchStreamPtrs;
+	c->maxMatchStreams = capacity;
+}
+
+CollatorControl* initCollatorControl(int numberOfDiagonals, int sortMatches) {
 	CollatorControl* c = (CollatorControl*) malloc(sizeof(CollatorControl));
 	xDieIfNULL(c, fprintf(stderr, "could not allocate memory for the collator control "
 			"in %s:%d\n", __FILE__, __LINE__ ), 1);
-	c->matchStreams = (MatchStream*) malloc(sizeof(MatchStream)*MAX_MATCH_STREAMS);
-	c->matchStreamPtrs = (MatchStream**) malloc(sizeof(MatchStream*)*MAX_MATCH_STREAMS);
+	// a window of 2*numberOfDiagonals kmers, the unused head of the heap and its sentinels
+	c->maxMatchStreams = 2*numberOfDiagonals+3;
+	if (c->maxMatchStreams<INITIAL_MATCH_STREAMS) {
+		c->maxMatchStreams = INITIAL_MATCH_STREAMS;
+	}
+	c->matchStreams = (MatchStream*) malloc(sizeof(MatchStream)*c->maxMatchStreams);
+	c->matchStreamPtrs = (MatchStream**) calloc(c->maxMatchStreams, sizeof(MatchStream*));
 	xDieIfNULL(c->matchStreams, fprintf(stderr, "could not allocate memory for the collator control match streams"
 			"in %s:%d\n", __FILE__, __LINE__ ), 1);
-	c->maxMatchStreams	= MAX_MATCH_STREAMS;
+	xDieIfNULL(c->matchStreamPtrs, fprintf(stderr, "could not allocate memory for the collator control match streams"
+			"in %s:%d\n", __FILE__, __LINE__ ), 1);
 	c->validMatchStreams = 0;
 	c->numberOfDiagonals = numberOfDiagonals;
-	c->matchPairsCapacity = 3*MAX_MATCH_STREAMS;
-	c->matchPairs = (MatchPair*) malloc(sizeof(MatchPair)*c->matchPairsCapacity);
-	xDieIfNULL(c->matchPairs, fprintf(stderr, "could not allocate memory for match pairs at %s:%d\n",
-			__FILE__, __LINE__), 1);
+	c->matchPairsCapacity = 0;
+	c->matchPairs = NULL;
+	c->matchRunStarts = NULL;
+	c->matchRunScores = NULL;
+	growMatchPairs(c, 3*INITIAL_MATCH_STREAMS);
 	c->bswMemory = (int*) malloc(MAX_READ_SIZE*(30+3*DEFAULT_BAND)*sizeof(int));
+	c->targetTemplate = NULL;
+	c->targetTemplateStart = 0;
+	c->reverseStrandDnaMethMapping = 0;
+	c->result = NULL;
+	c->sortMatches = sortMatches;
+	c->sortedMatches = NULL;
+	c->sortBuffer = NULL;
+	c->numberOfSortedMatches = 0;
+	c->sortedMatchesCapacity = 0;
+	c->nextSortedMatch = 0;
+	c->earlierBatchKmers = NULL;
+	c->windowHits = NULL;
+	c->numberOfWindowHits = 0;
+	c->windowHitsCapacity = 0;
+	c->sharedHitsWindowIndex = 0;
+	c->queuedReads = (QueuedRead*) malloc(sizeof(QueuedRead)*ALIGNMENT_BATCH_SIZE);
+	c->queuedReadTemplates = (char*) malloc((MAX_READ_SIZE+1)*ALIGNMENT_BATCH_SIZE);
+	c->queuedCandidatesCapacity = 2*ALIGNMENT_BATCH_SIZE;
+	c->queuedCandidates = (QueuedCandidate*) malloc(sizeof(QueuedCandidate)*c->queuedCandidatesCapacity);
+	xDieIfNULL(c->queuedReads, fprintf(stderr, "could not allocate memory for the alignment batch at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	xDieIfNULL(c->queuedReadTemplates, fprintf(stderr, "could not allocate memory for the alignment batch at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	xDieIfNULL(c->queuedCandidates, fprintf(stderr, "could not allocate memory for the alignment batch at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	c->numberOfQueuedReads = 0;
+	c->numberOfQueuedCandidates = 0;
 	return c;
 }
 
-/** Setup the match stream for a horizontal kmer, querying the hive hash.
+/** Append the matches of a runner that fall within the window to the gathered matches of the collator,
+ * applying the same filter as advanceTopMatchStream. Unless filterFirstPair is set, the first pair is
+ * appended wherever it falls, as setMatchStreamAndInsertInQueue inserts it.
+@return number of matches appended
+ */
+static guint32 gatherMatchStream(CollatorControl *c, IntListRunner* intListRunner, guint32 horizontalOffset,
+		int filterFirstPair) {
+	guint32 numDiagonals = c->numberOfDiagonals+10;
+	guint32* list = intListRunner->list;
+	guint32 left = intListRunner->left;
+	guint32 gathered = 0;
+	if (c->numberOfSortedMatches+left/2 > c->sortedMatchesCapacity) {
+		guint32 capacity = c->sortedMatchesCapacity>0 ? c->sortedMatchesCapacity : 3*INITIAL_MATCH_STREAMS;
+		while (capacity < c->numberOfSortedMatches+left/2) {
+			capacity *= 2;
+		}
+		c->sortedMatches = (guint64*) realloc(c->sortedMatches, capacity*sizeof(guint64));
+		xDieIfNULL(c->sortedMatches, fprintf(stderr, "could not allocate memory for %u matches at %s:%d\n",
+				capacity, __FILE__, __LINE__), 1);
+		c->sortBuffer = (guint64*) realloc(c->sortBuffer, capacity*sizeof(guint64));
+		xDieIfNULL(c->sortBuffer, fprintf(stderr, "could not allocate memory for %u matches at %s:%d\n",
+				capacity, __FILE__, __LINE__), 1);
+		c->sortedMatchesCapacity = capacity;
+	}
+	guint64* matches = c->sortedMatches+c->numberOfSortedMatches;
+	for (; left>0; list+=2, left-=2) {
+		guint32 verticalOffset = list[1];
+		if ((horizontalOffset>verticalOffset+numDiagonals || verticalOffset>numDiagonals) &&
+				(filterFirstPair || list!=intListRunner->list)) {
+			continue;
+		}
+		matches[gathered++] = (((guint64)list[0])<<32) | (((guint32)verticalOffset)<<16) | horizontalOffset;
+	}
+	c->numberOfSortedMatches += gathered;
+	return gathered;
+}
+
+/** Sort the gathered matches by read, then vertical and horizontal offset: the order in which
+ * the heap of match streams would deliver them. Least significant digit radix sort on bytes,
+ * skipping the bytes that are the same for all the matches; small windows use insertion sort.*/
+static void sortGatheredMatches(CollatorControl *c) {
+	guint32 numberOfMatches = c->numberOfSortedMatches;
+	guint64* matches = c->sortedMatches;
+	guint32 i, j, digit;
+	c->nextSortedMatch = 0;
+	if (numberOfMatches<=64) {
+		for (i=1; i<numberOfMatches; i++) {
+			guint64 match = matches[i];
+			for (j=i; j>0 && matches[j-1]>match; j--) {
+				matches[j] = matches[j-1];
+			}
+			matches[j] = match;
+		}
+		return;
+	}
+	guint32 counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (i=0; i<numberOfMatches; i++) {
+		guint64 match = matches[i];
+		for (digit=0; digit<8; digit++) {
+			counts[digit][(match>>(8*digit))&0xff]++;
+		}
+	}
+	guint64* sorted = c->sortBuffer;
+	for (digit=0; digit<8; digit++) {
+		guint32* digitCounts = counts[digit];
+		if (digitCounts[(matches[0]>>(8*digit))&0xff]==numberOfMatches) {
+			continue;
+		}
+		guint32 offset = 0;
+		for (i=0; i<256; i++) {
+			guint32 count = digitCounts[i];
+			digitCounts[i] = offset;
+			offset += count;
+		}
+		for (i=0; i<numberOfMatches; i++) {
+			guint64 match = matches[i];
+			sorted[digitCounts[(match>>(8*digit))&0xff]++] = match;
+		}
+		guint64* swap = matches;
+		matches = sorted;
+		sorted = swap;
+	}
+	c->sortedMatches = matches;
+	c->sortBuffer = sorted;
+}
+
+/** Whether the collator has matches left to collate.*/
+static inline int hasCollatorMatches(CollatorControl *c) {
+	return c->sortMatches ? c->nextSortedMatch<c->numberOfSortedMatches : c->validMatchStreams>0;
+}
+
+/** Next match to collate, in (read, offsets) order.
+@param okey vertical offset in the high 16 bits, horizontal offset in the low 16 bits
+@return vertical sequence id of the match
+ */
+static inline guint32 topCollatorMatch(CollatorControl *c, guint32* okey) {
+	if (c->sortMatches) {
+		guint64 match = c->sortedMatches[c->nextSortedMatch];
+		*okey = (guint32) match;
+		return (guint32) (match>>32);
+	}
+	*okey = c->matchStreamPtrs[1]->okey;
+	return c->matchStreamPtrs[1]->verticalSeqID;
+}
+
+/** Move past the current match.*/
+static inline void advanceCollatorMatches(CollatorControl *c) {
+	if (c->sortMatches) {
+		c->nextSortedMatch++;
+	} else if (advanceTopMatchStream(c->matchStreamPtrs, c->validMatchStreams, c->numberOfDiagonals+10) == 1) {
+		c->validMatchStreams --;
+	}
+}
+
+/** Setup the match stream for the (read, offset) pairs of a horizontal kmer.
 @param c collator control data structure
 @param kmer horizontal kmer
-@parma hh HiveHash
+@param intListRunner runner over the pairs of the kmer in the hive hash
 @param horizontalOffset horizontal offset of the kmer in the current horizontal window
  */
-inline void addMatchStreamCollatorControl(CollatorControl *c, guint32 kmer, HiveHash* hh, guint32 horizontalOffset) {
-
+static void addMatchStreamRunner(CollatorControl *c, guint32 kmer, const IntListRunner* intListRunner,
+		guint32 horizontalOffset) {
 	int i = c->validMatchStreams;
-	/*
-	if (i>MAX_MATCH_STREAMS) {
-		fprintf(stderr, "number of streams exceeds hard limit of %d at %s:%d\n",
-						MAX_MATCH_STREAMS, __FILE__, __LINE__);
-		exit(1);
+	// the new stream is at i+1, and removing the top of the heap reads the pointer past its last stream
+	if ((guint32)i+3>c->maxMatchStreams) {
+		growMatchStreams(c);
 	}
-	 */
 
 	MatchStream* matchStream = &c->matchStreams[i+1];
-	hh->getIntListRunner(kmer, &matchStream->intListRunner);
+	matchStream->intListRunner = *intListRunner;
+	// the first pair of a bin is collated wherever it falls, and the following ones only within the window;
+	// when a batch of reads continues the bin of an earlier batch, its first pair is one of the following ones
+	int filterFirstPair = c->earlierBatchKmers!=NULL && ((c->earlierBatchKmers[kmer>>5]>>(kmer&31))&1);
+	if (c->sortMatches) {
+		if (gatherMatchStream(c, &matchStream->intListRunner, horizontalOffset, filterFirstPair)>0) {
+			c->validMatchStreams++;
+		}
+		return;
+	}
+	if (filterFirstPair) {
+		guint32 numDiagonals = c->numberOfDiagonals+10;
+		while (matchStream->intListRunner.left > 0) {
+			guint32 verticalOffset = matchStream->intListRunner.list[1];
+			if (horizontalOffset<=verticalOffset+numDiagonals && verticalOffset<=numDiagonals) {
+				break;
+			}
+			matchStream->intListRunner.list += 2;
+			matchStream->intListRunner.left -= 2;
+		}
+	}
 	if (matchStream->intListRunner.left > 0) {
 		setMatchStreamAndInsertInQueue(matchStream, c->matchStreamPtrs, c->validMatchStreams, kmer, horizontalOffset);
 		c->validMatchStreams++;
 	}
 }
 
+/** Setup the match stream for a horizontal kmer, querying the hive hash.
+@param c collator control data structure
+@param kmer horizontal kmer
+@parma hh HiveHash
+@param horizontalOffset horizontal offset of the kmer in the current horizontal window
+ */
+void addMatchStreamCollatorControl(CollatorControl *c, guint32 kmer, HiveHash* hh, guint32 horizontalOffset) {
+	IntListRunner intListRunner;
+	hh->getIntListRunner(kmer, &intListRunner);
+	addMatchStreamRunner(c, kmer, &intListRunner, horizontalOffset);
+}
+
+/** Record a kmer of the current window found in the hive hash.*/
+static inline void addWindowHit(CollatorControl *c, guint32 kmer, HiveHash* hh, guint32 horizontalOffset) {
+	if (c->numberOfWindowHits==c->windowHitsCapacity) {
+		c->windowHitsCapacity = c->windowHitsCapacity>0 ? 2*c->windowHitsCapacity : REFERENCE_WINDOW_SIZE;
+		c->windowHits = (WindowHit*) realloc(c->windowHits, sizeof(WindowHit)*c->windowHitsCapacity);
+		xDieIfNULL(c->windowHits, fprintf(stderr, "could not allocate memory for %u window hits at %s:%d\n",
+				c->windowHitsCapacity, __FILE__, __LINE__), 1);
+	}
+	WindowHit* windowHit = &c->windowHits[c->numberOfWindowHits++];
+	windowHit->kmer = kmer;
+	windowHit->horizontalOffset = horizontalOffset;
+	hh->getIntListRunner(kmer, &windowHit->intListRunner);
+}
+
+/** Keep the hits the window shares with the previous window of the collator, if it is the window
+ * following it in the scan.
+@return offset of the window from which its kmers remain to be looked up
+ */
+static guint32 reuseSharedWindowHits(CollatorControl *c, ReferenceWindow* window) {
+	guint32 i, numberOfSharedHits;
+	if (c->sharedHitsWindowIndex!=window->windowIndex || c->sharedHitsChunkStart!=window->chunkStart) {
+		c->numberOfWindowHits = 0;
+		return 0;
+	}
+	numberOfSharedHits = c->numberOfWindowHits-c->firstSharedHit;
+	memmove(c->windowHits, c->windowHits+c->firstSharedHit, sizeof(WindowHit)*numberOfSharedHits);
+	for (i=0; i<numberOfSharedHits; i++) {
+		c->windowHits[i].horizontalOffset -= c->sharedHitsShift;
+	}
+	c->numberOfWindowHits = numberOfSharedHits;
+	return c->sharedHitsResumeOffset;
+}
+
+/** Record which hits of the window the window following it in the scan shares with it.
+@param seededOffsets number of offsets of the window whose kmers were looked up
+ */
+static void shareWindowHits(CollatorControl *c, ReferenceWindow* window, guint32 seededOffsets) {
+	guint32 shift = window->numberOfBands*c->numberOfDiagonals;
+	guint32 firstSharedHit = c->numberOfWindowHits;
+	while (firstSharedHit>0 && c->windowHits[firstSharedHit-1].horizontalOffset>=shift) {
+		firstSharedHit--;
+	}
+	c->sharedHitsWindowIndex = window->windowIndex+window->numberOfBands;
+	c->sharedHitsChunkStart = window->chunkStart+shift;
+	c->sharedHitsShift = shift;
+	c->sharedHitsResumeOffset = seededOffsets>shift ? seededOffsets-shift : 0;
+	c->firstSharedHit = firstSharedHit;
+}
+
 void freeCollatorControl(CollatorControl* c) {
 	free(c->matchStreams);
 	c->matchStreams = NULL;
+	free(c->matchStreamPtrs);
+	free(c->matchPairs);
+	free(c->matchRunStarts);
+	free(c->matchRunScores);
+	free(c->bswMemory);
+	free(c->sortedMatches);
+	free(c->sortBuffer);
+	free(c->windowHits);
+	free(c->queuedReads);
+	free(c->queuedReadTemplates);
+	free(c->queuedCandidates);
 	free(c);
 }
 
-inline void resetCollatorControl(CollatorControl *c) {
+void resetCollatorControl(CollatorControl *c) {
 	xDEBUG(DEB_RESET_COLLATOR, fprintf(stderr, "resetting collator\n"));
 	c->validMatchStreams = 0;
+	c->numberOfSortedMatches = 0;
+	c->nextSortedMatch = 0;
+	c->numberOfQueuedReads = 0;
+	c->numberOfQueuedCandidates = 0;
 	int i;
 	c->matchStreams[0].verticalSeqID  = 0;
 	for (i=1; i<=c->numberOfDiagonals+1; i++) {
@@ -462,61 +741,701 @@ inline void resetCollatorControl(CollatorControl *c) {
 	c->matchStreamPtrs[0] = & c->matchStreams[0];
 }
 
+/** Anchoring filter: a read is only aligned if its best anchoring run in the window
+ * is within 3/4 of the best anchoring seen so far for that read.*/
+static inline int passesAnchoringFilter(SequenceInfo* sequenceInfo, guint32 bestMatchScore) {
+	return bestMatchScore >= loadReadScore(&sequenceInfo->bestAnchoringScore)*3/4;
+}
+
+static inline void updateBestAnchoringScore(SequenceInfo* sequenceInfo, guint32 bestMatchScore) {
+	updateReadScoreMax(&sequenceInfo->bestAnchoringScore, bestMatchScore);
+}
+
+/** A read that already has more than the allowed number of full length mappings is not aligned anymore.*/
+static inline int isRepetitiveRead(SequenceInfo* sequenceInfo, guint32 maxReadMappings) {
+	return loadReadScore(&sequenceInfo->bestSWScore)>=sequenceInfo->sequenceLength &&
+			loadReadScore(&sequenceInfo->bestScoreMappings)>maxReadMappings;
+}
+
+static inline int passesSkeletonFilter(SequenceInfo* sequenceInfo, guint32 skeletonScore) {
+	return skeletonScore>=loadReadScore(&sequenceInfo->bestSkeletonScore)*7/10;
+}
+
+typedef enum {AlignmentBelowTarget, AlignmentDuplicate, AlignmentAccepted} AlignmentStatus;
+
+/** Update the best scores of a read with the score of a new alignment.
+ * Only the thread committing the collation results calls this.
+@param hitStart first reference position covered by the anchoring run
+@param hitStop last reference position covered by the anchoring run
+@return AlignmentBelowTarget if the alignment is not within the top percent of the best alignment,
+AlignmentDuplicate if an alignment with the same score was already reported at this locus, AlignmentAccepted otherwise
+ */
+static inline AlignmentStatus updateReadBestScores(SequenceInfo* sequenceInfo, int swScore, guint32 skeletonScore,
+		double withinTopPercent, guint32 currentChrom, guint32 hitStart, guint32 hitStop) {
+	guint32 bestSWScore = loadReadScore(&sequenceInfo->bestSWScore);
+	if (swScore<bestSWScore*withinTopPercent) {
+		return AlignmentBelowTarget;
+	}
+	updateReadScoreMax(&sequenceInfo->bestSkeletonScore, skeletonScore);
+	if (swScore>bestSWScore) {
+		sequenceInfo->bestChrom = currentChrom;
+		sequenceInfo->bestStart = hitStop;
+		storeReadScore(&sequenceInfo->bestScoreMappings, 1);
+		storeReadScore(&sequenceInfo->bestSWScore, swScore);
+	} else if (swScore==bestSWScore) {
+		if (sequenceInfo->bestChrom != currentChrom || sequenceInfo->bestStart+sequenceInfo->sequenceLength<hitStart) {
+			sequenceInfo->bestChrom = currentChrom;
+			sequenceInfo->bestStart = hitStop;
+			storeReadScore(&sequenceInfo->bestScoreMappings, loadReadScore(&sequenceInfo->bestScoreMappings)+1);
+		} else {
+			return AlignmentDuplicate;
+		}
+	}
+	return AlignmentAccepted;
+}
+
+/** Take a snapshot of the best scores of a read for the collation filters of a worker.
+ * The best scores only grow while the scan progresses, and a worker filters with scores no
+ * higher than the ones its window is committed against, so it never prunes an alignment
+ * that the commit would evaluate.*/
+static inline void loadReadState(SequenceInfo* readState, SequenceInfo* sequenceInfo) {
+	readState->sequenceName = sequenceInfo->sequenceName;
+	readState->sequenceLength = sequenceInfo->sequenceLength;
+	readState->bestAnchoringScore = loadReadScore(&sequenceInfo->bestAnchoringScore);
+	readState->bestSWScore = loadReadScore(&sequenceInfo->bestSWScore);
+	readState->bestScoreMappings = loadReadScore(&sequenceInfo->bestScoreMappings);
+	readState->bestSkeletonScore = loadReadScore(&sequenceInfo->bestSkeletonScore);
+	readState->bestChrom = 0;
+	readState->bestStart = 0;
+	readState->passingMappings = 0;
+}
+
+static void initCollationResult(CollationResult* result) {
+	result->eventsCapacity = 1024;
+	result->events = (CollationEvent*) malloc(sizeof(CollationEvent)*result->eventsCapacity);
+	result->outputBufferCapacity = 64*MAX_LINE_LENGTH;
+	result->outputBuffer = (char*) malloc(result->outputBufferCapacity);
+	xDieIfNULL(result->events, fprintf(stderr, "could not allocate memory for collation events at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	xDieIfNULL(result->outputBuffer, fprintf(stderr, "could not allocate memory for collation output at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	result->numberOfEvents = 0;
+	result->outputBufferSize = 0;
+	result->kmerAlignments = 0;
+	result->scoredAlignments = 0;
+	result->tracedBackAlignments = 0;
+	result->stoppedAlignments = 0;
+	result->ungappedAlignments = 0;
+}
+
+static void resetCollationResult(CollationResult* result) {
+	result->numberOfEvents = 0;
+	result->outputBufferSize = 0;
+	result->kmerAlignments = 0;
+	result->scoredAlignments = 0;
+	result->tracedBackAlignments = 0;
+	result->stoppedAlignments = 0;
+	result->ungappedAlignments = 0;
+}
+
+static void freeCollationResult(CollationResult* result) {
+	free(result->events);
+	free(result->outputBuffer);
+}
+
+static inline void addCollationEvent(CollationResult* result, CollationEventType type, guint32 sequenceId,
+		guint32 score, int swScore, guint32 hitStart, guint32 hitStop, long outputLineOffset) {
+	if (result->numberOfEvents==result->eventsCapacity) {
+		result->eventsCapacity *= 2;
+		result->events = (CollationEvent*) realloc(result->events, sizeof(CollationEvent)*result->eventsCapacity);
+		xDieIfNULL(result->events, fprintf(stderr, "could not allocate memory for collation events at %s:%d\n",
+				__FILE__, __LINE__), 1);
+	}
+	CollationEvent* event = &result->events[result->numberOfEvents++];
+	event->type = type;
+	event->sequenceId = sequenceId;
+	event->score = score;
+	event->swScore = swScore;
+	event->hitStart = hitStart;
+	event->hitStop = hitStop;
+	event->outputLineOffset = outputLineOffset;
+}
+
+/** Append a mapping record to the result buffer.
+@return offset of the record in the buffer*/
+static long appendOutputLine(CollationResult* result, const char* outputLine) {
+	size_t lineLength = mappingRecordSize(outputLine);
+	if (result->outputBufferSize+lineLength>result->outputBufferCapacity) {
+		while (result->outputBufferSize+lineLength>result->outputBufferCapacity) {
+			result->outputBufferCapacity *= 2;
+		}
+		result->outputBuffer = (char*) realloc(result->outputBuffer, result->outputBufferCapacity);
+		xDieIfNULL(result->outputBuffer, fprintf(stderr, "could not allocate memory for collation output at %s:%d\n",
+				__FILE__, __LINE__), 1);
+	}
+	long outputLineOffset = result->outputBufferSize;
+	memcpy(result->outputBuffer+outputLineOffset, outputLine, lineLength);
+	result->outputBufferSize += lineLength;
+	return outputLineOffset;
+}
+
+/** Generate the mapping record for an alignment of the current read template.*/
+static void generateMappingLine(CollatorControl* c, PashParameters* pp, SequenceInfo* sequenceInfo,
+		guint32 sequenceId, guint32 currentVerticalSequenceId, int swScore,
+		guint32 chromLength, char* currentSequence, guint32 currentChrom, long alignmentHorizontalStart,
+		AlignmentSummary* alignmentSummary, char* outputLine) {
+	SAMInfo samInfo;
+	resetSamInfo(&samInfo);
+	callVariants(c->readTemplate,
+			&c->targetTemplate[alignmentHorizontalStart-c->targetTemplateStart],
+			&samInfo, alignmentSummary, pp->bisulfiteSequencingMapping);
+	if (alignmentSummary->numMismatches != samInfo.numberOfBasePairVariants) {
+		fprintf(stderr, "incorrect number of mismatches for read %s: %d vs %d\n",
+				sequenceInfo->sequenceName,
+				alignmentSummary->numMismatches, samInfo.numberOfBasePairVariants);
+	}
+
+	if (pp->bisulfiteSequencingMapping) {
+		outputBisulfiteMappingLine(sequenceId, swScore, sequenceInfo, chromLength, currentSequence, currentChrom,
+				alignmentHorizontalStart, alignmentSummary,
+				outputLine, &samInfo, pp, c->reverseStrandDnaMethMapping);
+	} else {
+		outputRegularPashLine(sequenceId, swScore, sequenceInfo, chromLength, currentSequence, currentChrom,
+				alignmentHorizontalStart, alignmentSummary,
+				currentVerticalSequenceId%2==0?'+':'-',
+						outputLine, &samInfo, pp, c->reverseStrandDnaMethMapping);
+		xDEBUG(DEB_HWIN,fprintf(stderr, "got out line >>%s<<\n", outputLine));
+	}
+}
+
+/** When the reads are mapped in batches, mark the end of the output lines of a band, if it has any.
+@param bandIndex number of the band in the scan
+@param markedOutputLines lines stored up to the previous mark, included; updated
+ */
+static void markReferenceBand(MappingStore* mappingStore, PashParameters* pp, guint32 bandIndex,
+		unsigned long* markedOutputLines) {
+	if (!pp->mapReadsInBatches) {
+		return;
+	}
+	if (mappingStore->storedLines!=*markedOutputLines) {
+		storeWindowMark(mappingStore, bandIndex);
+		*markedOutputLines = mappingStore->storedLines;
+	}
+}
+
+/** Replay the decisions recorded while collating a window, in the order the serial scan
+ * takes them, against the current best scores of the reads, and write the surviving lines.
+ * Workers filter against best scores that are never higher than the ones seen here, so every
+ * alignment the serial scan would evaluate has been evaluated by the worker.
+@param mappingStore store of the mapping lines
+@param result recorded collation decisions for the window
+@param pp pash parameters
+@param currentChrom index of the chromosome of the window
+@param markedOutputLines lines stored up to the last band mark; updated
+ */
+static void commitCollationResult(MappingStore* mappingStore, CollationResult* result, PashParameters* pp,
+		guint32 currentChrom, unsigned long* markedOutputLines) {
+	double withinTopPercent = 1-pp->topPercent;
+	guint32 maxReadMappings = pp->maxMappings;
+	int kmerSpan = pp->mask.maskLen;
+	SequenceInfo* sequenceInfo = NULL;
+	int skipRead = 1;
+	guint32 eventIndex;
+
+	addMetric(MetricKmerAlignments, result->kmerAlignments);
+	addMetric(MetricSWScores, result->scoredAlignments);
+	addMetric(MetricSWTracebacks, result->tracedBackAlignments);
+	addMetric(MetricStoppedSWScores, result->stoppedAlignments);
+	addMetric(MetricUngappedAlignments, result->ungappedAlignments);
+	for (eventIndex=0; eventIndex<result->numberOfEvents; eventIndex++) {
+		CollationEvent* event = &result->events[eventIndex];
+		switch (event->type) {
+		case CollatedRead:
+			sequenceInfo = pp->verticalSequencesInfos+event->sequenceId;
+			skipRead = !passesAnchoringFilter(sequenceInfo, event->score);
+			if (!skipRead) {
+				updateBestAnchoringScore(sequenceInfo, event->score);
+				skipRead = isRepetitiveRead(sequenceInfo, maxReadMappings);
+			}
+			break;
+		case PoorAnchoring:
+			if (!skipRead) {
+				addMetric(MetricPoorAnchorings, 1);
+			}
+			break;
+		case BandCollated:
+			markReferenceBand(mappingStore, pp, event->sequenceId, markedOutputLines);
+			break;
+		case CandidateAlignment:
+			if (skipRead) {
+				break;
+			}
+			if (!passesSkeletonFilter(sequenceInfo, event->score)) {
+				addMetric(MetricSkeletonFiltered, 1);
+				break;
+			}
+			if (event->swScore<0) {
+				fprintf(stderr, "alignment of read %s was pruned before commit at %s:%d\n",
+						sequenceInfo->sequenceName, __FILE__, __LINE__);
+				exit(1);
+			}
+			addMetric(MetricSWCalls, 1);
+			switch (updateReadBestScores(sequenceInfo, event->swScore, event->score,
+					withinTopPercent, currentChrom, event->hitStart, event->hitStop)) {
+			case AlignmentBelowTarget:
+				addMetric(MetricFailedSWCalls, 1);
+				if (event->score<sequenceInfo->bestSkeletonScore*9/10) {
+					addMetric(MetricPredictedSkeletonFailures, 1);
+				}
+				break;
+			case AlignmentDuplicate:
+				break;
+			case AlignmentAccepted:
+				if (event->swScore>=kmerSpan) {
+					if (event->outputLineOffset<0) {
+						fprintf(stderr, "missing output line for read %s at %s:%d\n",
+								sequenceInfo->sequenceName, __FILE__, __LINE__);
+						exit(1);
+					}
+					storeMappingRecord(mappingStore, result->outputBuffer+event->outputLineOffset);
+				}
+				break;
+			}
+			break;
+		}
+	}
+}
+
 static inline void advanceToNextHorizontalSequence(SequenceHash* sequenceHash) {
 	sequenceHash->numberOfChunksInCurrentSequence = 0;
 	sequenceHash->offsetOfSequenceBufferInRealSequence=0;
 	sequenceHash->currentSequenceChunk = 0;
 }
 
+/** Seed a reference window against the hive hash, then collate the match streams of its bands
+ * one after the other. Every kmer of the window is looked up once, even if two bands share it,
+ * and the kmers it shares with the previous window are not looked up again if this collator
+ * collated that window.
+@param mappingStore store of the mapping lines; not used if the collation result is deferred
+@param cc collator control owned by the calling thread
+@param window reference window
+@param sequenceHash horizontal sequence hash
+@param pp pash parameters
+@param markedOutputLines lines stored up to the last band mark; not used if the collation result is deferred
+ */
+static void collateReferenceWindow(MappingStore* mappingStore, CollatorControl* cc, ReferenceWindow* window,
+		SequenceHash* sequenceHash, PashParameters* pp, unsigned long* markedOutputLines) {
+	HiveHash* hiveHash = (HiveHash*)sequenceHash->hiveHash;
+	Mask mask = pp->mask;
+	int maskWeight = mask.keyLen;
+	int useIgnoreList = pp->useIgnoreList;
+	IgnoreList ignoreList = pp->ignoreList;
+	char currentKmer [MAX_MASK_LEN+1];
+	int kmerPos, maskPos, currentSequencePos;
+	int startOffset, maxOffset;
+	guint32 forwardKey;
+	char* chunkSequence = &window->targetTemplate[window->chunkStart-window->targetTemplateStart];
+	SpacedSeed spacedSeed;
+	SpacedSeedWindow seedWindow;
+	int rollingKeys = !initSpacedSeed(&spacedSeed, &mask);
+	guint32 numberOfDiagonals = cc->numberOfDiagonals;
+	guint32 band, hitIndex, bandHitIndex, sharedHits;
+	int firstOffset;
+
+	currentKmer[maskWeight] = '\0';
+	maxOffset = window->chunkStop - window->chunkStart +1 - mask.maskLen;
+	xDEBUG(DEB_SCAN_HORIZONTAL_SEQ, fprintf(stderr,"f st %d f stop %d maxOffset=%d\n",
+			window->chunkStart, window->chunkStop, maxOffset));
+	firstOffset = reuseSharedWindowHits(cc, window);
+	sharedHits = cc->numberOfWindowHits;
+	// the keys are rolled along the window, one base at a time; patterns too long for the rolling
+	// window gather the sampled bases of every kmer
+	resetSpacedSeedWindow(&seedWindow);
+	if (rollingKeys) {
+		for (currentSequencePos=firstOffset; currentSequencePos<firstOffset+(int)mask.maskLen-1 && firstOffset<=maxOffset;
+				currentSequencePos++) {
+			pushSpacedSeedBase(&spacedSeed, &seedWindow, chunkSequence[currentSequencePos]);
+		}
+	}
+	for (startOffset = firstOffset; startOffset<=maxOffset; startOffset++) {
+		if (rollingKeys) {
+			pushSpacedSeedBase(&spacedSeed, &seedWindow, chunkSequence[startOffset+mask.maskLen-1]);
+			forwardKey = spacedSeedKey(&spacedSeed, &seedWindow);
+		} else {
+			for (currentSequencePos=startOffset, maskPos = 0,kmerPos = 0;
+					kmerPos < maskWeight;
+					currentSequencePos++, maskPos++) {
+				if (mask.mask[maskPos]) {
+					currentKmer [kmerPos] = chunkSequence[currentSequencePos];
+					kmerPos++;
+				}
+			}
+			getKeyForSeq(currentKmer, &forwardKey);
+		}
+		xDEBUG(DEB_SCAN_HORIZONTAL_SEQ, fprintf(stderr, "found forward kmer %d %x, h offset %d\n",
+				forwardKey, forwardKey, startOffset));
+		if (forwardKey != BAD_KEY) {
+			if(!useIgnoreList || !isIgnored(forwardKey, ignoreList)) {
+				if(hiveHash->hasEntries(forwardKey)) {
+					addWindowHit(cc, forwardKey, hiveHash, startOffset);
+				}
+			}
+		}
+	}
+	xDEBUG(DEB_SCAN_HORIZONTAL_SEQ, fprintf(stderr, "do something\n"));
+	addMetric(MetricReferenceWindows, 1);
+	addMetric(MetricWindowHits, cc->numberOfWindowHits-sharedHits);
+	shareWindowHits(cc, window, maxOffset>=0 ? maxOffset+1 : 0);
+	cc->targetTemplate = window->targetTemplate;
+	cc->targetTemplateStart = window->targetTemplateStart;
+	cc->reverseStrandDnaMethMapping = window->reverseStrandDnaMethMapping;
+	hitIndex = 0;
+	for (band=0; band<window->numberOfBands; band++) {
+		guint32 bandOffset = band*numberOfDiagonals;
+		guint32 bandStart = window->chunkStart+bandOffset;
+		guint32 bandStop = bandStart+2*numberOfDiagonals-1;
+		if (bandStop>window->chunkStop) {
+			bandStop = window->chunkStop;
+		}
+		// the band is collated as a window of its own: its match streams are the kmers lying wholly in its chunk
+		maxOffset = bandStop - bandStart +1 - mask.maskLen;
+		resetCollatorControl(cc);
+		while (hitIndex<cc->numberOfWindowHits && cc->windowHits[hitIndex].horizontalOffset<bandOffset) {
+			hitIndex++;
+		}
+		for (bandHitIndex=hitIndex; bandHitIndex<cc->numberOfWindowHits &&
+				(int)(cc->windowHits[bandHitIndex].horizontalOffset-bandOffset)<=maxOffset; bandHitIndex++) {
+			WindowHit* windowHit = &cc->windowHits[bandHitIndex];
+			addMatchStreamRunner(cc, windowHit->kmer, &windowHit->intListRunner, windowHit->horizontalOffset-bandOffset);
+		}
+		if (cc->validMatchStreams>0) {
+			double collationStartTime = metricTime();
+			performCollation(mappingStore, cc,  sequenceHash, pp,
+					window->chromName,
+					bandStart,
+					bandStop,
+					window->chromIndex);
+			addMetricTime(MetricCollation, collationStartTime);
+		}
+		if (cc->result==NULL) {
+			markReferenceBand(mappingStore, pp, window->windowIndex+band, markedOutputLines);
+		} else if (pp->mapReadsInBatches) {
+			addCollationEvent(cc->result, BandCollated, window->windowIndex+band, 0, -1, 0, 0, -1);
+		}
+	}
+}
+
+typedef enum {WindowFree, WindowReady, WindowCollated} WindowSlotState;
+
+/** Reference window queued for a scanning thread, together with its deferred collation result.*/
+typedef struct {
+	ReferenceWindow window;
+	CollationResult result;
+	WindowSlotState state;
+} WindowSlot;
+
+/** Multi-threaded scan: the main thread parses the reference and queues windows,
+ * the workers collate them, and the main thread commits the results in reference order.*/
+typedef struct {
+	PashParameters* pp;
+	SequenceHash* sequenceHash;
+	WindowSlot* slots;
+	guint32 numberOfSlots;
+	/** Number of windows submitted, taken by the workers, and committed so far.*/
+	unsigned long submittedWindows;
+	unsigned long takenWindows;
+	unsigned long committedWindows;
+	int scanDone;
+	pthread_mutex_t lock;
+	pthread_cond_t windowReady;
+	pthread_cond_t windowCollated;
+	pthread_t* workers;
+	guint32 numberOfWorkers;
+	/** Lines stored up to the last band mark, included.*/
+	unsigned long markedOutputLines;
+} ScanPipeline;
+
+static void* scanWorker(void* arg) {
+	ScanPipeline* pipeline = (ScanPipeline*) arg;
+	CollatorControl* cc = initCollatorControl(pipeline->pp->numberOfDiagonals,
+			pipeline->pp->collationEngine==SortCollation);
+	cc->earlierBatchKmers = pipeline->pp->earlierBatchKmers;
+	pthread_mutex_lock(&pipeline->lock);
+	while (1) {
+		while (pipeline->takenWindows==pipeline->submittedWindows && !pipeline->scanDone) {
+			pthread_cond_wait(&pipeline->windowReady, &pipeline->lock);
+		}
+		if (pipeline->takenWindows==pipeline->submittedWindows) {
+			break;
+		}
+		WindowSlot* slot = &pipeline->slots[pipeline->takenWindows % pipeline->numberOfSlots];
+		pipeline->takenWindows++;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		resetCollationResult(&slot->result);
+		cc->result = &slot->result;
+		collateReferenceWindow(NULL, cc, &slot->window, pipeline->sequenceHash, pipeline->pp, NULL);
+
+		pthread_mutex_lock(&pipeline->lock);
+		slot->state = WindowCollated;
+		pthread_cond_signal(&pipeline->windowCollated);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+	freeCollatorControl(cc);
+	mergeThreadMetrics();
+	return NULL;
+}
+
+static ScanPipeline* startScanPipeline(PashParameters* pp, SequenceHash* sequenceHash, guint32 numberOfWorkers) {
+	ScanPipeline* pipeline = (ScanPipeline*) malloc(sizeof(ScanPipeline));
+	xDieIfNULL(pipeline, fprintf(stderr, "could not allocate memory for the scan pipeline at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	pipeline->pp = pp;
+	pipeline->sequenceHash = sequenceHash;
+	pipeline->numberOfSlots = 4*numberOfWorkers;
+	pipeline->slots = (WindowSlot*) malloc(sizeof(WindowSlot)*pipeline->numberOfSlots);
+	pipeline->workers = (pthread_t*) malloc(sizeof(pthread_t)*numberOfWorkers);
+	xDieIfNULL(pipeline->slots, fprintf(stderr, "could not allocate memory for the scan pipeline at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	xDieIfNULL(pipeline->workers, fprintf(stderr, "could not allocate memory for the scan pipeline at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	guint32 i;
+	for (i=0; i<pipeline->numberOfSlots; i++) {
+		initCollationResult(&pipeline->slots[i].result);
+		pipeline->slots[i].state = WindowFree;
+	}
+	pipeline->submittedWindows = 0;
+	pipeline->takenWindows = 0;
+	pipeline->committedWindows = 0;
+	pipeline->scanDone = 0;
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->windowReady, NULL);
+	pthread_cond_init(&pipeline->windowCollated, NULL);
+	pipeline->numberOfWorkers = numberOfWorkers;
+	pipeline->markedOutputLines = 0;
+	for (i=0; i<numberOfWorkers; i++) {
+		if (pthread_create(&pipeline->workers[i], NULL, scanWorker, pipeline)!=0) {
+			fprintf(stderr, "could not start scanning thread %d\n", i);
+			exit(2);
+		}
+	}
+	xDEBUG(DEB_SCAN_THREADS, fprintf(stderr, "started %d scanning threads\n", numberOfWorkers));
+	return pipeline;
+}
+
+/** Commit the collated windows in submission order.
+@param wait if set, block until at least one window was committed
+ */
+static void commitCollatedWindows(ScanPipeline* pipeline, MappingStore* mappingStore, int wait) {
+	pthread_mutex_lock(&pipeline->lock);
+	while (pipeline->committedWindows<pipeline->submittedWindows) {
+		WindowSlot* slot = &pipeline->slots[pipeline->committedWindows % pipeline->numberOfSlots];
+		if (slot->state!=WindowCollated) {
+			if (!wait) {
+				break;
+			}
+			pthread_cond_wait(&pipeline->windowCollated, &pipeline->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pipeline->lock);
+		commitCollationResult(mappingStore, &slot->result, pipeline->pp, slot->window.chromIndex,
+				&pipeline->markedOutputLines);
+		pthread_mutex_lock(&pipeline->lock);
+		slot->state = WindowFree;
+		pipeline->committedWindows++;
+		wait = 0;
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/** Get the window of the next free slot, committing collated windows to make room if necessary.*/
+static ReferenceWindow* nextPipelineWindow(ScanPipeline* pipeline, MappingStore* mappingStore) {
+	commitCollatedWindows(pipeline, mappingStore,
+			pipeline->submittedWindows-pipeline->committedWindows>=pipeline->numberOfSlots);
+	return &pipeline->slots[pipeline->submittedWindows % pipeline->numberOfSlots].window;
+}
+
+static void submitPipelineWindow(ScanPipeline* pipeline) {
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->slots[pipeline->submittedWindows % pipeline->numberOfSlots].state = WindowReady;
+	pipeline->submittedWindows++;
+	pthread_cond_signal(&pipeline->windowReady);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/** Wait for the workers to collate the remaining windows, commit them and release the pipeline.*/
+static void finishScanPipeline(ScanPipeline* pipeline, MappingStore* mappingStore) {
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->scanDone = 1;
+	pthread_cond_broadcast(&pipeline->windowReady);
+	pthread_mutex_unlock(&pipeline->lock);
+	while (pipeline->committedWindows<pipeline->submittedWindows) {
+		commitCollatedWindows(pipeline, mappingStore, 1);
+	}
+	guint32 i;
+	for (i=0; i<pipeline->numberOfWorkers; i++) {
+		pthread_join(pipeline->workers[i], NULL);
+	}
+	for (i=0; i<pipeline->numberOfSlots; i++) {
+		freeCollationResult(&pipeline->slots[i].result);
+	}
+	pthread_mutex_destroy(&pipeline->lock);
+	pthread_cond_destroy(&pipeline->windowReady);
+	pthread_cond_destroy(&pipeline->windowCollated);
+	free(pipeline->slots);
+	free(pipeline->workers);
+	free(pipeline);
+}
+
+/** Report a new horizontal sequence and set up the bisulfite strand it is mapped on.
+@param defline sequence name
+@param sequenceLength sequence length
+@return 1 if the sequence is the reverse complement strand of a bisulfite mapping, 0 otherwise
+ */
+static int startHorizontalSequence(PashParameters* pp, const char* defline, guint32 sequenceLength) {
+	if (pp->bisulfiteSequencingMapping) {
+		if (strstr(defline, "#RC.pash.")!=NULL) {
+			pp->reverseStrandDnaMethMapping=1;
+			strcpy(pp->actualChromName, &defline[strlen("#RC.pash.")]);
+			fprintf(stderr, "def: %s ; reverse complement strand of %s\n",
+					defline, pp->actualChromName);
+			pp->reverseComplementSequenceLength = sequenceLength;
+
+		} else {
+			fprintf(stderr, "def: %s ; forward strand\n",
+					defline);
+			pp->reverseStrandDnaMethMapping = 0;
+		}
+	} else {
+		fprintf(stderr, "def: %s\n",
+				defline);
+	}
+	printNow();
+	fflush(stderr);
+	return pp->reverseStrandDnaMethMapping;
+}
+
+/** Collate a reference window, or queue it for the scanning threads if the scan is multi-threaded.
+@param markedOutputLines lines stored up to the last band mark, when collating in this thread
+ */
+static void dispatchReferenceWindow(MappingStore* mappingStore, CollatorControl* cc, ScanPipeline* pipeline,
+		ReferenceWindow* window, SequenceHash* sequenceHash, PashParameters* pp, unsigned long* markedOutputLines) {
+	if (pipeline!=NULL) {
+		submitPipelineWindow(pipeline);
+	} else {
+		collateReferenceWindow(mappingStore, cc, window, sequenceHash, pp, markedOutputLines);
+	}
+}
+
+/** Number of diagonal bands of the reference windows, so that a window spans about REFERENCE_WINDOW_SIZE bases.*/
+static inline guint32 referenceWindowBands(int numberOfDiagonals) {
+	guint32 numberOfBands = REFERENCE_WINDOW_SIZE/numberOfDiagonals;
+	return numberOfBands>0 ? numberOfBands : 1;
+}
+
+/** Scan the horizontal sequences from the packed reference. The windows are the same as when parsing
+ * the FASTA files, but every chunk and its radius are decoded straight into the window.
+@param window window used when collating in this thread; taken from the pipeline otherwise
+ */
+static void scanPackedReference(MappingStore* mappingStore, CollatorControl* cc, ScanPipeline* pipeline,
+		ReferenceWindow* window, SequenceHash* sequenceHash, PashParameters* pp, unsigned long* markedOutputLines) {
+	PackedReference* packedReference = pp->packedReferenceHorizontal;
+	int numberOfDiagonals = pp->numberOfDiagonals;
+	guint32 chrom, chunk, numberOfChunks, sequenceLength, numberOfBands;
+	guint32 bandsPerWindow = referenceWindowBands(numberOfDiagonals);
+	long radiusChunkStart, radiusChunkStop, targetChunkStart, targetChunkStop;
+	guint32 currentForwardChunkStart, currentForwardChunkStop;
+	for (chrom=1; chrom<=packedReference->numberOfSequences; chrom++) {
+		const char* chromName = packedReferenceSequenceName(packedReference, chrom);
+		sequenceLength = packedReference->sequences[chrom].length;
+		int reverseStrandDnaMethMapping = startHorizontalSequence(pp, chromName, sequenceLength);
+		numberOfChunks = (sequenceLength-1)/numberOfDiagonals+1;
+		for (chunk=0; chunk<numberOfChunks; chunk+=numberOfBands) {
+			numberOfBands = numberOfChunks-chunk<bandsPerWindow ? numberOfChunks-chunk : bandsPerWindow;
+			currentForwardChunkStart = numberOfDiagonals*chunk;
+			currentForwardChunkStop = currentForwardChunkStart+(numberOfBands+1)*numberOfDiagonals-1;
+			if (currentForwardChunkStop>=sequenceLength) {
+				currentForwardChunkStop = sequenceLength-1;
+			}
+			targetChunkStart = (long)currentForwardChunkStart - numberOfDiagonals-DEFAULT_BAND;
+			targetChunkStop = (long)currentForwardChunkStop + numberOfDiagonals+DEFAULT_BAND;
+			radiusChunkStart = targetChunkStart<0 ? 0 : targetChunkStart;
+			radiusChunkStop = targetChunkStop>=(long)sequenceLength ? (long)sequenceLength-1 : targetChunkStop;
+			if (pipeline!=NULL) {
+				window = nextPipelineWindow(pipeline, mappingStore);
+			}
+			if (radiusChunkStart>targetChunkStart) {
+				memset(window->targetTemplate, '@', radiusChunkStart-targetChunkStart);
+			}
+			decodePackedReference(packedReference, chrom, radiusChunkStart, radiusChunkStop-radiusChunkStart+1,
+					&window->targetTemplate[radiusChunkStart-targetChunkStart]);
+			if (targetChunkStop>radiusChunkStop) {
+				memset(&window->targetTemplate[radiusChunkStop-targetChunkStart+1], '@', targetChunkStop-radiusChunkStop);
+			}
+			window->windowIndex = sequenceHash->lastSequenceId+1;
+			window->numberOfBands = numberOfBands;
+			sequenceHash->lastSequenceId += numberOfBands;
+			window->targetTemplateStart = targetChunkStart;
+			window->targetTemplate[targetChunkStop-targetChunkStart+1]='\0';
+			window->chunkStart = currentForwardChunkStart;
+			window->chunkStop = currentForwardChunkStop;
+			window->chromIndex = chrom;
+			window->reverseStrandDnaMethMapping = reverseStrandDnaMethMapping;
+			strncpy(window->chromName, chromName, MAX_DEFNAME_SIZE);
+			window->chromName[MAX_DEFNAME_SIZE] = '\0';
+			dispatchReferenceWindow(mappingStore, cc, pipeline, window, sequenceHash, pp, markedOutputLines);
+		}
+	}
+}
+
 /// Scan the horizontal sequence (typically chromosome/genome) agains the hivehash.
 int scanHorizontalSequence(PashParameters* pp, SequenceHash* sequenceHash) {
 	FastaUtil* fastaUtilHorizontal=pp->fastaUtilHorizontal;
-	swCalls=0;
-	kswCalls=0;
-	failedSWCalls=0;
-	reallyPoorAnchorings=0;
-	predSkelScore = 0;
-	tSkelScore = 0;
+	// the counters reported at the end of the scan are only updated by this thread
+	Metrics scanStartMetrics = threadMetrics;
+	const unsigned long* scanStartCounters = scanStartMetrics.counters;
+	const unsigned long* counters = threadMetrics.counters;
+	double scanStartTime = metricTime();
 	double withinTopPercent = 1 -pp->topPercent;
 	guint32 currentForwardChunkStart, currentForwardChunkStop;
 	guint32 sequenceLength;
-	char currentKmer [MAX_MASK_LEN+1];
-	int maskLen, maskWeight, kmerPos, maskPos;
-	int startOffset, maxOffset, offsetGap;
-	Mask mask = pp->mask;
-	int currentSequencePos;
 	int numberOfDiagonals;
 	int minPosition;
 	int sequenceToKeep;
 	int radiusChunkStart, radiusChunkStop; // we want the sequence around a certain radius for potential alignment step
 	int targetChunkStart, targetChunkStop;
-	CollatorControl *cc;
-	HiveHash*hiveHash=(HiveHash*)sequenceHash->hiveHash;
-	guint32** hashSkeleton=hiveHash->hashSkeleton;
-	guint32 forwardKey;
-	maskLen =pp->mask.maskLen;
-	maskWeight = pp->mask.keyLen;
-	currentKmer[maskWeight] = '\0';
-	offsetGap = 1;
+	CollatorControl *cc = NULL;
+	ReferenceWindow *window = NULL;
+	ScanPipeline *pipeline = NULL;
+	unsigned long markedOutputLines = 0;
 	numberOfDiagonals = pp->numberOfDiagonals;
+	guint32 numberOfBands, bandsPerWindow = referenceWindowBands(numberOfDiagonals);
 	printNow();
 
 	char tmpOutputFileName[MAX_FILE_NAME_SIZE];
 	sprintf(tmpOutputFileName, "%s.tmp.%d", pp->outputFile, getpid());
-	FILE* tmpOutputFilePtr = fopen(tmpOutputFileName, "wt");
-	if (tmpOutputFilePtr==NULL) {
-		fprintf(stderr, "could not open temporary output file %s\n", tmpOutputFileName);
-		fflush(stderr);
-		exit(2);
-	}
+	MappingStore* mappingStore = createMappingStore(pp->verticalSequencesInfos, pp->maxMappings,
+			withinTopPercent, pp->mappingStoreMemoryLimit, tmpOutputFileName, pp->mapReadsInBatches);
 	xDEBUG(DEB_SCAN_HORIZONTAL_SEQ, fprintf(stderr, "starting horizontal scanning\n"));
-	rewindFastaUtil(fastaUtilHorizontal);
-	int useIgnoreList = pp->useIgnoreList;
-	IgnoreList ignoreList = pp->ignoreList;
-	char currentSequence[MAX_FILE_NAME_SIZE+1];
-	cc = initCollatorControl(numberOfDiagonals);
+	if (pp->packedReferenceHorizontal==NULL) {
+		rewindFastaUtil(fastaUtilHorizontal);
+	}
+	if (pp->numberOfThreads>1) {
+		pipeline = startScanPipeline(pp, sequenceHash, pp->numberOfThreads);
+	} else {
+		cc = initCollatorControl(numberOfDiagonals, pp->collationEngine==SortCollation);
+		cc->earlierBatchKmers = pp->earlierBatchKmers;
+		window = (ReferenceWindow*) malloc(sizeof(ReferenceWindow));
+		xDieIfNULL(window, fprintf(stderr, "could not allocate memory for the reference window at %s:%d\n",
+				__FILE__, __LINE__), 1);
+	}
+	char currentSequence[MAX_DEFNAME_SIZE+1];
+	int reverseStrandDnaMethMapping = 0;
+	if (pp->packedReferenceHorizontal!=NULL) {
+		scanPackedReference(mappingStore, cc, pipeline, window, sequenceHash, pp, &markedOutputLines);
+	}
 	// if at limit of memory, then stop, because we have enough info to resume the vert hash filling
-	while(!fastaUtilHorizontal->parsingDone) {
+	while(pp->packedReferenceHorizontal==NULL && !fastaUtilHorizontal->parsingDone) {
 		if (sequenceHash->numberOfChunksInCurrentSequence==0 ||
 				(sequenceHash->numberOfChunksInCurrentSequence>0 &&
 						sequenceHash->currentSequenceChunk>=sequenceHash->numberOfChunksInCurrentSequence)) {
@@ -549,26 +1468,9 @@ int scanHorizontalSequence(PashParameters* pp, SequenceHash* sequenceHash) {
 							fastaUtilHorizontal->deflineBuffer, fastaUtilHorizontal->sequenceBuffer);
 			}	);
 
-			if (pp->bisulfiteSequencingMapping) {
-				if (strstr(fastaUtilHorizontal->deflineBuffer, "#RC.pash.")!=NULL) {
-					pp->reverseStrandDnaMethMapping=1;
-					strcpy(pp->actualChromName, &fastaUtilHorizontal->deflineBuffer[strlen("#RC.pash.")]);
-					fprintf(stderr, "def: %s ; reverse complement strand of %s\n",
-							fastaUtilHorizontal->deflineBuffer, pp->actualChromName);
-					pp->reverseComplementSequenceLength = sequenceLength;
-
-				} else {
-					fprintf(stderr, "def: %s ; forward strand\n",
-							fastaUtilHorizontal->deflineBuffer);
-					pp->reverseStrandDnaMethMapping = 0;
-				}
-			} else {
-				fprintf(stderr, "def: %s\n",
-						fastaUtilHorizontal->deflineBuffer);
-			}
-			printNow();
-			fflush(stderr);
-			strncpy(currentSequence, fastaUtilHorizontal->deflineBuffer, MAX_FILE_NAME_SIZE);
+			reverseStrandDnaMethMapping = startHorizontalSequence(pp, fastaUtilHorizontal->deflineBuffer, sequenceLength);
+			strncpy(currentSequence, fastaUtilHorizontal->deflineBuffer, MAX_DEFNAME_SIZE);
+			currentSequence[MAX_DEFNAME_SIZE] = '\0';
 			// set # of sequences
 			sequenceHash->numberOfChunksInCurrentSequence = (sequenceLength-1)/numberOfDiagonals+1;
 			sequenceHash->offsetOfSequenceBufferInRealSequence = 0;
@@ -582,8 +1484,12 @@ int scanHorizontalSequence(PashParameters* pp, SequenceHash* sequenceHash) {
 						sequenceHash->offsetOfSequenceBufferInRealSequence,
 						sequenceHash->currentSequenceChunk));
 
+		numberOfBands = sequenceHash->numberOfChunksInCurrentSequence-sequenceHash->currentSequenceChunk;
+		if (numberOfBands>bandsPerWindow) {
+			numberOfBands = bandsPerWindow;
+		}
 		currentForwardChunkStart = numberOfDiagonals*sequenceHash->currentSequenceChunk;
-		currentForwardChunkStop = currentForwardChunkStart+2*numberOfDiagonals-1;
+		currentForwardChunkStop = currentForwardChunkStart+(numberOfBands+1)*numberOfDiagonals-1;
 		if (currentForwardChunkStop>=sequenceLength) {
 			currentForwardChunkStop = sequenceLength-1;
 		}
@@ -603,67 +1509,38 @@ int scanHorizontalSequence(PashParameters* pp, SequenceHash* sequenceHash) {
 		if (static_cast<unsigned>(radiusChunkStop) < sequenceHash->offsetOfSequenceBufferInRealSequence +
 				fastaUtilHorizontal->currentSequenceBufferPos  ) {
 			xDEBUG(DEB_SCAN_HORIZONTAL_SEQ, fprintf(stderr, "f chunk+radius is available\n"));
-			startOffset =0;
-			sequenceHash->lastSequenceId ++;
-			maxOffset = currentForwardChunkStop - currentForwardChunkStart +1 - maskLen;
-			/*	if (maxOffset >= numberOfDiagonals) {
-				maxOffset = numberOfDiagonals-1;
+			if (pipeline!=NULL) {
+				window = nextPipelineWindow(pipeline, mappingStore);
 			}
-			 */
-			xDEBUG(DEB_SCAN_HORIZONTAL_SEQ, fprintf(stderr,"f st %d f stop %d start offset=%d maxOffset=%d\n",
-					currentForwardChunkStart, currentForwardChunkStop, startOffset, maxOffset));
-			resetCollatorControl(cc);
-			for (startOffset = 0; startOffset<=maxOffset; startOffset+= offsetGap) {
-				for (currentSequencePos=startOffset+currentForwardChunkStart-sequenceHash->offsetOfSequenceBufferInRealSequence,
-						maskPos = 0,kmerPos = 0;
-						kmerPos < maskWeight;
-						currentSequencePos++, maskPos++) {
-					if (mask.mask[maskPos]) {
-						currentKmer [kmerPos] = fastaUtilHorizontal->sequenceBuffer[currentSequencePos];
-						kmerPos++;
-					}
-				}
-				getKeyForSeq(currentKmer, &forwardKey);
-				xDEBUG(DEB_SCAN_HORIZONTAL_SEQ, fprintf(stderr, "found forward kmer %s %d %x, h seq id %d, h offset %d\n",
-						currentKmer, forwardKey, forwardKey, sequenceHash->lastSequenceId,
-						startOffset));
-				// do something
-				if (forwardKey != BAD_KEY) {
-					if(!useIgnoreList || !isIgnored(forwardKey, ignoreList)) {
-						if(hashSkeleton[forwardKey]!=NULL) {
-							addMatchStreamCollatorControl(cc, forwardKey,  hiveHash, startOffset);
-						}
-					}
-				}
-			}
-			xDEBUG(DEB_SCAN_HORIZONTAL_SEQ, fprintf(stderr, "do something\n"));
-			if (cc->validMatchStreams>0) {
-				// setup target alignment template
-				xDEBUG(DEB_HWIN, fprintf(stderr,"tStart %d rStart=%d tStop = %d rStop = %d\n",
-						targetChunkStart, radiusChunkStart, radiusChunkStop, targetChunkStop));
-				if (targetChunkStart==radiusChunkStart && targetChunkStop==radiusChunkStop) {
-					memcpy(&cc->targetTemplate[0],
-							&fastaUtilHorizontal->sequenceBuffer[radiusChunkStart-sequenceHash->offsetOfSequenceBufferInRealSequence],
-							radiusChunkStop-radiusChunkStart+1);
-				} else {
-					int jjj;
-					for (jjj=0; jjj<=targetChunkStop-targetChunkStart; jjj++) {
-						cc->targetTemplate[jjj]='@';
-					}
-					memcpy(&cc->targetTemplate[radiusChunkStart-targetChunkStart],
-							&fastaUtilHorizontal->sequenceBuffer[radiusChunkStart-sequenceHash->offsetOfSequenceBufferInRealSequence],
-							radiusChunkStop-radiusChunkStart+1);
+			// setup target alignment template
+			xDEBUG(DEB_HWIN, fprintf(stderr,"tStart %d rStart=%d tStop = %d rStop = %d\n",
+					targetChunkStart, radiusChunkStart, radiusChunkStop, targetChunkStop));
+			if (targetChunkStart==radiusChunkStart && targetChunkStop==radiusChunkStop) {
+				memcpy(&window->targetTemplate[0],
+						&fastaUtilHorizontal->sequenceBuffer[radiusChunkStart-sequenceHash->offsetOfSequenceBufferInRealSequence],
+						radiusChunkStop-radiusChunkStart+1);
+			} else {
+				int jjj;
+				for (jjj=0; jjj<=targetChunkStop-targetChunkStart; jjj++) {
+					window->targetTemplate[jjj]='@';
 				}
-				cc->targetTemplateStart = targetChunkStart;
-				cc->targetTemplate[targetChunkStop-targetChunkStart+1]='\0';
-				performCollation(tmpOutputFilePtr, cc,  sequenceHash, pp,
-						fastaUtilHorizontal->deflineBuffer
-						, currentForwardChunkStart,
-						currentForwardChunkStop,
-						fastaUtilHorizontal->currentSequenceIndex);
+				memcpy(&window->targetTemplate[radiusChunkStart-targetChunkStart],
+						&fastaUtilHorizontal->sequenceBuffer[radiusChunkStart-sequenceHash->offsetOfSequenceBufferInRealSequence],
+						radiusChunkStop-radiusChunkStart+1);
 			}
+			window->windowIndex = sequenceHash->lastSequenceId+1;
+			window->numberOfBands = numberOfBands;
+			sequenceHash->lastSequenceId += numberOfBands;
+			window->targetTemplateStart = targetChunkStart;
+			window->targetTemplate[targetChunkStop-targetChunkStart+1]='\0';
+			window->chunkStart = currentForwardChunkStart;
+			window->chunkStop = currentForwardChunkStop;
+			window->chromIndex = fastaUtilHorizontal->currentSequenceIndex;
+			window->reverseStrandDnaMethMapping = reverseStrandDnaMethMapping;
+			strcpy(window->chromName, currentSequence);
+			dispatchReferenceWindow(mappingStore, cc, pipeline, window, sequenceHash, pp, &markedOutputLines);
 			// all input was consumed, move on to the next sequence
-			sequenceHash->currentSequenceChunk++;
+			sequenceHash->currentSequenceChunk += numberOfBands;
 		} else {
 			xDEBUG(DEB_SCAN_HORIZONTAL_SEQ,
 					fprintf(stderr, "f and reverse chunk are not simultaneously available\n"));
@@ -704,28 +1581,310 @@ int scanHorizontalSequence(PashParameters* pp, SequenceHash* sequenceHash) {
 						sequenceHash->offsetOfSequenceBufferInRealSequence,
 						sequenceHash->currentSequenceChunk));
 	}
-	fclose(tmpOutputFilePtr);
+	if (pipeline!=NULL) {
+		finishScanPipeline(pipeline, mappingStore);
+	} else {
+		freeCollatorControl(cc);
+		free(window);
+	}
+	double filterStartTime = metricTime();
+	writeStoredMappings(mappingStore, pp->outputFilePtr);
+	addMetricTime(MetricFilterOutput, filterStartTime);
+	freeMappingStore(mappingStore);
+	addMetricTime(MetricGenomeScan, scanStartTime);
+	fprintf(stderr, "anchorings %ld total sw calls %ld failed calls %ld really poor anchorings %ld predSkelScore %ld tSkelScore %ld\n",
+			counters[MetricKmerAlignments]-scanStartCounters[MetricKmerAlignments],
+			counters[MetricSWCalls]-scanStartCounters[MetricSWCalls],
+			counters[MetricFailedSWCalls]-scanStartCounters[MetricFailedSWCalls],
+			counters[MetricPoorAnchorings]-scanStartCounters[MetricPoorAnchorings],
+			counters[MetricPredictedSkeletonFailures]-scanStartCounters[MetricPredictedSkeletonFailures],
+			counters[MetricSkeletonFiltered]-scanStartCounters[MetricSkeletonFiltered]);
+	fprintf(stderr, "sw scores %ld stopped early %ld tracebacks %ld ungapped alignments %ld\n",
+			counters[MetricSWScores]-scanStartCounters[MetricSWScores],
+			counters[MetricStoppedSWScores]-scanStartCounters[MetricStoppedSWScores],
+			counters[MetricSWTracebacks]-scanStartCounters[MetricSWTracebacks],
+			counters[MetricUngappedAlignments]-scanStartCounters[MetricUngappedAlignments]);
+	return 0;
+}
 
+/// Best score of a queued candidate that failed the skeleton filter, or that is still to be scored.
+#define SW_SCORE_SKIPPED -1
+#define SW_SCORE_PENDING -2
+/// Candidate alignments handed at once to the batch scoring.
+#define SCORING_CHUNK_SIZE 64
+/// Band of an anchoring run on a single diagonal, whose alignment may be ungapped.
+#define UNGAPPED_ALIGNMENT_BAND 3
+
+/** Queue a candidate alignment of the last queued read.*/
+static QueuedCandidate* queueCandidateAlignment(CollatorControl* c) {
+	if (c->numberOfQueuedCandidates==c->queuedCandidatesCapacity) {
+		c->queuedCandidatesCapacity *= 2;
+		c->queuedCandidates = (QueuedCandidate*) realloc(c->queuedCandidates,
+				sizeof(QueuedCandidate)*c->queuedCandidatesCapacity);
+		xDieIfNULL(c->queuedCandidates, fprintf(stderr, "could not allocate memory for the alignment batch at %s:%d\n",
+				__FILE__, __LINE__), 1);
+	}
+	QueuedCandidate* candidate = &c->queuedCandidates[c->numberOfQueuedCandidates++];
+	candidate->queuedRead = c->numberOfQueuedReads-1;
+	return candidate;
+}
 
-	filterOutput(tmpOutputFileName, pp->outputFilePtr,
-			pp->verticalSequencesInfos, pp->maxMappings,
-			withinTopPercent);
+/** Score the queued candidates waiting for their score, the candidates of the same band together.
+ * A candidate is only scored until it cannot reach the target score of its read anymore: the target
+ * score only grows until the candidate is replayed, and a candidate below target is not traced back,
+ * so that its exact score does not matter. Candidates found to be ungapped are not scored at all.*/
+static void scoreQueuedCandidates(CollatorControl* c, PashParameters* pp) {
+	const char* verticalSequences[SCORING_CHUNK_SIZE];
+	const char* horizontalSequences[SCORING_CHUNK_SIZE];
+	int sizeVerticalSequences[SCORING_CHUNK_SIZE];
+	int targetScores[SCORING_CHUNK_SIZE];
+	int bestScores[SCORING_CHUNK_SIZE];
+	QueuedCandidate* chunkCandidates[SCORING_CHUNK_SIZE];
+	double withinTopPercent = 1-pp->topPercent;
+	guint32 candidateIndex, firstPending = 0;
+	int chunkSize, k, band;
+	unsigned long scored = 0, stopped = 0, ungapped = 0, cells = 0;
 
+	for (candidateIndex=0; candidateIndex<c->numberOfQueuedCandidates; candidateIndex++) {
+		QueuedCandidate* candidate = &c->queuedCandidates[candidateIndex];
+		if (candidate->swScore!=SW_SCORE_PENDING || candidate->band!=UNGAPPED_ALIGNMENT_BAND) {
+			continue;
+		}
+		QueuedRead* queuedRead = &c->queuedReads[candidate->queuedRead];
+		SequenceInfo* sequenceInfo = c->result!=NULL ? &queuedRead->readState :
+				pp->verticalSequencesInfos+queuedRead->sequenceId;
+		int swScore = scoreUngappedAlignment(c->queuedReadTemplates+candidate->queuedRead*(MAX_READ_SIZE+1),
+				&c->targetTemplate[candidate->alignmentHorizontalStart-c->targetTemplateStart],
+				sequenceInfo->sequenceLength, pp->bisulfiteSequencingMapping);
+		if (swScore>=0) {
+			candidate->swScore = swScore;
+			candidate->ungapped = 1;
+			ungapped++;
+		}
+	}
+	for (;;) {
+		for (; firstPending<c->numberOfQueuedCandidates &&
+				c->queuedCandidates[firstPending].swScore!=SW_SCORE_PENDING; firstPending++);
+		if (firstPending==c->numberOfQueuedCandidates) {
+			break;
+		}
+		band = c->queuedCandidates[firstPending].band;
+		chunkSize = 0;
+		for (candidateIndex=firstPending; candidateIndex<=c->numberOfQueuedCandidates; candidateIndex++) {
+			if (candidateIndex<c->numberOfQueuedCandidates) {
+				QueuedCandidate* candidate = &c->queuedCandidates[candidateIndex];
+				if (candidate->swScore!=SW_SCORE_PENDING || candidate->band!=band) {
+					continue;
+				}
+				QueuedRead* queuedRead = &c->queuedReads[candidate->queuedRead];
+				SequenceInfo* sequenceInfo = c->result!=NULL ? &queuedRead->readState :
+						pp->verticalSequencesInfos+queuedRead->sequenceId;
+				// the score needed for a traceback, as compared by bandedSWAlignmentInfo
+				float targetScore = sequenceInfo->bestSWScore*withinTopPercent;
+				chunkCandidates[chunkSize] = candidate;
+				verticalSequences[chunkSize] = c->queuedReadTemplates+candidate->queuedRead*(MAX_READ_SIZE+1);
+				horizontalSequences[chunkSize] = &c->targetTemplate[candidate->alignmentHorizontalStart-c->targetTemplateStart];
+				sizeVerticalSequences[chunkSize] = sequenceInfo->sequenceLength;
+				cells += (unsigned long)sequenceInfo->sequenceLength*band;
+				targetScores[chunkSize] = (int)targetScore;
+				if (targetScores[chunkSize]<targetScore) {
+					targetScores[chunkSize]++;
+				}
+				chunkSize++;
+			}
+			if (chunkSize==SCORING_CHUNK_SIZE || (candidateIndex==c->numberOfQueuedCandidates && chunkSize>0)) {
+				stopped += scoreBandedSWBatch(verticalSequences, horizontalSequences, sizeVerticalSequences,
+						targetScores, chunkSize, band, pp->bisulfiteSequencingMapping, bestScores);
+				for (k=0; k<chunkSize; k++) {
+					chunkCandidates[k]->swScore = bestScores[k];
+				}
+				scored += chunkSize;
+				chunkSize = 0;
+			}
+		}
+	}
+	addMetric(MetricSWCells, cells);
+	if (c->result!=NULL) {
+		c->result->scoredAlignments += scored;
+		c->result->stoppedAlignments += stopped;
+		c->result->ungappedAlignments += ungapped;
+	} else {
+		addMetric(MetricSWScores, scored);
+		addMetric(MetricStoppedSWScores, stopped);
+		addMetric(MetricUngappedAlignments, ungapped);
+	}
+}
 
+/** Alignment summary of the traceback of an ungapped candidate: a single block of the whole read,
+ * on the middle diagonal of its band, with one mismatch unless it scores one per read base.*/
+static void setUngappedAlignmentSummary(AlignmentSummary* alignmentSummary, int sizeVerticalSequence, int swScore) {
+	alignmentSummary->numMismatches = swScore==sizeVerticalSequence ? 0 : 1;
+	alignmentSummary->numMatches = sizeVerticalSequence-alignmentSummary->numMismatches;
+	alignmentSummary->numVerticalGaps = 0;
+	alignmentSummary->numHorizontalGaps = 0;
+	alignmentSummary->numGapBases = 0;
+	alignmentSummary->numBlocks = 1;
+	alignmentSummary->verticalStart = 0;
+	alignmentSummary->verticalStop = sizeVerticalSequence-1;
+	alignmentSummary->horizontalStart = UNGAPPED_ALIGNMENT_BAND/2;
+	alignmentSummary->horizontalStop = sizeVerticalSequence-1+UNGAPPED_ALIGNMENT_BAND/2;
+	alignmentSummary->verticalBlockStarts[0] = 0;
+	alignmentSummary->horizontalBlockStarts[0] = UNGAPPED_ALIGNMENT_BAND/2;
+	alignmentSummary->blockSizes[0] = sizeVerticalSequence;
+}
 
-	unlink(tmpOutputFileName);
-	fprintf(stderr, "anchorings %ld total sw calls %ld failed calls %ld really poor anchorings %ld predSkelScore %ld tSkelScore %ld\n",
-			kswCalls,  swCalls, failedSWCalls, reallyPoorAnchorings,
-			predSkelScore, tSkelScore);
-	return 0;
+/** Take the decisions on the queued reads and candidate alignments, in collation order, as they would
+ * have been taken with each candidate aligned when queued. The candidates are scored in batches first;
+ * a candidate is only traced back if its score reaches the target score of its read, which is
+ * when bandedSWAlignmentInfo would have traced it back. The traceback of an ungapped candidate is
+ * known without filling its matrix.*/
+static void flushAlignmentBatch(MappingStore* mappingStore, CollatorControl* c, PashParameters* pp,
+		char* currentSequence, guint32 currentChrom) {
+	SequenceInfo *verticalSequenceInfos = pp->verticalSequencesInfos;
+	int bisulfiteSequencingMapping = pp->bisulfiteSequencingMapping;
+	int deferCommit = (c->result!=NULL);
+	double withinTopPercent = 1-pp->topPercent;
+	int kmerSpan = pp->mask.maskLen;
+	guint32 chromLength = horizontalSequenceLength(pp, currentChrom);
+	guint32 readIndex, candidateIndex = 0;
+
+	double swStartTime = metricTime();
+	scoreQueuedCandidates(c, pp);
+	addMetricTime(MetricSmithWaterman, swStartTime);
+	for (readIndex=0; readIndex<c->numberOfQueuedReads; readIndex++) {
+		QueuedRead* queuedRead = &c->queuedReads[readIndex];
+		guint32 sequenceId = queuedRead->sequenceId;
+		guint32 currentVerticalSequenceId = queuedRead->currentVerticalSequenceId;
+		SequenceInfo *sequenceInfo = verticalSequenceInfos+sequenceId;
+		const char* readTemplate = c->queuedReadTemplates+readIndex*(MAX_READ_SIZE+1);
+		if (deferCommit) {
+			sequenceInfo = &queuedRead->readState;
+			addCollationEvent(c->result, CollatedRead, sequenceId, queuedRead->anchoringScore, -1, 0, 0, -1);
+		}
+		for (; candidateIndex<c->numberOfQueuedCandidates &&
+				c->queuedCandidates[candidateIndex].queuedRead==readIndex; candidateIndex++) {
+			QueuedCandidate* candidate = &c->queuedCandidates[candidateIndex];
+			guint32 skeletonScore = candidate->skeletonScore;
+			if (candidate->poorAnchoring) {
+				if (deferCommit) {
+					addCollationEvent(c->result, PoorAnchoring, sequenceId, 0, -1, 0, 0, -1);
+				} else {
+					addMetric(MetricPoorAnchorings, 1);
+				}
+				continue;
+			}
+			if (!passesSkeletonFilter(sequenceInfo, skeletonScore)) {
+				if (deferCommit) {
+					addCollationEvent(c->result, CandidateAlignment, sequenceId, skeletonScore, -1, 0, 0, -1);
+				} else {
+					addMetric(MetricSkeletonFiltered, 1);
+				}
+				continue;
+			}
+			if (candidate->swScore<0) {
+				fprintf(stderr, "candidate alignment of read %s was not scored at %s:%d\n",
+						sequenceInfo->sequenceName, __FILE__, __LINE__);
+				exit(1);
+			}
+
+			long alignmentHorizontalStart = candidate->alignmentHorizontalStart;
+			AlignmentSummary alignmentSummary;
+			int swScore = candidate->swScore;
+			float targetScore = sequenceInfo->bestSWScore*withinTopPercent;
+			if (swScore>=targetScore && swScore>0 && candidate->ungapped) {
+				setUngappedAlignmentSummary(&alignmentSummary, sequenceInfo->sequenceLength, swScore);
+				if (!bisulfiteSequencingMapping && !hasMinimumReadIdentity(&alignmentSummary, sequenceInfo->sequenceLength)) {
+					swScore = 0;
+				}
+			} else if (swScore>=targetScore && swScore>0) {
+				if (deferCommit) {
+					c->result->tracedBackAlignments++;
+				} else {
+					addMetric(MetricSWTracebacks, 1);
+				}
+				memcpy(c->readTemplate, readTemplate, sequenceInfo->sequenceLength+1);
+				addMetric(MetricSWCells, (unsigned long)sequenceInfo->sequenceLength*candidate->band);
+				swStartTime = metricTime();
+				if (bisulfiteSequencingMapping) {
+					swScore=bandedSWAlignmentInfoBisulfiteSeq(c->bswMemory,
+							c->readTemplate,
+							&c->targetTemplate[alignmentHorizontalStart-c->targetTemplateStart],
+							sequenceInfo->sequenceLength,
+							candidate->band, targetScore, &alignmentSummary);
+				} else {
+					swScore=bandedSWAlignmentInfo(c->bswMemory,
+							c->readTemplate,
+							&c->targetTemplate[alignmentHorizontalStart-c->targetTemplateStart],
+							sequenceInfo->sequenceLength,
+							candidate->band, targetScore, &alignmentSummary);
+				}
+				addMetricTime(MetricSmithWaterman, swStartTime);
+			}
+
+			xDEBUG(DEB_HWIN, fprintf(stderr, "got alignment score =%d \n", swScore));
+			guint32 hitStart = candidate->hitStart;
+			guint32 hitStop = candidate->hitStop;
+			if (deferCommit) {
+				// generate the line now, the commit decides whether it is reported
+				long outputLineOffset = -1;
+				if (swScore>=sequenceInfo->bestSWScore*withinTopPercent && swScore>=kmerSpan) {
+					char outputLine[20*MAX_LINE_LENGTH];
+					generateMappingLine(c, pp, verticalSequenceInfos+sequenceId, sequenceId, currentVerticalSequenceId,
+							swScore, chromLength, currentSequence, currentChrom, alignmentHorizontalStart, &alignmentSummary, outputLine);
+					outputLineOffset = appendOutputLine(c->result, outputLine);
+				}
+				addCollationEvent(c->result, CandidateAlignment, sequenceId, skeletonScore, swScore,
+						hitStart, hitStop, outputLineOffset);
+				continue;
+			}
+			addMetric(MetricSWCalls, 1);
+			AlignmentStatus alignmentStatus = updateReadBestScores(sequenceInfo, swScore, skeletonScore,
+					withinTopPercent, currentChrom, hitStart, hitStop);
+			if (alignmentStatus!=AlignmentBelowTarget) {
+				xDEBUG(DEB_TOPPERCENT,fprintf(stderr, ">>> about to print %s onto %s %u\t%u\t%c\t%d    exceeds threshold of %u %g %g\n",
+						sequenceInfo->sequenceName, currentSequence,
+						hitStart, hitStop,
+						currentVerticalSequenceId%2==0?'+':'-',
+								swScore, sequenceInfo->bestSWScore, withinTopPercent, sequenceInfo->bestSWScore*withinTopPercent));
+				if (alignmentStatus==AlignmentDuplicate) {
+					continue;
+				}
+				xDEBUG(DEB_HWIN,fprintf(stderr, "??? about to print\n"));
+
+				if (swScore>=kmerSpan) {
+					xDEBUG(DEB_FAIL_SW, fprintf(stderr, "best score M %d m %d\n",
+							candidate->anchoringMatches, candidate->anchoringMismatches));
+					xDEBUG(DEB_HWIN,fprintf(stderr, "### about to print %s onto %s %u\t%u\t%c\t%d\n",
+							sequenceInfo->sequenceName, currentSequence,
+							hitStart, hitStop,
+							currentVerticalSequenceId%2==0?'+':'-',
+									swScore));
+					char outputLine[20*MAX_LINE_LENGTH];
+					generateMappingLine(c, pp, sequenceInfo, sequenceId, currentVerticalSequenceId,
+							swScore, chromLength, currentSequence, currentChrom, alignmentHorizontalStart, &alignmentSummary, outputLine);
+					storeMappingRecord(mappingStore, outputLine);
+				}
+
+			} else {
+				xDEBUG(DEB_FAIL_SW,
+						fprintf(stderr, "fail sw %s M %d m %d \n",
+								sequenceInfo->sequenceName, candidate->anchoringMatches, candidate->anchoringMismatches));
+				addMetric(MetricFailedSWCalls, 1);
+				if (skeletonScore<sequenceInfo->bestSkeletonScore*9/10) {
+					addMetric(MetricPredictedSkeletonFailures, 1);
+				}
+			}
+		}
+	}
+	c->numberOfQueuedReads = 0;
+	c->numberOfQueuedCandidates = 0;
 }
 
-void performCollation(FILE* outputFilePtr, CollatorControl* c, SequenceHash* sequenceHash,
+void performCollation(MappingStore* mappingStore, CollatorControl* c, SequenceHash* sequenceHash,
 		PashParameters *pp, char* currentSequence,
 		guint32 start, guint32 stop, guint32 currentChrom) {
 	guint32 currentVerticalSequenceId;
 	guint32 numberOfMatchPairs;
-	guint32 chromLength = pp->fastaUtilHorizontal->sequencesInformation[currentChrom].sequenceLength;
 	int iii;
 	char currentKmer[MAX_MASK_LEN];
 	int currentDiagonal;
@@ -734,7 +1893,6 @@ void performCollation(FILE* outputFilePtr, CollatorControl* c, SequenceHash* seq
 	if (range<numberOfDiagonals) {
 		range = numberOfDiagonals;
 	}
-	double withinTopPercent = 1-pp->topPercent;
 	Mask mask = pp->mask;
 	int kmerWeight = mask.keyLen;
 	int kmerSpan = mask.maskLen;
@@ -749,9 +1907,9 @@ void performCollation(FILE* outputFilePtr, CollatorControl* c, SequenceHash* seq
 	int overlap;
 	int gapBases;
 	SequenceInfo *verticalSequenceInfos = pp->verticalSequencesInfos;
-	static guint32 iterNo = 0;
 	int bisulfiteSequencingMapping = pp->bisulfiteSequencingMapping;
-	iterNo +=1;
+	int deferCommit = (c->result!=NULL);
+	unsigned long collatedMatches = 0;
 
 	xDEBUG(DEB_PROGRESS, fprintf(stderr, "start collation of %s with %d valid streams %d---%d \n",
 			currentSequence, c->validMatchStreams, start, stop));
@@ -768,53 +1926,52 @@ while !done
     check for collation inconsistencies (e.
     g. do we have parallel runs ?)
 	 */
-	/* build heap of match streams*/
-	while (c->validMatchStreams>0) {
+	/* build heap of match streams, or sort the gathered matches*/
+	guint32 okey;
+	if (c->sortMatches) {
+		sortGatheredMatches(c);
+	}
+	while (hasCollatorMatches(c)) {
 		/*for (diagIdx=0; diagIdx<c->numberOfDiagonals; diagIdx++) {
 			c->diagonalCoverage[diagIdx] = 0;
 		}
 		 */
 
 		// pick top of priority queue
-		currentVerticalSequenceId = c->matchStreamPtrs[1]->verticalSeqID;
+		currentVerticalSequenceId = topCollatorMatch(c, &okey);
 		matchPairs[0].verticalSeqID = currentVerticalSequenceId;
-		matchPairs[0].verticalOffset = c->matchStreamPtrs[1]->okey >> 16;
-		matchPairs[0].horizontalOffset = c->matchStreamPtrs[1]->okey & 0x0000ffff;
+		matchPairs[0].verticalOffset = okey >> 16;
+		matchPairs[0].horizontalOffset = okey & 0x0000ffff;
 		//currentDiagonal = c->matchStreamPtrs[1]->diagonal;
 		//matchPairs[0].diagonal = currentDiagonal;
 		matchPairs[0].diagonal = -matchPairs[0].verticalOffset+matchPairs[0].horizontalOffset;
 
-		if (advanceTopMatchStream(c->matchStreamPtrs, c->validMatchStreams, c->numberOfDiagonals+10) == 1) {
-			c->validMatchStreams --;
-		}
+		advanceCollatorMatches(c);
+		collatedMatches++;
 		numberOfMatchPairs = 1;
 		xDEBUG(DEB_PERFORM_COLLATION, fprintf(stderr, "initialize new match set (%d, %d, %d) \n",
 				matchPairs[0].verticalSeqID, matchPairs[0].verticalOffset,
 				matchPairs[0].horizontalOffset));
-		if (c->validMatchStreams>0){
-			xDEBUG(DEB_PERFORM_COLLATION, fprintf(stderr, "validMatchStreams=%d, top match (vsid %d, kmer %d, hoff %d) \n",
-					c->validMatchStreams, c->matchStreamPtrs[1]->verticalSeqID,
-					0, c->matchStreamPtrs[1]->okey >> 16));
-		}
-		while (c->validMatchStreams>0 && c->matchStreamPtrs[1]->verticalSeqID == currentVerticalSequenceId) {
-			// todo: regrow number of match pairs dynamically
-			//assert(numberOfMatchPairs<matchPairsCapacity);
-			matchPairs[numberOfMatchPairs].verticalOffset = c->matchStreamPtrs[1]->okey >> 16;
-			matchPairs[numberOfMatchPairs].horizontalOffset = c->matchStreamPtrs[1]-> okey & 0x0000ffff; // horizontalOffset;
+		while (hasCollatorMatches(c) && topCollatorMatch(c, &okey) == currentVerticalSequenceId) {
 			//currentDiagonal = c->matchStreamPtrs[1]->diagonal;
-			currentDiagonal = matchPairs[numberOfMatchPairs].horizontalOffset - matchPairs[numberOfMatchPairs].verticalOffset;
+			currentDiagonal = (int)(okey & 0x0000ffff) - (int)(okey >> 16);
 			if (currentDiagonal>=0) {
-				matchPairs[numberOfMatchPairs].verticalSeqID = currentVerticalSequenceId;
-				matchPairs[numberOfMatchPairs].diagonal = currentDiagonal;
+				// a read with this many matches is not collated, so its further matches are only counted
+				if ((int)numberOfMatchPairs<numberMatchesCutoff) {
+					if (numberOfMatchPairs==c->matchPairsCapacity) {
+						growMatchPairs(c, numberOfMatchPairs+1);
+						matchPairs = c->matchPairs;
+					}
+					matchPairs[numberOfMatchPairs].verticalOffset = okey >> 16;
+					matchPairs[numberOfMatchPairs].horizontalOffset = okey & 0x0000ffff; // horizontalOffset;
+					matchPairs[numberOfMatchPairs].verticalSeqID = currentVerticalSequenceId;
+					matchPairs[numberOfMatchPairs].diagonal = currentDiagonal;
+				}
 				numberOfMatchPairs ++;
 				xDEBUG(DEB_COLL_HEURISTIC_1, fprintf(stderr, "[000] have %d matches to collate\n", numberOfMatchPairs));
 			}
-			if (advanceTopMatchStream(c->matchStreamPtrs, c->validMatchStreams, c->numberOfDiagonals+10) == 1) {
-				c->validMatchStreams --;
-			}
-			xDEBUG(DEB_COLL_HEURISTIC_1, fprintf(stderr, "validMatchStreams=%d, top match (vsid %d, kmer %d, hoff %d) \n",
-					c->validMatchStreams, c->matchStreamPtrs[1]->verticalSeqID,
-					0, c->matchStreamPtrs[1]->okey & 0x0000ffff));
+			advanceCollatorMatches(c);
+			collatedMatches++;
 		}
 
 		// TODO: resurrect this; mapping based on 1 seed is pointless
@@ -844,7 +2001,11 @@ while !done
 
 		// now do kmer-level alignment
 		numberOfMatchRunStarts = 0;
-		kswCalls +=1;
+		if (deferCommit) {
+			c->result->kmerAlignments += 1;
+		} else {
+			addMetric(MetricKmerAlignments, 1);
+		}
 		for (matchPairIndex=0; matchPairIndex<numberOfMatchPairs; matchPairIndex++) {
 			currentDiagonal = matchPairs[matchPairIndex].diagonal;
 			// attempt to collate current match pair
@@ -1006,41 +2167,55 @@ while !done
 		} else {
 			sequenceId = currentVerticalSequenceId/2;
 		}
+		// the decisions on the candidates of a read depend on the ones taken on its earlier candidates,
+		// so the batch is flushed before the other strand of a queued read is collated
+		if (c->numberOfQueuedReads==ALIGNMENT_BATCH_SIZE || c->numberOfQueuedCandidates>=ALIGNMENT_BATCH_SIZE ||
+				(c->numberOfQueuedReads>0 && c->queuedReads[c->numberOfQueuedReads-1].sequenceId==sequenceId)) {
+			flushAlignmentBatch(mappingStore, c, pp, currentSequence, currentChrom);
+		}
 		SequenceInfo *sequenceInfo = verticalSequenceInfos+sequenceId;
-		guint32 bestAnchoringScore = sequenceInfo->bestAnchoringScore ;
-		if (bestMatchScore >= bestAnchoringScore*3/4) {
+		QueuedRead* queuedRead = &c->queuedReads[c->numberOfQueuedReads];
+		if (deferCommit) {
+			// filter against a copy; the actual best scores are updated when the window is committed
+			loadReadState(&queuedRead->readState, sequenceInfo);
+			sequenceInfo = &queuedRead->readState;
+		}
+		if (passesAnchoringFilter(sequenceInfo, bestMatchScore)) {
 			xDEBUG(DEB_SW_CANDIDATES, fprintf(stderr, "[%d][%s] xAC %d vsq %d\n",
 					sequenceId, sequenceInfo->sequenceName, bestMatchScore, sequenceInfo->bestAnchoringScore*3/4));
 			// check if best match score exceeds 20% of best match score
-			if (bestMatchScore>sequenceInfo->bestAnchoringScore) {
-				sequenceInfo->bestAnchoringScore = bestMatchScore;
-				xDEBUG(DEB_BEST_ANCHORING, fprintf(stderr, "[%d][%s] upgraded best anchoring score to %d\n",
+			if (!deferCommit) {
+				updateBestAnchoringScore(sequenceInfo, bestMatchScore);
+				xDEBUG(DEB_BEST_ANCHORING, fprintf(stderr, "[%d][%s] best anchoring score %d\n",
 						sequenceId, sequenceInfo->sequenceName, sequenceInfo->bestAnchoringScore));
 			}
+			// queued even if it has no candidates, for a worker to record its CollatedRead event in order
+			queuedRead->sequenceId = sequenceId;
+			queuedRead->currentVerticalSequenceId = currentVerticalSequenceId;
+			queuedRead->anchoringScore = bestMatchScore;
+			c->numberOfQueuedReads++;
 
 			// sw
 			int sequenceLength = sequenceInfo->sequenceLength;
 
-			if (sequenceInfo->bestSWScore>=sequenceLength && sequenceInfo->bestScoreMappings>maxReadMappings) {
+			if (isRepetitiveRead(sequenceInfo, maxReadMappings)) {
 				xDEBUG(DEB_REP_READS, fprintf(stderr, "skip aligning read %s after %d mappings\n",
 						sequenceInfo->sequenceName, sequenceInfo->bestScoreMappings));
 				continue;
 			}
-			if (bisulfiteSequencingMapping) {
+			// packed reads are decoded straight into the read template
+			const char* readSequence;
+			if (bisulfiteSequencingMapping || currentVerticalSequenceId%2==0) {
 				// copy forward read
-				const char* fwdSequence = pp->verticalFastqUtil->retrieveSequence(sequenceId);
-				memcpy(&c->readTemplate[0], fwdSequence, sequenceLength+1);
+				readSequence = pp->verticalFastqUtil->retrieveSequence(sequenceId, c->readTemplate);
 			} else {
-				if (currentVerticalSequenceId%2==0) {
-					// copy forward read
-					const char* fwdSequence = pp->verticalFastqUtil->retrieveSequence(sequenceId);
-					memcpy(&c->readTemplate[0], fwdSequence, sequenceLength+1);
-				} else {
-					const char* revcSequence = pp->verticalFastqUtil->retrieveRevComplementSequence(sequenceId);
-					memcpy(&c->readTemplate[0], revcSequence, sequenceLength+1);
-				}
+				readSequence = pp->verticalFastqUtil->retrieveRevComplementSequence(sequenceId, c->readTemplate);
+			}
+			if (readSequence!=c->readTemplate) {
+				memcpy(&c->readTemplate[0], readSequence, sequenceLength+1);
 			}
 			c->readTemplate[sequenceLength]='\0';
+			memcpy(c->queuedReadTemplates+(c->numberOfQueuedReads-1)*(MAX_READ_SIZE+1), c->readTemplate, sequenceLength+1);
 			xDEBUG(DEB_HWIN, c->readTemplate[sequenceLength]='\0'; fprintf(stderr, "read template %s\n", c->readTemplate));
 			// determine banding
 			long vStop, hStop, vStart, hStart;
@@ -1156,119 +2331,29 @@ while !done
 								}
 							}
 						}
-						guint32 skeletonScore;
+						QueuedCandidate* candidate = queueCandidateAlignment(c);
+						candidate->anchoringMatches = anchoringMatches;
+						candidate->anchoringMismatches = anchoringMismatches;
+						candidate->alignmentHorizontalStart = alignmentHorizontalStart;
+						candidate->band = band;
+						candidate->hitStart = start+hStart+1;
+						candidate->hitStop = start+hStop+kmerSpan;
+						candidate->ungapped = 0;
 						xDEBUG(DEB_FAIL_SW, fprintf(stderr, "%s matches %d mismatches %d\n", sequenceInfo->sequenceName,
 								anchoringMatches, anchoringMismatches));
 						if(anchoringMismatches*4>anchoringMatches){
 							xDEBUG(DEB_BAD_ANCHORING, fprintf(stderr, "really poor anchoring M %d m %d \n", anchoringMatches, anchoringMismatches));
-							reallyPoorAnchorings++;
-							continue;
+							candidate->poorAnchoring = 1;
+							candidate->skeletonScore = 0;
+							candidate->swScore = SW_SCORE_SKIPPED;
 						} else {
-							skeletonScore = anchoringMatches-3 * anchoringMismatches;
-							xDEBUG(DEB_BAD_ANCHORING, fprintf(stderr,"cmp skel %d vs %d\n", skeletonScore, sequenceInfo->bestSkeletonScore));
-							if (skeletonScore<sequenceInfo->bestSkeletonScore*7/10) {
-								tSkelScore ++;
-								continue;
-							}	
-						}
-
-						AlignmentSummary alignmentSummary;
-						swCalls += 1;
-						failedSWCalls += 1;
-						int swScore;
-						if (bisulfiteSequencingMapping) {
-							swScore=bandedSWAlignmentInfoBisulfiteSeq(c->bswMemory,
-									c->readTemplate,
-									&c->targetTemplate[alignmentHorizontalStart-c->targetTemplateStart],
-									sequenceLength,
-									band, sequenceInfo->bestSWScore*withinTopPercent, &alignmentSummary);
-						} else {
-							swScore=bandedSWAlignmentInfo(c->bswMemory,
-									c->readTemplate,
-									&c->targetTemplate[alignmentHorizontalStart-c->targetTemplateStart],
-									sequenceLength,
-									band, sequenceInfo->bestSWScore*withinTopPercent, &alignmentSummary);
-						}
-
-
-						xDEBUG(DEB_HWIN, fprintf(stderr, "got alignment score =%d \n", swScore));
-						if (swScore>=sequenceInfo->bestSWScore*withinTopPercent) {
-							xDEBUG(DEB_TOPPERCENT,fprintf(stderr, ">>> about to print %s onto %s %ld\t%ld\t%c\t%d    exceeds threshold of %u %g %g\n",
-									sequenceInfo->sequenceName, currentSequence,
-									start+hStart+1, start+hStop+kmerSpan,
-									currentVerticalSequenceId%2==0?'+':'-',
-											swScore, sequenceInfo->bestSWScore, withinTopPercent, sequenceInfo->bestSWScore*withinTopPercent));
-							failedSWCalls -= 1;
-							if (skeletonScore>sequenceInfo->bestSkeletonScore) {
-								sequenceInfo->bestSkeletonScore=skeletonScore;
-							}
-							if (swScore>sequenceInfo->bestSWScore) {
-								sequenceInfo->bestChrom = currentChrom;
-								sequenceInfo->bestStart = start+hStop+kmerSpan;
-								sequenceInfo->bestSWScore = swScore;
-								sequenceInfo->bestScoreMappings=1;
-							} else {
-								if (swScore==sequenceInfo->bestSWScore) {
-									if( (sequenceInfo->bestChrom != currentChrom || ( sequenceInfo->bestStart+sequenceLength<start+hStart+1))
-									) {
-										sequenceInfo->bestChrom = currentChrom;
-										sequenceInfo->bestStart = start+hStop+kmerSpan;
-										sequenceInfo->bestSWScore = swScore;
-										sequenceInfo->bestScoreMappings++;
-									} else {
-										continue;
-									}
-								}
-							}
-							xDEBUG(DEB_HWIN,fprintf(stderr, "??? about to print\n"));
-
-							if (swScore>=kmerSpan) {
-								xDEBUG(DEB_FAIL_SW, fprintf(stderr, "best score M %d m %d\n", anchoringMatches, anchoringMismatches));
-								xDEBUG(DEB_HWIN,fprintf(stderr, "### about to print %s onto %s %ld\t%ld\t%c\t%d\n",
-										sequenceInfo->sequenceName, currentSequence,
-										start+hStart+1, start+hStop+kmerSpan,
-										currentVerticalSequenceId%2==0?'+':'-',
-												swScore));
-								char outputLine[20*MAX_LINE_LENGTH];
-								/*	fprintf(outputFilePtr, "%s\t%d\t%d\t%s\t%c\t%d\t%d\n",
-												currentSequence,
-												start+hStart+1, start+hStop+kmerSpan,
-												sequenceInfo->sequenceName,
-												currentVerticalSequenceId%2==0?'+':'-', swScore, sequenceId);
-								 */
-								SAMInfo samInfo;
-								resetSamInfo(&samInfo);
-								callVariants(c->readTemplate,
-										&c->targetTemplate[alignmentHorizontalStart-c->targetTemplateStart],
-										&samInfo, &alignmentSummary, bisulfiteSequencingMapping);
-								if (alignmentSummary.numMismatches != samInfo.numberOfBasePairVariants) {
-									fprintf(stderr, "incorrect number of mismatches for read %s: %d vs %d\n",
-											sequenceInfo->sequenceName,
-											alignmentSummary.numMismatches, samInfo.numberOfBasePairVariants);
-								}
-
-								if (bisulfiteSequencingMapping) {
-									outputBisulfiteMappingLine(sequenceId, swScore, sequenceInfo, chromLength, currentSequence,
-											alignmentHorizontalStart, &alignmentSummary,
-											outputLine, &samInfo, pp);
-								} else {
-									outputRegularPashLine(sequenceId, swScore, sequenceInfo, chromLength, currentSequence,
-											alignmentHorizontalStart, &alignmentSummary,
-											currentVerticalSequenceId%2==0?'+':'-',
-													outputLine, &samInfo, pp);
-									xDEBUG(DEB_HWIN,fprintf(stderr, "got out line >>%s<<\n", outputLine));
-								}
-
-								fprintf(outputFilePtr, "%s", outputLine);
-							}
-
-						} else {
-							xDEBUG(DEB_FAIL_SW,
-									fprintf(stderr, "fail sw %s M %d m %d \n",
-											sequenceInfo->sequenceName, anchoringMatches, anchoringMismatches));
-							if (skeletonScore<sequenceInfo->bestSkeletonScore*9/10) {
-								predSkelScore ++;
-							}
+							candidate->poorAnchoring = 0;
+							candidate->skeletonScore = anchoringMatches-3 * anchoringMismatches;
+							xDEBUG(DEB_BAD_ANCHORING, fprintf(stderr,"cmp skel %d vs %d\n", candidate->skeletonScore, sequenceInfo->bestSkeletonScore));
+							// the best scores only grow until the batch is flushed: a candidate failing the
+							// skeleton filter now also fails it then
+							candidate->swScore = passesSkeletonFilter(sequenceInfo, candidate->skeletonScore) ?
+									SW_SCORE_PENDING : SW_SCORE_SKIPPED;
 						}
 					}
 				}
@@ -1281,6 +2366,8 @@ while !done
 					sequenceId, sequenceInfo->sequenceName, bestMatchScore, sequenceInfo->bestAnchoringScore*3/4));
 		}
 	}
+	flushAlignmentBatch(mappingStore, c, pp, currentSequence, currentChrom);
+	addMetric(MetricHeapOperations, collatedMatches);
 	xDEBUG(DEB_PERFORM_COLLATION, fprintf(stderr, "stop collation \n"));
 }
 
@@ -1340,132 +2427,161 @@ int bandedSW(int *scoringMatrix, char* verticalSequence, char *horizontalSequenc
 	return bestGlobalScore;
 }
 
-void filterOutput(char* tmpOutputFileName, FILE *outputFilePtr, SequenceInfo* verticalSequenceInfos, guint32 maxReadMappings, double withinTopPercent) {
+void filterOutput(char* tmpOutputFileName, FILE *outputFilePtr, SequenceInfo* verticalSequenceInfos, guint32 maxReadMappings,
+		double withinTopPercent, int keepWindowMarks) {
 	// for now, select only best mappings
 	// optimize for best match mapping: don't write additional mappings of the same score during collation step
-	FILE *tmpOutputFilePtr= fopen(tmpOutputFileName, "rt");
+	FILE *tmpOutputFilePtr= fopen(tmpOutputFileName, "rb");
 	if (tmpOutputFilePtr==NULL) {
 		fprintf(stderr, "could not open temporary output file %s for reading\n", tmpOutputFileName);
 		fflush(stderr);
 		exit(2);
 	}
-	char chromosome[MAX_DEFNAME_SIZE], readName[MAX_DEFNAME_SIZE];
-	unsigned chromStart, chromStop, bwScore, sequenceId;
-	char strand;
-	char tmpLine[20*MAX_LINE_LENGTH];
-	while(fgets(tmpLine, 20*MAX_LINE_LENGTH-1, tmpOutputFilePtr) !=NULL) {
-		sscanf(tmpLine, "%u %u", &sequenceId, &bwScore);
-		if (sequenceId == UINT_MAX || bwScore == UINT_MAX) {
-			fprintf(stderr, "incorrect line %s", tmpLine);
+	MappingRecord record;
+	size_t outputCapacity = 20*MAX_LINE_LENGTH;
+	char* output = (char*) malloc(outputCapacity);
+	xDieIfNULL(output, fprintf(stderr, "could not allocate memory for filtering the output at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	while (readMappingRecord(tmpOutputFilePtr, &record, &output, &outputCapacity)) {
+		if (record.sequenceId==MAPPING_STORE_WINDOW_MARK) {
 			continue;
 		}
-		SequenceInfo * sequenceInfo = verticalSequenceInfos+sequenceId;
-		xDEBUG(DEB_TOPPERCENT, fprintf(stderr, "2: got mapping for for %d, score %d \n", sequenceId, bwScore));
-		if (sequenceInfo->passingMappings<=maxReadMappings&& bwScore >=sequenceInfo->bestSWScore*withinTopPercent) {
+		SequenceInfo * sequenceInfo = verticalSequenceInfos+record.sequenceId;
+		xDEBUG(DEB_TOPPERCENT, fprintf(stderr, "2: got mapping for for %d, score %d \n", record.sequenceId, record.score));
+		if (sequenceInfo->passingMappings<=maxReadMappings&& record.score >=sequenceInfo->bestSWScore*withinTopPercent) {
 			sequenceInfo->passingMappings ++;
 			xDEBUG(DEB_TOPPERCENT, fprintf(stderr, "passing mapping for %s: %d vs %d %g %g\n",
-					sequenceInfo->sequenceName, bwScore, sequenceInfo->bestSWScore, withinTopPercent, sequenceInfo->bestSWScore*withinTopPercent ));
+					sequenceInfo->sequenceName, record.score, sequenceInfo->bestSWScore, withinTopPercent, sequenceInfo->bestSWScore*withinTopPercent ));
 		}
 	}
 	fclose(tmpOutputFilePtr);
 
-	tmpOutputFilePtr= fopen(tmpOutputFileName, "rt");
+	tmpOutputFilePtr= fopen(tmpOutputFileName, "rb");
 	if (tmpOutputFilePtr==NULL) {
 		fprintf(stderr, "could not open temporary output file %s for reading\n", tmpOutputFileName);
 		fflush(stderr);
 		exit(2);
 	}
 
-	while(fgets(tmpLine, 20*MAX_LINE_LENGTH-1, tmpOutputFilePtr) !=NULL) {
-		sscanf(tmpLine, "%u %u", &sequenceId, &bwScore);
-		if (sequenceId == UINT_MAX || bwScore == UINT_MAX) {
-			fprintf(stderr, "incorrect line %s", tmpLine);
+	while (readMappingRecord(tmpOutputFilePtr, &record, &output, &outputCapacity)) {
+		if (record.sequenceId==MAPPING_STORE_WINDOW_MARK) {
+			if (keepWindowMarks) {
+				writeMappingRecord(outputFilePtr, record.sequenceId, record.score, NULL, 0);
+			}
 			continue;
 		}
-		SequenceInfo * sequenceInfo = verticalSequenceInfos+sequenceId;
-		xDEBUG(DEB_TOPPERCENT, fprintf(stderr, "2: got mapping for for %d, score %d \n", sequenceId, bwScore));
+		SequenceInfo * sequenceInfo = verticalSequenceInfos+record.sequenceId;
 		xDEBUG(DEB_FILTER_OUTPUT,
-				fprintf(stderr, "got %s\t%d\t%d\t%s\t%c\t%d; bestScore=sequenceInfo->bestSWScore; numMappings=%d vs %d\n",
-						chromosome, chromStart, chromStop, readName, strand, bwScore, sequenceInfo->bestScoreMappings, maxReadMappings));
-		if (sequenceInfo->passingMappings<=maxReadMappings && bwScore >=sequenceInfo->bestSWScore*withinTopPercent) {
-			int idx;
-			int lenTmpLine = strlen(tmpLine);
-			if (lenTmpLine > 0 && tmpLine[lenTmpLine-1] == '\n') {
-				tmpLine[--lenTmpLine] = '\0';
-			}
-			for (idx=0; tmpLine[idx]!='$' && idx<lenTmpLine ; idx++);
-			if (idx<lenTmpLine) {
-				fprintf(outputFilePtr, "%s\n", tmpLine+idx+1);
+				fprintf(stderr, "got mapping of %s, score %d; bestScore=%d; numMappings=%d vs %d\n",
+						sequenceInfo->sequenceName, record.score, sequenceInfo->bestSWScore, sequenceInfo->bestScoreMappings, maxReadMappings));
+		if (sequenceInfo->passingMappings<=maxReadMappings && record.score >=sequenceInfo->bestSWScore*withinTopPercent) {
+			if (keepWindowMarks) {
+				writeMappingRecord(outputFilePtr, record.sequenceId, record.score, output, record.outputSize);
 			} else {
-				fprintf(stderr, "incorrect line %s", tmpLine);
+				fwrite(output, 1, record.outputSize, outputFilePtr);
 			}
 		}
 	}
 	fclose(tmpOutputFilePtr);
+	free(output);
 }
 
 
 
+/** Output of a read batch, consumed one reference window at a time.*/
+typedef struct {
+	FILE* filePtr;
+	/** Window of the buffered outputs; 0 once the output is exhausted.*/
+	guint32 windowIndex;
+	char* lines;
+	size_t linesSize;
+	size_t linesCapacity;
+} ReadBatchOutput;
+
+/** Buffer the outputs of the next window of a read batch output.*/
+static void readBatchOutputWindow(ReadBatchOutput* batchOutput, const char* batchOutputFile) {
+	MappingRecord record;
+	batchOutput->linesSize = 0;
+	batchOutput->windowIndex = 0;
+	while (fread(&record, sizeof(MappingRecord), 1, batchOutput->filePtr)==1) {
+		if (record.sequenceId==MAPPING_STORE_WINDOW_MARK) {
+			batchOutput->windowIndex = record.score;
+			return;
+		}
+		if (batchOutput->linesSize+record.outputSize>batchOutput->linesCapacity) {
+			while (batchOutput->linesSize+record.outputSize>batchOutput->linesCapacity) {
+				batchOutput->linesCapacity *= 2;
+			}
+			batchOutput->lines = (char*) realloc(batchOutput->lines, batchOutput->linesCapacity);
+			xDieIfNULL(batchOutput->lines, fprintf(stderr, "could not allocate memory for merging the read batches at %s:%d\n",
+					__FILE__, __LINE__), 1);
+		}
+		if (fread(batchOutput->lines+batchOutput->linesSize, 1, record.outputSize, batchOutput->filePtr)!=record.outputSize) {
+			xDie(fprintf(stderr, "truncated output of read batch %s\n", batchOutputFile), 1);
+		}
+		batchOutput->linesSize += record.outputSize;
+	}
+	if (batchOutput->linesSize>0) {
+		xDie(fprintf(stderr, "output of read batch %s ends without a window mark\n", batchOutputFile), 1);
+	}
+}
+
+/** Merge the outputs of the read batches in reference window order, and within a window in batch
+ * order, which is the order in which a single batch run writes the mappings.
+@param batchOutputFiles outputs of the batches, in read order
+@param numberOfBatches number of batches
+@param outputFilePtr final output file
+ */
+void mergeReadBatchOutputs(char** batchOutputFiles, guint32 numberOfBatches, FILE* outputFilePtr) {
+	ReadBatchOutput* batchOutputs = (ReadBatchOutput*) malloc(numberOfBatches*sizeof(ReadBatchOutput));
+	xDieIfNULL(batchOutputs, fprintf(stderr, "could not allocate memory for merging the read batches at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	guint32 batch, nextBatch;
+	for (batch=0; batch<numberOfBatches; batch++) {
+		batchOutputs[batch].filePtr = fopen(batchOutputFiles[batch], "rb");
+		xDieIfNULL(batchOutputs[batch].filePtr, fprintf(stderr, "could not open read batch output %s for reading\n",
+				batchOutputFiles[batch]), 2);
+		batchOutputs[batch].linesCapacity = 64*MAX_LINE_LENGTH;
+		batchOutputs[batch].lines = (char*) malloc(batchOutputs[batch].linesCapacity);
+		xDieIfNULL(batchOutputs[batch].lines, fprintf(stderr, "could not allocate memory for merging the read batches at %s:%d\n",
+				__FILE__, __LINE__), 1);
+		readBatchOutputWindow(&batchOutputs[batch], batchOutputFiles[batch]);
+	}
+	while (1) {
+		nextBatch = numberOfBatches;
+		for (batch=0; batch<numberOfBatches; batch++) {
+			if (batchOutputs[batch].windowIndex>0 &&
+					(nextBatch==numberOfBatches || batchOutputs[batch].windowIndex<batchOutputs[nextBatch].windowIndex)) {
+				nextBatch = batch;
+			}
+		}
+		if (nextBatch==numberOfBatches) {
+			break;
+		}
+		fwrite(batchOutputs[nextBatch].lines, 1, batchOutputs[nextBatch].linesSize, outputFilePtr);
+		readBatchOutputWindow(&batchOutputs[nextBatch], batchOutputFiles[nextBatch]);
+	}
+	for (batch=0; batch<numberOfBatches; batch++) {
+		fclose(batchOutputs[batch].filePtr);
+		free(batchOutputs[batch].lines);
+	}
+	free(batchOutputs);
+}
+
+
 int bandedSWAlignmentInfo(int *scoringMatrix,
 		char* verticalSequence, char *horizontalSequence,
 		int sizeVerticalSequence, int band,
 		float targetScore, AlignmentSummary* alignmentSummary) {
-	int i, j, leftVal, upVal, diagVal;
 	int *prevLineH, *currentLineH;
-	int bestScore = 0;
 	int matchGain = 1;
 	int mismatchPenalty = -2;
 	int gapPenalty = -3;
-	int bandPlus1 = band+1;
-	int bestGlobalScore = 0;
+	int bestGlobalScore;
 	int bestScoreRow, bestScoreCol;
 
-	bestScoreRow = 0;
-	bestScoreCol = 0;
-
-	prevLineH = scoringMatrix;
-	for (j=0; j<=bandPlus1; j++) {
-		prevLineH[j]=0;
-	}
-	for (i=0; i<sizeVerticalSequence;i++) {
-		currentLineH = prevLineH+band+2;
-		currentLineH[0]=0;
-		//xDEBUG(DEB_BSW, fprintf(stderr, "vert base %c line %x\n", verticalSequence[i], currentLineH));
-		for (j=1; j<=band; j++) {
-			leftVal = currentLineH[j-1]+gapPenalty;
-			upVal = prevLineH[j+1]+gapPenalty;
-			if (verticalSequence[i]==horizontalSequence[i+j-1]) {
-				diagVal = prevLineH[j]+matchGain;
-			} else {
-				diagVal = prevLineH[j]+mismatchPenalty;
-			}
-			if (diagVal>upVal) {
-				bestScore = diagVal;
-			} else {
-				bestScore = upVal;
-			}
-			if (bestScore<leftVal) {
-				bestScore = leftVal;
-			}
-			if (bestScore>0) {
-				currentLineH[j]=bestScore;
-				if (bestScore>bestGlobalScore) {
-					bestScoreCol = j;
-					bestScoreRow = i;
-					bestGlobalScore=bestScore;
-				}
-			} else {
-				currentLineH[j]=0;
-			}
-
-			xDEBUG(DEB_BSW, fprintf(stderr, "[%d][%d] cmp %c vs %c leftVal=%d upVal=%d  diagH %d, diagVal=%d bestScore=%d\n",
-					i, j, verticalSequence[i], horizontalSequence[i+j-1], leftVal, upVal, prevLineH[j], diagVal, currentLineH[j]));
-		}
-		currentLineH[bandPlus1]=0;
-		//tmpLine = prevLineH;
-		prevLineH = currentLineH;
-		//currentLineH = prevLineH;
-	}
+	bestGlobalScore = fillBandedSWMatrix(scoringMatrix, verticalSequence, horizontalSequence,
+			sizeVerticalSequence, band, 0, &bestScoreRow, &bestScoreCol);
 
 	if (bestGlobalScore<targetScore || bestGlobalScore==0) {
 		return bestGlobalScore;
@@ -1576,11 +2692,7 @@ int bandedSWAlignmentInfo(int *scoringMatrix,
 		return 0;
 	}
 	// ENFORCE minimumReadIdentity
-	float minIdentity = 0.9;
-	if (alignmentSummary->numMatches < sizeVerticalSequence*minIdentity) {
-		bestGlobalScore = 0;
-	}
-	if ( (alignmentSummary->numMismatches + alignmentSummary->numGapBases) > (1-minIdentity)*alignmentSummary->numMatches) {
+	if (!hasMinimumReadIdentity(alignmentSummary, sizeVerticalSequence)) {
 		bestGlobalScore = 0;
 	}
 	return bestGlobalScore;
@@ -1699,64 +2811,16 @@ int bandedSWAlignmentInfoBisulfiteSeq(int *scoringMatrix,
 		char* verticalSequence, char *horizontalSequence,
 		int sizeVerticalSequence, int band,
 		float targetScore, AlignmentSummary* alignmentSummary) {
-	int i, j, leftVal, upVal, diagVal;
 	int *prevLineH, *currentLineH;
-	int bestScore = 0;
 	int matchGain = 1;
 	int mismatchPenalty = -2;
 	int gapPenalty = -3;
-	int bandPlus1 = band+1;
-	int bestGlobalScore = 0;
+	int bestGlobalScore;
 	int bestScoreRow, bestScoreCol;
 	char cH, cV;
-	bestScoreRow = 0;
-	bestScoreCol = 0;
 
-	prevLineH = scoringMatrix;
-	for (j=0; j<=bandPlus1; j++) {
-		prevLineH[j]=0;
-	}
-	for (i=0; i<sizeVerticalSequence;i++) {
-		currentLineH = prevLineH+band+2;
-		currentLineH[0]=0;
-		//xDEBUG(DEB_BSW, fprintf(stderr, "vert base %c line %x\n", verticalSequence[i], currentLineH));
-		cV = verticalSequence[i];
-		for (j=1; j<=band; j++) {
-			leftVal = currentLineH[j-1]+gapPenalty;
-			upVal = prevLineH[j+1]+gapPenalty;
-			cH = horizontalSequence[i+j-1];
-			if (cV==cH || (cV=='T' && cH=='C')) {
-				diagVal = prevLineH[j]+matchGain;
-			} else {
-				diagVal = prevLineH[j]+mismatchPenalty;
-			}
-			if (diagVal>upVal) {
-				bestScore = diagVal;
-			} else {
-				bestScore = upVal;
-			}
-			if (bestScore<leftVal) {
-				bestScore = leftVal;
-			}
-			if (bestScore>0) {
-				currentLineH[j]=bestScore;
-				if (bestScore>bestGlobalScore) {
-					bestScoreCol = j;
-					bestScoreRow = i;
-					bestGlobalScore=bestScore;
-				}
-			} else {
-				currentLineH[j]=0;
-			}
-
-			xDEBUG(DEB_BSW, fprintf(stderr, "[%d][%d] cmp %c vs %c leftVal=%d upVal=%d  diagH %d, diagVal=%d bestScore=%d\n",
-					i, j, verticalSequence[i], horizontalSequence[i+j-1], leftVal, upVal, prevLineH[j], diagVal, currentLineH[j]));
-		}
-		currentLineH[bandPlus1]=0;
-		//tmpLine = prevLineH;
-		prevLineH = currentLineH;
-		//currentLineH = prevLineH;
-	}
+	bestGlobalScore = fillBandedSWMatrix(scoringMatrix, verticalSequence, horizontalSequence,
+			sizeVerticalSequence, band, 1, &bestScoreRow, &bestScoreCol);
 
 	if (bestGlobalScore<targetScore || bestGlobalScore==0) {
 		return bestGlobalScore;
@@ -1873,21 +2937,22 @@ int bandedSWAlignmentInfoBisulfiteSeq(int *scoringMatrix,
 	return bestGlobalScore;
 }
 
-/** Generate extended CIGAR information for a read mapping.*/
-int buildCigarString(char* cigar, guint32 numBlocks,
+/** Generate the extended CIGAR operations of a read mapping, packed as BAM stores them.
+@return number of operations*/
+int buildCigarOperations(guint32* cigar, guint32 numBlocks,
 		guint32 readStart, guint32 readStop,
 		guint32* blockSizesArray,
 		guint32* horizontalStartsArray,
 		guint32* verticalStartsArray,
 		guint32 readLength) {
 	guint32 blockIdx;
-	cigar[0]='\0';
+	int cigarLength = 0;
 	guint32 crtVBlockStop, crtHBlockStop, nextVBlockStart, nextHBlockStart, Vdist, Hdist;
 	if (readStart>1) {
-		sprintf(cigar+strlen(cigar), "%uS", readStart-1);
+		cigar[cigarLength++] = bamCigarOperation(readStart-1, BAM_CIGAR_SOFT_CLIP);
 	}
 	for (blockIdx=1; blockIdx<numBlocks; blockIdx++) {
-		sprintf(cigar+strlen(cigar), "%dM", blockSizesArray[blockIdx-1]);
+		cigar[cigarLength++] = bamCigarOperation(blockSizesArray[blockIdx-1], BAM_CIGAR_MATCH);
 		// call an insert or a deletion from the read
 		crtVBlockStop = verticalStartsArray[blockIdx-1]+blockSizesArray[blockIdx-1]-1;
 		nextVBlockStart = verticalStartsArray[blockIdx];
@@ -1900,31 +2965,42 @@ int buildCigarString(char* cigar, guint32 numBlocks,
 			exit(2);
 		}
 		if (Vdist>Hdist) {
-			sprintf(cigar+strlen(cigar), "%dI", Vdist);
+			cigar[cigarLength++] = bamCigarOperation(Vdist, BAM_CIGAR_INSERTION);
 		} else {
-			sprintf(cigar+strlen(cigar), "%dD", Hdist);
+			cigar[cigarLength++] = bamCigarOperation(Hdist, BAM_CIGAR_DELETION);
 		}
 	}
-	sprintf(cigar+strlen(cigar), "%uM", blockSizesArray[numBlocks-1]);
+	cigar[cigarLength++] = bamCigarOperation(blockSizesArray[numBlocks-1], BAM_CIGAR_MATCH);
 	if (readStop<readLength) {
-		sprintf(cigar+strlen(cigar), "%uS", readLength-readStop);
+		cigar[cigarLength++] = bamCigarOperation(readLength-readStop, BAM_CIGAR_SOFT_CLIP);
+	}
+	return cigarLength;
+}
+
+/** Format CIGAR operations as the CIGAR string of a SAM line.*/
+void formatCigarString(char* cigarString, const guint32* cigar, int cigarLength) {
+	int length = 0;
+	cigarString[0] = '\0';
+	for (int i=0; i<cigarLength; i++) {
+		length += sprintf(cigarString+length, "%u%c", cigar[i]>>4, BAM_CIGAR_OPERATIONS[cigar[i]&0xf]);
 	}
-	return 0;
 }
 
 static int const maxAlignmentBlocks = 1000;
-static guint32 blockSizesArray      [maxAlignmentBlocks*sizeof(guint32)];
-static guint32 horizontalStartsArray[maxAlignmentBlocks*sizeof(guint32)];
-static guint32 verticalStartsArray  [maxAlignmentBlocks*sizeof(guint32)];
-static char reversedQualityScore[MAX_READ_SIZE];
 
 int outputRegularPashLine(guint32 sequenceId, int swScore, SequenceInfo* sequenceInfo,
-		guint32 chromLength, char* currentSequence,
+		guint32 chromLength, char* currentSequence, guint32 currentChrom,
 		guint32 alignmentHorizontalStart,
 		AlignmentSummary* alignmentSummary,
-		char strand, char *outputLine, SAMInfo* samInfo, PashParameters* pp)
+		char strand, char *outputLine, SAMInfo* samInfo, PashParameters* pp,
+		int reverseStrandDnaMethMapping)
 {
-	outputLine[0]='\0';
+	// kept on the stack: lines are generated concurrently by the scanning threads
+	guint32 blockSizesArray      [maxAlignmentBlocks];
+	guint32 horizontalStartsArray[maxAlignmentBlocks];
+	guint32 verticalStartsArray  [maxAlignmentBlocks];
+	char reversedQualityScore[MAX_READ_SIZE+1];
+	char querySequenceBuffer[MAX_READ_SIZE+1];
 	char const * chromosomeName =  currentSequence;
 	char const * readName = sequenceInfo->sequenceName;
 	int readStart = 1+alignmentSummary->verticalStart;
@@ -1932,7 +3008,7 @@ int outputRegularPashLine(guint32 sequenceId, int swScore, SequenceInfo* sequenc
 	int numBlocks = alignmentSummary->numBlocks;
 	unsigned const readLength = sequenceInfo->sequenceLength;
 
-	if (pp->reverseStrandDnaMethMapping) { // special case for bisulfite-treated reads
+	if (reverseStrandDnaMethMapping) { // special case for bisulfite-treated reads
 		// correction of readStart & readStop for bisulfite treated reads
 		int newReadStart = readLength + 1 - readStop;
 		readStop = readLength - readStart + 1;
@@ -1956,9 +3032,9 @@ int outputRegularPashLine(guint32 sequenceId, int swScore, SequenceInfo* sequenc
 	char const * qualityScores = pp->verticalFastqUtil->retrieveQualityScores(sequenceId);
 
 	if (strand == '+') {
-		querySequence = pp->verticalFastqUtil->retrieveSequence(sequenceId);
+		querySequence = pp->verticalFastqUtil->retrieveSequence(sequenceId, querySequenceBuffer);
 	} else {
-		querySequence = pp->verticalFastqUtil->retrieveRevComplementSequence(sequenceId);
+		querySequence = pp->verticalFastqUtil->retrieveRevComplementSequence(sequenceId, querySequenceBuffer);
 		unsigned const length = strlen(qualityScores);
 		for (unsigned i = 0; i < length; ++i) {
 			reversedQualityScore[i] = qualityScores[length-1-i];
@@ -1971,42 +3047,48 @@ int outputRegularPashLine(guint32 sequenceId, int swScore, SequenceInfo* sequenc
 		chromosomeName += 9;
 	}
 
-	char cigar[MAX_LINE_LENGTH];
-	buildCigarString(cigar, numBlocks, readStart, readStop, blockSizesArray, horizontalStartsArray, verticalStartsArray, readLength);
+	guint32 cigar[2*maxAlignmentBlocks+2];
+	int cigarLength = buildCigarOperations(cigar, numBlocks, readStart, readStop, blockSizesArray, horizontalStartsArray, verticalStartsArray, readLength);
 
 	int indelsCorrection = 0;
-	for (char const * c = cigar; *c != '\0'; ++c) {
-		int v = 0;
-		for ( ; *c >= '0' && *c <= '9'; ++c ) {
-			v *= 10;
-			v += (*c - '0');
-		}
-		if (*c == 'I') indelsCorrection += v;
-		if (*c == 'D') indelsCorrection -= v;
-		if (*c == '\0') break;
+	for (int i = 0; i < cigarLength; ++i) {
+		if ((cigar[i]&0xf) == BAM_CIGAR_INSERTION) indelsCorrection += cigar[i]>>4;
+		if ((cigar[i]&0xf) == BAM_CIGAR_DELETION) indelsCorrection -= cigar[i]>>4;
 	}
 
 	if (swScore < 0) swScore = 0;
-	int const chromosomeStart = (pp->reverseStrandDnaMethMapping)
+	int const chromosomeStart = (reverseStrandDnaMethMapping)
 				? (chromLength-alignmentHorizontalStart-alignmentSummary->horizontalStart-(readStop-readStart)+indelsCorrection) // special case for bisulfite-treated reads
 				: (alignmentHorizontalStart+1+alignmentSummary->horizontalStart);
-	sprintf(outputLine+strlen(outputLine), "%u\t%d $%s\t%d\t%s\t%d\t99\t%s\t*\t0\t0\t%s\t%s\n", sequenceId, swScore,
-			readName, strand=='+'?0:16, chromosomeName, chromosomeStart, cigar, querySequence, qualityScores);
+	MappingRecord record;
+	record.sequenceId = sequenceId;
+	record.score = swScore;
+	char* output = outputLine+sizeof(MappingRecord);
+	if (pp->useBamOutput) {
+		record.outputSize = encodeBamRecord(output, readName, strand=='+'?0:BAM_FLAG_REVERSE,
+				pp->outputReferenceIds[currentChrom], chromosomeStart-1, 99, cigar, cigarLength, querySequence, qualityScores);
+	} else {
+		char cigarString[MAX_LINE_LENGTH];
+		formatCigarString(cigarString, cigar, cigarLength);
+		record.outputSize = sprintf(output, "%s\t%d\t%s\t%d\t99\t%s\t*\t0\t0\t%s\t%s\n",
+				readName, strand=='+'?0:BAM_FLAG_REVERSE, chromosomeName, chromosomeStart, cigarString, querySequence, qualityScores);
+	}
+	memcpy(outputLine, &record, sizeof(MappingRecord));
 
 	return 0;
 }
 
 
 int outputBisulfiteMappingLine(guint32 sequenceId, int swScore, SequenceInfo* sequenceInfo,
-		guint32 chromLength, char* currentSequence,
+		guint32 chromLength, char* currentSequence, guint32 currentChrom,
 		guint32 alignmentHorizontalStart,
 		AlignmentSummary* alignmentSummary,
 		char *outputLine, SAMInfo* samInfo,
-		PashParameters* pp) {
+		PashParameters* pp, int reverseStrandDnaMethMapping) {
 	return outputRegularPashLine(sequenceId, swScore, sequenceInfo,
-			chromLength, currentSequence,
+			chromLength, currentSequence, currentChrom,
 			alignmentHorizontalStart,
 			alignmentSummary,
-			(pp->reverseStrandDnaMethMapping) ? ('-') : ('+')
-					, outputLine, samInfo, pp);
+			(reverseStrandDnaMethMapping) ? ('-') : ('+')
+					, outputLine, samInfo, pp, reverseStrandDnaMethMapping);
 }
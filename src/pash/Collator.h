@@ -11,6 +11,8 @@ See the included file LICENSE for details.
 #include <glib.h>
 #include "HiveHash.h"
 #include "someConstants.h"
+#include "SequenceInfo.h"
+#include "MappingStore.h"
 
 /** Data structure enabling the traversal of a stream of matches for a vertical kmer.*/
 typedef struct {
@@ -27,6 +29,14 @@ typedef struct {
 	//	guint32 kmer;
 } MatchStream;
 
+/** Kmer of a reference window found in the hive hash, with the runner over its (read, offset) pairs.*/
+typedef struct {
+  guint32 kmer;
+  /** Offset of the kmer in the window.*/
+  guint32 horizontalOffset;
+  IntListRunner intListRunner;
+} WindowHit;
+
 /** Data structure holding the information for a matching pair of positions.
 */
 typedef struct {
@@ -48,34 +58,189 @@ typedef struct {
 } MatchPair;
 
 
+/** Blocks of a traced back alignment, with the counts of its matches, mismatches and gaps.*/
+typedef struct {
+	int horizontalStart;
+	int horizontalStop;
+	int verticalStart;
+	int verticalStop;
+	int numMatches;
+	int numMismatches;
+	int numVerticalGaps;
+	int numHorizontalGaps;
+	int numGapBases;
+	int numBlocks;
+	unsigned int blockSizes[MAX_NUMBER_BLOCKS];
+	unsigned int horizontalBlockStarts[MAX_NUMBER_BLOCKS];
+	unsigned int verticalBlockStarts[MAX_NUMBER_BLOCKS];
+} AlignmentSummary;
+
+/// Number of reference bases a window is seeded for at once, whatever the length of the reads.
+#define REFERENCE_WINDOW_SIZE 4096
+
+/** Reference window scanned against the hive hash: a chunk of the current chromosome
+ * together with the radius around it needed by the alignment step. The kmers of the chunk are
+ * looked up once, then the chunk is collated one diagonal band at a time: band b holds the reads
+ * starting within numberOfDiagonals bases of chunkStart+b*numberOfDiagonals, collated against the
+ * 2*numberOfDiagonals bases from there.*/
+typedef struct {
+  /** Number of the first band of the window in the scan, starting at 1; the bands follow it.*/
+  guint32 windowIndex;
+  /** Number of diagonal bands of the window.*/
+  guint32 numberOfBands;
+  /** Index of the chromosome in the horizontal sequences information.*/
+  guint32 chromIndex;
+  /** Chromosome defline, as reported in the output.*/
+  char chromName[MAX_DEFNAME_SIZE+1];
+  /** Flag whether the chromosome is the reverse complement strand of a bisulfite mapping.*/
+  int reverseStrandDnaMethMapping;
+  /** First position of the chunk in the chromosome.*/
+  guint32 chunkStart;
+  /** Last position of the chunk in the chromosome.*/
+  guint32 chunkStop;
+  /** Position in the chromosome of the first base of the target template.*/
+  long targetTemplateStart;
+  /** Chunk of (numberOfBands+1)*numberOfDiagonals bases plus a radius of numberOfDiagonals+DEFAULT_BAND
+   * on each side, and its terminating zero; positions outside the chromosome are padded with '@'.*/
+  char targetTemplate[REFERENCE_WINDOW_SIZE+3*MAX_READ_SIZE+2*DEFAULT_BAND+1];
+} ReferenceWindow;
+
+typedef enum {CollatedRead, PoorAnchoring, CandidateAlignment, BandCollated} CollationEventType;
+
+/** Outcome of a pruning decision that depends on the per-read best scores. When a window is
+ * collated by a worker thread, these decisions are replayed in reference order by the
+ * thread owning the output, so that the result does not depend on thread scheduling.*/
+typedef struct {
+  CollationEventType type;
+  /** Index of the read in the vertical sequence infos; number of the band for a collated band.*/
+  guint32 sequenceId;
+  /** Anchoring score for a collated read, skeleton score for a candidate alignment.*/
+  guint32 score;
+  /** Smith-Waterman score of a candidate alignment; -1 if the worker pruned the candidate.*/
+  int swScore;
+  /** First reference position covered by the anchoring run.*/
+  guint32 hitStart;
+  /** Last reference position covered by the anchoring run.*/
+  guint32 hitStop;
+  /** Offset of the output line in the result buffer; -1 if no line was generated.*/
+  long outputLineOffset;
+} CollationEvent;
+
+/** Deferred collation output for one reference window.*/
+typedef struct {
+  CollationEvent* events;
+  guint32 numberOfEvents;
+  guint32 eventsCapacity;
+  /** Output lines, in the temporary output format.*/
+  char* outputBuffer;
+  size_t outputBufferSize;
+  size_t outputBufferCapacity;
+  /** Number of kmer-level alignments performed.*/
+  unsigned long kmerAlignments;
+  /** Number of candidate alignments scored, traced back, and whose scoring stopped early.*/
+  unsigned long scoredAlignments;
+  unsigned long tracedBackAlignments;
+  unsigned long stoppedAlignments;
+  /** Number of candidate alignments found to be ungapped, and neither scored nor traced back.*/
+  unsigned long ungappedAlignments;
+} CollationResult;
+
+/// Number of queued candidate alignments, or of queued reads, triggering the scoring of the batch.
+#define ALIGNMENT_BATCH_SIZE 128
+
+/** Read collated in the window, whose candidate alignments wait in the alignment batch.*/
+typedef struct {
+  guint32 sequenceId;
+  guint32 currentVerticalSequenceId;
+  /** Anchoring score of the read in the window.*/
+  guint32 anchoringScore;
+  /** Best scores of the read when queued, that a worker filters the candidates against.*/
+  SequenceInfo readState;
+} QueuedRead;
+
+/** Candidate alignment of a queued read, on the band of its anchoring run.*/
+typedef struct {
+  /** Index of the read in the queued reads.*/
+  guint32 queuedRead;
+  /** Flag whether the anchoring run has too many mismatches to be aligned.*/
+  int poorAnchoring;
+  guint32 skeletonScore;
+  int anchoringMatches;
+  int anchoringMismatches;
+  long alignmentHorizontalStart;
+  int band;
+  guint32 hitStart;
+  guint32 hitStop;
+  /** Best score of the band, only known to be below the target score of the read if it is;
+   * -1 if the candidate failed the skeleton filter when queued, and is not scored.*/
+  int swScore;
+  /** Flag whether the alignment is known to be the ungapped alignment of the read on the middle of the band.*/
+  int ungapped;
+} QueuedCandidate;
+
 /** Data structure containing information necessary for the collation.*/
 typedef struct {
   /** Current stream of matches.*/
 	MatchStream* matchStreams;
 	MatchStream** matchStreamPtrs;
-  /** Maximum match streams capacity.*/
+  /** Match streams capacity; grown with the windows, and kept for the following ones.*/
 	guint32 maxMatchStreams;
   /** Number of valid match streams for current horizontal chunk.*/
 	guint32 validMatchStreams;
   /** Number of diagonal capacity.*/
   guint32 numberOfDiagonals ;
-  /** Match pairs.*/
+  /** Match pairs of the read being collated.*/
   MatchPair* matchPairs;
-  /** Overall match pairs capacity.*/
+  /** Overall match pairs capacity; the match runs have the same capacity, since every run starts at a match pair.*/
   guint32 matchPairsCapacity;
   /** Starting positions in the match pairs of match runs.*/
-  guint32 matchRunStarts[MAX_MATCH_STREAMS];
+  guint32* matchRunStarts;
 	/** Match run scores.*/
-  guint32 matchRunScores[MAX_MATCH_STREAMS];
-	char targetTemplate[3*MAX_READ_SIZE+2*DEFAULT_BAND];
+  guint32* matchRunScores;
+	/** Target template of the window being collated.*/
+	char* targetTemplate;
 	char readTemplate[MAX_READ_SIZE+1];
 	long targetTemplateStart;
+	int reverseStrandDnaMethMapping;
 	int *bswMemory;
+	/** If not NULL, the best-score dependent decisions are recorded here instead of being applied.*/
+	CollationResult* result;
+	/** Gather the matches of the window and sort them, instead of merging the match streams.*/
+	int sortMatches;
+	/** Gathered matches, as (verticalSeqID<<32)|okey; sortBuffer is the radix sort scratch.*/
+	guint64* sortedMatches;
+	guint64* sortBuffer;
+	guint32 numberOfSortedMatches;
+	guint32 sortedMatchesCapacity;
+	/** Next sorted match to collate.*/
+	guint32 nextSortedMatch;
+	/** When the reads are mapped in batches, one bit per kmer hashed by an earlier batch; NULL otherwise.*/
+	const guint32* earlierBatchKmers;
+	/** Kmers of the current window found in the hive hash, in window order.*/
+	WindowHit* windowHits;
+	guint32 numberOfWindowHits;
+	guint32 windowHitsCapacity;
+	/** The window following the last one collated overlaps it; if it is collated next, the hits from
+	 * firstSharedHit on are shifted back by sharedHitsShift bases and kept, and its kmers are looked
+	 * up from sharedHitsResumeOffset on. sharedHitsWindowIndex is 0 if there is no such window.*/
+	guint32 sharedHitsWindowIndex;
+	guint32 sharedHitsChunkStart;
+	guint32 sharedHitsShift;
+	guint32 sharedHitsResumeOffset;
+	guint32 firstSharedHit;
+	/** Reads and candidate alignments queued to be scored together; the template of queued read i
+	 * starts at queuedReadTemplates+i*(MAX_READ_SIZE+1).*/
+	QueuedRead* queuedReads;
+	guint32 numberOfQueuedReads;
+	char* queuedReadTemplates;
+	QueuedCandidate* queuedCandidates;
+	guint32 numberOfQueuedCandidates;
+	guint32 queuedCandidatesCapacity;
 
 } CollatorControl;
 
 /** Construct & initialize a CollatorControl data structure.*/
-CollatorControl* initCollatorControl();
+CollatorControl* initCollatorControl(int numberOfDiagonals, int sortMatches);
 /** Add a new match stream to the collator control if there is a matching vertical kmer.*/
 void addMatchStreamCollatorControl(CollatorControl *c, guint32 kmer, HiveHash* hh);
 /** Reset the collator control for a new collation.*/
@@ -83,7 +248,7 @@ void resetCollatorControl(CollatorControl *c);
 /** Release collator control resources.*/
 void freeCollatorControl(CollatorControl *c);
 /** Do the actual collation.*/
-void performCollation(FILE* outputFilePtr, CollatorControl* c, SequenceHash* sequenceHash, PashParameters *pp,
+void performCollation(MappingStore* mappingStore, CollatorControl* c, SequenceHash* sequenceHash, PashParameters *pp,
 											char* currentSequence, guint32 start, guint32 stop, guint32 currentChrom);
 /*
 #define STREAM_LESS_THAN(matchStream1,matchStream2)  			             \
@@ -174,11 +339,20 @@ int setMatchStreamAndInsertInQueue(MatchStream matchStream, MatchStream* matchSt
 																		guint32 kmer, guint32 horizontalOffset);
 /** Setup the match stream for a horizontal kmer, querying the hive hash.*/
 void addMatchStreamCollatorControl(CollatorControl *c, guint32 kmer, HiveHash* hh, guint32 horizontalOffset);
-/** Advance the top match stream and restore the priority queue.*/
-int advanceTopMatchStream(MatchStream* matchStreamPriorityQueue, int numStreams, int numDiagonals);
+/** Advance the top match stream and restore the priority queue.
+@return 1 if the stream is exhausted and left the queue, 0 otherwise*/
+int advanceTopMatchStream(MatchStream** matchStreamPriorityQueue, int numStreams, int numDiagonals);
 
 int deleteHeapMin(MatchStream* matchStreams, int numStreams);
+/** Align a read in a band of the reference and trace the alignment back if its score reaches a target.
+@param scoringMatrix (sizeVerticalSequence+1)*(band+2) scores, followed by 8 more
+@return best score of the band*/
+int bandedSWAlignmentInfo(int *scoringMatrix,
+		char* verticalSequence, char *horizontalSequence,
+		int sizeVerticalSequence, int band,
+		float targetScore, AlignmentSummary* alignmentSummary);
 void filterOutput(char* tmpOutputFileName, FILE *outputFilePtr,
-                  SequenceInfo* verticalSequenceInfos, guint32 maxReadMappings, double withinTopPercent) ;
+                  SequenceInfo* verticalSequenceInfos, guint32 maxReadMappings, double withinTopPercent,
+                  int keepWindowMarks);
 
 #endif
@@ -8,7 +8,8 @@ See the included file LICENSE for details.
 #include <string.h>
 
 #include "FastQUtil.h"
-#include "BRLGenericUtils.h"
+#include "InputReader.h"
+#include "Metrics.h"
 #include "generic_debug.h"
 
 #define DEB_LOAD_SEQUENCES 0
@@ -33,6 +34,15 @@ PashFastqUtil::PashFastqUtil(char* fileName, ReadsSequenceType sequenceType) {
   sequenceNames[0]=NULL;
   sequencePool = new SequencePool();
   readsSequenceType = sequenceType;
+  packedSequences = 0;
+  packedBases = NULL;
+  packedWordsUsed = 0;
+  packedWordsCapacity = 0;
+  packedOffsets = NULL;
+  sequenceLengths = NULL;
+  fastqPtr = NULL;
+  buffer = NULL;
+  moreSequences = 1;
   xDEBUG(DEB_INIT, fprintf(stderr, "init finished\n"));
 }
 
@@ -42,43 +52,176 @@ PashFastqUtil::~PashFastqUtil() {
   free(reverseSequences);
   free(qualities);
   free(sequenceNames);
+  free(packedBases);
+  free(packedOffsets);
+  free(sequenceLengths);
+  if (fastqPtr!=NULL) {
+    closeInputReader(fastqPtr);
+  }
+  free(buffer);
 }
 
-int PashFastqUtil::loadSequences(int loadReverseComplement) {
-  FILE* fastqPtr = BRLGenericUtils::openTextGzipBzipFile(fastqFile);
-  if (fastqPtr==NULL) {
-    fprintf(stderr, "could not open fastq file %s\n", fastqFile);
+/** Append a read to the packed bases: 16 bases per word, then one N flag per base, 32 per word,
+    if the read has N bases. Its offset and length are stored at the current sequence index.*/
+void PashFastqUtil::packSequence(const char* sequence, guint32 sequenceLength) {
+  guint32 baseWords = (sequenceLength+15)/16;
+  guint32 maskWords = (sequenceLength+31)/32;
+  guint32 i, code;
+  int hasN = 0;
+  if ((guint64)packedWordsUsed+baseWords+maskWords > G_MAXUINT32) {
+    fprintf(stderr, "too many bases to pack the reads of %s\n", fastqFile);
     exit(2);
   }
+  if (packedWordsUsed+baseWords+maskWords > packedWordsCapacity) {
+    guint64 newCapacity = 2*(guint64)packedWordsCapacity+baseWords+maskWords+1024;
+    if (newCapacity > G_MAXUINT32) {
+      newCapacity = G_MAXUINT32;
+    }
+    packedWordsCapacity = newCapacity;
+    packedBases = (guint32*) realloc(packedBases, sizeof(guint32)*(size_t)packedWordsCapacity);
+    if (packedBases==NULL) {
+      fprintf(stderr, "Insufficient memory, exiting ...\n");
+      exit(2);
+    }
+  }
+  guint32* bases = packedBases+packedWordsUsed;
+  guint32* nMask = bases+baseWords;
+  for (i=0; i<baseWords+maskWords; i++) {
+    bases[i] = 0;
+  }
+  for (i=0; i<sequenceLength; i++) {
+    switch(sequence[i]) {
+      case 'A': code = 0; break;
+      case 'C': code = 1; break;
+      case 'G': code = 2; break;
+      case 'T': code = 3; break;
+      default:
+        code = 0;
+        nMask[i/32] |= 1u<<(i%32);
+        hasN = 1;
+        break;
+    }
+    bases[i/16] |= code<<(2*(i%16));
+  }
+  packedOffsets[numberOfSequences] = packedWordsUsed;
+  sequenceLengths[numberOfSequences] = sequenceLength | (hasN ? PACKED_READ_HAS_N : 0);
+  packedWordsUsed += baseWords + (hasN ? maskWords : 0);
+}
+
+/** Add a read to the store.
+    @param defLine fastq definition line, starting with @
+    @param fwdSequence read bases; converted to uppercase in place
+    @param qualityScores read quality scores
+*/
+void PashFastqUtil::storeSequence(char* defLine, char* fwdSequence, char* qualityScores) {
+  numberOfSequences++;
+  if (availableEntries == numberOfSequences) {
+    availableEntries = 5*availableEntries/4+1;
+    sequenceNames = (char**) realloc(sequenceNames, sizeof(char*)*availableEntries);
+    if (packedSequences) {
+      packedOffsets = (guint32*) realloc(packedOffsets, sizeof(guint32)*availableEntries);
+      sequenceLengths = (guint16*) realloc(sequenceLengths, sizeof(guint16)*availableEntries);
+    } else {
+      forwardSequences= (char**) realloc(forwardSequences, sizeof(char*)*availableEntries);
+      // also grown without reverse complements, which a later batch may keep
+      reverseSequences = (char**) realloc(reverseSequences, sizeof(char*)*availableEntries);
+    }
+    if (readsSequenceType==FastaAndQualityScores) {
+      qualities = (char**) realloc(qualities, sizeof(char*)*availableEntries);
+    }
+    if (qualities==NULL || sequenceNames==NULL || forwardSequences==NULL || reverseSequences==NULL ||
+        (packedSequences && (packedOffsets==NULL || sequenceLengths==NULL))) {
+      fprintf(stderr, "Insufficient memory, exiting ...\n");
+      exit(2);
+    }       
+  }
+  char fixedName[MAX_LINE_LENGTH]; 
+  sscanf(defLine+1, " %s ", fixedName );
+  sequenceNames[numberOfSequences] = sequencePool->addSequence(fixedName);
+  // convert sequence to uppercase
+  guint32 fwdSequenceIndex = 0;
+  guint32 sequenceLength =   strlen(fwdSequence);
+  
+  for (fwdSequenceIndex=0; fwdSequenceIndex<sequenceLength; fwdSequenceIndex++) {
+    if (fwdSequence[fwdSequenceIndex]>='a') {
+      fwdSequence[fwdSequenceIndex] = fwdSequence[fwdSequenceIndex] - ('a'-'A');
+    }
+  }
+  if (packedSequences) {
+    packSequence(fwdSequence, sequenceLength);
+    xDEBUG(DEB_LOAD_SEQUENCES, fprintf(stderr,"packed seq %s\n", fwdSequence));
+  } else {
+    forwardSequences[numberOfSequences] = sequencePool->addSequence(fwdSequence);
+    xDEBUG(DEB_LOAD_SEQUENCES, fprintf(stderr,"added fwd seq %s\n", fwdSequence));
+  }
+
+  if (reverseSequencesAvailable && !packedSequences) {
+    char reverseComplementSequence [MAX_LINE_LENGTH];
+    int revComplementIndex;
+    for (revComplementIndex=0; revComplementIndex<sequenceLength; revComplementIndex++) {
+      reverseComplementSequence[revComplementIndex]= baseComplement(fwdSequence[sequenceLength-1-revComplementIndex]);
+    }
+    reverseComplementSequence[sequenceLength]='\0';
+    reverseSequences[numberOfSequences] = sequencePool->addSequence(reverseComplementSequence);
+    xDEBUG(DEB_LOAD_SEQUENCES, fprintf(stderr,"added rev seq %s\n", reverseComplementSequence));
+  }
+  
+  if (readsSequenceType==FastaAndQualityScores) {
+    qualities[numberOfSequences] = sequencePool->addSequence(qualityScores);
+  }
+}
+
+/** Load the reads of the fastq file. With a batch size, only the next batch of reads is loaded:
+    the reads of the previous batch are released, the new ones are numbered from 1, and the file
+    stays open for the next batch until it is exhausted.
+    @param loadReverseComplement keep the reverse complement of the reads
+    @param packSequences keep the reads 2-bit packed
+    @param maxSequences maximum number of reads to load, 0 for all the reads
+    @return number of reads loaded
+*/
+int PashFastqUtil::loadSequences(int loadReverseComplement, int packSequences, guint32 maxSequences) {
+  double loadStartTime = metricTime();
+  if (fastqPtr==NULL) {
+    fastqPtr = openInputReader(fastqFile);
+    if (fastqPtr==NULL) {
+      fprintf(stderr, "could not open fastq file %s\n", fastqFile);
+      exit(2);
+    }
+    buffer = (char*) malloc(sizeof(char)*(DEFAULT_BUFFER_SIZE+5*MAX_LINE_LENGTH));
+    if (buffer==NULL) {
+      fprintf(stderr, "Insufficient memory, exiting ...\n");
+      exit(2);
+    }
+    actualBufferSize = 0;
+    sequenceBufferIndexStart = 0;
+    endOfFile = 0;
+  }
+  if (numberOfSequences>0) {
+    // release the previous batch
+    delete sequencePool;
+    sequencePool = new SequencePool();
+    numberOfSequences = 0;
+    packedWordsUsed = 0;
+  }
   reverseSequencesAvailable = loadReverseComplement;
-  char *buffer = (char*) malloc(sizeof(char)*(DEFAULT_BUFFER_SIZE+5*MAX_LINE_LENGTH));;
+  packedSequences = packSequences;
+  if (packedSequences && packedOffsets==NULL) {
+    packedOffsets = (guint32*) malloc(sizeof(guint32)*availableEntries);
+    sequenceLengths = (guint16*) malloc(sizeof(guint16)*availableEntries);
+    if (packedOffsets==NULL || sequenceLengths==NULL) {
+      fprintf(stderr, "Insufficient memory, exiting ...\n");
+      exit(2);
+    }
+  }
   guint32 bufferReadPos = 0; 
   guint32 numCharsRead = 0;
   guint32 targetChars;
-  int endOfFile;
   guint32 bufferIndex;
   guint32 newLineIdx1, newLineIdx2, newLineIdx3, newLineIdx4;
-  guint32 actualBufferSize;
-  guint32 currentSequenceId = 0;
-  guint32 sequenceBufferIndexStart;
   
-  for (endOfFile =0; !endOfFile; ) {
-    targetChars = DEFAULT_BUFFER_SIZE;
-    numCharsRead = fread(buffer+bufferReadPos, sizeof(char), targetChars, fastqPtr);
-    actualBufferSize = bufferReadPos+numCharsRead;
-    xDEBUG(DEB_LOAD_SEQUENCES,
-           fprintf(stderr, "bufferReadPos=%d targetChars=%d actualBufferSize=%d\n",
-                   bufferReadPos, targetChars, actualBufferSize));
-    if (numCharsRead<targetChars) {
-      endOfFile = 1;
-      if (buffer[actualBufferSize-1]!='\n') {
-        buffer[actualBufferSize]='\n';
-        actualBufferSize+=1;
-      }
-    }
-    sequenceBufferIndexStart = 0;
+  for (;;) {
     int done;
-    for(done=0; !done; ) {
+    for(done=0; !done && (maxSequences==0 || numberOfSequences<maxSequences); ) {
       // search exactly 4 new lines
       xDEBUG(DEB_LOAD_SEQUENCES,
            fprintf(stderr, "sequenceBufferIndexStart=%d \n",
@@ -123,110 +266,172 @@ int PashFastqUtil::loadSequences(int loadReverseComplement) {
       } else {
         newLineIdx4 = bufferIndex;
       }
-      currentSequenceId += 1;
       buffer[newLineIdx1]='\0';
       buffer[newLineIdx2]='\0';
       buffer[newLineIdx3]='\0';
       buffer[newLineIdx4]='\0';
-      xDEBUG(DEB_LOAD_SEQUENCES, fprintf(stderr, "[%d] 4 lines:\n%s\n%s\n%s\n%s\n", currentSequenceId,
+      xDEBUG(DEB_LOAD_SEQUENCES, fprintf(stderr, "[%d] 4 lines:\n%s\n%s\n%s\n%s\n", numberOfSequences+1,
                                          &buffer[sequenceBufferIndexStart],
                                          &buffer[newLineIdx1+1],
                                          &buffer[newLineIdx2+1],
                                          &buffer[newLineIdx3+1]));
       // add sequence and quality to appropriate repository
       if (strlen(&buffer[newLineIdx1+1]) <= MAX_READ_SIZE) {
-        numberOfSequences++;
-        if (availableEntries == numberOfSequences) {
-          availableEntries = 5*availableEntries/4+1;
-          sequenceNames = (char**) realloc(sequenceNames, sizeof(char*)*availableEntries);
-          forwardSequences= (char**) realloc(forwardSequences, sizeof(char*)*availableEntries);
-          if (loadReverseComplement) {
-            reverseSequences = (char**) realloc(reverseSequences, sizeof(char*)*availableEntries);
-          }
-          if (readsSequenceType==FastaAndQualityScores) {
-            qualities = (char**) realloc(qualities, sizeof(char*)*availableEntries);
-          }
-          if (qualities==NULL || sequenceNames==NULL || forwardSequences==NULL || reverseSequences==NULL) {
-            fprintf(stderr, "Insufficient memory, exiting ...\n");
-            exit(2);
-          }       
-        }
-        char fixedName[MAX_LINE_LENGTH]; 
-        sscanf(&buffer[sequenceBufferIndexStart+1], " %s ", fixedName );
-        sequenceNames[numberOfSequences] = sequencePool->addSequence(fixedName);
-        // convert sequence to uppercase
-        guint32 fwdSequenceIndex = 0;
-        char *fwdSequence = &buffer[newLineIdx1+1];
-        guint32 sequenceLength =   strlen(fwdSequence);
-        
-        for (fwdSequenceIndex=0; fwdSequenceIndex<sequenceLength; fwdSequenceIndex++) {
-          if (fwdSequence[fwdSequenceIndex]>='a') {
-            fwdSequence[fwdSequenceIndex] = fwdSequence[fwdSequenceIndex] - ('a'-'A');
-          }
-        }
-        forwardSequences[numberOfSequences] = sequencePool->addSequence(fwdSequence);
-        xDEBUG(DEB_LOAD_SEQUENCES, fprintf(stderr,"added fwd seq %s\n", fwdSequence));
-  
-        if (loadReverseComplement) {
-          char reverseComplementSequence [MAX_LINE_LENGTH];
-          int revComplementIndex;
-          for (revComplementIndex=0; revComplementIndex<sequenceLength; revComplementIndex++) {
-            reverseComplementSequence[revComplementIndex]= baseComplement(fwdSequence[sequenceLength-1-revComplementIndex]);
-          }
-          reverseComplementSequence[sequenceLength]='\0';
-          reverseSequences[numberOfSequences] = sequencePool->addSequence(reverseComplementSequence);
-          xDEBUG(DEB_LOAD_SEQUENCES, fprintf(stderr,"added rev seq %s\n", reverseComplementSequence));
-        }
-        
-        if (readsSequenceType==FastaAndQualityScores) {
-          qualities[numberOfSequences] = sequencePool->addSequence(&buffer[newLineIdx3+1]);
-        }
-      
+        storeSequence(&buffer[sequenceBufferIndexStart], &buffer[newLineIdx1+1], &buffer[newLineIdx3+1]);
       }
       
       sequenceBufferIndexStart=newLineIdx4+1;
     }
+    if (!done) {
+      // the batch is full
+      break;
+    }
     xDEBUG(DEB_LOAD_SEQUENCES,
            fprintf(stderr, ">> bufferIndex=%d, sequenceBufferIndexStart=%d \n",
                    bufferIndex, sequenceBufferIndexStart));
-    if (bufferIndex == actualBufferSize && sequenceBufferIndexStart<actualBufferSize) {
-      if (endOfFile) {
+    if (endOfFile) {
+      if (sequenceBufferIndexStart<actualBufferSize) {
         // should not get here
         fprintf(stderr, "incorrect input; could not find 4x number of sequences lines\n");
-      } else {
-        guint32 copyIdx;
-        bufferReadPos = actualBufferSize-sequenceBufferIndexStart;
-        for (copyIdx=0; copyIdx<bufferReadPos; copyIdx++) {
-          buffer[copyIdx] = buffer[sequenceBufferIndexStart+copyIdx];
-        }
       }
-      // roll over leftover buffer
-    } else {
-      bufferReadPos=0;
+      free(buffer);
+      buffer = NULL;
+      closeInputReader(fastqPtr);
+      fastqPtr = NULL;
+      moreSequences = 0;
+      break;
+    }
+    // roll over leftover buffer
+    guint32 copyIdx;
+    bufferReadPos = actualBufferSize-sequenceBufferIndexStart;
+    for (copyIdx=0; copyIdx<bufferReadPos; copyIdx++) {
+      buffer[copyIdx] = buffer[sequenceBufferIndexStart+copyIdx];
+    }
+    sequenceBufferIndexStart = 0;
+
+    targetChars = DEFAULT_BUFFER_SIZE;
+    numCharsRead = readInput(fastqPtr, buffer+bufferReadPos, targetChars);
+    actualBufferSize = bufferReadPos+numCharsRead;
+    xDEBUG(DEB_LOAD_SEQUENCES,
+           fprintf(stderr, "bufferReadPos=%d targetChars=%d actualBufferSize=%d\n",
+                   bufferReadPos, targetChars, actualBufferSize));
+    if (numCharsRead<targetChars) {
+      endOfFile = 1;
+      if (actualBufferSize>0 && buffer[actualBufferSize-1]!='\n') {
+        buffer[actualBufferSize]='\n';
+        actualBufferSize+=1;
+      }
     }
   }
   
+  addMetricTime(MetricLoadReads, loadStartTime);
+  return numberOfSequences;
+}
+
+/** Whether the fastq file has reads left to load in later batches.*/
+int PashFastqUtil::hasMoreSequences() {
+  return moreSequences;
+}
+
+/** Start loading batches again from the beginning of the fastq file.*/
+void PashFastqUtil::rewindSequences() {
+  if (fastqPtr!=NULL) {
+    closeInputReader(fastqPtr);
+    fastqPtr = NULL;
+  }
   free(buffer);
-  fclose(fastqPtr);
-  return 0;
+  buffer = NULL;
+  moreSequences = 1;
 }
 
+/** Forward sequence of a read; NULL if the reads are packed, use the buffer version instead.*/
 const char* PashFastqUtil::retrieveSequence(guint32 sequenceId) {
-  if (sequenceId<=numberOfSequences) {
+  if (!packedSequences && sequenceId<=numberOfSequences) {
     return forwardSequences[sequenceId];
   } else {
     return NULL;
   }
 }
 
+/** Reverse complement of a read; NULL if the reads are packed, use the buffer version instead.*/
 const char* PashFastqUtil::retrieveRevComplementSequence(guint32 sequenceId) {
-  if (reverseSequencesAvailable && sequenceId<=numberOfSequences) {
+  if (!packedSequences && reverseSequencesAvailable && sequenceId<=numberOfSequences) {
     return reverseSequences[sequenceId];
   } else {
     return NULL;
   }
 }
 
+/** Forward sequence of a read.
+    @param sequenceId read id
+    @param buffer buffer of at least MAX_READ_SIZE+1 characters, used if the reads are packed
+    @return the sequence, in the buffer or in the reads store
+*/
+const char* PashFastqUtil::retrieveSequence(guint32 sequenceId, char* buffer) {
+  if (!packedSequences) {
+    return retrieveSequence(sequenceId);
+  }
+  if (sequenceId>numberOfSequences) {
+    return NULL;
+  }
+  guint32 sequenceLength = PACKED_READ_LENGTH(sequenceLengths[sequenceId]);
+  const guint32* bases = packedBases+packedOffsets[sequenceId];
+  guint32 i;
+  for (i=0; i<sequenceLength; i++) {
+    buffer[i] = "ACGT"[(bases[i/16]>>(2*(i%16)))&3];
+  }
+  if (sequenceLengths[sequenceId]&PACKED_READ_HAS_N) {
+    const guint32* nMask = bases+(sequenceLength+15)/16;
+    for (i=0; i<sequenceLength; i++) {
+      if ((nMask[i/32]>>(i%32))&1) {
+        buffer[i] = 'N';
+      }
+    }
+  }
+  buffer[sequenceLength] = '\0';
+  return buffer;
+}
+
+/** Reverse complement of a read.
+    @param sequenceId read id
+    @param buffer buffer of at least MAX_READ_SIZE+1 characters, used if the reads are packed
+    @return the reverse complement, in the buffer or in the reads store
+*/
+const char* PashFastqUtil::retrieveRevComplementSequence(guint32 sequenceId, char* buffer) {
+  if (!packedSequences) {
+    return retrieveRevComplementSequence(sequenceId);
+  }
+  if (!reverseSequencesAvailable || sequenceId>numberOfSequences) {
+    return NULL;
+  }
+  guint32 sequenceLength = PACKED_READ_LENGTH(sequenceLengths[sequenceId]);
+  const guint32* bases = packedBases+packedOffsets[sequenceId];
+  guint32 i, j;
+  for (i=0, j=sequenceLength-1; i<sequenceLength; i++, j--) {
+    buffer[i] = "TGCA"[(bases[j/16]>>(2*(j%16)))&3];
+  }
+  if (sequenceLengths[sequenceId]&PACKED_READ_HAS_N) {
+    const guint32* nMask = bases+(sequenceLength+15)/16;
+    for (i=0, j=sequenceLength-1; i<sequenceLength; i++, j--) {
+      if ((nMask[j/32]>>(j%32))&1) {
+        buffer[i] = 'N';
+      }
+    }
+  }
+  buffer[sequenceLength] = '\0';
+  return buffer;
+}
+
+guint32 PashFastqUtil::retrieveSequenceLength(guint32 sequenceId) {
+  if (sequenceId>numberOfSequences) {
+    return 0;
+  }
+  if (packedSequences) {
+    return PACKED_READ_LENGTH(sequenceLengths[sequenceId]);
+  }
+  return strlen(forwardSequences[sequenceId]);
+}
+
 const char* PashFastqUtil::retrieveQualityScores(guint32 sequenceId) {
   if (readsSequenceType==FastaAndQualityScores && sequenceId<=numberOfSequences) {
     return qualities[sequenceId];
@@ -8,12 +8,23 @@ See the included file LICENSE for details.
 #define _PASH_FASTQ_UTIL___H__
 
 #include <glib.h>
+#include <stdio.h>
 #include "someConstants.h"
 #include "SequencePool.h"
+#include "InputReader.h"
 
 typedef enum {FastaOnly, FastaAndQualityScores} ReadsSequenceType;
 
 
+/** Packed reads: bit 15 of the stored length flags a read with N bases.*/
+#define PACKED_READ_HAS_N 0x8000
+#define PACKED_READ_LENGTH(l) ((l)&0x7fff)
+
+/** Reads loaded from a fastq file. The sequences are either kept as strings, forward and reverse
+ * complement, or packed: 2 bits per base in 32-bit words, each read starting on a word boundary at a
+ * 32-bit word offset, followed for reads with N bases by a bitmap of their N positions. Packed reads
+ * are decoded on demand into caller buffers; bases other than ACGT decode as N. The reads can be loaded
+ * all at once, or in batches that replace each other.*/
 class PashFastqUtil {
   char fastqFile[MAX_FILE_NAME];
   guint32 numberOfSequences;
@@ -25,18 +36,38 @@ class PashFastqUtil {
   SequencePool* sequencePool;
   ReadsSequenceType readsSequenceType;
   int reverseSequencesAvailable;
+  int packedSequences;
+  guint32* packedBases;
+  guint32 packedWordsUsed;
+  guint32 packedWordsCapacity;
+  guint32* packedOffsets;
+  guint16* sequenceLengths;
+  /** Loading state kept between read batches.*/
+  InputReader* fastqPtr;
+  char* buffer;
+  guint32 actualBufferSize;
+  guint32 sequenceBufferIndexStart;
+  int endOfFile;
+  int moreSequences;
   
   public:
     PashFastqUtil(char* fileName, ReadsSequenceType sequenceType);
     ~PashFastqUtil();
-    int loadSequences(int loadReverseComplement);
+    int loadSequences(int loadReverseComplement, int packSequences=0, guint32 maxSequences=0);
+    int hasMoreSequences();
+    void rewindSequences();
     const char* retrieveSequence(guint32 sequenceId);
     const char* retrieveRevComplementSequence(guint32 sequenceId);
+    const char* retrieveSequence(guint32 sequenceId, char* buffer);
+    const char* retrieveRevComplementSequence(guint32 sequenceId, char* buffer);
+    guint32 retrieveSequenceLength(guint32 sequenceId);
     const char* retrieveQualityScores(guint32 sequenceId);
     const char* retrieveDefName(guint32 sequenceId);
     guint32 getNumberOfSequences();
   private:
     char baseComplement(char b);      
+    void packSequence(const char* sequence, guint32 sequenceLength);
+    void storeSequence(char* defLine, char* fwdSequence, char* qualityScores);
 };
 
 
@@ -9,7 +9,7 @@ See the included file LICENSE for details.
 #include <glib.h>
 #include <stdlib.h>
 #include "FastaUtil.h"
-#include "BRLGenericUtils.h"
+#include "InputReader.h"
 
 /** Check a flag and execute a block of code.*/
 #define xDEBUG(flag, code) if (flag) {code; fflush(stdout); fflush(stderr);}
@@ -56,7 +56,7 @@ int parseFastaFileFirstPassFastaUtil(FastaUtil* fastaUtil) {
 	xDEBUG(DEB_FIRST_PASS,
 			fprintf(stderr, "performing first pass for file >>%s<<\n",
 					fastaUtil->fileArray[fastaUtil->numFiles-1]));
-	fastaUtil->currentFile =  BRLGenericUtils::openTextGzipBzipFile(fastaUtil->fileArray[fastaUtil->numFiles-1]);
+	fastaUtil->currentFile =  openInputReader(fastaUtil->fileArray[fastaUtil->numFiles-1]);
 
 	perror("opening fasta file");
 	xDieIfNULL(fastaUtil->currentFile,
@@ -64,8 +64,7 @@ int parseFastaFileFirstPassFastaUtil(FastaUtil* fastaUtil) {
 					fastaUtil->fileArray[fastaUtil->numFiles-1]));
 	parsingDone = 0;
 	bufferRead = RAW_BUFFER_SIZE;
-	readChars = fread(rawBuffer, sizeof(char),
-			bufferRead, fastaUtil->currentFile);
+	readChars = readInput(fastaUtil->currentFile, rawBuffer, bufferRead);
 	xDEBUG(DEB_RAW_READ, fprintf(stderr, "read %d chars , requested %d\n", readChars, bufferRead));
 	positionInRawBuffer = 0;
 	status = DetermineLineType;
@@ -86,7 +85,7 @@ int parseFastaFileFirstPassFastaUtil(FastaUtil* fastaUtil) {
 			xDEBUG(DEB_FIRST_PASS, fprintf(stderr, "DetermineLineType at %d\n", currentLine));
 			while(!parsingDone) {
 				if (positionInRawBuffer == readChars) { // buffer full, read again
-					readChars = fread(rawBuffer, sizeof(char), bufferRead, fastaUtil->currentFile);
+					readChars = readInput(fastaUtil->currentFile, rawBuffer, bufferRead);
 					xDEBUG(DEB_FIRST_PASS,
 							fprintf(stderr, "refresh raw buffer, read %d out of %d requested\n", readChars, bufferRead));
 					positionInRawBuffer = 0;
@@ -154,7 +153,7 @@ int parseFastaFileFirstPassFastaUtil(FastaUtil* fastaUtil) {
 				haveSequence =1;
 				while(!parsingDone) {
 					if (positionInRawBuffer == readChars) {  // buffer full, read again
-						readChars = fread(rawBuffer, sizeof(char),  bufferRead, fastaUtil->currentFile);
+						readChars = readInput(fastaUtil->currentFile, rawBuffer, bufferRead);
 						xDEBUG(DEB_FIRST_PASS,
 								fprintf(stderr, "refresh raw buffer, read %d out of %d requested\n", readChars, bufferRead));
 						positionInRawBuffer = 0;
@@ -195,7 +194,7 @@ int parseFastaFileFirstPassFastaUtil(FastaUtil* fastaUtil) {
 				// no blanks on sequence lines
 				while(!parsingDone) {
 					if (positionInRawBuffer == readChars) {  // buffer full, read again
-						readChars = fread(rawBuffer, sizeof(char),  bufferRead, fastaUtil->currentFile);
+						readChars = readInput(fastaUtil->currentFile, rawBuffer, bufferRead);
 						xDEBUG(DEB_FIRST_PASS,
 								fprintf(stderr, "refresh raw buffer, read %d out of %d requested\n", readChars, bufferRead));
 						positionInRawBuffer = 0;
@@ -224,7 +223,7 @@ int parseFastaFileFirstPassFastaUtil(FastaUtil* fastaUtil) {
 				xDEBUG(DEB_FIRST_PASS, fprintf(stderr, "Comment at %d\n", currentLine));
 				while(!parsingDone) {
 					if (positionInRawBuffer == readChars) {  // buffer full, read again
-						readChars = fread(rawBuffer, sizeof(char),  bufferRead, fastaUtil->currentFile);
+						readChars = readInput(fastaUtil->currentFile, rawBuffer, bufferRead);
 						xDEBUG(DEB_FIRST_PASS,
 								fprintf(stderr, "refresh raw buffer, read %d out of %d requested\n", readChars, bufferRead));
 						positionInRawBuffer = 0;
@@ -272,14 +271,14 @@ int parseFastaFileFirstPassFastaUtil(FastaUtil* fastaUtil) {
 	fastaUtil->numberOfSequences = numberOfSequences;
 	fastaUtil->currentSequenceIndex = numberOfSequences-1;
 	fastaUtil->currentLine = currentLine;
-	fclose(fastaUtil->currentFile);
+	closeInputReader(fastaUtil->currentFile);
 	return 0;
 }
 
 int addFileFastaUtil(char *fileName, FastaUtil* fastaUtil) {
 	int numFiles;
 	numFiles = fastaUtil->numFiles +1;
-	fastaUtil->fileArray = (char**)realloc(fastaUtil->fileArray, numFiles*sizeof(char));
+	fastaUtil->fileArray = (char**)realloc(fastaUtil->fileArray, numFiles*sizeof(char*));
 	xDEBUG(DEB_FIRST_PASS, fprintf(stderr, "adding FASTA file %s\n", fileName));
 	if (fastaUtil->fileArray==NULL) {
 		fprintf(stderr, "couldn't realloc fileArray for file %s\n", fileName);
@@ -298,7 +297,7 @@ int addFileFastaUtil(char *fileName, FastaUtil* fastaUtil) {
  */
 FastaUtil* initFastaUtil(char *fileName) {
 	FastaUtil* fastaUtil;
-	FILE *fofFile;
+	InputReader *fofFile;
 	char currentLine[MAX_FILE_NAME+2];
 	char currentFastaFile[MAX_FILE_NAME+1];
 	fastaUtil = (FastaUtil*) malloc(sizeof(FastaUtil));
@@ -322,8 +321,8 @@ FastaUtil* initFastaUtil(char *fileName) {
 	} else {
 		if (strstr(fileName+strlen(fileName)-4, ".fof")!=NULL) {
 			// have fof file
-			fofFile = BRLGenericUtils::openTextGzipBzipFile(fileName);
-			while(fgets(currentLine, MAX_FILE_NAME+2, fofFile)!=NULL) {
+			fofFile = openInputReader(fileName);
+			while(readInputLine(fofFile, currentLine, MAX_FILE_NAME+2)!=NULL) {
 				sscanf(currentLine, "%s", currentFastaFile);
 				if (strlen(currentFastaFile)>MAX_FILE_NAME) {
 					fprintf(stderr, "file name longer than %d at line %d in %s\n",
@@ -333,7 +332,7 @@ FastaUtil* initFastaUtil(char *fileName) {
 				xDEBUG(DEB_FIRST_PASS, fprintf(stderr, "adding current file: %s\n", currentLine));
 				addFileFastaUtil(currentFastaFile, fastaUtil);
 			}
-			fclose(fofFile);
+			closeInputReader(fofFile);
 		} else {
 			// have single file
 			xDEBUG(DEB_FIRST_PASS, fprintf(stderr, "adding a single file: %s\n", fileName));
@@ -345,9 +344,7 @@ FastaUtil* initFastaUtil(char *fileName) {
 
 
 void fillRawBuffer(FastaUtil* fastaUtil) {
-	fastaUtil->readChars = fread(fastaUtil->rawBuffer, sizeof(char),
-			fastaUtil->bufferRead,
-			fastaUtil->currentFile);
+	fastaUtil->readChars = readInput(fastaUtil->currentFile, fastaUtil->rawBuffer, fastaUtil->bufferRead);
 	xDEBUG(DEB_RAW_READ, fprintf(stderr, "read %d chars , requested %d\n",
 			fastaUtil->readChars, fastaUtil->bufferRead));
 	fastaUtil->positionInRawBuffer = 0;
@@ -359,13 +356,13 @@ void fillRawBuffer(FastaUtil* fastaUtil) {
 			// assertion would be more appropriate
 			if (fastaUtil->readChars ==0 && fastaUtil->isEof) {
 				// attempt to go to next file
-				fclose(fastaUtil->currentFile);
+				closeInputReader(fastaUtil->currentFile);
 				fastaUtil->currentFileIndex++;
 				if (fastaUtil->currentFileIndex == fastaUtil->numFiles) {
 					fastaUtil->parsingDone = 1;
 					fastaUtil->currentFileIndex--;
 				} else {
-					fastaUtil->currentFile = BRLGenericUtils::openTextGzipBzipFile(fastaUtil->fileArray[fastaUtil->currentFileIndex]);
+					fastaUtil->currentFile = openInputReader(fastaUtil->fileArray[fastaUtil->currentFileIndex]);
 					xDieIfNULL(fastaUtil->currentFile,
 							fprintf(stderr, "could not open file %s\n", fastaUtil->fileArray[fastaUtil->currentFileIndex]));
 					fastaUtil->positionInRawBuffer = 0;
@@ -391,7 +388,7 @@ int rewindFastaUtil(FastaUtil* fastaUtil) {
 	xDEBUG(DEB_NEXT_CHUNK, fprintf(stderr, "rewinding fasta util..."));
 	fastaUtil->currentFileIndex = 0;
 
-	fastaUtil->currentFile = BRLGenericUtils::openTextGzipBzipFile(fastaUtil->fileArray[fastaUtil->currentFileIndex]);
+	fastaUtil->currentFile = openInputReader(fastaUtil->fileArray[fastaUtil->currentFileIndex]);
 	xDieIfNULL(fastaUtil->currentFile,
 			fprintf(stderr, "could not open file %s\n", fastaUtil->fileArray[fastaUtil->currentFileIndex]));
 	fastaUtil->positionInRawBuffer= 0;
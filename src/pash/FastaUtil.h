@@ -9,6 +9,7 @@ See the included file LICENSE for details.
 
 #include "SequencePool.h"
 #include "SequenceInfo.h"
+#include "InputReader.h"
 
 #define RAW_BUFFER_SIZE 16000
 #define MAX_DEFNAME_SIZE 200
@@ -29,7 +30,7 @@ typedef struct {
     /// index of current FASTA file
     int currentFileIndex;
     /// file pointer for the current FASTA file
-    FILE* currentFile;
+    InputReader* currentFile;
     /// number of FASTA sequences
     guint32 numberOfSequences;
     /// number of allocated sequences
@@ -33,6 +33,10 @@ HiveHash::markEntry(guint32 key) {
   unsigned long currentBin;
   xDEBUG(DEB_MARK_ENTRY, fprintf(stderr, "B markEntry %d %x\n", key, key));
 
+  if (compactLayout) {
+    binOffsets[key] += 1;
+    return 0;
+  }
   currentBin = (unsigned long) hashSkeleton[key];
   hashSkeleton[key]= (guint32*)(currentBin+1); 
   xDEBUG(DEB_MARK_ENTRY, fprintf(stderr, "E markEntry %u %lu\n", key, (unsigned long)hashSkeleton[key]));
@@ -189,6 +193,16 @@ HiveHash::checkHashXX() {
   guint32* currentBin;
   int numberOfBinEntries, pos;
   guint32 key;
+  if (compactLayout) {
+    size_t entry;
+    for (entry=0; entry<2*(size_t)numberOfEntries; entry+=2) {
+      if (binEntries[entry]==0) {
+        fprintf(stderr, "hash with seq values 0\n");
+        exit(0);
+      }
+    }
+    return;
+  }
   for (key=0; key<hashSize; key++) {
     if (hashSkeleton[key] != NULL) {
       currentBin = hashSkeleton[key];
@@ -213,6 +227,21 @@ HiveHash::dumpHash(FILE *filePtr) {
   int numberOfBinEntries, pos;
   guint32 key;
   fprintf(filePtr, "dumping hiveHash %lx %p\n", reinterpret_cast<long unsigned>(this), this);
+  if (compactLayout) {
+    size_t entry;
+    for (key=0; key<(guint32)hashSize; key++) {
+      if (binOffsets[key+1]>binOffsets[key]) {
+        fprintf(filePtr, "key %d has data: %d (value,offset) pairs: [\n",
+                key, binOffsets[key+1]-binOffsets[key]);
+        for (entry=2*(size_t)binOffsets[key]; entry<2*(size_t)binOffsets[key+1]; entry+=2) {
+          fprintf(filePtr, "(%d, %d)\t", binEntries[entry], binEntries[entry+1]);
+        }
+        fprintf(filePtr,"]\n");
+      }
+    }
+    printStatistics(filePtr);
+    return;
+  }
   for (key=0; key<hashSize; key++) {
     if (hashSkeleton[key] != NULL) {
       currentBin = hashSkeleton[key];
@@ -234,6 +263,11 @@ HiveHash::dumpHash(FILE *filePtr) {
 *   */
 int
 HiveHash::getIntListRunner(guint32 key, IntListRunner* listRunner) {
+  if (compactLayout) {
+    listRunner->left = 2*(binOffsets[key+1]-binOffsets[key]);
+    listRunner->list = listRunner->left>0 ? binEntries+2*(size_t)binOffsets[key] : NULL;
+    return 0;
+  }
   guint32 * currentBin = hashSkeleton[key];
   guint32 pos;
   if (currentBin != NULL) {
@@ -256,21 +290,40 @@ HiveHash::getIntListRunner(guint32 key, IntListRunner* listRunner) {
 
 /** Initializes a HiveHash object
 *    @param size number of entries in the hive hash
+*    @param keepKmerPercent percent of the kmer occurrences kept, dropping the most frequent kmers
+*    @param compact use the compact layout
 */
-HiveHash::HiveHash(int size, guint32 keepKmerPercent) {
+HiveHash::HiveHash(int size, guint32 keepKmerPercent, int compact) {
   int key;
   hashSize = size;
   if (size < 0) {
     fprintf(stderr, "HiveHash size should be greater than 0!\nExiting ...\n");
     exit(1);
   }
-  hashSkeleton = (guint32**) malloc(hashSize*sizeof(guint32*));
-  if (hashSkeleton == NULL) {
-    fprintf(stderr, "could not allocate HiveHash skeleton\n");
-    exit(1);
-  }
-  for (key=0; key<size; key++) {
-    hashSkeleton[key]=(guint32*)0;
+  compactLayout = compact;
+  mappedImage = 0;
+  numberOfEntries = 0;
+  hashSkeleton = NULL;
+  binOffsets = NULL;
+  binEntries = NULL;
+  binFill = NULL;
+  poolList = NULL;
+  kmerCounts = NULL;
+  if (compactLayout) {
+    binOffsets = (guint32*) calloc(hashSize+1, sizeof(guint32));
+    if (binOffsets == NULL) {
+      fprintf(stderr, "could not allocate HiveHash offsets\n");
+      exit(1);
+    }
+  } else {
+    hashSkeleton = (guint32**) malloc(hashSize*sizeof(guint32*));
+    if (hashSkeleton == NULL) {
+      fprintf(stderr, "could not allocate HiveHash skeleton\n");
+      exit(1);
+    }
+    for (key=0; key<size; key++) {
+      hashSkeleton[key]=(guint32*)0;
+    }
   }
   memoryFootprint = 0.0;
   numberOfHashValues = 0;
@@ -278,9 +331,50 @@ HiveHash::HiveHash(int size, guint32 keepKmerPercent) {
   kmerPercent = (double)keepKmerPercent*1.0/100.0;
 }
 
+/** Initializes a HiveHash object in the compact layout from an image written by writeImage,
+*   typically mapped from a file; the image is used in place and must outlive the object.
+*    @param image hive hash image
+*    @param imageWords size of the image in 32-bit words
+*/
+HiveHash::HiveHash(guint32* image, size_t imageWords) {
+  if (imageWords<2) {
+    fprintf(stderr, "HiveHash image is truncated\n");
+    exit(1);
+  }
+  hashSize = image[0];
+  numberOfEntries = image[1];
+  if (imageWords != 2+(hashSize+1)+2*(size_t)numberOfEntries) {
+    fprintf(stderr, "HiveHash image of %lu words does not match %d keys and %u entries\n",
+            (unsigned long)imageWords, hashSize, numberOfEntries);
+    exit(1);
+  }
+  compactLayout = 1;
+  mappedImage = 1;
+  hashSkeleton = NULL;
+  binOffsets = image+2;
+  binEntries = binOffsets+hashSize+1;
+  binFill = NULL;
+  poolList = NULL;
+  kmerCounts = NULL;
+  memoryFootprint = 0.0;
+  numberOfHashValues = numberOfEntries;
+  numberOfKeys = 0;
+  kmerPercent = 1.0;
+}
+
 /** Destroys a HiveHash object.*/
 HiveHash::~HiveHash() {
+  GSList* pool;
+  for (pool=poolList; pool!=NULL; pool=pool->next) {
+    free(pool->data);
+  }
+  g_slist_free(poolList);
   free(hashSkeleton);
+  if (!mappedImage) {
+    free(binOffsets);
+    free(binEntries);
+  }
+  free(binFill);
 }
 
 /** Returns the size in bytes of the hive hash.
@@ -288,6 +382,9 @@ HiveHash::~HiveHash() {
 */
 double
 HiveHash::getMemoryFootprint() {
+  if (compactLayout) {
+    return ((hashSize+1.0)*sizeof(guint32)+2.0*numberOfEntries*sizeof(guint32))/(1024.0*1024.0);
+  }
   return (memoryFootprint*sizeof(guint32)+hashSize*sizeof(guint32*))/(1024.0*1024.0);
 }
 
@@ -307,14 +404,6 @@ int HiveHash::allocateHashMemory() {
   int key;
   xDEBUG(DEB_HASH_TRUALLOC, fprintf(stderr, "starting truAlloc\n"));
   
-  poolList = NULL;
-  individualPoolSize = 1*1024*1024;
-  //individualPoolSize = 10;
-  
-  currentPool = (guint32*)malloc( individualPoolSize* sizeof(guint32));
-  poolList = g_slist_append (poolList, (gpointer) currentPool);
-  guint32 currentPoolUsed = 0;
-  guint32 currentPoolLeft = individualPoolSize-currentPoolUsed;
   // get statistics about the has occupancy
   double maxKmers = 0;
   guint32 binSize;
@@ -331,7 +420,7 @@ int HiveHash::allocateHashMemory() {
   }
   guint32 r;
   for (key=0; key<hashSize; key++) {
-    binSize = (unsigned long)hashSkeleton[key];
+    binSize = kmerCounts!=NULL ? kmerCounts[key] : markedEntries(key);
     if (binSize>0) {
       if (maxKmers<binSize) {
         maxKmers = binSize;
@@ -385,11 +474,50 @@ int HiveHash::allocateHashMemory() {
   
   xDEBUG(1, fprintf(stderr, "%g nonempty bins sum %g mean %g max %g threshold %g\n", 
      nIndividualKmers, sumKmerOccurence, nIndividualKmers, maxKmers, threshold)); 
+  free(kmerFreqHist);
+  free(kmerOccurencesHist);
+
+  if (compactLayout) {
+    // turn the marks into the first entry of each bin, dropping the bins above threshold;
+    // the offsets are 32-bit, so the reads are hashed in batches past G_MAXUINT32 entries
+    guint64 firstEntry = 0;
+    for (key=0; key<hashSize; key++) {
+      binSize = binOffsets[key];
+      binOffsets[key] = (guint32)firstEntry;
+      if (binSize>0 && (kmerCounts!=NULL ? kmerCounts[key] : binSize)<=threshold) {
+        firstEntry += binSize;
+        if (firstEntry>G_MAXUINT32) {
+          fprintf(stderr, "too many kmer occurrences for the compact hive hash; "
+                  "map the reads in batches with --indexMemory or --batchReads\n");
+          exit(1);
+        }
+      }
+    }
+    binOffsets[hashSize] = (guint32)firstEntry;
+    numberOfEntries = (guint32)firstEntry;
+    binEntries = (guint32*) malloc((2*(size_t)numberOfEntries+1)*sizeof(guint32));
+    binFill = (guint32*) calloc(hashSize, sizeof(guint32));
+    if (binEntries==NULL || binFill==NULL) {
+      fprintf(stderr, "could not allocate HiveHash entries for %u kmer occurrences\n", numberOfEntries);
+      exit(1);
+    }
+    xDEBUG(DEB_HASH_TRUALLOC, fprintf(stderr, "compact layout: %u entries\n", numberOfEntries));
+    return 0;
+  }
+
+  poolList = NULL;
+  individualPoolSize = 1*1024*1024;
+  //individualPoolSize = 10;
+  
+  currentPool = (guint32*)malloc( individualPoolSize* sizeof(guint32));
+  poolList = g_slist_append (poolList, (gpointer) currentPool);
+  guint32 currentPoolUsed = 0;
+  guint32 currentPoolLeft = individualPoolSize-currentPoolUsed;
 
   for (key=0; key<hashSize; key++) {
     guint32 binSize = (unsigned long)hashSkeleton[key];
     xDEBUG(DEB_HASH_TRUALLOC,  if (binSize>0) { fprintf(stderr, "individual bin size %d\n", binSize);} );
-    if (binSize==0 || binSize>threshold) {
+    if (binSize==0 || (kmerCounts!=NULL ? kmerCounts[key] : binSize)>threshold) {
       hashSkeleton[key]=NULL;
     } else {
       guint32 neededSize = 2+binSize*2;
@@ -437,6 +565,9 @@ HiveHash::addEntryXX(guint32 key, guint32 value, guint32 offset) {
     exit(0);
   }
 
+  if (compactLayout) {
+    return addEntryAt(key, binFill[key]++, value, offset);
+  }
   currentBin = hashSkeleton[key];
   if (currentBin==NULL) {
     //  fprintf(stderr, "bin should not be empty\n");
@@ -470,3 +601,131 @@ HiveHash::addEntryXX(guint32 key, guint32 value, guint32 offset) {
   xDEBUG(DEB_ADD_ENTRYXX, fprintf(stderr, "E addEntryXX \n"));
   return 0;
 }
+
+/**
+  Store a pair (value, offset) at a given position of the bin of key, as sized by allocateHashMemory.
+  Threads filling disjoint positions of the same bin do not need to synchronize; the thread storing
+  the last entry of a bin marks it as full, as addEntryXX would.
+  @param key current hash key
+  @param entry position of the pair in the bin, starting at 0
+  @param value current value
+  @param offset current offset
+  @return 0 for success, 1 for failure
+*/
+int
+HiveHash::addEntryAt(guint32 key, guint32 entry, guint32 value, guint32 offset) {
+  guint32* currentBin;
+  xDEBUG(DEB_ADD_ENTRYXX, fprintf(stderr, "B addEntryAt %d %x [%d] --> %d %d\n", key, key, entry, value, offset));
+  if (value==0) {
+    fprintf(stderr, "adding value of 0\n");
+    exit(0);
+  }
+
+  if (compactLayout) {
+    if ((guint64)binOffsets[key]+entry>=binOffsets[key+1]) {
+      if (binOffsets[key+1]>binOffsets[key]) {
+        fprintf(stderr, "trying to add entry %d to key %d beyond capacity %d\n", entry, key, binOffsets[key+1]-binOffsets[key]);
+        exit(0);
+      }
+      return 0;
+    }
+    currentBin = binEntries+2*(size_t)binOffsets[key];
+    currentBin[2*entry] = value;
+    currentBin[2*entry+1] = offset;
+    return 0;
+  }
+  currentBin = hashSkeleton[key];
+  if (currentBin==NULL) {
+    return 0;
+  }
+  if (entry>=currentBin[0]) {
+    fprintf(stderr, "trying to add entry %d to key %d beyond capacity %d\n", entry, key, currentBin[0]);
+    exit(0);
+  }
+  currentBin[2*entry+2] = value;
+  currentBin[2*entry+3] = offset;
+  if (entry+1==currentBin[0]) {
+    currentBin[1] = currentBin[0];
+  }
+  return 0;
+}
+
+/** Set the number of entries marked for key, as if markEntry had been called numberOfMarks times.
+  @param key current hash key
+  @param numberOfMarks number of (value, offset) pairs of the key
+*/
+void
+HiveHash::setMarkedEntries(guint32 key, guint32 numberOfMarks) {
+  if (compactLayout) {
+    binOffsets[key] = numberOfMarks;
+  } else {
+    hashSkeleton[key] = (guint32*)(unsigned long) numberOfMarks;
+  }
+}
+
+/** Select the kmers kept by allocateHashMemory from counts over a larger set of reads than the
+  marked ones, typically all the batches of a reads file, so that every batch keeps the same kmers.
+  @param counts number of occurrences of each key; must outlive allocateHashMemory
+*/
+void
+HiveHash::useKmerCounts(const guint32* counts) {
+  kmerCounts = counts;
+}
+
+/** Release the memory only needed while the hash is filled.*/
+void
+HiveHash::completeHash() {
+  free(binFill);
+  binFill = NULL;
+}
+
+/** Write the hive hash in the compact layout: the number of keys and of entries, the hashSize+1
+  entry offsets, then the (value, offset) pairs. The image can be used in place by HiveHash(image, imageWords).
+  @param filePtr  output stream
+  @return 0 for success, 1 for failure
+*/
+int
+HiveHash::writeImage(FILE* filePtr) {
+  guint32 header[2];
+  guint32 entries;
+  int key;
+  header[0] = hashSize;
+  if (compactLayout) {
+    header[1] = numberOfEntries;
+    if (fwrite(header, sizeof(guint32), 2, filePtr)!=2 ||
+        fwrite(binOffsets, sizeof(guint32), hashSize+1, filePtr)!=(size_t)hashSize+1 ||
+        fwrite(binEntries, sizeof(guint32), 2*(size_t)numberOfEntries, filePtr)!=2*(size_t)numberOfEntries) {
+      return 1;
+    }
+    return 0;
+  }
+  entries = 0;
+  for (key=0; key<hashSize; key++) {
+    if (hashSkeleton[key]!=NULL) {
+      entries += hashSkeleton[key][0];
+    }
+  }
+  header[1] = entries;
+  if (fwrite(header, sizeof(guint32), 2, filePtr)!=2) {
+    return 1;
+  }
+  entries = 0;
+  for (key=0; key<hashSize; key++) {
+    if (fwrite(&entries, sizeof(guint32), 1, filePtr)!=1) {
+      return 1;
+    }
+    if (hashSkeleton[key]!=NULL) {
+      entries += hashSkeleton[key][0];
+    }
+  }
+  if (fwrite(&entries, sizeof(guint32), 1, filePtr)!=1) {
+    return 1;
+  }
+  for (key=0; key<hashSize; key++) {
+    if (hashSkeleton[key]!=NULL &&
+        fwrite(hashSkeleton[key]+2, sizeof(guint32), 2*hashSkeleton[key][0], filePtr)!=2*hashSkeleton[key][0]) {
+      return 1;
+    }
+  }
+  return 0;
+}
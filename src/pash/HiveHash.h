@@ -22,6 +22,11 @@ public:
 /**
 * The main difference between Pash 2.0 and Pash 3.0: a hive kmer hash that
 * collapses hashtables for multiple offsets.
+*
+* Two layouts are available. The default skeleton keeps a pointer per key to a bin carved from a pool,
+* holding the bin size, the number of entries added, then the (value, offset) pairs. The compact layout
+* keeps a single array of hashSize+1 entry offsets and a single array of (value, offset) pairs, the
+* pairs of key k being stored between binOffsets[k] and binOffsets[k+1].
 */
 class HiveHash {
 protected:
@@ -36,8 +41,22 @@ protected:
   guint32 *currentPool;
   guint32 individualPoolSize;
   double kmerPercent;
+
+  int compactLayout;
+  /** Whether the compact arrays belong to a mapped image, and cannot be freed.*/
+  int mappedImage;
+  guint32 numberOfEntries;
+  /** Compact layout: number of pairs added to each key by addEntryXX, while the hash is filled.*/
+  guint32* binFill;
+  /** Kmer counts deciding which bins are kept, if not the marked entries.*/
+  const guint32* kmerCounts;
+  /** Number of entries marked for key before allocateHashMemory.*/
+  inline guint32 markedEntries(guint32 key) {
+    return compactLayout ? binOffsets[key] : (guint32)(unsigned long)hashSkeleton[key];
+  }
 public:
-  HiveHash(int size, guint32 keepKmerPercent);
+  HiveHash(int size, guint32 keepKmerPercent, int compact=0);
+  HiveHash(guint32* image, size_t imageWords);
   int addEntry(guint32 key, guint32 value, guint32 offset);
   int addEntryX(guint32 key, guint32 value, guint32 offset);
   int markEntry(guint32 key);
@@ -48,9 +67,21 @@ public:
   void printStatistics(FILE* filePtr);
   ~HiveHash();
   guint32** hashSkeleton;
+  /** Compact layout: first entry of each key, and (value, offset) pairs.*/
+  guint32* binOffsets;
+  guint32* binEntries;
   int addEntryXX(guint32 key, guint32 value, guint32 offset);
+  int addEntryAt(guint32 key, guint32 entry, guint32 value, guint32 offset);
+  void setMarkedEntries(guint32 key, guint32 numberOfMarks);
+  void useKmerCounts(const guint32* counts);
   int allocateHashMemory();
+  void completeHash();
+  int writeImage(FILE* filePtr);
   void checkHashXX();
+  /** Whether key has any (value, offset) pair; only valid after allocateHashMemory.*/
+  inline int hasEntries(guint32 key) {
+    return compactLayout ? binOffsets[key+1]>binOffsets[key] : hashSkeleton[key]!=NULL;
+  }
 };
 
 #endif
@@ -0,0 +1,703 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+/***********************************************************************
+ * InputReader.cpp
+ * plain, gzip and bzip2 decoders, and the buffered reader on top of them
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include "PashDebug.h"
+#include "InputReader.h"
+#include "Metrics.h"
+
+#define DEB_INPUT_READER 0
+
+/** Plain file decoder.*/
+typedef struct {
+	FILE* filePtr;
+	int errorNumber;
+} PlainInput;
+
+static void* openPlainInput(const char* fileName) {
+	FILE* filePtr = fopen(fileName, "rb");
+	if (filePtr==NULL) {
+		return NULL;
+	}
+	PlainInput* input = (PlainInput*) malloc(sizeof(PlainInput));
+	xDieIfNULL(input, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	input->filePtr = filePtr;
+	input->errorNumber = 0;
+	return input;
+}
+
+static long readPlainInput(void* state, char* buffer, size_t size) {
+	PlainInput* input = (PlainInput*) state;
+	size_t readChars = fread(buffer, sizeof(char), size, input->filePtr);
+	if (readChars==0 && ferror(input->filePtr)) {
+		input->errorNumber = errno;
+		return -1;
+	}
+	return (long) readChars;
+}
+
+static const char* plainInputError(void* state) {
+	return strerror(((PlainInput*) state)->errorNumber);
+}
+
+static void closePlainInput(void* state) {
+	PlainInput* input = (PlainInput*) state;
+	fclose(input->filePtr);
+	free(input);
+}
+
+const InputDecoder plainInputDecoder = {"text", openPlainInput, readPlainInput, plainInputError, closePlainInput};
+
+/** gzip decoder; gzread also decodes the gzip members following the first one.*/
+static void* openGzipInput(const char* fileName) {
+	gzFile input = gzopen(fileName, "rb");
+	if (input==NULL) {
+		return NULL;
+	}
+	gzbuffer(input, INPUT_READER_BUFFER_SIZE);
+	return input;
+}
+
+static long readGzipInput(void* state, char* buffer, size_t size) {
+	unsigned chunk = size>INT_MAX ? INT_MAX : (unsigned) size;
+	int decodedChars = gzread((gzFile) state, buffer, chunk);
+	if (decodedChars==0) {
+		// a truncated file only shows as an error once its last bytes are consumed
+		int errorNumber;
+		gzerror((gzFile) state, &errorNumber);
+		if (errorNumber!=Z_OK) {
+			return -1;
+		}
+	}
+	return decodedChars;
+}
+
+static const char* gzipInputError(void* state) {
+	int errorNumber;
+	return gzerror((gzFile) state, &errorNumber);
+}
+
+static void closeGzipInput(void* state) {
+	gzclose((gzFile) state);
+}
+
+const InputDecoder gzipInputDecoder = {"gzip", openGzipInput, readGzipInput, gzipInputError, closeGzipInput};
+
+/** bzip2 decoder; a new stream is opened on the bytes following the end of a stream, as bunzip2
+ * does for concatenated files.*/
+typedef struct {
+	FILE* filePtr;
+	BZFILE* stream;
+	int bzError;
+	char unused[BZ_MAX_UNUSED];
+	int numberOfUnused;
+} Bzip2Input;
+
+static void* openBzip2Input(const char* fileName) {
+	FILE* filePtr = fopen(fileName, "rb");
+	if (filePtr==NULL) {
+		return NULL;
+	}
+	Bzip2Input* input = (Bzip2Input*) malloc(sizeof(Bzip2Input));
+	xDieIfNULL(input, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	input->filePtr = filePtr;
+	input->stream = NULL;
+	input->bzError = BZ_OK;
+	input->numberOfUnused = 0;
+	return input;
+}
+
+static long readBzip2Input(void* state, char* buffer, size_t size) {
+	Bzip2Input* input = (Bzip2Input*) state;
+	int chunk = size>INT_MAX ? INT_MAX : (int) size;
+	for (;;) {
+		if (input->stream==NULL) {
+			if (input->numberOfUnused==0) {
+				int nextChar = getc(input->filePtr);
+				if (nextChar==EOF) {
+					return 0;
+				}
+				ungetc(nextChar, input->filePtr);
+			}
+			input->stream = BZ2_bzReadOpen(&input->bzError, input->filePtr, 0, 0,
+					input->unused, input->numberOfUnused);
+			if (input->bzError!=BZ_OK) {
+				BZ2_bzReadClose(&input->bzError, input->stream);
+				input->stream = NULL;
+				return -1;
+			}
+		}
+		int decodedChars = BZ2_bzRead(&input->bzError, input->stream, buffer, chunk);
+		if (input->bzError==BZ_OK) {
+			return decodedChars;
+		}
+		if (input->bzError!=BZ_STREAM_END) {
+			return -1;
+		}
+		void* unused;
+		int bzError;
+		BZ2_bzReadGetUnused(&bzError, input->stream, &unused, &input->numberOfUnused);
+		memcpy(input->unused, unused, input->numberOfUnused);
+		BZ2_bzReadClose(&bzError, input->stream);
+		input->stream = NULL;
+		if (decodedChars>0) {
+			return decodedChars;
+		}
+	}
+}
+
+static const char* bzip2InputError(void* state) {
+	switch (((Bzip2Input*) state)->bzError) {
+	case BZ_IO_ERROR:
+		return strerror(errno);
+	case BZ_UNEXPECTED_EOF:
+		return "unexpected end of file";
+	case BZ_DATA_ERROR:
+		return "data integrity error";
+	case BZ_DATA_ERROR_MAGIC:
+		return "not a bzip2 stream";
+	case BZ_MEM_ERROR:
+		return "out of memory";
+	default:
+		return "bzip2 error";
+	}
+}
+
+static void closeBzip2Input(void* state) {
+	Bzip2Input* input = (Bzip2Input*) state;
+	int bzError;
+	if (input->stream!=NULL) {
+		BZ2_bzReadClose(&bzError, input->stream);
+	}
+	fclose(input->filePtr);
+	free(input);
+}
+
+const InputDecoder bzip2InputDecoder = {"bzip2", openBzip2Input, readBzip2Input, bzip2InputError, closeBzip2Input};
+
+/** Decoder running another decoder on a thread of its own, so that the parsing of a buffer overlaps
+ * the decompression of the next ones.*/
+#define PIPELINED_INPUT_BUFFERS 4
+
+typedef struct {
+	const InputDecoder* decoder;
+	void* decoderState;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t bufferFilled;
+	pthread_cond_t bufferEmptied;
+	char* buffers[PIPELINED_INPUT_BUFFERS];
+	/// Bytes decoded in each buffer; 0 at the end of the file, -1 on error.
+	long bufferSizes[PIPELINED_INPUT_BUFFERS];
+	unsigned long filledBuffers;
+	unsigned long consumedBuffers;
+	/// Bytes of the oldest filled buffer already consumed.
+	long consumedChars;
+	int stop;
+} PipelinedInput;
+
+static void* pipelinedInputThread(void* arg) {
+	PipelinedInput* input = (PipelinedInput*) arg;
+	long decodedChars;
+	do {
+		pthread_mutex_lock(&input->lock);
+		while (!input->stop && input->filledBuffers-input->consumedBuffers==PIPELINED_INPUT_BUFFERS) {
+			pthread_cond_wait(&input->bufferEmptied, &input->lock);
+		}
+		if (input->stop) {
+			pthread_mutex_unlock(&input->lock);
+			break;
+		}
+		int bufferIndex = input->filledBuffers%PIPELINED_INPUT_BUFFERS;
+		pthread_mutex_unlock(&input->lock);
+		decodedChars = input->decoder->read(input->decoderState, input->buffers[bufferIndex], INPUT_READER_BUFFER_SIZE);
+		pthread_mutex_lock(&input->lock);
+		input->bufferSizes[bufferIndex] = decodedChars;
+		input->filledBuffers++;
+		pthread_cond_signal(&input->bufferFilled);
+		pthread_mutex_unlock(&input->lock);
+	} while (decodedChars>0);
+	return NULL;
+}
+
+static void* openPipelinedInput(const char* fileName, const InputDecoder* decoder) {
+	void* decoderState = decoder->open(fileName);
+	if (decoderState==NULL) {
+		return NULL;
+	}
+	PipelinedInput* input = (PipelinedInput*) malloc(sizeof(PipelinedInput));
+	xDieIfNULL(input, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	input->decoder = decoder;
+	input->decoderState = decoderState;
+	for (int i=0; i<PIPELINED_INPUT_BUFFERS; i++) {
+		input->buffers[i] = (char*) malloc(INPUT_READER_BUFFER_SIZE);
+		xDieIfNULL(input->buffers[i], fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	}
+	input->filledBuffers = 0;
+	input->consumedBuffers = 0;
+	input->consumedChars = 0;
+	input->stop = 0;
+	pthread_mutex_init(&input->lock, NULL);
+	pthread_cond_init(&input->bufferFilled, NULL);
+	pthread_cond_init(&input->bufferEmptied, NULL);
+	if (pthread_create(&input->thread, NULL, pipelinedInputThread, input)!=0) {
+		xDie(fprintf(stderr, "could not create the decompression thread of %s\n", fileName), 2);
+	}
+	return input;
+}
+
+static long readPipelinedInput(void* state, char* buffer, size_t size) {
+	PipelinedInput* input = (PipelinedInput*) state;
+	pthread_mutex_lock(&input->lock);
+	while (input->filledBuffers==input->consumedBuffers) {
+		pthread_cond_wait(&input->bufferFilled, &input->lock);
+	}
+	pthread_mutex_unlock(&input->lock);
+	int bufferIndex = input->consumedBuffers%PIPELINED_INPUT_BUFFERS;
+	long bufferSize = input->bufferSizes[bufferIndex];
+	if (bufferSize<=0) {
+		// the decoding thread has stopped on this buffer
+		return bufferSize;
+	}
+	long copiedChars = bufferSize-input->consumedChars;
+	if ((size_t) copiedChars>size) {
+		copiedChars = (long) size;
+	}
+	memcpy(buffer, input->buffers[bufferIndex]+input->consumedChars, copiedChars);
+	input->consumedChars += copiedChars;
+	if (input->consumedChars==bufferSize) {
+		input->consumedChars = 0;
+		pthread_mutex_lock(&input->lock);
+		input->consumedBuffers++;
+		pthread_cond_signal(&input->bufferEmptied);
+		pthread_mutex_unlock(&input->lock);
+	}
+	return copiedChars;
+}
+
+static const char* pipelinedInputError(void* state) {
+	PipelinedInput* input = (PipelinedInput*) state;
+	return input->decoder->error(input->decoderState);
+}
+
+static void closePipelinedInput(void* state) {
+	PipelinedInput* input = (PipelinedInput*) state;
+	pthread_mutex_lock(&input->lock);
+	input->stop = 1;
+	pthread_cond_signal(&input->bufferEmptied);
+	pthread_mutex_unlock(&input->lock);
+	pthread_join(input->thread, NULL);
+	input->decoder->close(input->decoderState);
+	for (int i=0; i<PIPELINED_INPUT_BUFFERS; i++) {
+		free(input->buffers[i]);
+	}
+	pthread_mutex_destroy(&input->lock);
+	pthread_cond_destroy(&input->bufferFilled);
+	pthread_cond_destroy(&input->bufferEmptied);
+	free(input);
+}
+
+static void* openPipelinedGzipInput(const char* fileName) {
+	return openPipelinedInput(fileName, &gzipInputDecoder);
+}
+
+static void* openPipelinedBzip2Input(const char* fileName) {
+	return openPipelinedInput(fileName, &bzip2InputDecoder);
+}
+
+const InputDecoder pipelinedGzipInputDecoder = {"gzip", openPipelinedGzipInput, readPipelinedInput,
+		pipelinedInputError, closePipelinedInput};
+const InputDecoder pipelinedBzip2InputDecoder = {"bzip2", openPipelinedBzip2Input, readPipelinedInput,
+		pipelinedInputError, closePipelinedInput};
+
+/** BGZF decoder. A BGZF file is a series of gzip members of at most 64KB each, whose header
+ * holds the size of the member; the members are read in turn and inflated on a pool of threads, and
+ * handed back in the file order.*/
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+#define BGZF_MAX_BLOCK_SIZE 65536
+/// Blocks read ahead of the parsing, per inflating thread.
+#define BGZF_BLOCKS_PER_THREAD 8
+
+typedef struct {
+	unsigned char* compressed;
+	int compressedSize;
+	char* decompressed;
+	long decompressedSize;
+	/// Whether the block has been inflated, or has failed.
+	int ready;
+	/// The block is past the last block of the file.
+	int endOfInput;
+	/// Why the block could not be read or inflated; NULL if it was.
+	const char* error;
+} BgzfBlock;
+
+typedef struct {
+	FILE* filePtr;
+	int numberOfWorkers;
+	pthread_t* workers;
+	pthread_mutex_t lock;
+	pthread_cond_t blockReady;
+	pthread_cond_t blockFreed;
+	BgzfBlock* blocks;
+	int numberOfBlocks;
+	unsigned long claimedBlocks;
+	unsigned long consumedBlocks;
+	/// Bytes of the oldest claimed block already consumed.
+	long consumedChars;
+	/// No block is claimed after the end of the file, or a read error.
+	int endOfFile;
+	int stop;
+	const char* error;
+} BgzfInput;
+
+/** Whether a gzip member header is a BGZF header, with the block size as the only extra subfield.*/
+static int isBgzfHeader(const unsigned char* header) {
+	return header[0]==0x1f && header[1]==0x8b && header[2]==8 && (header[3]&4)!=0
+		&& header[10]==6 && header[11]==0 && header[12]=='B' && header[13]=='C'
+		&& header[14]==2 && header[15]==0;
+}
+
+/** Read the next block of the file; called with the lock held, so that blocks are claimed in the
+ * order of the file.*/
+static void readBgzfBlock(BgzfInput* input, BgzfBlock* block) {
+	unsigned char header[BGZF_HEADER_SIZE];
+	size_t headerSize = fread(header, 1, BGZF_HEADER_SIZE, input->filePtr);
+	if (headerSize==0 && !ferror(input->filePtr)) {
+		block->endOfInput = 1;
+		input->endOfFile = 1;
+		return;
+	}
+	if (headerSize<BGZF_HEADER_SIZE) {
+		block->error = ferror(input->filePtr) ? strerror(errno) : "unexpected end of file";
+		input->endOfFile = 1;
+		return;
+	}
+	if (!isBgzfHeader(header)) {
+		block->error = "not a BGZF block";
+		input->endOfFile = 1;
+		return;
+	}
+	int blockSize = (header[16] | header[17]<<8)+1;
+	block->compressedSize = blockSize-BGZF_HEADER_SIZE;
+	if (block->compressedSize<BGZF_FOOTER_SIZE) {
+		block->error = "invalid BGZF block size";
+		input->endOfFile = 1;
+		return;
+	}
+	if (fread(block->compressed, 1, block->compressedSize, input->filePtr)!=(size_t) block->compressedSize) {
+		block->error = ferror(input->filePtr) ? strerror(errno) : "unexpected end of file";
+		input->endOfFile = 1;
+	}
+}
+
+static void inflateBgzfBlock(BgzfBlock* block) {
+	const unsigned char* footer = block->compressed+block->compressedSize-BGZF_FOOTER_SIZE;
+	uLong crc = footer[0] | footer[1]<<8 | footer[2]<<16 | (uLong) footer[3]<<24;
+	uLong inflatedSize = footer[4] | footer[5]<<8 | footer[6]<<16 | (uLong) footer[7]<<24;
+	if (inflatedSize>BGZF_MAX_BLOCK_SIZE) {
+		block->error = "invalid BGZF block size";
+		return;
+	}
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, -MAX_WBITS)!=Z_OK) {
+		block->error = "out of memory";
+		return;
+	}
+	stream.next_in = block->compressed;
+	stream.avail_in = block->compressedSize-BGZF_FOOTER_SIZE;
+	stream.next_out = (Bytef*) block->decompressed;
+	stream.avail_out = BGZF_MAX_BLOCK_SIZE;
+	int status = inflate(&stream, Z_FINISH);
+	block->decompressedSize = stream.total_out;
+	inflateEnd(&stream);
+	if (status!=Z_STREAM_END) {
+		block->error = "invalid compressed data";
+	} else if (stream.total_out!=inflatedSize
+			|| crc32(0, (const Bytef*) block->decompressed, (uInt) inflatedSize)!=crc) {
+		block->error = "data integrity error";
+	}
+}
+
+static void* bgzfInputWorker(void* arg) {
+	BgzfInput* input = (BgzfInput*) arg;
+	pthread_mutex_lock(&input->lock);
+	for (;;) {
+		while (!input->stop && !input->endOfFile
+				&& input->claimedBlocks-input->consumedBlocks==(unsigned long) input->numberOfBlocks) {
+			pthread_cond_wait(&input->blockFreed, &input->lock);
+		}
+		if (input->stop || input->endOfFile) {
+			break;
+		}
+		BgzfBlock* block = &input->blocks[input->claimedBlocks%input->numberOfBlocks];
+		input->claimedBlocks++;
+		block->ready = 0;
+		block->endOfInput = 0;
+		block->error = NULL;
+		block->decompressedSize = 0;
+		readBgzfBlock(input, block);
+		pthread_mutex_unlock(&input->lock);
+		if (block->error==NULL && !block->endOfInput) {
+			inflateBgzfBlock(block);
+		}
+		pthread_mutex_lock(&input->lock);
+		block->ready = 1;
+		pthread_cond_signal(&input->blockReady);
+	}
+	pthread_mutex_unlock(&input->lock);
+	return NULL;
+}
+
+static void* openBgzfInput(const char* fileName) {
+	FILE* filePtr = fopen(fileName, "rb");
+	if (filePtr==NULL) {
+		return NULL;
+	}
+	BgzfInput* input = (BgzfInput*) malloc(sizeof(BgzfInput));
+	xDieIfNULL(input, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	input->filePtr = filePtr;
+	input->numberOfWorkers = getInputDecoderThreads();
+	input->numberOfBlocks = input->numberOfWorkers*BGZF_BLOCKS_PER_THREAD;
+	input->blocks = (BgzfBlock*) malloc(sizeof(BgzfBlock)*input->numberOfBlocks);
+	xDieIfNULL(input->blocks, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	for (int i=0; i<input->numberOfBlocks; i++) {
+		input->blocks[i].compressed = (unsigned char*) malloc(BGZF_MAX_BLOCK_SIZE);
+		input->blocks[i].decompressed = (char*) malloc(BGZF_MAX_BLOCK_SIZE);
+		xDieIfNULL(input->blocks[i].compressed, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+		xDieIfNULL(input->blocks[i].decompressed, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+		input->blocks[i].ready = 0;
+	}
+	input->claimedBlocks = 0;
+	input->consumedBlocks = 0;
+	input->consumedChars = 0;
+	input->endOfFile = 0;
+	input->stop = 0;
+	input->error = NULL;
+	pthread_mutex_init(&input->lock, NULL);
+	pthread_cond_init(&input->blockReady, NULL);
+	pthread_cond_init(&input->blockFreed, NULL);
+	input->workers = (pthread_t*) malloc(sizeof(pthread_t)*input->numberOfWorkers);
+	xDieIfNULL(input->workers, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	for (int i=0; i<input->numberOfWorkers; i++) {
+		if (pthread_create(&input->workers[i], NULL, bgzfInputWorker, input)!=0) {
+			xDie(fprintf(stderr, "could not create the decompression threads of %s\n", fileName), 2);
+		}
+	}
+	return input;
+}
+
+/** Hand back the oldest claimed block to the workers; called with the lock held.*/
+static void freeOldestBgzfBlock(BgzfInput* input) {
+	input->blocks[input->consumedBlocks%input->numberOfBlocks].ready = 0;
+	input->consumedBlocks++;
+	input->consumedChars = 0;
+	pthread_cond_broadcast(&input->blockFreed);
+}
+
+static long readBgzfInput(void* state, char* buffer, size_t size) {
+	BgzfInput* input = (BgzfInput*) state;
+	BgzfBlock* block;
+	pthread_mutex_lock(&input->lock);
+	for (;;) {
+		block = &input->blocks[input->consumedBlocks%input->numberOfBlocks];
+		while (input->consumedBlocks==input->claimedBlocks || !block->ready) {
+			pthread_cond_wait(&input->blockReady, &input->lock);
+		}
+		if (block->error!=NULL || block->endOfInput || block->decompressedSize>0) {
+			break;
+		}
+		// empty block, as the end of file marker of BGZF
+		freeOldestBgzfBlock(input);
+	}
+	pthread_mutex_unlock(&input->lock);
+	if (block->error!=NULL) {
+		input->error = block->error;
+		return -1;
+	}
+	if (block->endOfInput) {
+		return 0;
+	}
+	long copiedChars = block->decompressedSize-input->consumedChars;
+	if ((size_t) copiedChars>size) {
+		copiedChars = (long) size;
+	}
+	memcpy(buffer, block->decompressed+input->consumedChars, copiedChars);
+	input->consumedChars += copiedChars;
+	if (input->consumedChars==block->decompressedSize) {
+		pthread_mutex_lock(&input->lock);
+		freeOldestBgzfBlock(input);
+		pthread_mutex_unlock(&input->lock);
+	}
+	return copiedChars;
+}
+
+static const char* bgzfInputError(void* state) {
+	return ((BgzfInput*) state)->error;
+}
+
+static void closeBgzfInput(void* state) {
+	BgzfInput* input = (BgzfInput*) state;
+	pthread_mutex_lock(&input->lock);
+	input->stop = 1;
+	pthread_cond_broadcast(&input->blockFreed);
+	pthread_mutex_unlock(&input->lock);
+	for (int i=0; i<input->numberOfWorkers; i++) {
+		pthread_join(input->workers[i], NULL);
+	}
+	for (int i=0; i<input->numberOfBlocks; i++) {
+		free(input->blocks[i].compressed);
+		free(input->blocks[i].decompressed);
+	}
+	free(input->blocks);
+	free(input->workers);
+	fclose(input->filePtr);
+	pthread_mutex_destroy(&input->lock);
+	pthread_cond_destroy(&input->blockReady);
+	pthread_cond_destroy(&input->blockFreed);
+	free(input);
+}
+
+const InputDecoder bgzfInputDecoder = {"BGZF", openBgzfInput, readBgzfInput, bgzfInputError, closeBgzfInput};
+
+static int inputDecoderThreads = 1;
+
+void setInputDecoderThreads(int numberOfThreads) {
+	inputDecoderThreads = numberOfThreads<1 ? 1 : numberOfThreads;
+}
+
+int getInputDecoderThreads() {
+	return inputDecoderThreads;
+}
+
+InputReader* openInputReaderWithDecoder(const char* fileName, const InputDecoder* decoder) {
+	if (strlen(fileName)>MAX_FILE_NAME) {
+		return NULL;
+	}
+	void* decoderState = decoder->open(fileName);
+	if (decoderState==NULL) {
+		return NULL;
+	}
+	InputReader* reader = (InputReader*) malloc(sizeof(InputReader));
+	xDieIfNULL(reader, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	reader->buffer = (char*) malloc(INPUT_READER_BUFFER_SIZE);
+	xDieIfNULL(reader->buffer, fprintf(stderr, "could not allocate memory for reading %s\n", fileName), 2);
+	strcpy(reader->fileName, fileName);
+	reader->decoder = decoder;
+	reader->decoderState = decoderState;
+	reader->bufferStart = 0;
+	reader->bufferEnd = 0;
+	reader->endOfInput = 0;
+	xDEBUG(DEB_INPUT_READER, fprintf(stderr, "opened %s file %s\n", decoder->name, fileName));
+	return reader;
+}
+
+InputReader* openInputReader(const char* fileName) {
+	unsigned char magic[BGZF_HEADER_SIZE];
+	memset(magic, 0, sizeof(magic));
+	FILE* filePtr = fopen(fileName, "rb");
+	if (filePtr==NULL) {
+		return NULL;
+	}
+	size_t magicSize = fread(magic, 1, sizeof(magic), filePtr);
+	fclose(filePtr);
+	int pipelined = inputDecoderThreads>1;
+	if (magicSize==BGZF_HEADER_SIZE && isBgzfHeader(magic) && pipelined) {
+		return openInputReaderWithDecoder(fileName, &bgzfInputDecoder);
+	}
+	if (magicSize>=2 && magic[0]==0x1f && magic[1]==0x8b) {
+		return openInputReaderWithDecoder(fileName, pipelined ? &pipelinedGzipInputDecoder : &gzipInputDecoder);
+	}
+	if (magicSize>=3 && magic[0]=='B' && magic[1]=='Z' && magic[2]=='h') {
+		return openInputReaderWithDecoder(fileName, pipelined ? &pipelinedBzip2InputDecoder : &bzip2InputDecoder);
+	}
+	return openInputReaderWithDecoder(fileName, &plainInputDecoder);
+}
+
+/** Decode the next bytes of the input into a buffer; exits if the input cannot be decoded.*/
+static size_t decodeInput(InputReader* reader, char* buffer, size_t size) {
+	long decodedChars = reader->decoder->read(reader->decoderState, buffer, size);
+	if (decodedChars<0) {
+		xDie(fprintf(stderr, "could not read %s file %s: %s\n", reader->decoder->name, reader->fileName,
+				reader->decoder->error(reader->decoderState)), 2);
+	}
+	if (decodedChars==0) {
+		reader->endOfInput = 1;
+	}
+	addMetric(MetricBytesRead, decodedChars);
+	return (size_t) decodedChars;
+}
+
+size_t readInput(InputReader* reader, char* buffer, size_t size) {
+	size_t readChars = 0;
+	while (readChars<size) {
+		if (reader->bufferStart==reader->bufferEnd) {
+			if (reader->endOfInput) {
+				break;
+			}
+			if (size-readChars>=INPUT_READER_BUFFER_SIZE) {
+				// large reads bypass the buffer
+				readChars += decodeInput(reader, buffer+readChars, size-readChars);
+				continue;
+			}
+			reader->bufferStart = 0;
+			reader->bufferEnd = decodeInput(reader, reader->buffer, INPUT_READER_BUFFER_SIZE);
+			continue;
+		}
+		size_t copiedChars = reader->bufferEnd-reader->bufferStart;
+		if (copiedChars>size-readChars) {
+			copiedChars = size-readChars;
+		}
+		memcpy(buffer+readChars, reader->buffer+reader->bufferStart, copiedChars);
+		reader->bufferStart += copiedChars;
+		readChars += copiedChars;
+	}
+	return readChars;
+}
+
+char* readInputLine(InputReader* reader, char* line, int size) {
+	int lineLength = 0;
+	while (lineLength<size-1) {
+		if (reader->bufferStart==reader->bufferEnd) {
+			if (reader->endOfInput) {
+				break;
+			}
+			reader->bufferStart = 0;
+			reader->bufferEnd = decodeInput(reader, reader->buffer, INPUT_READER_BUFFER_SIZE);
+			continue;
+		}
+		char c = reader->buffer[reader->bufferStart++];
+		line[lineLength++] = c;
+		if (c=='\n') {
+			break;
+		}
+	}
+	if (lineLength==0) {
+		return NULL;
+	}
+	line[lineLength] = '\0';
+	return line;
+}
+
+void closeInputReader(InputReader* reader) {
+	reader->decoder->close(reader->decoderState);
+	free(reader->buffer);
+	free(reader);
+}
@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_INPUT_READER_H
+#define PASH_INPUT_READER_H
+
+/***********************************************************************
+ * InputReader.h
+ * Buffered sequential reading of the input files, decompressed in
+ * process. The decoder of a file is chosen from its first bytes: gzip
+ * (including concatenated members, as in BGZF files) through zlib,
+ * bzip2 through libbz2, plain text otherwise. Other decoders can be
+ * plugged in through openInputReaderWithDecoder.
+ *
+ * With more than one decoder thread, the blocks of BGZF files are
+ * inflated on that many threads, and other compressed files are decoded
+ * on a thread of their own while the previous bytes are parsed.
+ ***********************************************************************/
+
+#include <stdio.h>
+#include "someConstants.h"
+
+/// Decoded bytes buffered by a reader.
+#define INPUT_READER_BUFFER_SIZE (1<<20)
+
+/** Decompression of an input file.*/
+typedef struct {
+	/// Name of the format, for the messages.
+	const char* name;
+	/** Open a file.
+	@return state of the decoder for the file; NULL if it could not be opened*/
+	void* (*open)(const char* fileName);
+	/** Decode the next bytes of the file.
+	@return number of bytes decoded, at most size; 0 at the end of the file, -1 on error*/
+	long (*read)(void* state, char* buffer, size_t size);
+	/** Description of the last error.*/
+	const char* (*error)(void* state);
+	void (*close)(void* state);
+} InputDecoder;
+
+extern const InputDecoder plainInputDecoder;
+extern const InputDecoder gzipInputDecoder;
+extern const InputDecoder bzip2InputDecoder;
+extern const InputDecoder pipelinedGzipInputDecoder;
+extern const InputDecoder pipelinedBzip2InputDecoder;
+extern const InputDecoder bgzfInputDecoder;
+
+/** Set the number of threads decompressing each input file opened afterwards; 1 decodes the files on
+ * the thread reading them.*/
+void setInputDecoderThreads(int numberOfThreads);
+
+int getInputDecoderThreads();
+
+typedef struct {
+	char fileName[MAX_FILE_NAME+1];
+	const InputDecoder* decoder;
+	void* decoderState;
+	/// Decoded bytes not consumed yet, from bufferStart to bufferEnd.
+	char* buffer;
+	size_t bufferStart;
+	size_t bufferEnd;
+	int endOfInput;
+} InputReader;
+
+/** Open an input file, with the decoder matching its first bytes.
+@return the reader; NULL if the file could not be opened*/
+InputReader* openInputReader(const char* fileName);
+
+/** Open an input file with a given decoder.
+@return the reader; NULL if the file could not be opened*/
+InputReader* openInputReaderWithDecoder(const char* fileName, const InputDecoder* decoder);
+
+/** Read the next decoded bytes, as fread does: fewer than size bytes are only returned at the end
+ * of the input. Exits with a message if the file cannot be decoded.
+@return number of bytes read*/
+size_t readInput(InputReader* reader, char* buffer, size_t size);
+
+/** Read the next line, as fgets does.
+@return line, NULL at the end of the input*/
+char* readInputLine(InputReader* reader, char* line, int size);
+
+void closeInputReader(InputReader* reader);
+
+#endif
@@ -0,0 +1,378 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+/***********************************************************************
+ * MappingStore.cpp
+ * bounded in-memory store of the mapping records of a scan, filtered and
+ * written once the best scores of the reads are final
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "PashDebug.h"
+#include "Collator.h"
+#include "MappingStore.h"
+#include "Metrics.h"
+
+#define DEB_MAPPING_STORE 0
+
+/// No retained line.
+#define NO_STORED_MAPPING G_MAXUINT32
+
+MappingStore* createMappingStore(SequenceInfo* verticalSequenceInfos, guint32 maxReadMappings,
+		double withinTopPercent, guint32 memoryLimit, const char* spillFileName, int keepWindowMarks) {
+	MappingStore* store = (MappingStore*) malloc(sizeof(MappingStore));
+	xDieIfNULL(store, fprintf(stderr, "could not allocate memory for the mapping store at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	store->verticalSequenceInfos = verticalSequenceInfos;
+	store->maxReadMappings = maxReadMappings;
+	store->withinTopPercent = withinTopPercent;
+	store->keepWindowMarks = keepWindowMarks;
+	store->mappingsCapacity = 1024;
+	store->mappings = (StoredMapping*) malloc(sizeof(StoredMapping)*store->mappingsCapacity);
+	store->numberOfMappings = 0;
+	store->linesCapacity = 1024*1024;
+	store->lines = (char*) malloc(store->linesCapacity);
+	store->linesSize = 0;
+	store->readsCapacity = 0;
+	store->reads = NULL;
+	xDieIfNULL(store->mappings, fprintf(stderr, "could not allocate memory for the mapping store at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	xDieIfNULL(store->lines, fprintf(stderr, "could not allocate memory for the mapping store at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	store->memoryLimit = (size_t)memoryLimit*1024*1024;
+	store->storedLines = 0;
+	store->spillFilePtr = NULL;
+	strncpy(store->spillFileName, spillFileName, MAX_FILE_NAME_SIZE-1);
+	store->spillFileName[MAX_FILE_NAME_SIZE-1] = '\0';
+	return store;
+}
+
+void writeMappingRecord(FILE* filePtr, guint32 sequenceId, guint32 score, const char* output, guint32 outputSize) {
+	MappingRecord header;
+	header.sequenceId = sequenceId;
+	header.score = score;
+	header.outputSize = outputSize;
+	if (fwrite(&header, sizeof(MappingRecord), 1, filePtr)!=1
+			|| (outputSize>0 && fwrite(output, 1, outputSize, filePtr)!=outputSize)) {
+		xDie(fprintf(stderr, "could not write mapping records\n"), 2);
+	}
+}
+
+int readMappingRecord(FILE* filePtr, MappingRecord* header, char** output, size_t* outputCapacity) {
+	if (fread(header, sizeof(MappingRecord), 1, filePtr)!=1) {
+		return 0;
+	}
+	if (header->outputSize>*outputCapacity) {
+		*outputCapacity = 2*(size_t)header->outputSize;
+		*output = (char*) realloc(*output, *outputCapacity);
+		xDieIfNULL(*output, fprintf(stderr, "could not allocate memory for reading mapping records at %s:%d\n",
+				__FILE__, __LINE__), 1);
+	}
+	if (fread(*output, 1, header->outputSize, filePtr)!=header->outputSize) {
+		xDie(fprintf(stderr, "truncated mapping record\n"), 2);
+	}
+	return 1;
+}
+
+void freeMappingStore(MappingStore* store) {
+	free(store->mappings);
+	free(store->lines);
+	free(store->reads);
+	free(store);
+}
+
+/** Retained lines of a read, growing the read table as reads are first seen.*/
+static StoredRead* storedRead(MappingStore* store, guint32 sequenceId) {
+	if (sequenceId>=store->readsCapacity) {
+		guint32 readsCapacity = 2*store->readsCapacity>sequenceId ? 2*store->readsCapacity : sequenceId+1024;
+		store->reads = (StoredRead*) realloc(store->reads, sizeof(StoredRead)*readsCapacity);
+		xDieIfNULL(store->reads, fprintf(stderr, "could not allocate memory for the mapping store at %s:%d\n",
+				__FILE__, __LINE__), 1);
+		guint32 readIndex;
+		for (readIndex=store->readsCapacity; readIndex<readsCapacity; readIndex++) {
+			store->reads[readIndex].lastMapping = NO_STORED_MAPPING;
+			store->reads[readIndex].retainedMappings = 0;
+			store->reads[readIndex].rejectedScore = -1;
+		}
+		store->readsCapacity = readsCapacity;
+	}
+	return &store->reads[sequenceId];
+}
+
+/** Whether a line of a read may still be reported: it is not below the reporting threshold of the
+ * read, that only rises, and the read is not rejected for every threshold it would be reported at.*/
+static inline int isReportableMapping(MappingStore* store, const StoredRead* read, guint32 sequenceId, guint32 score) {
+	if (score<store->verticalSequenceInfos[sequenceId].bestSWScore*store->withinTopPercent) {
+		return 0;
+	}
+	return read->rejectedScore<0 || score>(guint32)read->rejectedScore;
+}
+
+/** Evict a line; its bytes are reclaimed by the next compaction.*/
+static inline void evictMapping(StoredMapping* mapping) {
+	mapping->lineOffset = -1;
+}
+
+static int compareScoresDescending(const void* a, const void* b) {
+	guint32 scoreA = *(const guint32*)a;
+	guint32 scoreB = *(const guint32*)b;
+	return scoreA<scoreB ? 1 : (scoreA>scoreB ? -1 : 0);
+}
+
+/** Evict the lines of a read that cannot be reported anymore. If more than maxMappings lines remain
+ * at or above the score s of the (maxMappings+1)-th best one, the read is not reported unless its
+ * threshold rises above s, and then none of the lines at or below s is reported either.*/
+static void pruneReadMappings(MappingStore* store, guint32 sequenceId) {
+	StoredRead* read = &store->reads[sequenceId];
+	guint32 mappingIndex, nextMappingIndex;
+	guint32* link;
+	guint32* scores = (guint32*) malloc(sizeof(guint32)*read->retainedMappings);
+	xDieIfNULL(scores, fprintf(stderr, "could not allocate memory for the mapping store at %s:%d\n",
+			__FILE__, __LINE__), 1);
+	guint32 numberOfScores = 0;
+
+	for (link=&read->lastMapping, mappingIndex=read->lastMapping; mappingIndex!=NO_STORED_MAPPING;
+			mappingIndex=nextMappingIndex) {
+		StoredMapping* mapping = &store->mappings[mappingIndex];
+		nextMappingIndex = mapping->previousMappingOfRead;
+		if (isReportableMapping(store, read, sequenceId, mapping->score)) {
+			scores[numberOfScores++] = mapping->score;
+			*link = mappingIndex;
+			link = &mapping->previousMappingOfRead;
+		} else {
+			evictMapping(mapping);
+		}
+	}
+	*link = NO_STORED_MAPPING;
+	read->retainedMappings = numberOfScores;
+
+	if (numberOfScores>store->maxReadMappings) {
+		qsort(scores, numberOfScores, sizeof(guint32), compareScoresDescending);
+		read->rejectedScore = (int) scores[store->maxReadMappings];
+		for (link=&read->lastMapping, mappingIndex=read->lastMapping; mappingIndex!=NO_STORED_MAPPING;
+				mappingIndex=nextMappingIndex) {
+			StoredMapping* mapping = &store->mappings[mappingIndex];
+			nextMappingIndex = mapping->previousMappingOfRead;
+			if (mapping->score>(guint32)read->rejectedScore) {
+				*link = mappingIndex;
+				link = &mapping->previousMappingOfRead;
+			} else {
+				evictMapping(mapping);
+				read->retainedMappings--;
+			}
+		}
+		*link = NO_STORED_MAPPING;
+	}
+	free(scores);
+}
+
+/** Move the retained lines and the window marks to the front of the store, in scan order, evicting
+ * the lines that cannot be reported anymore.*/
+static void compactMappingStore(MappingStore* store) {
+	guint32 mappingIndex, numberOfMappings = 0;
+	size_t linesSize = 0;
+
+	for (mappingIndex=0; mappingIndex<store->numberOfMappings; mappingIndex++) {
+		StoredMapping* mapping = &store->mappings[mappingIndex];
+		if (mapping->sequenceId!=MAPPING_STORE_WINDOW_MARK && mapping->lineOffset>=0) {
+			store->reads[mapping->sequenceId].lastMapping = NO_STORED_MAPPING;
+			store->reads[mapping->sequenceId].retainedMappings = 0;
+		}
+	}
+	for (mappingIndex=0; mappingIndex<store->numberOfMappings; mappingIndex++) {
+		StoredMapping mapping = store->mappings[mappingIndex];
+		if (mapping.sequenceId!=MAPPING_STORE_WINDOW_MARK) {
+			if (mapping.lineOffset<0) {
+				continue;
+			}
+			StoredRead* read = &store->reads[mapping.sequenceId];
+			if (!isReportableMapping(store, read, mapping.sequenceId, mapping.score)) {
+				continue;
+			}
+			memmove(store->lines+linesSize, store->lines+mapping.lineOffset, mapping.lineSize);
+			mapping.lineOffset = linesSize;
+			linesSize += mapping.lineSize;
+			mapping.previousMappingOfRead = read->lastMapping;
+			read->lastMapping = numberOfMappings;
+			read->retainedMappings++;
+		}
+		store->mappings[numberOfMappings++] = mapping;
+	}
+	xDEBUG(DEB_MAPPING_STORE, fprintf(stderr, "compacted mapping store from %u to %u lines, %lu to %lu bytes\n",
+			store->numberOfMappings, numberOfMappings, (unsigned long)store->linesSize, (unsigned long)linesSize));
+	store->numberOfMappings = numberOfMappings;
+	store->linesSize = linesSize;
+}
+
+/** Write the retained lines and the window marks to the spill file, which receives the lines
+ * stored from now on.*/
+static void spillMappingStore(MappingStore* store) {
+	guint32 mappingIndex;
+	fprintf(stderr, "mapping lines exceed %lu MB, writing them to temporary file %s\n",
+			(unsigned long)(store->memoryLimit/(1024*1024)), store->spillFileName);
+	store->spillFilePtr = fopen(store->spillFileName, "wb");
+	xDieIfNULL(store->spillFilePtr, fprintf(stderr, "could not open temporary output file %s\n",
+			store->spillFileName), 2);
+	for (mappingIndex=0; mappingIndex<store->numberOfMappings; mappingIndex++) {
+		StoredMapping* mapping = &store->mappings[mappingIndex];
+		if (mapping->sequenceId==MAPPING_STORE_WINDOW_MARK) {
+			writeMappingRecord(store->spillFilePtr, MAPPING_STORE_WINDOW_MARK, mapping->score, NULL, 0);
+		} else if (mapping->lineOffset>=0) {
+			fwrite(store->lines+mapping->lineOffset, 1, mapping->lineSize, store->spillFilePtr);
+		}
+	}
+	store->numberOfMappings = 0;
+	store->linesSize = 0;
+}
+
+static inline size_t mappingStoreMemory(const MappingStore* store) {
+	return store->linesSize+sizeof(StoredMapping)*(size_t)store->numberOfMappings;
+}
+
+/** Append a line or a window mark to the store.
+@return the stored mapping*/
+static StoredMapping* appendStoredMapping(MappingStore* store, guint32 sequenceId, guint32 score, const char* record) {
+	if (store->numberOfMappings==store->mappingsCapacity) {
+		store->mappingsCapacity *= 2;
+		store->mappings = (StoredMapping*) realloc(store->mappings, sizeof(StoredMapping)*store->mappingsCapacity);
+		xDieIfNULL(store->mappings, fprintf(stderr, "could not allocate memory for the mapping store at %s:%d\n",
+				__FILE__, __LINE__), 1);
+	}
+	StoredMapping* mapping = &store->mappings[store->numberOfMappings++];
+	mapping->sequenceId = sequenceId;
+	mapping->score = score;
+	mapping->lineOffset = -1;
+	mapping->lineSize = 0;
+	mapping->previousMappingOfRead = NO_STORED_MAPPING;
+	if (record!=NULL) {
+		size_t lineSize = mappingRecordSize(record);
+		if (store->linesSize+lineSize>store->linesCapacity) {
+			while (store->linesSize+lineSize>store->linesCapacity) {
+				store->linesCapacity *= 2;
+			}
+			store->lines = (char*) realloc(store->lines, store->linesCapacity);
+			xDieIfNULL(store->lines, fprintf(stderr, "could not allocate memory for the mapping store at %s:%d\n",
+					__FILE__, __LINE__), 1);
+		}
+		memcpy(store->lines+store->linesSize, record, lineSize);
+		mapping->lineOffset = store->linesSize;
+		mapping->lineSize = lineSize;
+		store->linesSize += lineSize;
+	}
+	return mapping;
+}
+
+/** Compact the store once it reaches its memory limit, and spill it if the retained lines
+ * still fill half of the limit.*/
+static void checkMappingStoreMemory(MappingStore* store) {
+	if (mappingStoreMemory(store)<=store->memoryLimit) {
+		return;
+	}
+	compactMappingStore(store);
+	if (mappingStoreMemory(store)>store->memoryLimit/2) {
+		spillMappingStore(store);
+	}
+}
+
+void storeMappingRecord(MappingStore* store, const char* record) {
+	store->storedLines++;
+	if (store->spillFilePtr!=NULL) {
+		fwrite(record, 1, mappingRecordSize(record), store->spillFilePtr);
+		return;
+	}
+	MappingRecord header;
+	memcpy(&header, record, sizeof(MappingRecord));
+	guint32 sequenceId = header.sequenceId;
+	StoredRead* read = storedRead(store, sequenceId);
+	if (!isReportableMapping(store, read, sequenceId, header.score)) {
+		return;
+	}
+	StoredMapping* mapping = appendStoredMapping(store, sequenceId, header.score, record);
+	mapping->previousMappingOfRead = read->lastMapping;
+	read->lastMapping = store->numberOfMappings-1;
+	read->retainedMappings++;
+	if (read->retainedMappings>=2*((guint64)store->maxReadMappings+1)) {
+		pruneReadMappings(store, sequenceId);
+	}
+	checkMappingStoreMemory(store);
+}
+
+void storeWindowMark(MappingStore* store, guint32 windowIndex) {
+	store->storedLines++;
+	if (store->spillFilePtr!=NULL) {
+		writeMappingRecord(store->spillFilePtr, MAPPING_STORE_WINDOW_MARK, windowIndex, NULL, 0);
+		return;
+	}
+	appendStoredMapping(store, MAPPING_STORE_WINDOW_MARK, windowIndex, NULL);
+	checkMappingStoreMemory(store);
+}
+
+/** Count the reportable lines of the reads as filterOutput does, starting the rejected reads
+ * at more than maxMappings reportable lines.*/
+static void countPassingMappings(MappingStore* store) {
+	guint32 sequenceId, mappingIndex;
+	SequenceInfo* verticalSequenceInfos = store->verticalSequenceInfos;
+	for (sequenceId=0; sequenceId<store->readsCapacity; sequenceId++) {
+		StoredRead* read = &store->reads[sequenceId];
+		if (read->rejectedScore>=0 &&
+				(guint32)read->rejectedScore>=verticalSequenceInfos[sequenceId].bestSWScore*store->withinTopPercent) {
+			verticalSequenceInfos[sequenceId].passingMappings = store->maxReadMappings+1;
+		}
+	}
+	for (mappingIndex=0; mappingIndex<store->numberOfMappings; mappingIndex++) {
+		StoredMapping* mapping = &store->mappings[mappingIndex];
+		if (mapping->sequenceId==MAPPING_STORE_WINDOW_MARK || mapping->lineOffset<0) {
+			continue;
+		}
+		SequenceInfo* sequenceInfo = verticalSequenceInfos+mapping->sequenceId;
+		if (sequenceInfo->passingMappings<=store->maxReadMappings &&
+				mapping->score>=sequenceInfo->bestSWScore*store->withinTopPercent) {
+			sequenceInfo->passingMappings ++;
+		}
+	}
+}
+
+void writeStoredMappings(MappingStore* store, FILE* outputFilePtr) {
+	guint32 mappingIndex;
+	countPassingMappings(store);
+	if (store->spillFilePtr!=NULL) {
+		addMetric(MetricSpilledBytes, ftell(store->spillFilePtr));
+		fclose(store->spillFilePtr);
+		store->spillFilePtr = NULL;
+		filterOutput(store->spillFileName, outputFilePtr, store->verticalSequenceInfos,
+				store->maxReadMappings, store->withinTopPercent, store->keepWindowMarks);
+		unlink(store->spillFileName);
+		return;
+	}
+	for (mappingIndex=0; mappingIndex<store->numberOfMappings; mappingIndex++) {
+		StoredMapping* mapping = &store->mappings[mappingIndex];
+		if (mapping->sequenceId==MAPPING_STORE_WINDOW_MARK) {
+			// keep the window marks for merging the read batches
+			writeMappingRecord(outputFilePtr, MAPPING_STORE_WINDOW_MARK, mapping->score, NULL, 0);
+			continue;
+		}
+		if (mapping->lineOffset<0) {
+			continue;
+		}
+		SequenceInfo* sequenceInfo = store->verticalSequenceInfos+mapping->sequenceId;
+		if (sequenceInfo->passingMappings<=store->maxReadMappings &&
+				mapping->score>=sequenceInfo->bestSWScore*store->withinTopPercent) {
+			const char* record = store->lines+mapping->lineOffset;
+			if (store->keepWindowMarks) {
+				fwrite(record, 1, mapping->lineSize, outputFilePtr);
+			} else {
+				fwrite(record+sizeof(MappingRecord), 1, mapping->lineSize-sizeof(MappingRecord), outputFilePtr);
+			}
+		}
+	}
+	store->numberOfMappings = 0;
+	store->linesSize = 0;
+}
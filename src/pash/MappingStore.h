@@ -0,0 +1,136 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_MAPPING_STORE_H
+#define PASH_MAPPING_STORE_H
+
+/***********************************************************************
+ * MappingStore.h
+ * Mapping records of a scan, kept in memory until the best scores of the
+ * reads are final, then filtered as filterOutput does and written in
+ * scan order in a single pass.
+ *
+ * A mapping record is a MappingRecord header followed by the output of
+ * the mapping, a SAM line or a BAM record; the store does not look into
+ * the output, and the lines it talks about below are these records.
+ *
+ * A read only keeps the lines that may be reported: lines below its
+ * reporting threshold are evicted once its best score rises, and once it
+ * has more than maxMappings lines at or above some score s, the lines at
+ * or below s are evicted and the read is rejected should its threshold
+ * fall to s or below. Evicted lines leave holes in the line arena that are
+ * compacted away when the memory limit is reached; if the retained lines
+ * still fill half of the limit, they are spilled to a temporary file in
+ * the scan order and filtered with filterOutput at the end.
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "SequenceInfo.h"
+#include "PashLib.h"
+
+/// Read id of a window mark.
+#define MAPPING_STORE_WINDOW_MARK G_MAXUINT32
+
+/** Header of a mapping record, followed by outputSize bytes of output.*/
+typedef struct {
+	/// Read of the mapping; MAPPING_STORE_WINDOW_MARK for a window mark, which has no output.
+	guint32 sequenceId;
+	/// Alignment score of the mapping; index of the reference window of a mark.
+	guint32 score;
+	guint32 outputSize;
+} MappingRecord;
+
+/** Size of a mapping record, header included.*/
+static inline size_t mappingRecordSize(const char* record) {
+	MappingRecord header;
+	memcpy(&header, record, sizeof(MappingRecord));
+	return sizeof(MappingRecord)+header.outputSize;
+}
+
+/** Write a mapping record.*/
+void writeMappingRecord(FILE* filePtr, guint32 sequenceId, guint32 score, const char* output, guint32 outputSize);
+
+/** Read the next mapping record of a file.
+@param header header of the record
+@param output output of the record, grown as needed
+@param outputCapacity size of output; updated
+@return 1 if a record was read, 0 at the end of the file*/
+int readMappingRecord(FILE* filePtr, MappingRecord* header, char** output, size_t* outputCapacity);
+
+/** Mapping line of a read, or reference window mark, in scan order.*/
+typedef struct {
+	/// Read of the line; MAPPING_STORE_WINDOW_MARK for a window mark.
+	guint32 sequenceId;
+	/// Alignment score of the line; index of the reference window of a mark.
+	guint32 score;
+	/// Offset of the line in the line arena; -1 once evicted.
+	long lineOffset;
+	/// Size of the mapping record.
+	guint32 lineSize;
+	/// Previous retained line of the same read.
+	guint32 previousMappingOfRead;
+} StoredMapping;
+
+/** Retained lines of a read.*/
+typedef struct {
+	/// Last retained line of the read.
+	guint32 lastMapping;
+	guint32 retainedMappings;
+	/// The read has more than maxMappings mappings at or above this score; -1 if not known.
+	int rejectedScore;
+} StoredRead;
+
+typedef struct {
+	SequenceInfo* verticalSequenceInfos;
+	guint32 maxReadMappings;
+	double withinTopPercent;
+	/// Whether the written records keep their header, and the window marks are written.
+	int keepWindowMarks;
+	StoredMapping* mappings;
+	guint32 numberOfMappings;
+	guint32 mappingsCapacity;
+	/// Mapping records of the stored mappings.
+	char* lines;
+	size_t linesSize;
+	size_t linesCapacity;
+	StoredRead* reads;
+	guint32 readsCapacity;
+	/// Memory of the lines and mappings above which they are compacted, or spilled.
+	size_t memoryLimit;
+	/// Lines and window marks stored so far, including the spilled ones.
+	unsigned long storedLines;
+	/// Temporary file of the lines, once spilled; NULL while they fit in memory.
+	FILE* spillFilePtr;
+	char spillFileName[MAX_FILE_NAME_SIZE];
+} MappingStore;
+
+/** Create an empty mapping store.
+@param verticalSequenceInfos best scores of the reads
+@param maxReadMappings reads with more reportable mappings are not reported
+@param withinTopPercent fraction of the best score of a read that a reported mapping reaches
+@param memoryLimit memory of the lines, in MB
+@param spillFileName temporary file of the lines should they not fit in memory
+@param keepWindowMarks write whole mapping records and the window marks, to merge read batches later
+ */
+MappingStore* createMappingStore(SequenceInfo* verticalSequenceInfos, guint32 maxReadMappings,
+		double withinTopPercent, guint32 memoryLimit, const char* spillFileName, int keepWindowMarks);
+
+/** Store a mapping record.*/
+void storeMappingRecord(MappingStore* store, const char* record);
+
+/** Store the mark following the lines of a reference window.*/
+void storeWindowMark(MappingStore* store, guint32 windowIndex);
+
+/** Write the reported mappings of the reads in the order they were stored, once the best scores of the
+ * reads are final: their output, or their whole records and the window marks if keepWindowMarks is set.*/
+void writeStoredMappings(MappingStore* store, FILE* outputFilePtr);
+
+void freeMappingStore(MappingStore* store);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+/***********************************************************************
+ * Metrics.cpp
+ * Per-thread run metrics and their JSON report
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "Metrics.h"
+
+__thread Metrics threadMetrics;
+
+/** Totals of the threads merged so far.*/
+static Metrics runMetrics;
+static pthread_mutex_t runMetricsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Names of the timers and counters in the report, in the order of their enumerations.*/
+static const char* metricTimerNames[NUMBER_OF_METRIC_TIMERS] = {
+	"loadReads", "kmerCounting", "sizingPass", "fillPass", "genomeScan", "collation", "smithWaterman", "filterOutput"
+};
+static const char* metricCounterNames[NUMBER_OF_METRIC_COUNTERS] = {
+	"referenceWindows", "windowHits", "heapOperations", "kmerAlignments", "poorAnchorings", "skeletonFiltered",
+	"swCalls", "failedSWCalls", "predictedSkeletonFailures", "swScores", "stoppedSWScores", "swTracebacks",
+	"ungappedAlignments", "swCells", "bytesRead", "bytesWritten", "spilledBytes"
+};
+
+double metricTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec+now.tv_nsec*1e-9;
+}
+
+void mergeThreadMetrics() {
+	int i;
+	pthread_mutex_lock(&runMetricsLock);
+	for (i=0; i<NUMBER_OF_METRIC_TIMERS; i++) {
+		runMetrics.seconds[i] += threadMetrics.seconds[i];
+	}
+	for (i=0; i<NUMBER_OF_METRIC_COUNTERS; i++) {
+		runMetrics.counters[i] += threadMetrics.counters[i];
+	}
+	pthread_mutex_unlock(&runMetricsLock);
+	memset(&threadMetrics, 0, sizeof(Metrics));
+}
+
+int writeMetricsJson(const char* fileName, int numberOfThreads, double wallSeconds) {
+	int i;
+	mergeThreadMetrics();
+	FILE* filePtr = fopen(fileName, "wt");
+	if (filePtr==NULL) {
+		return 1;
+	}
+	fprintf(filePtr, "{\n  \"threads\": %d,\n  \"wallSeconds\": %.6f,\n  \"seconds\": {\n", numberOfThreads, wallSeconds);
+	for (i=0; i<NUMBER_OF_METRIC_TIMERS; i++) {
+		fprintf(filePtr, "    \"%s\": %.6f%s\n", metricTimerNames[i], runMetrics.seconds[i],
+				i+1<NUMBER_OF_METRIC_TIMERS ? "," : "");
+	}
+	fprintf(filePtr, "  },\n  \"counters\": {\n");
+	for (i=0; i<NUMBER_OF_METRIC_COUNTERS; i++) {
+		fprintf(filePtr, "    \"%s\": %lu%s\n", metricCounterNames[i], runMetrics.counters[i],
+				i+1<NUMBER_OF_METRIC_COUNTERS ? "," : "");
+	}
+	fprintf(filePtr, "  }\n}\n");
+	return fclose(filePtr)==0 ? 0 : 1;
+}
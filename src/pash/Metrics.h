@@ -0,0 +1,111 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_METRICS_H
+#define PASH_METRICS_H
+
+/***********************************************************************
+ * Metrics.h
+ * Run metrics: the time spent in each stage of the mapping and the
+ * counts of the work done by the scan, to compare runs across builds.
+ *
+ * Every thread accumulates its metrics in thread local storage, without
+ * locking; a thread merges them into the totals of the run before it
+ * exits, and the main thread when the report is written. The timers are
+ * measured on a monotonic clock, and the collation time includes the
+ * Smith-Waterman time. The genome scan time is wall time of the main
+ * thread, while the times of the stages run by several threads add up the
+ * seconds of all of them: with --threads, the collation and Smith-Waterman
+ * times are summed over the scanning threads and can exceed the scan time.
+ ***********************************************************************/
+
+#include <stdio.h>
+
+/** Stages of the mapping.*/
+typedef enum {
+	/** Parsing the reads, including the kmer counting pass of batched runs.*/
+	MetricLoadReads,
+	/** Counting the kmers of all the reads to size the read batches, parsing the reads included.*/
+	MetricKmerCounting,
+	/** Counting the kmers of a read batch and allocating its hash.*/
+	MetricSizingPass,
+	/** Filling the hash of a read batch.*/
+	MetricFillPass,
+	/** Scanning the reference against the hash of a read batch, until the mappings are written.*/
+	MetricGenomeScan,
+	/** Collating the kmer matches of the reference windows.*/
+	MetricCollation,
+	/** Scoring and tracing back the candidate alignments.*/
+	MetricSmithWaterman,
+	/** Filtering the stored mappings into the output, and merging the outputs of the read batches.*/
+	MetricFilterOutput,
+	NUMBER_OF_METRIC_TIMERS
+} MetricTimer;
+
+/** Counts of the work done.*/
+typedef enum {
+	MetricReferenceWindows,
+	/** Kmers of the reference windows found in the hash.*/
+	MetricWindowHits,
+	/** Kmer matches taken off the match stream heap, or off the sorted matches.*/
+	MetricHeapOperations,
+	/** Kmer level alignments of the collated reads, or anchorings.*/
+	MetricKmerAlignments,
+	MetricPoorAnchorings,
+	/** Candidate alignments failing the skeleton filter.*/
+	MetricSkeletonFiltered,
+	/** Candidate alignments replayed against the best scores of their read, and the ones below target.*/
+	MetricSWCalls,
+	MetricFailedSWCalls,
+	/** Failed candidate alignments whose skeleton score was below 90% of the best skeleton score.*/
+	MetricPredictedSkeletonFailures,
+	MetricSWScores,
+	MetricStoppedSWScores,
+	MetricSWTracebacks,
+	MetricUngappedAlignments,
+	/** Dynamic programming cells in the bands of the scored and traced back alignments.*/
+	MetricSWCells,
+	/** Decoded bytes of the read and reference files.*/
+	MetricBytesRead,
+	/** Bytes of the output file, and of the temporary file of the mappings exceeding the output memory.*/
+	MetricBytesWritten,
+	MetricSpilledBytes,
+	NUMBER_OF_METRIC_COUNTERS
+} MetricCounter;
+
+typedef struct {
+	double seconds[NUMBER_OF_METRIC_TIMERS];
+	unsigned long counters[NUMBER_OF_METRIC_COUNTERS];
+} Metrics;
+
+/** Metrics of the calling thread, not merged yet.*/
+extern __thread Metrics threadMetrics;
+
+/** Monotonic time, in seconds.*/
+double metricTime();
+
+static inline void addMetric(MetricCounter counter, unsigned long value) {
+	threadMetrics.counters[counter] += value;
+}
+
+/** Add the time elapsed since a start time, taken by metricTime, to a timer.*/
+static inline void addMetricTime(MetricTimer timer, double startTime) {
+	threadMetrics.seconds[timer] += metricTime()-startTime;
+}
+
+/** Add the metrics of the calling thread to the totals of the run, and reset them.*/
+void mergeThreadMetrics();
+
+/** Write the totals of the run, with the metrics of the calling thread merged, as a JSON object.
+@param fileName report file
+@param numberOfThreads threads of the run
+@param wallSeconds elapsed time of the run
+@return 0 for success, 1 if the file could not be written
+ */
+int writeMetricsJson(const char* fileName, int numberOfThreads, double wallSeconds);
+
+#endif
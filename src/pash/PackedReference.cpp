@@ -0,0 +1,307 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+/***********************************************************************
+ * PackedReference.cpp
+ * packing the horizontal sequences, decoding reference windows, and
+ * saving and mapping packed reference files
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "PashDebug.h"
+#include "PackedReference.h"
+
+#define DEB_PACKED_REFERENCE 0
+
+/** Append a sequence to a packed reference, growing its sequence table.*/
+static PackedReferenceSequence* addPackedReferenceSequence(PackedReference* ref, guint32* sequencesCapacity,
+		const char* name, guint64* namesCapacity) {
+	size_t nameLength = strlen(name);
+	ref->numberOfSequences++;
+	if (ref->numberOfSequences>=*sequencesCapacity) {
+		*sequencesCapacity = 2*(*sequencesCapacity)+1;
+		ref->sequences = (PackedReferenceSequence*) realloc(ref->sequences, *sequencesCapacity*sizeof(PackedReferenceSequence));
+		xDieIfNULL(ref->sequences, fprintf(stderr, "could not allocate memory for the packed reference at %s:%d\n",
+				__FILE__, __LINE__), 2);
+	}
+	if (ref->namesSize+nameLength+1>*namesCapacity) {
+		*namesCapacity = 2*(*namesCapacity)+nameLength+1;
+		ref->names = (char*) realloc(ref->names, *namesCapacity);
+		xDieIfNULL(ref->names, fprintf(stderr, "could not allocate memory for the packed reference at %s:%d\n",
+				__FILE__, __LINE__), 2);
+	}
+	PackedReferenceSequence* sequence = &ref->sequences[ref->numberOfSequences];
+	memset(sequence, 0, sizeof(PackedReferenceSequence));
+	sequence->nameOffset = ref->namesSize;
+	memcpy(ref->names+ref->namesSize, name, nameLength+1);
+	ref->namesSize += nameLength+1;
+	sequence->firstWord = ref->numberOfWords;
+	sequence->firstRun = ref->numberOfRuns;
+	return sequence;
+}
+
+/** Pack all the sequences of a FastaUtil. The sequences are read chunk by chunk as the scan does,
+ * so the packed reference decodes to the exact characters the scan would see.
+@param fastaUtil horizontal sequences; rewound and parsed to the end
+@return packed reference; exits on failure
+*/
+PackedReference* packFastaUtil(FastaUtil* fastaUtil) {
+	PackedReference* ref = (PackedReference*) calloc(1, sizeof(PackedReference));
+	xDieIfNULL(ref, fprintf(stderr, "could not allocate memory for the packed reference at %s:%d\n",
+			__FILE__, __LINE__), 2);
+	guint32 sequencesCapacity = fastaUtil->numberOfSequences+1;
+	guint64 namesCapacity = 0, wordsCapacity = 0;
+	guint32 runsCapacity = 0, i;
+	for (i=1; i<=fastaUtil->numberOfSequences; i++) {
+		wordsCapacity += (fastaUtil->sequencesInformation[i].sequenceLength+15)/16;
+	}
+	ref->sequences = (PackedReferenceSequence*) malloc(sequencesCapacity*sizeof(PackedReferenceSequence));
+	ref->packedBases = (guint32*) malloc((wordsCapacity+1)*sizeof(guint32));
+	xDieIfNULL(ref->sequences, fprintf(stderr, "could not allocate memory for the packed reference at %s:%d\n",
+			__FILE__, __LINE__), 2);
+	xDieIfNULL(ref->packedBases, fprintf(stderr, "could not allocate memory for the packed reference at %s:%d\n",
+			__FILE__, __LINE__), 2);
+	wordsCapacity++;
+
+	PackedReferenceSequence* sequence = NULL;
+	guint32 position = 0;
+	rewindFastaUtil(fastaUtil);
+	while (!fastaUtil->parsingDone) {
+		fastaUtilKeepPartialBuffer(fastaUtil, 0);
+		nextChunkFastaUtil(fastaUtil);
+		guint32 chunkLength = fastaUtil->currentSequenceBufferPos;
+		if (chunkLength==0) {
+			continue;
+		}
+		if (fastaUtil->currentActualSequencePos==chunkLength) {
+			// the chunk starts a new sequence
+			if (sequence!=NULL) {
+				sequence->length = position;
+			}
+			fastaUtil->deflineBuffer[fastaUtil->currentDeflineBufferPos]='\0';
+			sequence = addPackedReferenceSequence(ref, &sequencesCapacity, fastaUtil->deflineBuffer, &namesCapacity);
+			position = 0;
+		}
+		if (ref->numberOfWords+(position%16+chunkLength+15)/16>wordsCapacity) {
+			wordsCapacity = 2*wordsCapacity+chunkLength/16+1;
+			ref->packedBases = (guint32*) realloc(ref->packedBases, wordsCapacity*sizeof(guint32));
+			xDieIfNULL(ref->packedBases, fprintf(stderr, "could not allocate memory for the packed reference at %s:%d\n",
+					__FILE__, __LINE__), 2);
+		}
+		for (i=0; i<chunkLength; i++, position++) {
+			char base = fastaUtil->sequenceBuffer[i];
+			guint32 code;
+			if (position%16==0) {
+				ref->packedBases[ref->numberOfWords++] = 0;
+			}
+			switch(base) {
+				case 'A': code = 0; break;
+				case 'C': code = 1; break;
+				case 'G': code = 2; break;
+				case 'T': code = 3; break;
+				default:
+					code = 0;
+					if (sequence->numberOfRuns>0 && ref->runs[ref->numberOfRuns-1].base==base &&
+							ref->runs[ref->numberOfRuns-1].position+ref->runs[ref->numberOfRuns-1].length==position) {
+						ref->runs[ref->numberOfRuns-1].length++;
+					} else {
+						if (ref->numberOfRuns==runsCapacity) {
+							runsCapacity = 2*runsCapacity+1024;
+							ref->runs = (PackedReferenceRun*) realloc(ref->runs, runsCapacity*sizeof(PackedReferenceRun));
+							xDieIfNULL(ref->runs, fprintf(stderr, "could not allocate memory for the packed reference at %s:%d\n",
+									__FILE__, __LINE__), 2);
+						}
+						PackedReferenceRun* run = &ref->runs[ref->numberOfRuns++];
+						memset(run, 0, sizeof(PackedReferenceRun));
+						run->position = position;
+						run->length = 1;
+						run->base = base;
+						sequence->numberOfRuns++;
+					}
+					break;
+			}
+			ref->packedBases[ref->numberOfWords-1] |= code<<(2*(position%16));
+		}
+	}
+	if (sequence!=NULL) {
+		sequence->length = position;
+	}
+	xDEBUG(DEB_PACKED_REFERENCE, fprintf(stderr, "packed %u sequences in %llu words, %u runs of other bases\n",
+			ref->numberOfSequences, (unsigned long long) ref->numberOfWords, ref->numberOfRuns));
+	return ref;
+}
+
+/** Decode a stretch of a packed sequence.
+@param packedReference packed reference
+@param sequenceIndex sequence, starting at 1
+@param start first position to decode
+@param length number of bases to decode; start+length must not exceed the sequence length
+@param buffer receives the bases; not terminated
+*/
+void decodePackedReference(PackedReference* packedReference, guint32 sequenceIndex,
+		guint32 start, guint32 length, char* buffer) {
+	static const char bases[4] = {'A', 'C', 'G', 'T'};
+	PackedReferenceSequence* sequence = &packedReference->sequences[sequenceIndex];
+	const guint32* words = packedReference->packedBases+sequence->firstWord;
+	guint32 i, position;
+	for (i=0, position=start; i<length; i++, position++) {
+		buffer[i] = bases[(words[position/16]>>(2*(position%16)))&3];
+	}
+	// restore the other bases from the first run ending after start
+	PackedReferenceRun* runs = packedReference->runs+sequence->firstRun;
+	guint32 low = 0, high = sequence->numberOfRuns;
+	while (low<high) {
+		guint32 middle = (low+high)/2;
+		if (runs[middle].position+runs[middle].length<=start) {
+			low = middle+1;
+		} else {
+			high = middle;
+		}
+	}
+	for (; low<sequence->numberOfRuns && runs[low].position<start+length; low++) {
+		guint32 runStart = runs[low].position<start ? start : runs[low].position;
+		guint32 runStop = runs[low].position+runs[low].length;
+		if (runStop>start+length) {
+			runStop = start+length;
+		}
+		memset(buffer+runStart-start, runs[low].base, runStop-runStart);
+	}
+}
+
+/** Save a packed reference to a file.
+@param packedReference packed reference
+@param referenceFile packed reference file name
+@return 0 for success; exits on failure
+*/
+int writePackedReference(PackedReference* packedReference, const char* referenceFile) {
+	PackedReferenceHeader header;
+	PackedReferenceSequence unusedSequence;
+	memset(&header, 0, sizeof(PackedReferenceHeader));
+	memcpy(header.magic, PACKED_REFERENCE_MAGIC, sizeof(header.magic));
+	header.version = PACKED_REFERENCE_VERSION;
+	header.headerSize = sizeof(PackedReferenceHeader);
+	header.numberOfSequences = packedReference->numberOfSequences;
+	header.numberOfRuns = packedReference->numberOfRuns;
+	header.numberOfWords = packedReference->numberOfWords;
+	header.namesSize = packedReference->namesSize;
+	memset(&unusedSequence, 0, sizeof(PackedReferenceSequence));
+
+	FILE* referenceFilePtr = fopen(referenceFile, "wb");
+	xDieIfNULL(referenceFilePtr, fprintf(stderr, "could not open packed reference file %s\n", referenceFile), 2);
+	int failed = fwrite(&header, sizeof(PackedReferenceHeader), 1, referenceFilePtr)!=1 ||
+			fwrite(&unusedSequence, sizeof(PackedReferenceSequence), 1, referenceFilePtr)!=1 ||
+			fwrite(packedReference->sequences+1, sizeof(PackedReferenceSequence), header.numberOfSequences,
+					referenceFilePtr)!=header.numberOfSequences ||
+			fwrite(packedReference->runs, sizeof(PackedReferenceRun), header.numberOfRuns,
+					referenceFilePtr)!=header.numberOfRuns ||
+			fwrite(packedReference->packedBases, sizeof(guint32), header.numberOfWords,
+					referenceFilePtr)!=header.numberOfWords ||
+			fwrite(packedReference->names, 1, header.namesSize, referenceFilePtr)!=header.namesSize;
+	if (fclose(referenceFilePtr) || failed) {
+		xDie(fprintf(stderr, "could not write packed reference file %s\n", referenceFile), 2);
+	}
+	xDEBUG(DEB_PACKED_REFERENCE, fprintf(stderr, "saved packed reference of %u sequences to %s\n",
+			header.numberOfSequences, referenceFile));
+	return 0;
+}
+
+/** Map a packed reference file. Only the header and the sequence table are checked, so the startup
+ * cost depends on the number of sequences; the bases are paged in by the scan.
+@param referenceFile packed reference file name
+@return packed reference; exits on failure
+*/
+PackedReference* mapPackedReference(const char* referenceFile) {
+	struct stat referenceStat;
+	guint32 i;
+	int referenceFd = open(referenceFile, O_RDONLY);
+	if (referenceFd<0 || fstat(referenceFd, &referenceStat)) {
+		xDie(fprintf(stderr, "could not open packed reference file %s\n", referenceFile), 2);
+	}
+	size_t referenceSize = referenceStat.st_size;
+	if (referenceSize<sizeof(PackedReferenceHeader)) {
+		xDie(fprintf(stderr, "%s is not a pash packed reference\n", referenceFile), 1);
+	}
+	void* referenceImage = mmap(NULL, referenceSize, PROT_READ, MAP_SHARED, referenceFd, 0);
+	if (referenceImage==MAP_FAILED) {
+		xDie(fprintf(stderr, "could not map packed reference file %s\n", referenceFile), 2);
+	}
+	close(referenceFd);
+	madvise(referenceImage, referenceSize, MADV_SEQUENTIAL);
+
+	PackedReferenceHeader* header = (PackedReferenceHeader*) referenceImage;
+	if (memcmp(header->magic, PACKED_REFERENCE_MAGIC, sizeof(header->magic))) {
+		xDie(fprintf(stderr, "%s is not a pash packed reference\n", referenceFile), 1);
+	}
+	if (header->version!=PACKED_REFERENCE_VERSION || header->headerSize!=sizeof(PackedReferenceHeader)) {
+		xDie(fprintf(stderr, "packed reference %s has version %u, expected version %u\n",
+				referenceFile, header->version, PACKED_REFERENCE_VERSION), 1);
+	}
+	guint64 sequencesOffset = sizeof(PackedReferenceHeader);
+	guint64 runsOffset = sequencesOffset+((guint64)header->numberOfSequences+1)*sizeof(PackedReferenceSequence);
+	guint64 wordsOffset = runsOffset+(guint64)header->numberOfRuns*sizeof(PackedReferenceRun);
+	guint64 namesOffset = wordsOffset+header->numberOfWords*sizeof(guint32);
+	if (namesOffset+header->namesSize!=referenceSize) {
+		xDie(fprintf(stderr, "packed reference %s is corrupted\n", referenceFile), 1);
+	}
+
+	PackedReference* ref = (PackedReference*) calloc(1, sizeof(PackedReference));
+	xDieIfNULL(ref, fprintf(stderr, "could not allocate memory for the packed reference at %s:%d\n",
+			__FILE__, __LINE__), 2);
+	char* image = (char*) referenceImage;
+	ref->numberOfSequences = header->numberOfSequences;
+	ref->sequences = (PackedReferenceSequence*) (image+sequencesOffset);
+	ref->runs = (PackedReferenceRun*) (image+runsOffset);
+	ref->numberOfRuns = header->numberOfRuns;
+	ref->packedBases = (guint32*) (image+wordsOffset);
+	ref->numberOfWords = header->numberOfWords;
+	ref->names = image+namesOffset;
+	ref->namesSize = header->namesSize;
+	ref->mappedImage = referenceImage;
+	ref->mappedSize = referenceSize;
+	for (i=1; i<=ref->numberOfSequences; i++) {
+		PackedReferenceSequence* sequence = &ref->sequences[i];
+		if (sequence->length==0 || sequence->nameOffset>=ref->namesSize ||
+				sequence->firstWord+(sequence->length+15)/16>ref->numberOfWords ||
+				(guint64)sequence->firstRun+sequence->numberOfRuns>ref->numberOfRuns) {
+			xDie(fprintf(stderr, "packed reference %s is corrupted\n", referenceFile), 1);
+		}
+	}
+	if (ref->namesSize>0 && ref->names[ref->namesSize-1]!='\0') {
+		xDie(fprintf(stderr, "packed reference %s is corrupted\n", referenceFile), 1);
+	}
+	return ref;
+}
+
+/** Whether a horizontal sequence file is a packed reference, judging by its suffix.*/
+int isPackedReferenceFile(const char* fileName) {
+	size_t fileNameLength = strlen(fileName);
+	size_t suffixLength = strlen(PACKED_REFERENCE_SUFFIX);
+	return fileNameLength>=suffixLength && !strcmp(fileName+fileNameLength-suffixLength, PACKED_REFERENCE_SUFFIX);
+}
+
+/** Release a packed reference.*/
+void freePackedReference(PackedReference* packedReference) {
+	if (packedReference==NULL) {
+		return;
+	}
+	if (packedReference->mappedImage!=NULL) {
+		munmap(packedReference->mappedImage, packedReference->mappedSize);
+		free(packedReference);
+		return;
+	}
+	free(packedReference->sequences);
+	free(packedReference->names);
+	free(packedReference->packedBases);
+	free(packedReference->runs);
+	free(packedReference);
+}
@@ -0,0 +1,99 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_PACKED_REFERENCE_H
+#define PASH_PACKED_REFERENCE_H
+
+/***********************************************************************
+ * PackedReference.h
+ * Horizontal sequences kept in memory 2-bit packed, so that they can be
+ * scanned repeatedly without parsing the FASTA files again, and the
+ * .pash2bit file holding a packed reference, mapped by later runs.
+ ***********************************************************************/
+
+#include <glib.h>
+#include "FastaUtil.h"
+
+/** Run of identical bases other than ACGT, which the 2 bits per base cannot hold.*/
+typedef struct {
+	/// First position of the run in its sequence.
+	guint32 position;
+	guint32 length;
+	/// Base of the run, as parsed from the FASTA file (typically N).
+	char base;
+	char reserved[3];
+} PackedReferenceRun;
+
+/** Horizontal sequence of a packed reference.*/
+typedef struct {
+	/// Offset of the sequence name in the names of the reference.
+	guint64 nameOffset;
+	/// First word of the sequence in the packed bases.
+	guint64 firstWord;
+	guint32 length;
+	/// Runs of bases other than ACGT of the sequence, sorted by position.
+	guint32 firstRun;
+	guint32 numberOfRuns;
+	guint32 reserved;
+} PackedReferenceSequence;
+
+#define PACKED_REFERENCE_MAGIC "PASH2BIT"
+#define PACKED_REFERENCE_VERSION 1
+/// Horizontal sequence files with this suffix are packed references rather than FASTA files.
+#define PACKED_REFERENCE_SUFFIX ".pash2bit"
+
+/** Header of a packed reference file. It is followed by the sequence table, indexed from 1 with an
+ * unused entry 0, the runs of other bases, the packed bases and the sequence names. All fields are
+ * in the byte order of the machine writing the file.*/
+typedef struct {
+	char magic[8];
+	guint32 version;
+	guint32 headerSize;
+	guint32 numberOfSequences;
+	guint32 numberOfRuns;
+	guint64 numberOfWords;
+	guint64 namesSize;
+} PackedReferenceHeader;
+
+/** Packed reference: 16 bases per 32-bit word, A=0 C=1 G=2 T=3 from the low bits up, each sequence
+ * starting on a word boundary, and a table of the runs of other bases.*/
+typedef struct {
+	guint32 numberOfSequences;
+	/// Sequences, indexed from 1 as the horizontal sequences information of FastaUtil.
+	PackedReferenceSequence* sequences;
+	/// Sequence names, as reported in the output, each followed by '\0'.
+	char* names;
+	guint64 namesSize;
+	guint32* packedBases;
+	guint64 numberOfWords;
+	PackedReferenceRun* runs;
+	guint32 numberOfRuns;
+	/// File mapping holding the tables, if the reference was mapped from a file.
+	void* mappedImage;
+	size_t mappedSize;
+} PackedReference;
+
+/// Pack all the sequences of a FastaUtil; the FastaUtil is rewound and parsed to the end.
+PackedReference* packFastaUtil(FastaUtil* fastaUtil);
+/// Decode a stretch of a packed sequence into a buffer, without terminating it.
+void decodePackedReference(PackedReference* packedReference, guint32 sequenceIndex,
+		guint32 start, guint32 length, char* buffer);
+/// Save a packed reference to a file.
+int writePackedReference(PackedReference* packedReference, const char* referenceFile);
+/// Map a packed reference file; the tables are used in place from the mapping.
+PackedReference* mapPackedReference(const char* referenceFile);
+/// Whether a horizontal sequence file is a packed reference, judging by its suffix.
+int isPackedReferenceFile(const char* fileName);
+/// Release a packed reference.
+void freePackedReference(PackedReference* packedReference);
+
+/** Name of a sequence of a packed reference.*/
+static inline const char* packedReferenceSequenceName(PackedReference* packedReference, guint32 sequenceIndex) {
+	return packedReference->names+packedReference->sequences[sequenceIndex].nameOffset;
+}
+
+#endif
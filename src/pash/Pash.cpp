@@ -17,6 +17,7 @@ See the included file LICENSE for details.
 
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <glib.h>
@@ -26,10 +27,20 @@ See the included file LICENSE for details.
 
 #include "PashLib.h"
 #include "PashDebug.h"
+#include "ReadIndex.h"
+#include "HiveHash.h"
+#include "BandedSW.h"
+#include "InputReader.h"
+#include "BgzfWriter.h"
+#include "BamOutput.h"
+#include "Metrics.h"
 
 #define DEB_MAIN 1 
 
 int runPash(int argc, char** argv);
+static void mapReadBatches(PashParameters* pashParams);
+static void writeOutputHeader(PashParameters* pashParams, guint32 numberOfHorizontalSequences);
+static void writeRunMetrics(PashParameters* pashParams, double runStartTime);
 
 int main(int argc, char** argv) {
   int result;
@@ -39,35 +50,51 @@ int main(int argc, char** argv) {
 
 int runPash(int argc, char** argv) {
   PashParameters *pashParams;
+  double runStartTime = metricTime();
   pashParams = parseCommandLine(argc, argv);
 
   printNow();
-  pashParams->outputFilePtr = fopen(pashParams->outputFile, "wt");
+  fprintf(stderr, "banded Smith-Waterman kernel: %s, %d alignments per batch\n", bandedSWKernelName(), bandedSWBatchLanes());
+  if (pashParams->useGzippedOutput || pashParams->useBamOutput) {
+    pashParams->outputFilePtr = openBgzfOutputFile(pashParams->outputFile, pashParams->numberOfThreads);
+  } else {
+    pashParams->outputFilePtr = fopen(pashParams->outputFile, "wt");
+  }
   if (pashParams->outputFilePtr==NULL) {
     fprintf(stderr, "could not open temporary output file %s\n", pashParams->outputFile);
     fflush(stderr);
     exit(2);
   }
 
+  setInputDecoderThreads(pashParams->numberOfThreads);
   pashParams->verticalFastqUtil = new PashFastqUtil(pashParams->verticalFile, FastaAndQualityScores);
-  pashParams->verticalFastqUtil->loadSequences(1);
+  if (!pashParams->mapReadsInBatches) {
+    pashParams->verticalFastqUtil->loadSequences(1, pashParams->packedReads);
+  }
 
   fprintf(stderr, "initialized  vertical sequence util\n");
   printNow();
-  pashParams->fastaUtilHorizontal = initFastaUtil(pashParams->horizontalFile);
+  guint32 numberOfHorizontalSequences;
+  if (isPackedReferenceFile(pashParams->horizontalFile)) {
+    pashParams->packedReferenceHorizontal = mapPackedReference(pashParams->horizontalFile);
+    numberOfHorizontalSequences = pashParams->packedReferenceHorizontal->numberOfSequences;
+    fprintf(stderr, "mapped packed reference %s: %u sequences\n", pashParams->horizontalFile, numberOfHorizontalSequences);
+  } else {
+    pashParams->fastaUtilHorizontal = initFastaUtil(pashParams->horizontalFile);
+    numberOfHorizontalSequences = pashParams->fastaUtilHorizontal->numberOfSequences;
+  }
   fprintf(stderr, "initialized  horizontal sequence util\n");
   printNow();
 
-  // print SAM header
-  fprintf(pashParams->outputFilePtr, "@HD\tVN:1.0\n");
-  fprintf(pashParams->outputFilePtr, "@PG\tID:pash3\tPN:Pash\tVN:3.01.03\n");
-  //fprintf(pashParams->outputFilePtr, "@RG\tID:--\tCN:BRL\n");
-  for ( unsigned i = 1;  i <= pashParams->fastaUtilHorizontal->numberOfSequences;  ++i ) {
-    char const * name = pashParams->fastaUtilHorizontal->sequencesInformation[i].sequenceName;
-    if ( strncmp(name, "#RC.pash.", 9) == 0 ) continue;
-    fprintf(pashParams->outputFilePtr, "@SQ\tSN:%s\tLN:%u\n", name, pashParams->fastaUtilHorizontal->sequencesInformation[i].sequenceLength);
+  writeOutputHeader(pashParams, numberOfHorizontalSequences);
+
+  if (pashParams->mapReadsInBatches) {
+    mapReadBatches(pashParams);
+    fclose(pashParams->outputFilePtr);
+    writeRunMetrics(pashParams, runStartTime);
+    return 0;
   }
-  
+
   SequenceHash * horizontalSequenceHash = initSequenceHash();
   pashParams->lastVerticalSequenceMapped = 0;
   guint32 numberOfVerticalReads = pashParams->verticalFastqUtil->getNumberOfSequences();
@@ -76,12 +103,21 @@ int runPash(int argc, char** argv) {
     fprintf(stderr,"could not allocate memory for the reads\n");
     exit(2);
   }
-  // load as much stuff into memory as specified by user
-  xDEBUG(DEB_MAIN, fprintf(stderr, "starting hashed the vertical sequence\n"));
-  sizeCurrentVerticalSequencesBatch(pashParams);
-  hashCurrentVerticalSequencesBatch(pashParams);
-  xDEBUG(DEB_MAIN, fprintf(stderr, "done hashed the vertical sequence\n"));
-  fprintf(stderr, "hashed the vertical sequence\n");
+  if (strlen(pashParams->loadReadIndexFile)>0) {
+    loadReadIndex(pashParams, pashParams->loadReadIndexFile);
+  } else {
+    // load as much stuff into memory as specified by user
+    xDEBUG(DEB_MAIN, fprintf(stderr, "starting hashed the vertical sequence\n"));
+    loadIgnoreList(pashParams);
+    sizeCurrentVerticalSequencesBatch(pashParams);
+    hashCurrentVerticalSequencesBatch(pashParams);
+    xDEBUG(DEB_MAIN, fprintf(stderr, "done hashed the vertical sequence\n"));
+    if (strlen(pashParams->saveReadIndexFile)>0) {
+      saveReadIndex(pashParams, pashParams->saveReadIndexFile);
+      fprintf(stderr, "saved the reads index to %s\n", pashParams->saveReadIndexFile);
+    }
+    fprintf(stderr, "hashed the vertical sequence\n");
+  }
   printNow();
   fflush(stderr);
   // pass the hive hash to the horizontal scan sequence
@@ -92,6 +128,9 @@ int runPash(int argc, char** argv) {
   // run genome against it, perform anchoring/alignment, write output
   scanHorizontalSequence(pashParams, horizontalSequenceHash);
   // free memory
+  if (pashParams->readIndexImage!=NULL) {
+    releaseReadIndex(pashParams);
+  }
   fprintf(stderr, "finished traversing horizontal sequence\n");
   printNow();
   fprintf(stderr, "freed resources\n");
@@ -99,5 +138,175 @@ int runPash(int argc, char** argv) {
   fflush(stderr);
 
   fclose(pashParams->outputFilePtr);
+  writeRunMetrics(pashParams, runStartTime);
   return 0;
 }
+
+/** Map the reads one batch at a time: each batch is hashed, scanned against the reference and released
+ * before the next batch is loaded, so the memory used depends on the batch size, not on the number of reads.
+ * The kmers of all the reads are counted first, so that the batches are hashed as a single batch would be,
+ * and the batch outputs are merged in the order of a single batch run. Unless it was mapped from a packed
+ * reference file, the reference is packed in memory once and every batch scans it from there.*/
+static void mapReadBatches(PashParameters* pashParams) {
+  PashFastqUtil* verticalFastqUtil = pashParams->verticalFastqUtil;
+  FILE* outputFilePtr = pashParams->outputFilePtr;
+  char** batchOutputFiles = NULL;
+  guint32 numberOfBatches = 0;
+
+  loadIgnoreList(pashParams);
+  countReadKmersInBatches(pashParams);
+  printNow();
+  // every batch scans the reference, so it is parsed only once
+  int packedReference = pashParams->packedReferenceHorizontal==NULL;
+  if (packedReference) {
+    pashParams->packedReferenceHorizontal = packFastaUtil(pashParams->fastaUtilHorizontal);
+    fprintf(stderr, "packed the horizontal sequence: %u sequences, %u runs of bases other than ACGT\n",
+            pashParams->packedReferenceHorizontal->numberOfSequences, pashParams->packedReferenceHorizontal->numberOfRuns);
+    printNow();
+  }
+  pashParams->lastVerticalSequenceMapped = 0;
+  while (verticalFastqUtil->hasMoreSequences()) {
+    guint32 numberOfVerticalReads = verticalFastqUtil->loadSequences(1, pashParams->packedReads, pashParams->readsPerBatch);
+    if (numberOfVerticalReads==0) {
+      break;
+    }
+    fprintf(stderr, "loaded batch %u: reads %u to %u\n", numberOfBatches+1,
+            pashParams->lastVerticalSequenceMapped+1, pashParams->lastVerticalSequenceMapped+numberOfVerticalReads);
+    batchOutputFiles = (char**) realloc(batchOutputFiles, (numberOfBatches+1)*sizeof(char*));
+    xDieIfNULL(batchOutputFiles, fprintf(stderr, "could not allocate memory for the read batches\n"), 2);
+    batchOutputFiles[numberOfBatches] = (char*) malloc(MAX_FILE_NAME_SIZE+64);
+    xDieIfNULL(batchOutputFiles[numberOfBatches], fprintf(stderr, "could not allocate memory for the read batches\n"), 2);
+    sprintf(batchOutputFiles[numberOfBatches], "%s.batch%u.%d", pashParams->outputFile, numberOfBatches, getpid());
+    pashParams->outputFilePtr = fopen(batchOutputFiles[numberOfBatches], "wb");
+    xDieIfNULL(pashParams->outputFilePtr, fprintf(stderr, "could not open temporary output file %s\n",
+                                                   batchOutputFiles[numberOfBatches]), 2);
+    numberOfBatches++;
+
+    pashParams->verticalSequencesInfos = (SequenceInfo*) malloc((numberOfVerticalReads+1)*sizeof(SequenceInfo));
+    xDieIfNULL(pashParams->verticalSequencesInfos, fprintf(stderr,"could not allocate memory for the reads\n"), 2);
+    sizeCurrentVerticalSequencesBatch(pashParams);
+    hashCurrentVerticalSequencesBatch(pashParams);
+    fprintf(stderr, "hashed the vertical sequence\n");
+    printNow();
+    SequenceHash* horizontalSequenceHash = initSequenceHash();
+    horizontalSequenceHash->hiveHash = pashParams->hiveHash;
+    scanHorizontalSequence(pashParams, horizontalSequenceHash);
+    fprintf(stderr, "finished traversing horizontal sequence\n");
+    printNow();
+    fflush(stderr);
+
+    // release the batch
+    markBatchKmers(pashParams);
+    fclose(pashParams->outputFilePtr);
+    free(horizontalSequenceHash);
+    delete (HiveHash*) pashParams->hiveHash;
+    pashParams->hiveHash = NULL;
+    free(pashParams->verticalSequencesInfos);
+    pashParams->verticalSequencesInfos = NULL;
+  }
+  pashParams->outputFilePtr = outputFilePtr;
+
+  double mergeStartTime = metricTime();
+  mergeReadBatchOutputs(batchOutputFiles, numberOfBatches, outputFilePtr);
+  addMetricTime(MetricFilterOutput, mergeStartTime);
+  for (guint32 batch=0; batch<numberOfBatches; batch++) {
+    unlink(batchOutputFiles[batch]);
+    free(batchOutputFiles[batch]);
+  }
+  free(batchOutputFiles);
+  free(pashParams->readKmerCounts);
+  pashParams->readKmerCounts = NULL;
+  free(pashParams->earlierBatchKmers);
+  pashParams->earlierBatchKmers = NULL;
+  if (packedReference) {
+    freePackedReference(pashParams->packedReferenceHorizontal);
+    pashParams->packedReferenceHorizontal = NULL;
+  }
+  fprintf(stderr, "merged the outputs of %u read batches\n", numberOfBatches);
+  printNow();
+}
+
+/** Reference sequence of the output header.*/
+typedef struct {
+  const char* name;
+  gint32 referenceId;
+} OutputReference;
+
+static int compareOutputReferences(const void* a, const void* b) {
+  return strcmp(((const OutputReference*)a)->name, ((const OutputReference*)b)->name);
+}
+
+/** Write the SAM header, or the BAM header, listing the horizontal sequences but the reverse complement
+ * strands of a bisulfite mapping, whose alignments are reported on their forward strand; set the index
+ * of the reference of each horizontal sequence in the header.*/
+static void writeOutputHeader(PashParameters* pashParams, guint32 numberOfHorizontalSequences) {
+  OutputReference* references = (OutputReference*) malloc(sizeof(OutputReference)*(numberOfHorizontalSequences+1));
+  const char** referenceNames = (const char**) malloc(sizeof(char*)*(numberOfHorizontalSequences+1));
+  guint32* referenceLengths = (guint32*) malloc(sizeof(guint32)*(numberOfHorizontalSequences+1));
+  pashParams->outputReferenceIds = (gint32*) malloc(sizeof(gint32)*(numberOfHorizontalSequences+1));
+  xDieIfNULL(references, fprintf(stderr, "could not allocate memory for the output header\n"), 2);
+  xDieIfNULL(referenceNames, fprintf(stderr, "could not allocate memory for the output header\n"), 2);
+  xDieIfNULL(referenceLengths, fprintf(stderr, "could not allocate memory for the output header\n"), 2);
+  xDieIfNULL(pashParams->outputReferenceIds, fprintf(stderr, "could not allocate memory for the output header\n"), 2);
+  size_t headerTextSize = 64;
+  guint32 numberOfReferences = 0;
+  for ( unsigned i = 1;  i <= numberOfHorizontalSequences;  ++i ) {
+    char const * name = pashParams->packedReferenceHorizontal!=NULL ?
+        packedReferenceSequenceName(pashParams->packedReferenceHorizontal, i) :
+        pashParams->fastaUtilHorizontal->sequencesInformation[i].sequenceName;
+    if ( strncmp(name, "#RC.pash.", 9) == 0 ) continue;
+    references[numberOfReferences].name = name;
+    references[numberOfReferences].referenceId = numberOfReferences;
+    referenceNames[numberOfReferences] = name;
+    referenceLengths[numberOfReferences] = horizontalSequenceLength(pashParams, i);
+    pashParams->outputReferenceIds[i] = numberOfReferences;
+    headerTextSize += strlen(name)+32;
+    numberOfReferences++;
+  }
+  qsort(references, numberOfReferences, sizeof(OutputReference), compareOutputReferences);
+  for ( unsigned i = 1;  i <= numberOfHorizontalSequences;  ++i ) {
+    char const * name = pashParams->packedReferenceHorizontal!=NULL ?
+        packedReferenceSequenceName(pashParams->packedReferenceHorizontal, i) :
+        pashParams->fastaUtilHorizontal->sequencesInformation[i].sequenceName;
+    if ( strncmp(name, "#RC.pash.", 9) != 0 ) continue;
+    OutputReference key;
+    key.name = name+9;
+    OutputReference* forwardStrand = (OutputReference*) bsearch(&key, references, numberOfReferences,
+                                                                sizeof(OutputReference), compareOutputReferences);
+    pashParams->outputReferenceIds[i] = forwardStrand!=NULL ? forwardStrand->referenceId : -1;
+    if (forwardStrand==NULL && pashParams->useBamOutput) {
+      fprintf(stderr, "no forward strand for %s; its alignments are reported as unplaced\n", name);
+    }
+  }
+
+  char* headerText = (char*) malloc(headerTextSize);
+  xDieIfNULL(headerText, fprintf(stderr, "could not allocate memory for the output header\n"), 2);
+  size_t headerTextLength = sprintf(headerText, "@HD\tVN:1.0\n@PG\tID:pash3\tPN:Pash\tVN:3.01.03\n");
+  //headerTextLength += sprintf(headerText+headerTextLength, "@RG\tID:--\tCN:BRL\n");
+  for (guint32 r = 0;  r < numberOfReferences;  ++r) {
+    headerTextLength += sprintf(headerText+headerTextLength, "@SQ\tSN:%s\tLN:%u\n", referenceNames[r], referenceLengths[r]);
+  }
+  if (pashParams->useBamOutput) {
+    writeBamHeader(pashParams->outputFilePtr, headerText, numberOfReferences, referenceNames, referenceLengths);
+  } else {
+    fputs(headerText, pashParams->outputFilePtr);
+  }
+  free(headerText);
+  free(references);
+  free(referenceNames);
+  free(referenceLengths);
+}
+
+/** Write the run metrics, if they were asked for, once the output file is closed.*/
+static void writeRunMetrics(PashParameters* pashParams, double runStartTime) {
+  if (strlen(pashParams->metricsJsonFile)==0) {
+    return;
+  }
+  struct stat outputStat;
+  if (stat(pashParams->outputFile, &outputStat)==0) {
+    addMetric(MetricBytesWritten, outputStat.st_size);
+  }
+  if (writeMetricsJson(pashParams->metricsJsonFile, pashParams->numberOfThreads, metricTime()-runStartTime)!=0) {
+    fprintf(stderr, "could not write the metrics to %s\n", pashParams->metricsJsonFile);
+  }
+}
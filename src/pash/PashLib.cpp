@@ -17,14 +17,17 @@ See the included file LICENSE for details.
 #include <math.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "PashLib.h"
 #include "PashDebug.h"
 #include "HiveHash.h"
 #include "FastaUtil.h"
 #include "FastQUtil.h"
 #include "FixedHashKey.h"
+#include "SpacedSeed.h"
 #include "IgnoreList.h"
 #include "BisulfiteKmerGenerator.h"
+#include "Metrics.h"
 
 #define DEB_HIVE_HASH 0
 #define DEB_HASH_VERTICAL_SEQ 0
@@ -92,14 +95,24 @@ PashParameters* parseCommandLine(int argc, char**argv) {
 			{"maxMappings",required_argument,0,'N'},
 			{"topPercent",required_argument,0,'P'},
 //			{"score", required_argument, 0,'s'},
-//			{"indexMemory", required_argument, 0, 'M'},
+			{"indexMemory", required_argument, 0, 'M'},
+			{"outputMemory", required_argument, 0, 'O'},
+			{"batchReads", required_argument, 0, 'b'},
 			{"bisulfiteSequencingMapping", no_argument, 0, 'B'},
 			{"gzip", no_argument, 0, 'z'},
+			{"bam", no_argument, 0, 'Z'},
 			{"highSensitivity", no_argument, 0, '0'},
 			{"mediumSensitivity", no_argument, 0, '1'},
 			{"lowSensitivity", no_argument, 0, '2'},
 			{"fastMode", no_argument, 0, '3'},
 			{"keepHashedKmersPercent",required_argument,0,'K'},
+			{"threads",required_argument,0,'T'},
+			{"compactHash", no_argument, 0, 'C'},
+			{"saveReadIndex", required_argument, 0, 'I'},
+			{"loadReadIndex", required_argument, 0, 'i'},
+			{"packedReads", no_argument, 0, 'R'},
+			{"collation", required_argument, 0, 'c'},
+			{"metricsJson", required_argument, 0, 'J'},
 //			{"self", no_argument, 0, 'A'},
 			{0, 0, 0, 0}
 	};
@@ -118,6 +131,7 @@ PashParameters* parseCommandLine(int argc, char**argv) {
 	strcpy(pp->horizontalFile, "");
 	pp->verticalFastqUtil = NULL;
 	pp->fastaUtilHorizontal = NULL;
+	pp->packedReferenceHorizontal = NULL;
 	strcpy(pp->scratchDirectory, "");
 	strcpy(pp->outputFile, "");
 	pp->numberOfDiagonals = DEFAULT_NUMBER_OF_DIAGONALS;
@@ -125,8 +139,16 @@ PashParameters* parseCommandLine(int argc, char**argv) {
 	pp->wordOffset = DEFAULT_WORD_OFFSET;
 	pp->isMaskDefined = FALSE;
 	pp->hiveHashMemoryLimit = DEFAULT_HIVE_HASH_MEMORY;
+	pp->mappingStoreMemoryLimit = DEFAULT_MAPPING_STORE_MEMORY;
+	pp->mapReadsInBatches = FALSE;
+	pp->readsPerBatch = 0;
+	pp->readKmerCounts = NULL;
+	pp->earlierBatchKmers = NULL;
+	pp->maxReadLength = 0;
 	pp->useIgnoreList = FALSE;
 	pp->useGzippedOutput = FALSE;
+	pp->useBamOutput = FALSE;
+	pp->outputReferenceIds = NULL;
 	int option_index = 0;
 	pp->mask.maskLen = 18;
 	pp->mask.keyLen = 12;
@@ -134,21 +156,48 @@ PashParameters* parseCommandLine(int argc, char**argv) {
 	pp->useIgnoreList = 0;
 	pp->maxMappings = 1;
 	pp->bisulfiteSequencingMapping=0;
+	pp->reverseStrandDnaMethMapping=0;
 	pp->sensitivityMode = MediumSensitivity;
 	pp->keepHashedKmersPercent=99;
+	pp->numberOfThreads=1;
+	pp->compactHash = FALSE;
+	strcpy(pp->saveReadIndexFile, "");
+	strcpy(pp->loadReadIndexFile, "");
+	pp->readIndexImage = NULL;
+	pp->readIndexSize = 0;
+	pp->packedReads = FALSE;
+	pp->collationEngine = HeapCollation;
+	pp->hiveHash = NULL;
+	pp->verticalHashSlices = NULL;
+	pp->numberOfVerticalHashSlices = 0;
+	strcpy(pp->metricsJsonFile, "");
 	while((opt=getopt_long(argc,argv,
-			"r:g:o:L:zBP:N:K:p:0123", //":S:M:d:v:h:L:g:G:k:n:m:o:s:tBA:N:P:0123K:",
+			"r:g:o:L:zZBP:N:K:p:T:CI:i:Rc:M:O:b:J:0123", //":S:M:d:v:h:L:g:G:k:n:m:o:s:tBA:N:P:0123K:",
 			long_options, &option_index))!=-1) {
 		switch(opt) {
 //		case 'S':  // scratch directory location
 //			strncpy(pp->scratchDirectory,optarg,MAX_FILE_NAME_SIZE);
 //			break;
-//		case 'M':  // maximum amount of RAM available for hive hash
-//			pp->hiveHashMemoryLimit=atoi(optarg);
-//			if(pp->hiveHashMemoryLimit < 0) {
-//				xDie(fprintf(stderr, "Vertical sequence hash limit should be positive\n"), 1);
-//			}
-//			break;
+		case 'M':  // maximum amount of RAM available for hive hash
+			if (atoi(optarg)<1) {
+				xDie(fprintf(stderr, "Vertical sequence hash limit should be positive\n"), 1);
+			}
+			pp->hiveHashMemoryLimit=atoi(optarg);
+			pp->mapReadsInBatches = TRUE;
+			break;
+		case 'O':
+			if (atoi(optarg)<1) {
+				xDie(fprintf(stderr, "Output memory should be positive\n"), 1);
+			}
+			pp->mappingStoreMemoryLimit=atoi(optarg);
+			break;
+		case 'b':
+			if (atoi(optarg)<1) {
+				xDie(fprintf(stderr, "Number of reads per batch should be positive\n"), 1);
+			}
+			pp->readsPerBatch=atoi(optarg);
+			pp->mapReadsInBatches = TRUE;
+			break;
 //		case 'd':  // shortcut for setting 'paralellogram' geometry of this diagonal length
 //			pp->numberOfDiagonals=atoi(optarg);
 //			if(pp->hiveHashMemoryLimit < 0) {
@@ -207,6 +256,9 @@ PashParameters* parseCommandLine(int argc, char**argv) {
 		case 'z': // GZIP-ed output (default is text)
 			pp->useGzippedOutput=TRUE;
 			break;
+		case 'Z':
+			pp->useBamOutput=TRUE;
+			break;
 		case 'K':
 			pp->keepHashedKmersPercent=atoi(optarg);
 			if (pp->keepHashedKmersPercent<90) {
@@ -219,6 +271,36 @@ PashParameters* parseCommandLine(int argc, char**argv) {
 //		case 'A':  // self-comparison; ignore any matches below the main diagonal
 //			pp->selfComparison=TRUE;
 //			break;
+		case 'T':
+			if (atoi(optarg)<1) {
+				xDie(fprintf(stderr, "Number of threads should be positive\n"), 1);
+			}
+			pp->numberOfThreads=atoi(optarg);
+			break;
+		case 'C':
+			pp->compactHash = TRUE;
+			break;
+		case 'I':
+			strncpy(pp->saveReadIndexFile, optarg, MAX_FILE_NAME_SIZE);
+			break;
+		case 'i':
+			strncpy(pp->loadReadIndexFile, optarg, MAX_FILE_NAME_SIZE);
+			break;
+		case 'R':
+			pp->packedReads = TRUE;
+			break;
+		case 'c':
+			if (!strcmp(optarg, "heap")) {
+				pp->collationEngine = HeapCollation;
+			} else if (!strcmp(optarg, "sort")) {
+				pp->collationEngine = SortCollation;
+			} else {
+				xDie(fprintf(stderr, "collation should be heap or sort\n"), 1);
+			}
+			break;
+		case 'J':
+			strncpy(pp->metricsJsonFile, optarg, MAX_FILE_NAME_SIZE);
+			break;
 		case 'B':
 			fprintf(stderr, "Performing bisulfite sequencing mapping\n");
 			pp->bisulfiteSequencingMapping=1;
@@ -245,6 +327,9 @@ PashParameters* parseCommandLine(int argc, char**argv) {
 	if (!strcmp(pp->outputFile, "")) {
 		xDie(fprintf(stderr, "no output file provided\n"), 1);
 	}
+	if (pp->mapReadsInBatches && (strlen(pp->saveReadIndexFile)>0 || strlen(pp->loadReadIndexFile)>0)) {
+		xDie(fprintf(stderr, "a read index holds all the reads; it cannot be used when mapping the reads in batches\n"), 1);
+	}
 	// generate sampling pattern
 	if(pp->isMaskDefined==FALSE) {
 		setMask("12from18", &(pp->mask));
@@ -261,13 +346,19 @@ void PashUsage() {
 			" --reads                 | -r <file> Reads to map as a fastq input file with full path; may be gzipped\n"
 			" --referenceGenome       | -g <file> Reference genome as a fasta input file with full path (gzipped files are\n"
 			"                              also accepted); if file ends in '.fof', it is assumed the named file contains a list of fasta files\n"
+			"                              if file ends in '.pash2bit', it is a packed reference made by pash3_makePackedReference\n"
 //			" --diagonals             | -d <number of diagonals> \n" // THIS IS SET TO MAX READ LENGTH IN THE CODE !!!
 //TODO - used in code			" --verticalWordOffset    | -G <vertical word offset gap - must be a multiple of diagonal offset gap>\n"
 			" --outputFile            | -o <output file name>\n"
 //			" --score                 | -s <scoreCutoff>\n"
-			" --gzip                  | -z request gzip-ed output (default is text)\n"
+			" --gzip                  | -z write the SAM output compressed as BGZF, as bgzip does (default is text)\n"
+			" --bam                   | -Z write the output as BAM\n"
 //			" --scratch               | -S Scratch directory location \n"
-//			" --indexMemory           | -M index of the vertical sequence hash in MB(default 1024)\n"
+			" --indexMemory           | -M <memory in MB> map the reads in batches sized to fit the reads and their index in this\n"
+			"                              amount of memory; the output is the same as when mapping all the reads at once\n"
+			" --batchReads            | -b <number of reads> map the reads in batches of this many reads\n"
+			" --outputMemory          | -O <memory in MB> keep the mapping lines in memory until the reference is scanned, and\n"
+			"                              only write them to a temporary file beyond this amount of memory; default 1024\n"
 			" --ignoreList            | -L ignore the kmers present in the ignore list file\n"
 			" --maxMappings           | -N maximum number of mappings per read\n"
 			" --topPercent            | -P top percent from the best alignment score to be reported for each read; use numbers in the interval 0-100; default 1\n"
@@ -277,6 +368,19 @@ void PashUsage() {
 			" --lowSensitivity        | -2 run pash in low-sensitivity mode \n"
 			" --fastMode              | -3 run pash in fast mode \n"
 			" --keepHashedKmersPercent| -K <percent amount of hashed kmers to keep> this value should be between 90 and 100; default is 99 \n"
+			" --threads               | -T <number of threads hashing the reads and scanning the reference genome>; default is 1\n"
+			" --compactHash           | -C store the reads index as one offset array and one contiguous array of kmer occurrences,\n"
+			"                              halving the memory of the index skeleton\n"
+			" --saveReadIndex         | -I <file> save the reads index, with the sampling pattern and sensitivity settings, to a file\n"
+			" --loadReadIndex         | -i <file> map a reads index saved by --saveReadIndex for the same reads instead of hashing\n"
+			"                              the reads; the sampling pattern and sensitivity settings are taken from the index\n"
+			" --packedReads           | -R keep the read bases packed in memory, 2 bits per base, and decode them on demand;\n"
+			"                              bases other than ACGT are reported as N\n"
+			" --collation             | -c <heap|sort> order the kmer matches of each reference window by merging the match\n"
+			"                              streams through a heap (default), or by gathering and radix sorting them; the output\n"
+			"                              is the same\n"
+			" --metricsJson           | -J <file> write the time spent in each stage of the mapping and the counts of the\n"
+			"                              work done, summed over the threads, to a JSON file\n"
 			" --samplingPattern       | -p <sampling pattern> (e.g. 11011 would sample the two positions, skip one position, then\n"
 			"                              sample the next two), to use predefined pattern choose one of the following: 8from14,\n"
 			"                              9from15, 10from16, 11from18, 12from18, 13from21, 14from21 (default is 12from18)\n"
@@ -293,10 +397,78 @@ void PashUsage() {
 			);
 }
 
-/// Determine the memory requirements of the current vertical batch.
-int sizeCurrentVerticalSequencesBatch(PashParameters* pp) {
-	guint32 hiveHashSize;
-	//FastaUtil* fastaUtilVertical = pp->fastaUtilVertical;
+/** State of one thread building the vertical hash. Each slice walks a contiguous range of reads, and
+ * the slices are ordered by read id: filling every bin slice after slice keeps the (value, offset)
+ * pairs in the order of the single-threaded construction, so the hash skeleton does not depend on
+ * the number of threads.*/
+typedef struct {
+	PashParameters* pp;
+	HiveHash* hiveHash;
+	guint32 firstSequence;
+	guint32 lastSequence;
+	/** Number of kmers of the slice per key; before the fill pass, it becomes the position of the first
+	 * entry of the slice in each bin. NULL if the slice is the only one, in which case the hive hash
+	 * counts and fills the bins directly.*/
+	guint32* kmerCounts;
+	int fillPass;
+	guint32 maxReadLength;
+	double totalKmers;
+	/// Range of keys merged by this thread after the count pass.
+	guint32 firstKey;
+	guint32 lastKey;
+	guint32 numberOfSlices;
+	void* slices;
+} VerticalHashSlice;
+
+/** Number of read positions between consecutive kmers hashed from a read.*/
+static int readOffsetGap(PashParameters* pp, guint32 sequenceLength) {
+	int offsetGap = 0;
+	switch(pp->sensitivityMode) {
+	case HighSensitivity:
+		//offsetGap = (sequenceLength<=50?(sequenceLength<=36?2:3):(sequenceLength<76?4:6));
+		offsetGap = (sequenceLength<76?(sequenceLength<=36?2:(sequenceLength<=50?3:4)):(sequenceLength<100?6:8));
+		break;
+	case MediumSensitivity:
+		offsetGap = (sequenceLength<76?(sequenceLength<=36?2:(sequenceLength<=50?3:4)):(sequenceLength<100?8:12));
+		break;
+	case LowSensitivity:
+		offsetGap = (sequenceLength<76?(sequenceLength<=36?2:(sequenceLength<=50?4:4)):(sequenceLength<100?10:(sequenceLength<150?14:18)));
+		break;
+	case FastSensitivity:
+		offsetGap = (sequenceLength<=100?(sequenceLength<=36?2:(sequenceLength<=50?3:4)):(sequenceLength<=200?8:10));
+		break;
+	case UserDefinedSensitivity:
+		offsetGap=pp->wordOffset;
+		break;
+	default:
+		fprintf(stderr, "offset gap not determined !\n");
+		exit(0);
+	}
+	return offsetGap;
+}
+
+/** Count or store one kmer occurrence of a read, depending on the pass of the slice.*/
+static inline void hashReadKmer(VerticalHashSlice* slice, guint32 key, guint32 value, guint32 offset) {
+	if (!slice->fillPass) {
+		if (slice->kmerCounts==NULL) {
+			slice->hiveHash->markEntry(key);
+		} else {
+			slice->kmerCounts[key] += 1;
+		}
+	} else {
+		if (slice->kmerCounts==NULL) {
+			slice->hiveHash->addEntryXX(key, value, offset);
+		} else {
+			slice->hiveHash->addEntryAt(key, slice->kmerCounts[key], value, offset);
+			slice->kmerCounts[key] += 1;
+		}
+	}
+}
+
+/** Walk the sampled kmers of the reads of a slice, forward then reverse complement, and count or store them.*/
+static void* hashVerticalSlice(void* arg) {
+	VerticalHashSlice* slice = (VerticalHashSlice*) arg;
+	PashParameters* pp = slice->pp;
 	PashFastqUtil* verticalFastqUtil = pp->verticalFastqUtil;
 	guint32 sequenceLength;
 	char currentKmer [MAX_MASK_LEN+1];
@@ -305,13 +477,18 @@ int sizeCurrentVerticalSequencesBatch(PashParameters* pp) {
 	int startOffset, maxOffset, minOffset, offsetGap;
 	Mask mask = pp->mask;
 	int currentSequencePos;
-	char revCSeq[2000];
-	BisulfiteKmerGenerator *bisulfiteKmerGenerator;
+	char sequenceBuffer[MAX_READ_SIZE+1];
+	BisulfiteKmerGenerator *bisulfiteKmerGenerator = NULL;
 	int bisulfiteSequencingMapping = pp->bisulfiteSequencingMapping;
-	int kmersPerRead = 0;
+	int useIgnoreList = pp->useIgnoreList;
+	int kmersPerRead;
+	SpacedSeed spacedSeed;
+	SpacedSeedWindow seedWindow;
+	// bisulfite reads generate their kmers from the sampled bases, so they keep gathering them
+	int rollingKeys = !bisulfiteSequencingMapping && !initSpacedSeed(&spacedSeed, &mask);
 
 	int maxSeeds=512;
-	guint32* guintSeeds;
+	guint32* guintSeeds = NULL;
 	int actualSeeds;
 	if (bisulfiteSequencingMapping) {
 		bisulfiteKmerGenerator= new BisulfiteKmerGenerator();
@@ -323,48 +500,13 @@ int sizeCurrentVerticalSequencesBatch(PashParameters* pp) {
 	maskWeight = pp->mask.keyLen;
 	currentKmer[maskWeight] = '\0';
 	currentReverseKmer[maskWeight] = '\0';
-	offsetGap = pp->wordOffset;
-	HiveHash *hiveHash = (HiveHash*)pp->hiveHash;
-	double totalKmers;
-	xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "START sizeCurrentVerticalSequencesBatch\n"));
-	IgnoreList ignoreList; // see IgnoreList.h
-	FILE *ignoreListFile;  // file handle for the ignore list
-	// read ignore list, if applicable.  depends on sampling pattern (i.e. must call setMask before this point)
-	int useIgnoreList = pp->useIgnoreList;
-	if(useIgnoreList) {
-		ignoreListFile=fopen(pp->ignoreListFile,"r");
-		if(ignoreListFile==NULL) {
-			fprintf(stdout,"failed to open ignore list file %s, bailing out\n", pp->ignoreListFile);
-		}
-		readIgnoreList(ignoreListFile, &ignoreList, pp->mask.keyLen); // ignoreList is allocated, initialized and read
-		fclose(ignoreListFile);
-		ignoreListFile=NULL;
-		pp->ignoreList=ignoreList;
-	}
-
-
-	if (hiveHash == NULL) {
-		hiveHashSize = 1;
-		for (guint32 i=0; i< pp->mask.keyLen; i++) {
-			hiveHashSize *= 4;
-		}
-		xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "hive hash size = %d\n", hiveHashSize));
-		hiveHash = new HiveHash(hiveHashSize, pp->keepHashedKmersPercent);
-		pp->hiveHash = hiveHash;
-	}
-
 
-	// if at limit of memory, then stop, because we have enough info to resume the vert hash filling
-	guint32 numberOfVerticalSequences = verticalFastqUtil->getNumberOfSequences();
 	guint32 currentVerticalSequence;
-	kmersPerRead = 0;
-	guint32 maxReadLength = 1;
-	for (currentVerticalSequence=1;
-			currentVerticalSequence<=numberOfVerticalSequences;
+	for (currentVerticalSequence=slice->firstSequence;
+			currentVerticalSequence<=slice->lastSequence;
 			currentVerticalSequence++) {
 		kmersPerRead = 0;
-		// print current sequence length
-		const char* currentSequence = verticalFastqUtil->retrieveSequence(currentVerticalSequence);
+		const char* currentSequence = verticalFastqUtil->retrieveSequence(currentVerticalSequence, sequenceBuffer);
 		const char* currentDefName = verticalFastqUtil->retrieveDefName(currentVerticalSequence);
 		xDEBUG(DEB_HASH_VERTICAL_SEQ,
 				fprintf(stderr, ">> got current sequence [%u] %s -- %s: %lu characters\n",
@@ -374,179 +516,189 @@ int sizeCurrentVerticalSequencesBatch(PashParameters* pp) {
 						strlen(currentSequence)
 				));
 		sequenceLength=strlen(currentSequence);
-		if (maxReadLength < sequenceLength) {
-			maxReadLength = sequenceLength ;
-		} 
-		switch(pp->sensitivityMode) {
-		case HighSensitivity:
-			//offsetGap = (sequenceLength<=50?(sequenceLength<=36?2:3):(sequenceLength<76?4:6));
-			offsetGap = (sequenceLength<76?(sequenceLength<=36?2:(sequenceLength<=50?3:4)):(sequenceLength<100?6:8));
-			break;
-		case MediumSensitivity:
-			offsetGap = (sequenceLength<76?(sequenceLength<=36?2:(sequenceLength<=50?3:4)):(sequenceLength<100?8:12));
-			break;
-		case LowSensitivity:
-			offsetGap = (sequenceLength<76?(sequenceLength<=36?2:(sequenceLength<=50?4:4)):(sequenceLength<100?10:(sequenceLength<150?14:18)));
-			break;
-		case FastSensitivity:
-			offsetGap = (sequenceLength<=100?(sequenceLength<=36?2:(sequenceLength<=50?3:4)):(sequenceLength<=200?8:10));
-			break;
-
-		case UserDefinedSensitivity:
-			offsetGap=pp->wordOffset;
-			break;
-		default:
-			fprintf(stderr, "offset gap not determined !\n");
-			exit(0);
-		} 
-		const char* fwdSeq = currentSequence;
-		sequenceLength=strlen(fwdSeq);
-		if (!bisulfiteSequencingMapping) {
-			for (guint32 fwdIdx =0; fwdIdx<sequenceLength; fwdIdx++) {
-				revCSeq[sequenceLength-1-fwdIdx] = complement(fwdSeq[fwdIdx]);
+		if (!slice->fillPass) {
+			if (slice->maxReadLength < sequenceLength) {
+				slice->maxReadLength = sequenceLength ;
+			}
+		} else {
+			SequenceInfo* currentSequenceInfo = &pp->verticalSequencesInfos[currentVerticalSequence];
+			currentSequenceInfo->sequenceName = currentDefName;
+			currentSequenceInfo->sequenceLength = sequenceLength;
+			currentSequenceInfo->bestAnchoringScore = 0;
+			currentSequenceInfo->bestSWScore = 0;
+			currentSequenceInfo->bestSkeletonScore = 0;
+			currentSequenceInfo->bestScoreMappings = 0;
+			currentSequenceInfo->passingMappings = 0;
+
+			// TODO: in the first pass stage, find a suitable # of diagonals
+			if (sequenceLength>pp->numberOfDiagonals) {
+				fprintf(stderr, "number of diagonals %d should be greater than sequence length %d\n",
+						pp->numberOfDiagonals, sequenceLength);
+				exit(1);
 			}
-			revCSeq[sequenceLength] = '\0';
 		}
+		offsetGap = readOffsetGap(pp, sequenceLength);
 
-		xDEBUG(DEB_SIZE_VERT_HASH,
-				fprintf(stderr, "S got current sequence [%u] %s >>%s<< >>%s<< ~~%s~~ of length %u: %lu characters\n",
-						currentVerticalSequence,
-						currentDefName,
-						fwdSeq, revCSeq,
-						currentSequence,
-						sequenceLength, strlen(fwdSeq)));
-
-		//xDEBUG(DEB_DUMP_HIVE_HASH, hiveHash->dumpHash(stderr));
-		//offsetGap = (sequenceLength<=50?(sequenceLength<=36?2:4):(sequenceLength<=76?6:12));
-		// start filling the vertical hash table
 		xDEBUG(DEB_HASH_VERTICAL_SEQ,
-				fprintf(stderr, "S processing short sequence (maybe read)\n"));
+				fprintf(stderr, "processing short sequence (maybe read)\n"));
 		maxOffset = sequenceLength-maskLen;
 		xDEBUG(DEB_HASH_VERTICAL_SEQ,
-				fprintf(stderr, "S %d Gap: %d \n", maxOffset, offsetGap));
-		for (startOffset = 0; startOffset<=maxOffset; startOffset+= offsetGap) {
-			for (currentSequencePos=startOffset,maskPos = 0,kmerPos = 0;
-					kmerPos < maskWeight;
-					currentSequencePos++, maskPos++) {
-				if (mask.mask[maskPos]) {
-					currentKmer [kmerPos] = currentSequence[currentSequencePos];
-					kmerPos++;
+				fprintf(stderr, "%d Gap: %d \n", maxOffset, offsetGap));
+		if (rollingKeys) {
+			// roll the key along the read, one base at a time, and hash the kmers starting at the sampled offsets
+			resetSpacedSeedWindow(&seedWindow);
+			for (currentSequencePos=0; currentSequencePos<(int)sequenceLength; currentSequencePos++) {
+				pushSpacedSeedBase(&spacedSeed, &seedWindow, currentSequence[currentSequencePos]);
+				startOffset = currentSequencePos-maskLen+1;
+				if (startOffset<0 || startOffset%offsetGap!=0) {
+					continue;
+				}
+				forwardKey = spacedSeedKey(&spacedSeed, &seedWindow);
+				xDEBUG(DEB_HASH_VERTICAL_SEQ,
+						fprintf(stderr, "VERT SEQ HASH: found forward kmer %d %x, v seq %d at v offset %d\n",
+								forwardKey, forwardKey, currentVerticalSequence, startOffset));
+				if(!useIgnoreList || !isIgnored(forwardKey, pp->ignoreList)) {
+					hashReadKmer(slice, forwardKey, 2*currentVerticalSequence, startOffset);
+					kmersPerRead += 1;
 				}
 			}
-			getKeyForSeq(currentKmer, &forwardKey);
-			xDEBUG(DEB_HASH_VERTICAL_SEQ,
-					fprintf(stderr, "VERT SEQ HASH: found forward kmer %s %d %x, v seq %d at v offset %d\n",
-							currentKmer, forwardKey, forwardKey, currentVerticalSequence,
-							startOffset));
-			if(!useIgnoreList || !isIgnored(forwardKey, ignoreList)) {
-				if (bisulfiteSequencingMapping) {
-					actualSeeds=bisulfiteKmerGenerator->generateKmerList(currentKmer, guintSeeds, maxSeeds);
-					for (int i=0; i<actualSeeds; i++) {
-						xDEBUG(DEB_SIZE_VERT_HASH, fprintf(stderr, "mark entry %d of %d\n", i+1, actualSeeds));
-						hiveHash->markEntry(guintSeeds[i]);
-						kmersPerRead += 1;
-					}
-				} else {
-					xDEBUG(DEB_SIZE_VERT_HASH, fprintf(stderr, "mark entry %d \n", forwardKey ));
-					hiveHash->markEntry(forwardKey);
+			// the reverse complement kmers, from the end of the read: the complement of each base
+			// enters the key as the last sampled base of the kmer
+			resetSpacedSeedWindow(&seedWindow);
+			for (currentSequencePos=sequenceLength-1; currentSequencePos>=0; currentSequencePos--) {
+				pushSpacedSeedBase(&spacedSeed, &seedWindow, complement(currentSequence[currentSequencePos]));
+				startOffset = currentSequencePos+maskLen-1;
+				if (startOffset>(int)sequenceLength-1 || (sequenceLength-1-startOffset)%offsetGap!=0) {
+					continue;
+				}
+				reverseKey = spacedSeedKey(&spacedSeed, &seedWindow);
+				xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "found reverse kmer %d %x, adding value %d at offset %d\n",
+						reverseKey, reverseKey, currentVerticalSequence, sequenceLength-1-startOffset));
+				if(!useIgnoreList || !isIgnored(reverseKey, pp->ignoreList)) {
+					hashReadKmer(slice, reverseKey, 2*currentVerticalSequence+1, sequenceLength-1-startOffset);
 					kmersPerRead += 1;
 				}
-				xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "done adding to hive hash\n"));
-			} else {
-				// fprintf(stderr, "ignore %s %u\n", currentKmer, forwardKey);
 			}
-			xDEBUG(DEB_DUMP_HIVE_HASH, hiveHash->dumpHash(stderr));
-		}
-
-		if (!bisulfiteSequencingMapping) {
-			minOffset = maskLen -1;
-			for (startOffset = sequenceLength-1; startOffset>=minOffset; startOffset-= offsetGap) {
+		} else {
+			for (startOffset = 0; startOffset<=maxOffset; startOffset+= offsetGap) {
 				for (currentSequencePos=startOffset,maskPos = 0,kmerPos = 0;
 						kmerPos < maskWeight;
-						currentSequencePos--, maskPos++) {
+						currentSequencePos++, maskPos++) {
 					if (mask.mask[maskPos]) {
-						currentReverseKmer[kmerPos] = complement(currentSequence[currentSequencePos]);
+						currentKmer [kmerPos] = currentSequence[currentSequencePos];
 						kmerPos++;
 					}
 				}
-				getKeyForSeq(currentReverseKmer, &reverseKey);
-				xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "found reverse kmer %s %d %x, adding value %d at offset %d\n",
-						currentReverseKmer, reverseKey, reverseKey,
-						currentVerticalSequence, sequenceLength-1-startOffset));
-				if(!useIgnoreList || !isIgnored(reverseKey, ignoreList)) {
-					hiveHash->markEntry(reverseKey);
-					kmersPerRead += 1;
+				getKeyForSeq(currentKmer, &forwardKey);
+				xDEBUG(DEB_HASH_VERTICAL_SEQ,
+						fprintf(stderr, "VERT SEQ HASH: found forward kmer %s %d %x, v seq %d at v offset %d\n",
+								currentKmer, forwardKey, forwardKey, currentVerticalSequence,
+								startOffset));
+				if(!useIgnoreList || !isIgnored(forwardKey, pp->ignoreList)) {
+					if (bisulfiteSequencingMapping) {
+						actualSeeds=bisulfiteKmerGenerator->generateKmerList(currentKmer, guintSeeds, maxSeeds);
+						for (int i=0; i<actualSeeds; i++) {
+							xDEBUG(DEB_SIZE_VERT_HASH, fprintf(stderr, "hash entry %d of %d\n", i+1, actualSeeds));
+							hashReadKmer(slice, guintSeeds[i], currentVerticalSequence, startOffset);
+							kmersPerRead += 1;
+						}
+					} else {
+						hashReadKmer(slice, forwardKey, 2*currentVerticalSequence, startOffset);
+						kmersPerRead += 1;
+					}
+					xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "done adding to hive hash\n"));
 				} else {
-					// fprintf(stderr, "ignore %s %u\n", currentReverseKmer, reverseKey);
+					// fprintf(stderr, "ignore %s %u\n", currentKmer, forwardKey);
+				}
+			}
+
+			if (!bisulfiteSequencingMapping) {
+				minOffset = maskLen -1;
+				for (startOffset = sequenceLength-1; startOffset>=minOffset; startOffset-= offsetGap) {
+					for (currentSequencePos=startOffset,maskPos = 0,kmerPos = 0;
+							kmerPos < maskWeight;
+							currentSequencePos--, maskPos++) {
+						if (mask.mask[maskPos]) {
+							currentReverseKmer[kmerPos] = complement(currentSequence[currentSequencePos]);
+							kmerPos++;
+						}
+					}
+					getKeyForSeq(currentReverseKmer, &reverseKey);
+					xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "found reverse kmer %s %d %x, adding value %d at offset %d\n",
+							currentReverseKmer, reverseKey, reverseKey,
+							currentVerticalSequence, sequenceLength-1-startOffset));
+					if(!useIgnoreList || !isIgnored(reverseKey, pp->ignoreList)) {
+						hashReadKmer(slice, reverseKey, 2*currentVerticalSequence+1, sequenceLength-1-startOffset);
+						kmersPerRead += 1;
+					} else {
+						// fprintf(stderr, "ignore %s %u\n", currentReverseKmer, reverseKey);
+					}
 				}
 			}
 		}
-		totalKmers += kmersPerRead;
-		xDEBUG(DEB_LOAD_PER_READ, fprintf(stderr, "rl: %s\t%d\n",
-				currentDefName, kmersPerRead));
+		if (!slice->fillPass) {
+			slice->totalKmers += kmersPerRead;
+			xDEBUG(DEB_LOAD_PER_READ, fprintf(stderr, "rl: %s\t%d\n",
+					currentDefName, kmersPerRead));
+		}
 		xDEBUG(DEB_HASH_VERTICAL_SEQ,
 				fprintf(stderr, "++ sequence status %d\n",
 						currentVerticalSequence));
 	}
-	xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "end of parsing or fill hash capacity\n"));
-	xDEBUG(DEB_DUMP_HIVE_HASH_1, hiveHash->dumpHash(stderr));
-	xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "STOP hashCurrentVerticalSequencesBatch\n"));
 
-	if (pp->bisulfiteSequencingMapping) {
-		//delete bisulfiteKmerGenerator;
+	if (bisulfiteSequencingMapping) {
+		delete bisulfiteKmerGenerator;
 		free(guintSeeds);
 	}
-	xDEBUG(DEB_LOAD_PER_READ, fprintf(stderr, "Total kmers: %g\n", totalKmers));
-	hiveHash->allocateHashMemory();
-	pp->numberOfDiagonals = maxReadLength ;
-	if (pp->numberOfDiagonals<100) {
-		pp->numberOfDiagonals = 100;
-	}
-	fprintf(stderr, "Number of diagonals set to %d\n", pp->numberOfDiagonals);
-
-	return 0;
+	return NULL;
 }
 
-/// Hash vertical sequence until the hive hash size reaches a user-specified limit.
-int hashCurrentVerticalSequencesBatch(PashParameters* pp) {
-	guint32 hiveHashSize;
-	//FastaUtil* fastaUtilVertical = pp->fastaUtilVertical;
-	PashFastqUtil* verticalFastqUtil = pp->verticalFastqUtil;
-	int i;
-	guint32 sequenceLength;
-	char currentKmer [MAX_MASK_LEN+1];
-	char currentReverseKmer[MAX_MASK_LEN+1];
-	int maskLen, maskWeight, kmerPos, maskPos;
-	int startOffset, maxOffset, minOffset, offsetGap;
-	Mask mask = pp->mask;
-	int currentSequencePos;
-	int numberOfDiagonals;
-	char revCSeq[2000];
-	BisulfiteKmerGenerator *bisulfiteKmerGenerator;
-	int bisulfiteSequencingMapping = pp->bisulfiteSequencingMapping;
+/** Merge the kmer counts of all slices for a range of keys: the total goes to the hive hash
+ * bin size, and each slice count is replaced by the number of entries of the previous slices.*/
+static void* mergeVerticalSliceCounts(void* arg) {
+	VerticalHashSlice* slice = (VerticalHashSlice*) arg;
+	VerticalHashSlice* slices = (VerticalHashSlice*) slice->slices;
+	guint32 key, s, total, count;
+	for (key=slice->firstKey; key<slice->lastKey; key++) {
+		total = 0;
+		for (s=0; s<slice->numberOfSlices; s++) {
+			count = slices[s].kmerCounts[key];
+			slices[s].kmerCounts[key] = total;
+			total += count;
+		}
+		slice->hiveHash->setMarkedEntries(key, total);
+	}
+	return NULL;
+}
 
-	int maxSeeds=512;
-	guint32* guintSeeds;
-	int actualSeeds;
-	if (bisulfiteSequencingMapping) {
-		bisulfiteKmerGenerator= new BisulfiteKmerGenerator();
-		guintSeeds = (guint32*) malloc(maxSeeds*sizeof(guint32));
+/** Run a routine on every slice, on its own thread when there is more than one slice.*/
+static void runVerticalHashSlices(VerticalHashSlice* slices, guint32 numberOfSlices, void* (*routine)(void*)) {
+	guint32 s;
+	if (numberOfSlices==1) {
+		routine(&slices[0]);
+		return;
+	}
+	pthread_t* threads = (pthread_t*) malloc(numberOfSlices*sizeof(pthread_t));
+	xDieIfNULL(threads, fprintf(stderr, "could not allocate memory for the vertical hash threads at %s:%d\n",
+			__FILE__, __LINE__), 2);
+	for (s=0; s<numberOfSlices; s++) {
+		if (pthread_create(&threads[s], NULL, routine, &slices[s])) {
+			fprintf(stderr, "could not start vertical hash thread %d\n", s);
+			exit(2);
+		}
+	}
+	for (s=0; s<numberOfSlices; s++) {
+		pthread_join(threads[s], NULL);
 	}
+	free(threads);
+}
 
-	guint32 forwardKey, reverseKey;
-	maskLen =pp->mask.maskLen;
-	maskWeight = pp->mask.keyLen;
-	currentKmer[maskWeight] = '\0';
-	currentReverseKmer[maskWeight] = '\0';
-	offsetGap = pp->wordOffset;
-	numberOfDiagonals = pp->numberOfDiagonals;
-	HiveHash *hiveHash = (HiveHash*)pp->hiveHash;
-	xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "START hashCurrentVerticalSequencesBatch\n"));
+/// Read the ignore list, if applicable.
+void loadIgnoreList(PashParameters* pp) {
 	IgnoreList ignoreList; // see IgnoreList.h
 	FILE *ignoreListFile;  // file handle for the ignore list
 	// read ignore list, if applicable.  depends on sampling pattern (i.e. must call setMask before this point)
-	int useIgnoreList = pp->useIgnoreList;
-	if(useIgnoreList) {
+	if(pp->useIgnoreList) {
 		ignoreListFile=fopen(pp->ignoreListFile,"r");
 		if(ignoreListFile==NULL) {
 			fprintf(stdout,"failed to open ignore list file %s, bailing out\n", pp->ignoreListFile);
@@ -556,169 +708,252 @@ int hashCurrentVerticalSequencesBatch(PashParameters* pp) {
 		ignoreListFile=NULL;
 		pp->ignoreList=ignoreList;
 	}
+}
 
+/** Split the reads of the current batch in contiguous slices, one per thread.
+@param hiveHash hive hash counted and filled by the slices, NULL if the slices only count kmers
+@param privateCounts count the kmers of every slice separately, even if there is a single slice
+@param slicesCount set to the number of slices
+*/
+static VerticalHashSlice* initVerticalHashSlices(PashParameters* pp, HiveHash* hiveHash, guint32 hiveHashSize,
+		int privateCounts, guint32* slicesCount) {
+	guint32 numberOfVerticalSequences = pp->verticalFastqUtil->getNumberOfSequences();
+	guint32 s;
+	guint32 numberOfSlices = pp->numberOfThreads;
+	if (numberOfSlices>numberOfVerticalSequences) {
+		numberOfSlices = numberOfVerticalSequences;
+	}
+	if (numberOfSlices==0) {
+		numberOfSlices = 1;
+	}
+	VerticalHashSlice* slices = (VerticalHashSlice*) malloc(numberOfSlices*sizeof(VerticalHashSlice));
+	xDieIfNULL(slices, fprintf(stderr, "could not allocate memory for the vertical hash slices at %s:%d\n",
+			__FILE__, __LINE__), 2);
+	for (s=0; s<numberOfSlices; s++) {
+		slices[s].pp = pp;
+		slices[s].hiveHash = hiveHash;
+		slices[s].firstSequence = 1+(guint32)((guint64)numberOfVerticalSequences*s/numberOfSlices);
+		slices[s].lastSequence = (guint32)((guint64)numberOfVerticalSequences*(s+1)/numberOfSlices);
+		slices[s].kmerCounts = NULL;
+		if (numberOfSlices>1 || privateCounts) {
+			slices[s].kmerCounts = (guint32*) calloc(hiveHashSize, sizeof(guint32));
+			xDieIfNULL(slices[s].kmerCounts, fprintf(stderr, "could not allocate memory for the kmer counts of %d hashing threads at %s:%d\n",
+					numberOfSlices, __FILE__, __LINE__), 2);
+		}
+		slices[s].fillPass = 0;
+		slices[s].maxReadLength = 1;
+		slices[s].totalKmers = 0;
+		slices[s].firstKey = (guint32)((guint64)hiveHashSize*s/numberOfSlices);
+		slices[s].lastKey = (guint32)((guint64)hiveHashSize*(s+1)/numberOfSlices);
+		slices[s].numberOfSlices = numberOfSlices;
+		slices[s].slices = slices;
+	}
+	*slicesCount = numberOfSlices;
+	return slices;
+}
 
-	if (hiveHash == NULL) {
-		hiveHashSize = 1;
-		for ( i=0; i< pp->mask.keyLen; i++) {
-			hiveHashSize *= 4;
+/** Add the kmer counts of all slices for a range of keys to the counts over all the read batches.*/
+static void* addVerticalSliceCounts(void* arg) {
+	VerticalHashSlice* slice = (VerticalHashSlice*) arg;
+	VerticalHashSlice* slices = (VerticalHashSlice*) slice->slices;
+	guint32* readKmerCounts = slice->pp->readKmerCounts;
+	guint32 key, s;
+	guint64 total;
+	for (key=slice->firstKey; key<slice->lastKey; key++) {
+		total = readKmerCounts[key];
+		for (s=0; s<slice->numberOfSlices; s++) {
+			total += slices[s].kmerCounts[key];
 		}
+		readKmerCounts[key] = total>G_MAXUINT32 ? G_MAXUINT32 : (guint32)total;
+	}
+	return NULL;
+}
+
+/// Determine the memory requirements of the current vertical batch.
+int sizeCurrentVerticalSequencesBatch(PashParameters* pp) {
+	guint32 hiveHashSize;
+	HiveHash *hiveHash = (HiveHash*)pp->hiveHash;
+	double totalKmers = 0;
+	guint32 s;
+	double sizingStartTime = metricTime();
+	xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "START sizeCurrentVerticalSequencesBatch\n"));
+
+	hiveHashSize = 1;
+	for (guint32 i=0; i< pp->mask.keyLen; i++) {
+		hiveHashSize *= 4;
+	}
+	if (hiveHash == NULL) {
 		xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "hive hash size = %d\n", hiveHashSize));
-		hiveHash = new HiveHash(hiveHashSize, pp->keepHashedKmersPercent);
+		hiveHash = new HiveHash(hiveHashSize, pp->keepHashedKmersPercent, pp->compactHash);
 		pp->hiveHash = hiveHash;
 	}
 
+	guint32 numberOfSlices;
+	VerticalHashSlice* slices = initVerticalHashSlices(pp, hiveHash, hiveHashSize, 0, &numberOfSlices);
+	pp->verticalHashSlices = slices;
+	pp->numberOfVerticalHashSlices = numberOfSlices;
 
-	// if at limit of memory, then stop, because we have enough info to resume the vert hash filling
-	guint32 numberOfVerticalSequences = verticalFastqUtil->getNumberOfSequences();
-	guint32 currentVerticalSequence;
-	for (currentVerticalSequence=1;
-			currentVerticalSequence<=numberOfVerticalSequences;
-			currentVerticalSequence++) {
-		// print current sequence length
-		const char* currentSequence = verticalFastqUtil->retrieveSequence(currentVerticalSequence);
-		const char* currentDefName = verticalFastqUtil->retrieveDefName(currentVerticalSequence);
-		xDEBUG(DEB_HASH_VERTICAL_SEQ,
-				fprintf(stderr, ">> got current sequence [%u] %s -- %s: %lu characters\n",
-						currentVerticalSequence,
-						currentDefName,
-						currentSequence,
-						strlen(currentSequence)
-				));
-
-		SequenceInfo* currentSequenceInfo = &pp->verticalSequencesInfos[currentVerticalSequence];
-		sequenceLength = strlen(currentSequence);
-		currentSequenceInfo->sequenceName = currentDefName;
-		currentSequenceInfo->sequenceLength = sequenceLength;
-		currentSequenceInfo->bestAnchoringScore = 0;
-		currentSequenceInfo->bestSWScore = 0;
-		currentSequenceInfo->bestSkeletonScore = 0;
-		currentSequenceInfo->bestScoreMappings = 0;
-		currentSequenceInfo->passingMappings = 0;
-
-
-		// TODO: in the first pass stage, find a suitable # of diagonals
-		if (sequenceLength>numberOfDiagonals) {
-			fprintf(stderr, "number of diagonals %d should be greater than sequence length %d\n",
-					numberOfDiagonals, sequenceLength);
-			exit(1);
+	runVerticalHashSlices(slices, numberOfSlices, hashVerticalSlice);
+	if (numberOfSlices>1) {
+		runVerticalHashSlices(slices, numberOfSlices, mergeVerticalSliceCounts);
+	}
+	// when mapping in batches, the number of diagonals is set by the longest read of all the batches
+	guint32 maxReadLength = pp->maxReadLength>1 ? pp->maxReadLength : 1;
+	for (s=0; s<numberOfSlices; s++) {
+		if (maxReadLength < slices[s].maxReadLength) {
+			maxReadLength = slices[s].maxReadLength;
 		}
+		totalKmers += slices[s].totalKmers;
+	}
+	xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "end of parsing or fill hash capacity\n"));
+	xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "STOP sizeCurrentVerticalSequencesBatch\n"));
 
-		int fwdIdx;
-		const char* fwdSeq = currentSequence;
-		if (!bisulfiteSequencingMapping) {
-			for (fwdIdx =0; fwdIdx<sequenceLength; fwdIdx++) {
-				revCSeq[sequenceLength-1-fwdIdx] = complement(fwdSeq[fwdIdx]);
-			}
-			revCSeq[sequenceLength] = '\0';
-		}
+	xDEBUG(DEB_LOAD_PER_READ, fprintf(stderr, "Total kmers: %g\n", totalKmers));
+	if (pp->readKmerCounts!=NULL) {
+		hiveHash->useKmerCounts(pp->readKmerCounts);
+	}
+	hiveHash->allocateHashMemory();
+	pp->numberOfDiagonals = maxReadLength ;
+	if (pp->numberOfDiagonals<100) {
+		pp->numberOfDiagonals = 100;
+	}
+	fprintf(stderr, "Number of diagonals set to %d\n", pp->numberOfDiagonals);
+	addMetricTime(MetricSizingPass, sizingStartTime);
 
-		xDEBUG(DEB_LOAD_VERT_HASH,
-				fprintf(stderr, "got current sequence [%u] %s >>%s<< >>%s<< ~~%s~~ of length %u: %lu characters\n",
-						currentVerticalSequence,
-						currentDefName,
-						fwdSeq, revCSeq,
-						currentSequence,
-						sequenceLength, strlen(fwdSeq)));
-		switch(pp->sensitivityMode) {
-		case HighSensitivity:
-			offsetGap = (sequenceLength<=50?(sequenceLength<=36?2:3):(sequenceLength<76?4:6));
-			break;
-		case MediumSensitivity:
-			offsetGap = (sequenceLength<76?(sequenceLength<=36?2:(sequenceLength<=50?3:4)):(sequenceLength<100?8:12));
-			break;
-		case LowSensitivity:
-			offsetGap = (sequenceLength<76?(sequenceLength<=36?2:(sequenceLength<=50?4:4)):(sequenceLength<100?10:(sequenceLength<150?14:18)));
-			break;
-		case FastSensitivity:
-			offsetGap = (sequenceLength<=100?(sequenceLength<=36?2:(sequenceLength<=50?3:4)):(sequenceLength<=200?8:10));
-			break;
-		case UserDefinedSensitivity:
-			offsetGap=pp->wordOffset;
+	return 0;
+}
+
+/** Count the sampled kmers of all the reads and find the longest read, loading the reads one batch at
+ * a time, so that every mapping batch is hashed with the kmer selection and the number of diagonals of
+ * a single batch run. Unless the number of reads per batch was given, the batches are sized to fit the
+ * hive hash memory limit. The reads are rewound for the mapping batches.
+@param pp pash parameters; the ignore list must be loaded
+@return 0 for success; exits on failure
+*/
+int countReadKmersInBatches(PashParameters* pp) {
+	PashFastqUtil* verticalFastqUtil = pp->verticalFastqUtil;
+	guint32 hiveHashSize, numberOfSlices, numberOfReads, readId, s;
+	guint32 maxReadLength = 1;
+	double totalReads = 0, totalBases = 0, totalNameBytes = 0, totalKmers = 0;
+	double countingStartTime = metricTime();
+
+	hiveHashSize = 1;
+	for (guint32 i=0; i< pp->mask.keyLen; i++) {
+		hiveHashSize *= 4;
+	}
+	pp->readKmerCounts = (guint32*) calloc(hiveHashSize, sizeof(guint32));
+	xDieIfNULL(pp->readKmerCounts, fprintf(stderr, "could not allocate memory for the kmer counts at %s:%d\n",
+			__FILE__, __LINE__), 2);
+	pp->earlierBatchKmers = (guint32*) calloc(hiveHashSize/32+1, sizeof(guint32));
+	xDieIfNULL(pp->earlierBatchKmers, fprintf(stderr, "could not allocate memory for the kmer counts at %s:%d\n",
+			__FILE__, __LINE__), 2);
+	guint32 countBatchReads = pp->readsPerBatch>0 ? pp->readsPerBatch : READ_COUNT_BATCH;
+	verticalFastqUtil->rewindSequences();
+	while (verticalFastqUtil->hasMoreSequences()) {
+		numberOfReads = verticalFastqUtil->loadSequences(0, pp->packedReads, countBatchReads);
+		if (numberOfReads==0) {
 			break;
-		default:
-			fprintf(stderr, "offset gap not determined !\n");
-			exit(0);
 		}
-		//xDEBUG(DEB_DUMP_HIVE_HASH, hiveHash->dumpHash(stderr));
-		//offsetGap = (sequenceLength<=50?(sequenceLength<=36?2:4):(sequenceLength<=76?6:12));
-		// start filling the vertical hash table
-		xDEBUG(DEB_HASH_VERTICAL_SEQ,
-				fprintf(stderr, "processing short sequence (maybe read)\n"));
-		maxOffset = sequenceLength-maskLen;
-		for (startOffset = 0; startOffset<=maxOffset; startOffset+= offsetGap) {
-			for (currentSequencePos=startOffset,maskPos = 0,kmerPos = 0;
-					kmerPos < maskWeight;
-					currentSequencePos++, maskPos++) {
-				if (mask.mask[maskPos]) {
-					currentKmer [kmerPos] = currentSequence[currentSequencePos];
-					kmerPos++;
-				}
-			}
-			getKeyForSeq(currentKmer, &forwardKey);
-			xDEBUG(DEB_HASH_VERTICAL_SEQ,
-					fprintf(stderr, "VERT SEQ HASH: found forward kmer %s %d %x, v seq %d at v offset %d\n",
-							currentKmer, forwardKey, forwardKey, currentVerticalSequence,
-							startOffset));
-			if(!useIgnoreList || !isIgnored(forwardKey, ignoreList)) {
-				if (bisulfiteSequencingMapping) {
-					actualSeeds=bisulfiteKmerGenerator->generateKmerList(currentKmer, guintSeeds, maxSeeds);
-					for (i=0; i<actualSeeds; i++) {
-						xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "add entry %d of %d\n", i+1, actualSeeds));
-						hiveHash->addEntryXX(guintSeeds[i], currentVerticalSequence, startOffset);
-					}
-				} else {
-					hiveHash->addEntryXX(forwardKey, 2*currentVerticalSequence, startOffset);
-				}
-				xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "done adding to hive hash\n"));
-			} else {
-				// fprintf(stderr, "ignore %s %u\n", currentKmer, forwardKey);
+		VerticalHashSlice* slices = initVerticalHashSlices(pp, NULL, hiveHashSize, 1, &numberOfSlices);
+		runVerticalHashSlices(slices, numberOfSlices, hashVerticalSlice);
+		runVerticalHashSlices(slices, numberOfSlices, addVerticalSliceCounts);
+		for (s=0; s<numberOfSlices; s++) {
+			if (maxReadLength < slices[s].maxReadLength) {
+				maxReadLength = slices[s].maxReadLength;
 			}
-			xDEBUG(DEB_DUMP_HIVE_HASH, hiveHash->dumpHash(stderr));
+			totalKmers += slices[s].totalKmers;
+			free(slices[s].kmerCounts);
 		}
-
-		if (!bisulfiteSequencingMapping) {
-			minOffset = maskLen -1;
-			for (startOffset = sequenceLength-1; startOffset>=minOffset; startOffset-= offsetGap) {
-				for (currentSequencePos=startOffset,maskPos = 0,kmerPos = 0;
-						kmerPos < maskWeight;
-						currentSequencePos--, maskPos++) {
-					if (mask.mask[maskPos]) {
-						currentReverseKmer[kmerPos] = complement(currentSequence[currentSequencePos]);
-						kmerPos++;
-					}
-				}
-				getKeyForSeq(currentReverseKmer, &reverseKey);
-				xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "found reverse kmer %s %d %x, adding value %d at offset %d\n",
-						currentReverseKmer, reverseKey, reverseKey,
-						currentVerticalSequence, sequenceLength-1-startOffset));
-				if(!useIgnoreList || !isIgnored(reverseKey, ignoreList)) {
-					hiveHash->addEntryXX(reverseKey, 2*currentVerticalSequence+1, sequenceLength-1-startOffset);
-				} else {
-					// fprintf(stderr, "ignore %s %u\n", currentReverseKmer, reverseKey);
-				}
-			}
+		free(slices);
+		for (readId=1; readId<=numberOfReads; readId++) {
+			totalBases += verticalFastqUtil->retrieveSequenceLength(readId);
+			totalNameBytes += strlen(verticalFastqUtil->retrieveDefName(readId))+1;
+		}
+		totalReads += numberOfReads;
+	}
+	verticalFastqUtil->rewindSequences();
+	pp->maxReadLength = maxReadLength;
+
+	if (pp->readsPerBatch==0 && totalReads>0) {
+		// the hive hash skeleton and the kmer counts do not depend on the batch size
+		double fixedBytes = hiveHashSize*((pp->compactHash ? sizeof(guint32) : sizeof(guint32*))+sizeof(guint32)+0.125);
+		if (pp->numberOfThreads>1) {
+			fixedBytes += (double)pp->numberOfThreads*hiveHashSize*sizeof(guint32);
+		}
+		// per read: name, sequences, qualities, read information and up to two words per hashed kmer
+		double readBases = totalBases/totalReads;
+		double readBytes = totalNameBytes/totalReads+readBases+1+4*sizeof(char*)+sizeof(SequenceInfo)
+				+(pp->packedReads ? readBases/4+2*sizeof(guint32) : 2*(readBases+1))
+				+2*sizeof(guint32)*totalKmers/totalReads;
+		double memoryLimit = pp->hiveHashMemoryLimit*1024.0*1024.0;
+		if (memoryLimit<fixedBytes+readBytes) {
+			xDie(fprintf(stderr, "index memory of %u MB is too small for the sampling pattern; at least %g MB are needed\n",
+					pp->hiveHashMemoryLimit, (fixedBytes+readBytes)/(1024.0*1024.0)), 1);
 		}
+		double readsPerBatch = (memoryLimit-fixedBytes)/readBytes;
+		pp->readsPerBatch = readsPerBatch<totalReads ? (guint32)readsPerBatch : (guint32)totalReads;
+	}
+	fprintf(stderr, "counted the kmers of %.0f reads, longest read %u; mapping %u reads per batch\n",
+			totalReads, maxReadLength, pp->readsPerBatch);
+	addMetricTime(MetricKmerCounting, countingStartTime);
+	return 0;
+}
 
-		xDEBUG(DEB_HASH_VERTICAL_SEQ,
-				fprintf(stderr, "++ sequence status %d\n",
-						currentVerticalSequence));
+/// Hash vertical sequence until the hive hash size reaches a user-specified limit.
+int hashCurrentVerticalSequencesBatch(PashParameters* pp) {
+	HiveHash *hiveHash = (HiveHash*)pp->hiveHash;
+	VerticalHashSlice* slices = (VerticalHashSlice*)pp->verticalHashSlices;
+	guint32 numberOfSlices = pp->numberOfVerticalHashSlices;
+	guint32 s;
+	double fillStartTime = metricTime();
+	xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "START hashCurrentVerticalSequencesBatch\n"));
+	if (slices==NULL) {
+		fprintf(stderr, "the vertical batch should be sized before it is hashed\n");
+		exit(1);
+	}
+
+	for (s=0; s<numberOfSlices; s++) {
+		slices[s].fillPass = 1;
+	}
+	runVerticalHashSlices(slices, numberOfSlices, hashVerticalSlice);
+	for (s=0; s<numberOfSlices; s++) {
+		if (slices[s].kmerCounts!=NULL) {
+			free(slices[s].kmerCounts);
+		}
 	}
-	pp->lastVerticalSequenceMapped = currentVerticalSequence;
+	free(slices);
+	pp->verticalHashSlices = NULL;
+	pp->numberOfVerticalHashSlices = 0;
+
+	pp->lastVerticalSequenceMapped += pp->verticalFastqUtil->getNumberOfSequences();
 	xDEBUG(DEB_HASH_VERTICAL_SEQ, fprintf(stderr, "end of parsing or fill hash capacity\n"));
 	xDEBUG(DEB_DUMP_HIVE_HASH_1, hiveHash->dumpHash(stderr));
 	xDEBUG(DEB_HIVE_HASH, fprintf(stderr, "STOP hashCurrentVerticalSequencesBatch\n"));
 
-	if (pp->bisulfiteSequencingMapping) {
-		//delete bisulfiteKmerGenerator;
-		free(guintSeeds);
-	}
-
-	// set number of diagonals based on maximum read length
+	hiveHash->completeHash();
 	hiveHash->checkHashXX();
+	addMetricTime(MetricFillPass, fillStartTime);
 	return 0;
 }
 
+/** Record the kmers hashed by the current read batch, once it was mapped. The bins of these kmers in the
+ * following batches do not start with the first pair of the reads, which the collator then filters as
+ * it does the following pairs of a bin, so that the batches map the reads as a single batch would.
+@param pp pash parameters; the kmers must have been counted by countReadKmersInBatches
+*/
+void markBatchKmers(PashParameters* pp) {
+	HiveHash *hiveHash = (HiveHash*)pp->hiveHash;
+	IntListRunner intListRunner;
+	guint32 hiveHashSize = 1, key;
+	for (guint32 i=0; i< pp->mask.keyLen; i++) {
+		hiveHashSize *= 4;
+	}
+	for (key=0; key<hiveHashSize; key++) {
+		if (pp->readKmerCounts[key]>0 && hiveHash->getIntListRunner(key, &intListRunner)==0 && intListRunner.left>0) {
+			pp->earlierBatchKmers[key>>5] |= ((guint32)1)<<(key&31);
+		}
+	}
+}
 
 /// Initialize the sequence hash
 SequenceHash *initSequenceHash() {
@@ -13,6 +13,7 @@ See the included file LICENSE for details.
 #include <string.h>		// strncpy
 #include "Mask.h"		// Sampling patterns
 #include "FastaUtil.h"
+#include "PackedReference.h"
 #include "FastQUtil.h"
 #include "pashtypes.h"
 #include "byte.h"
@@ -25,11 +26,18 @@ See the included file LICENSE for details.
 #define VERTICAL_FASTA_FILE 0
 #define HORIZONTAL_FASTA_FILE 1
 #define DEFAULT_HIVE_HASH_MEMORY 4096 
+/// Memory of the mapping lines kept until the end of the scan by default, in MB.
+#define DEFAULT_MAPPING_STORE_MEMORY 1024
+/// Reads loaded at a time while counting the kmers of reads mapped in batches.
+#define READ_COUNT_BATCH 100000
 #define DEFAULT_NUMBER_OF_DIAGONALS 500
 #define DEFAULT_MIN_SCORE 40
 #define DEFAULT_WORD_OFFSET 6
 
 enum SensitivityMode {HighSensitivity, MediumSensitivity, LowSensitivity, FastSensitivity, UserDefinedSensitivity };
+/** How the kmer matches of a reference window are brought into (read, offsets) order: by merging the
+ * match streams of the window kmers through a heap, or by gathering all the matches and sorting them.*/
+enum CollationEngine {HeapCollation, SortCollation};
 
 typedef struct {
 	/// Vertical sequence file (typically reads/chromosomes/genome).
@@ -38,9 +46,13 @@ typedef struct {
 	//FastaUtil* fastaUtilVertical;
 	/// FastQ Utility for the vertical sequence.
 	PashFastqUtil* verticalFastqUtil;
+	/// Number of reads hashed so far, over all the batches.
 	guint32 lastVerticalSequenceMapped;
 	SequenceInfo *verticalSequencesInfos;
 	void* hiveHash;
+	/// Per-thread state of the vertical hash construction, between the sizing and the hashing passes.
+	void* verticalHashSlices;
+	guint32 numberOfVerticalHashSlices;
 	// Bisulfite sequencing support
 	int bisulfiteSequencingMapping;
 	// dna meth support
@@ -53,6 +65,9 @@ typedef struct {
 	char horizontalFile[MAX_FILE_NAME_SIZE+1];
 	/// Fasta Utility for the horizontal sequence.
 	FastaUtil* fastaUtilHorizontal;
+	/// Horizontal sequence packed in memory or mapped from a packed reference file; if set, it is scanned
+	/// instead of parsing the FASTA files, and fastaUtilHorizontal is NULL if it was mapped.
+	PackedReference* packedReferenceHorizontal;
 	/// Location of scratch directory (hopefully soon to become obsolete).
 	char scratchDirectory[MAX_FILE_NAME_SIZE+1];
 	/// Output file
@@ -79,14 +94,46 @@ typedef struct {
 	gboolean isMaskDefined;
 	/// Avoid redundancy when doing self comparison -- any match found below the main diagonal is ignored.
 	gboolean selfComparison;
-	/// Hive hash memory limit.
+	/// Hive hash memory limit, in MB; sizes the read batches.
 	guint32 hiveHashMemoryLimit;
+	/// Hash and map the reads one batch at a time.
+	gboolean mapReadsInBatches;
+	/// Number of reads per batch; if 0, derived from the hive hash memory limit.
+	guint32 readsPerBatch;
+	/// Kmer counts and longest read over all the batches, so that each batch is hashed as a single batch run would.
+	guint32* readKmerCounts;
+	guint32 maxReadLength;
+	/// One bit per kmer, set once a batch has hashed the kmer: the first pair of its bin in the following batches is not the first of the reads.
+	guint32* earlierBatchKmers;
 	/// List of kmers to ignore.
 	/// Flag whether the user desires gzipped output.
 	FILE* outputFilePtr;
 	gboolean useGzippedOutput;
+	/// Write the mappings as BAM records instead of SAM lines.
+	gboolean useBamOutput;
+	/// Index in the output header of the reference sequence of each horizontal sequence, which for the
+	/// reverse complement strand of a bisulfite mapping is its forward strand.
+	gint32* outputReferenceIds;
 	guint32 maxMappings;
 	double topPercent;
+	/// Memory of the mapping lines kept until the end of the scan, in MB; beyond it they go to a temporary file.
+	guint32 mappingStoreMemoryLimit;
+	/// Number of threads hashing the vertical sequence and scanning the horizontal sequence.
+	guint32 numberOfThreads;
+	/// Use the compact layout of the hive hash.
+	gboolean compactHash;
+	/// Read index file to save the hive hash to, or to map it from, if not empty.
+	char saveReadIndexFile[MAX_FILE_NAME_SIZE+1];
+	char loadReadIndexFile[MAX_FILE_NAME_SIZE+1];
+	/// Read index mapped by loadReadIndex, and its size; NULL if the reads were hashed.
+	void* readIndexImage;
+	size_t readIndexSize;
+	/// Keep the read bases 2-bit packed.
+	gboolean packedReads;
+	/// Ordering of the kmer matches of each reference window.
+	CollationEngine collationEngine;
+	/// File to write the run metrics to, if not empty.
+	char metricsJsonFile[MAX_FILE_NAME_SIZE+1];
 } PashParameters;
 
 typedef struct {
@@ -106,14 +153,30 @@ typedef struct {
 PashParameters* parseCommandLine(int argc, char**argv);
 /// Print Pash parameters.
 void PashUsage();
+/// Read the ignore list, if applicable.
+void loadIgnoreList(PashParameters* pashParams);
 /// Hash vertical sequence until the hive hash size reaches a user-specified limit.
 int sizeCurrentVerticalSequencesBatch(PashParameters* pashParams);
 int hashCurrentVerticalSequencesBatch(PashParameters* pashParams);
+/// Count the kmers of all the reads batch by batch, and size the batches.
+int countReadKmersInBatches(PashParameters* pashParams);
+/// Record the kmers hashed by the current read batch.
+void markBatchKmers(PashParameters* pashParams);
 /// Scan the horizontal sequence (typically chromosome/genome) agains the hivehash.
 int scanHorizontalSequence(PashParameters* pashParams, SequenceHash* sequenceHash);
+/// Merge the outputs of the read batches in the order of a single batch run.
+void mergeReadBatchOutputs(char** batchOutputFiles, guint32 numberOfBatches, FILE* outputFilePtr);
 /// Initialize the sequence hash
 SequenceHash *initSequenceHash();
 
+/** Length of a horizontal sequence, from the packed reference if there is one.*/
+static inline guint32 horizontalSequenceLength(PashParameters* pashParams, guint32 sequenceIndex) {
+	if (pashParams->packedReferenceHorizontal!=NULL) {
+		return pashParams->packedReferenceHorizontal->sequences[sequenceIndex].length;
+	}
+	return pashParams->fastaUtilHorizontal->sequencesInformation[sequenceIndex].sequenceLength;
+}
+
 /// Print current time
 void printNow();
 
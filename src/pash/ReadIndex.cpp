@@ -0,0 +1,189 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+/***********************************************************************
+ * ReadIndex.cpp
+ * saving and mapping the hive hash of the reads
+ ***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "PashLib.h"
+#include "PashDebug.h"
+#include "HiveHash.h"
+#include "ReadIndex.h"
+
+#define DEB_READ_INDEX 0
+
+/** Fill the header of a read index from the Pash parameters and the reads.*/
+static void fillReadIndexHeader(ReadIndexHeader* header, PashParameters* pp) {
+	guint32 numberOfReads = pp->verticalFastqUtil->getNumberOfSequences();
+	guint32 readId;
+	memset(header, 0, sizeof(ReadIndexHeader));
+	memcpy(header->magic, READ_INDEX_MAGIC, sizeof(header->magic));
+	header->version = READ_INDEX_VERSION;
+	header->headerSize = sizeof(ReadIndexHeader);
+	header->mask = pp->mask;
+	header->sensitivityMode = pp->sensitivityMode;
+	header->wordOffset = pp->wordOffset;
+	header->keepHashedKmersPercent = pp->keepHashedKmersPercent;
+	header->bisulfiteSequencingMapping = pp->bisulfiteSequencingMapping;
+	header->useIgnoreList = pp->useIgnoreList;
+	header->numberOfDiagonals = pp->numberOfDiagonals;
+	header->numberOfReads = numberOfReads;
+	header->totalReadLength = 0;
+	for (readId=1; readId<=numberOfReads; readId++) {
+		header->totalReadLength += pp->verticalSequencesInfos[readId].sequenceLength;
+	}
+}
+
+/** Save the hive hash of the current vertical batch, with its settings and read table.
+@param pp pash parameters; the reads must be hashed
+@param indexFile read index file name
+@return 0 for success; exits on failure
+*/
+int saveReadIndex(PashParameters* pp, const char* indexFile) {
+	ReadIndexHeader header;
+	HiveHash* hiveHash = (HiveHash*) pp->hiveHash;
+	guint32 readId;
+	fillReadIndexHeader(&header, pp);
+
+	FILE* indexFilePtr = fopen(indexFile, "wb");
+	xDieIfNULL(indexFilePtr, fprintf(stderr, "could not open read index file %s\n", indexFile), 2);
+	int failed = fwrite(&header, sizeof(ReadIndexHeader), 1, indexFilePtr)!=1;
+	for (readId=1; readId<=header.numberOfReads && !failed; readId++) {
+		failed = fwrite(&pp->verticalSequencesInfos[readId].sequenceLength, sizeof(guint32), 1, indexFilePtr)!=1;
+	}
+	if (!failed) {
+		failed = hiveHash->writeImage(indexFilePtr);
+	}
+	if (fclose(indexFilePtr) || failed) {
+		xDie(fprintf(stderr, "could not write read index file %s\n", indexFile), 2);
+	}
+	xDEBUG(DEB_READ_INDEX, fprintf(stderr, "saved read index of %u reads to %s\n", header.numberOfReads, indexFile));
+	return 0;
+}
+
+/** Map a saved read index. The hive hash is used in place from the mapping, so runs sharing an index
+ * share its pages; the hashing settings stored in the index replace the ones on the command line.
+@param pp pash parameters; the reads must be loaded
+@param indexFile read index file name
+@return 0 for success; exits on failure
+*/
+int loadReadIndex(PashParameters* pp, const char* indexFile) {
+	ReadIndexHeader* header;
+	struct stat indexStat;
+	guint32 readId;
+
+	int indexFd = open(indexFile, O_RDONLY);
+	if (indexFd<0 || fstat(indexFd, &indexStat)) {
+		xDie(fprintf(stderr, "could not open read index file %s\n", indexFile), 2);
+	}
+	size_t indexSize = indexStat.st_size;
+	if (indexSize<sizeof(ReadIndexHeader)) {
+		xDie(fprintf(stderr, "%s is not a pash read index\n", indexFile), 1);
+	}
+	void* indexImage = mmap(NULL, indexSize, PROT_READ, MAP_SHARED, indexFd, 0);
+	if (indexImage==MAP_FAILED) {
+		xDie(fprintf(stderr, "could not map read index file %s\n", indexFile), 2);
+	}
+	close(indexFd);
+	madvise(indexImage, indexSize, MADV_WILLNEED);
+
+	header = (ReadIndexHeader*) indexImage;
+	if (memcmp(header->magic, READ_INDEX_MAGIC, sizeof(header->magic))) {
+		xDie(fprintf(stderr, "%s is not a pash read index\n", indexFile), 1);
+	}
+	if (header->version!=READ_INDEX_VERSION) {
+		xDie(fprintf(stderr, "read index %s has version %u, expected version %u\n",
+				indexFile, header->version, READ_INDEX_VERSION), 1);
+	}
+	if (header->headerSize!=sizeof(ReadIndexHeader)) {
+		xDie(fprintf(stderr, "read index %s is corrupted: header of %u bytes, expected %u\n",
+				indexFile, header->headerSize, (guint32)sizeof(ReadIndexHeader)), 1);
+	}
+	if ((gboolean)header->useIgnoreList != (pp->useIgnoreList!=0)) {
+		xDie(fprintf(stderr, "read index %s was built %s an ignore list; use the same ignore list to map against it\n",
+				indexFile, header->useIgnoreList ? "with" : "without"), 1);
+	}
+
+	// check that the reads are the ones the index was built from
+	PashFastqUtil* verticalFastqUtil = pp->verticalFastqUtil;
+	guint32 numberOfReads = verticalFastqUtil->getNumberOfSequences();
+	size_t readTableSize = sizeof(ReadIndexHeader)+header->numberOfReads*sizeof(guint32);
+	if (header->numberOfReads!=numberOfReads || indexSize<readTableSize) {
+		xDie(fprintf(stderr, "read index %s was built from %u reads, %s has %u reads\n",
+				indexFile, header->numberOfReads, pp->verticalFile, numberOfReads), 1);
+	}
+	guint32* readLengths = (guint32*) ((char*)indexImage+sizeof(ReadIndexHeader));
+	for (readId=1; readId<=numberOfReads; readId++) {
+		guint32 sequenceLength = verticalFastqUtil->retrieveSequenceLength(readId);
+		if (sequenceLength!=readLengths[readId-1]) {
+			xDie(fprintf(stderr, "read %s has length %u, but the read index %s was built from a read of length %u\n",
+					verticalFastqUtil->retrieveDefName(readId), sequenceLength, indexFile, readLengths[readId-1]), 1);
+		}
+		SequenceInfo* currentSequenceInfo = &pp->verticalSequencesInfos[readId];
+		currentSequenceInfo->sequenceName = verticalFastqUtil->retrieveDefName(readId);
+		currentSequenceInfo->sequenceLength = sequenceLength;
+		currentSequenceInfo->bestAnchoringScore = 0;
+		currentSequenceInfo->bestSWScore = 0;
+		currentSequenceInfo->bestSkeletonScore = 0;
+		currentSequenceInfo->bestScoreMappings = 0;
+		currentSequenceInfo->passingMappings = 0;
+	}
+
+	// settings the index was built with
+	pp->mask = header->mask;
+	pp->isMaskDefined = TRUE;
+	pp->sensitivityMode = (SensitivityMode) header->sensitivityMode;
+	pp->wordOffset = header->wordOffset;
+	pp->keepHashedKmersPercent = header->keepHashedKmersPercent;
+	pp->bisulfiteSequencingMapping = header->bisulfiteSequencingMapping;
+	pp->numberOfDiagonals = header->numberOfDiagonals;
+	loadIgnoreList(pp);
+
+	guint32 hashSize = 1;
+	for (guint32 i=0; i<pp->mask.keyLen; i++) {
+		hashSize *= 4;
+	}
+	guint32* hashImage = (guint32*) ((char*)indexImage+readTableSize);
+	size_t hashImageWords = (indexSize-readTableSize)/sizeof(guint32);
+	// header: number of keys and of entries; then the hashSize+1 bin offsets and the entries
+	if (hashImageWords<2 || hashImage[0]!=hashSize) {
+		xDie(fprintf(stderr, "read index %s is corrupted\n", indexFile), 1);
+	}
+	guint32 numberOfEntries = hashImage[1];
+	if (hashImageWords!=2+(size_t)hashSize+1+2*(size_t)numberOfEntries || hashImage[2+hashSize]!=numberOfEntries) {
+		xDie(fprintf(stderr, "read index %s is corrupted: %u entries do not fit in %lu words\n",
+				indexFile, numberOfEntries, (unsigned long)hashImageWords), 1);
+	}
+	pp->hiveHash = new HiveHash(hashImage, hashImageWords);
+	pp->readIndexImage = indexImage;
+	pp->readIndexSize = indexSize;
+	pp->lastVerticalSequenceMapped = numberOfReads;
+	fprintf(stderr, "loaded read index %s: %u reads, %s mapping, number of diagonals %d\n",
+			indexFile, numberOfReads, pp->bisulfiteSequencingMapping ? "bisulfite" : "regular", pp->numberOfDiagonals);
+	return 0;
+}
+
+/** Release the hive hash of a read index mapped by loadReadIndex, and unmap the index.
+@param pp pash parameters
+*/
+void releaseReadIndex(PashParameters* pp) {
+	delete (HiveHash*) pp->hiveHash;
+	pp->hiveHash = NULL;
+	if (pp->readIndexImage!=NULL) {
+		munmap(pp->readIndexImage, pp->readIndexSize);
+		pp->readIndexImage = NULL;
+		pp->readIndexSize = 0;
+	}
+}
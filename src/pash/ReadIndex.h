@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_READ_INDEX_H
+#define PASH_READ_INDEX_H
+
+/***********************************************************************
+ * ReadIndex.h
+ * Persistent read index: the hive hash of the reads together with the
+ * settings it was built with, saved after hashing and mapped back read-only
+ * by later runs on the same reads.
+ ***********************************************************************/
+
+#include <glib.h>
+#include "PashLib.h"
+
+#define READ_INDEX_MAGIC "PASHRIDX"
+#define READ_INDEX_VERSION 1
+
+/** Header of a read index file. It is followed by the length of every read, then by the hive hash
+ * image (see HiveHash::writeImage). All fields are in the byte order of the machine writing the index.*/
+typedef struct {
+	char magic[8];
+	guint32 version;
+	guint32 headerSize;
+	/// Sampling pattern and hashing settings.
+	Mask mask;
+	guint32 sensitivityMode;
+	guint32 wordOffset;
+	guint32 keepHashedKmersPercent;
+	guint32 bisulfiteSequencingMapping;
+	guint32 useIgnoreList;
+	guint32 numberOfDiagonals;
+	/// Reads the index was built from.
+	guint32 numberOfReads;
+	guint32 reserved;
+	guint64 totalReadLength;
+} ReadIndexHeader;
+
+/// Save the hive hash of the current vertical batch, with its settings and read table.
+int saveReadIndex(PashParameters* pashParams, const char* indexFile);
+/// Map a saved read index, restoring the hashing settings and the read table instead of hashing the reads.
+int loadReadIndex(PashParameters* pashParams, const char* indexFile);
+/// Release the hive hash of a mapped read index and unmap it.
+void releaseReadIndex(PashParameters* pashParams);
+
+#endif
@@ -20,6 +20,35 @@ typedef struct {
     guint32 passingMappings;
 } SequenceInfo;
 
+/*
+ * The best scores of a read are read by the scanning threads while the thread committing
+ * the collation results updates them; use these accessors for any such access.
+ * bestSWScore is stored last and loaded first, so that a reader observing a new best score
+ * also observes the matching bestScoreMappings, bestChrom and bestStart.
+ */
+
+/** Atomically load a best score of a read.*/
+static inline guint32 loadReadScore(const guint32* score) {
+  return __atomic_load_n(score, __ATOMIC_ACQUIRE);
+}
+
+/** Atomically store a best score of a read.*/
+static inline void storeReadScore(guint32* score, guint32 value) {
+  __atomic_store_n(score, value, __ATOMIC_RELEASE);
+}
+
+/** Lock-free maximum update of a best score.
+@return 1 if value is the new best score, 0 otherwise*/
+static inline int updateReadScoreMax(guint32* score, guint32 value) {
+  guint32 current = __atomic_load_n(score, __ATOMIC_RELAXED);
+  while (value>current) {
+    if (__atomic_compare_exchange_n(score, &current, value, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 
 #endif
 
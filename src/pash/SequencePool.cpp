@@ -51,9 +51,10 @@ SequencePool::SequencePool() {
 
 
 SequencePool::~SequencePool() {
-  int i;
-  xDEBUG(DEB_FREE, fprintf(stderr, "freeing %d pools\n", poolCapacity));
-  for (i=0; i<poolCapacity; i++) {
+  guint32 i;
+  xDEBUG(DEB_FREE, fprintf(stderr, "freeing %d pools\n", latestPool+1));
+  // only the pools up to the latest one are allocated
+  for (i=0; i<=latestPool; i++) {
    // xDEBUG(DEB_FREE, fprintf(stderr, "about to free pool %d %x\n", i, poolSkeleton[i].sequence));
     free(poolSkeleton[i].sequence);
   }
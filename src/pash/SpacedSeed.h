@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+
+#ifndef PASH_SPACED_SEED_H
+#define PASH_SPACED_SEED_H
+
+/************************************************************************
+ * SpacedSeed.h
+ * rolling computation of the sampled kmer keys along a sequence
+ *
+ * The last maskLen bases are kept 2-bit packed in a 64-bit window, the
+ * first base of the kmer in the low bits, and the key is extracted from
+ * the window with shift/mask pairs precomputed for the runs of sampled
+ * positions of the pattern (with a single pext when compiled for BMI2).
+ * Keys are the ones getKeyForSeq computes for the sampled bases.
+ ************************************************************************/
+
+#include <string.h>
+#include <glib.h>
+#include "Mask.h"
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+/// Longest sampling pattern the window can hold.
+#define MAX_SPACED_SEED_LEN 32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	guint32 maskLen;
+	guint32 keyLen;
+	/// Shift of a new base into the window.
+	guint32 lastBaseShift;
+	/// Bases of the window, 2 bits per position.
+	guint64 windowBits;
+	/// Sampled bases of the window, 2 bits per sampled position.
+	guint64 sampledBits;
+	/// Sampled positions of the window, 1 bit per position.
+	guint64 sampledPositions;
+	/// Runs of consecutive sampled positions: window shift, bits of the run, shift in the key.
+	guint32 numberOfRuns;
+	guint32 runWindowShift[MAX_SPACED_SEED_LEN];
+	guint64 runBits[MAX_SPACED_SEED_LEN];
+	guint32 runKeyShift[MAX_SPACED_SEED_LEN];
+} SpacedSeed;
+
+/** Bases of the last maskLen positions of a sequence, and which of them are not ACGT.*/
+typedef struct {
+	guint64 bases;
+	guint64 invalidPositions;
+} SpacedSeedWindow;
+
+/** Prepare the rolling key computation for a sampling pattern.
+@return 0 for success, 1 if the pattern is too long for the window*/
+static inline int initSpacedSeed(SpacedSeed* seed, const Mask* mask) {
+	guint32 position, keyPosition = 0;
+	memset(seed, 0, sizeof(SpacedSeed));
+	if (mask->maskLen<1 || mask->maskLen>MAX_SPACED_SEED_LEN) {
+		return 1;
+	}
+	seed->maskLen = mask->maskLen;
+	seed->keyLen = mask->keyLen;
+	seed->lastBaseShift = 2*(mask->maskLen-1);
+	seed->windowBits = mask->maskLen==32 ? ~(guint64)0 : (((guint64)1)<<(2*mask->maskLen))-1;
+	seed->sampledBits = 0;
+	seed->sampledPositions = 0;
+	seed->numberOfRuns = 0;
+	for (position=0; position<mask->maskLen; position++) {
+		if (!mask->mask[position]) {
+			continue;
+		}
+		seed->sampledBits |= ((guint64)3)<<(2*position);
+		seed->sampledPositions |= ((guint64)1)<<position;
+		if (position>0 && mask->mask[position-1]) {
+			seed->runBits[seed->numberOfRuns-1] = (seed->runBits[seed->numberOfRuns-1]<<2)|3;
+		} else {
+			seed->runWindowShift[seed->numberOfRuns] = 2*position;
+			seed->runBits[seed->numberOfRuns] = 3;
+			seed->runKeyShift[seed->numberOfRuns] = 2*keyPosition;
+			seed->numberOfRuns++;
+		}
+		keyPosition++;
+	}
+	return 0;
+}
+
+/** Empty window, before the first base of a sequence.*/
+static inline void resetSpacedSeedWindow(SpacedSeedWindow* window) {
+	window->bases = 0;
+	window->invalidPositions = 0;
+}
+
+/** Code of a base in the keys, as setNthBase: A=0 T=1 G=2 C=3 in either case; any other character is coded 4.*/
+static inline guint32 spacedSeedBaseCode(char base) {
+	switch(base) {
+	case 'A': case 'a': return 0;
+	case 'T': case 't': return 1;
+	case 'G': case 'g': return 2;
+	case 'C': case 'c': return 3;
+	default: return 4;
+	}
+}
+
+/** Shift the next base of a sequence into the window. Once maskLen bases were pushed, the window
+ * holds the kmer starting maskLen-1 bases before this one.*/
+static inline void pushSpacedSeedBase(const SpacedSeed* seed, SpacedSeedWindow* window, char base) {
+	guint32 code = spacedSeedBaseCode(base);
+	// bases other than ACGT add no bits, as in getKeyForSeq
+	window->bases = (window->bases>>2) | ((guint64)(code&3)<<seed->lastBaseShift);
+	window->invalidPositions = (window->invalidPositions>>1) | ((guint64)(code>>2)<<(seed->maskLen-1));
+}
+
+/** Shift the next base of a sequence into a window over its reverse complement: after pushing the base
+ * at position p, the window holds the reverse complement kmer whose first base complements p.*/
+static inline void pushSpacedSeedReverseBase(const SpacedSeed* seed, SpacedSeedWindow* window, char base) {
+	guint32 code = spacedSeedBaseCode(base);
+	guint32 complementCode = code>>2 ? 0 : code^1;
+	window->bases = ((window->bases<<2) | complementCode) & seed->windowBits;
+	window->invalidPositions = ((window->invalidPositions<<1) | (code>>2)) & (seed->windowBits>>seed->maskLen);
+}
+
+/** Key of the kmer in the window.*/
+static inline guint32 spacedSeedKey(const SpacedSeed* seed, const SpacedSeedWindow* window) {
+#if defined(__BMI2__)
+	return (guint32) _pext_u64(window->bases, seed->sampledBits);
+#else
+	guint32 key = 0, run;
+	for (run=0; run<seed->numberOfRuns; run++) {
+		key |= (guint32) (((window->bases>>seed->runWindowShift[run]) & seed->runBits[run]) << seed->runKeyShift[run]);
+	}
+	return key;
+#endif
+}
+
+/** Whether all the sampled bases of the kmer in the window are ACGT.*/
+static inline int spacedSeedKeyIsValid(const SpacedSeed* seed, const SpacedSeedWindow* window) {
+	return (window->invalidPositions & seed->sampledPositions)==0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
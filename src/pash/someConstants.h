@@ -13,7 +13,8 @@ See the included file LICENSE for details.
 #define DEFAULT_BUFFER_SIZE 128*1024
 //#define DEFAULT_BUFFER_SIZE 40
 
-#define MAX_MATCH_STREAMS 4000
+/** Initial capacity of the match streams of a collator; grown with the reference windows.*/
+#define INITIAL_MATCH_STREAMS 4000
 #define MAX_GAPS 50
 #define MAX_VERT_ID 600000000
 
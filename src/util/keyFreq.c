@@ -19,6 +19,7 @@ see usage information below in function printUsage()
 #include "err.h"
 #include "PashDebug.h"
 #include "../pash/Mask.h"
+#include "../pash/SpacedSeed.h"
 
 #define KEYFREQ_VERSION "0.9"
 
@@ -94,21 +95,18 @@ static inline int isBase(char c)
 	return 0;
 }
 
-static inline void revComp(const char* const seq, char *rev, int len)
+/** Base as sampled in a word: lower case letters between 'a' and 'z' (exclusive) count as upper case,
+and anything that is not then A, C, G or T makes the word bad.
+@param c base letter */
+static inline char sampledBase(char c)
 {
-	int ii=0;
-	char c=0;
-	xDEBUG(DEB_REVCOMP, fprintf(stderr, "revcomp for %s\n",seq););
-	for(ii=0;ii<len;ii++)
-	{
-		c=toupper(seq[ii]);
-		if(c=='A') rev[len-ii-1]='T';
-		else if(c=='T') rev[len-ii-1]='A';
-		else if(c=='G') rev[len-ii-1]='C';
-		else if(c=='C') rev[len-ii-1]='G';
-		else            rev[len-ii-1]='N';
-		xDEBUG(DEB_REVCOMP, fprintf(stderr, "[%c]->[%c]\n",seq[ii], rev[len-ii-1]););
+	if (c > 'a' && c < 'z')  {
+		c += 'A'-'a';
 	}
+	if (c == 'A' || c == 'C' || c == 'G' || c == 'T') {
+		return c;
+	}
+	return 'N';
 }
 
 int main(int argc, char ** argv)
@@ -346,15 +344,12 @@ void processInputFile(const char * inputName, guint32 *freq, KmerFreqEntry* kfre
 {
 	int mode=NEWLN;	// type of data encountered at end of last read
 	guint32 jj=0,   // position in input buffer
-			kk=0,   // position in sampling pattern
-			pos=0,  // base position in current word
-			badWord=0,      // set to 1 if current word contains bad characters
-			badReverseWord=0;      // set to 1 if current reverse word contains bad characters
+			kk=0;   // position in sampling pattern
 	charbuff readBuff, seqBuff;
 	FILE *input=NULL;
-	char seq[17], revseq[17], rev[17];
 	char currentBase;
-	char currentRevBase;
+	SpacedSeed spacedSeed;
+	SpacedSeedWindow window, reverseWindow;
 
 	guint32 key;  // hash key for current word
 
@@ -370,6 +365,8 @@ void processInputFile(const char * inputName, guint32 *freq, KmerFreqEntry* kfre
 	seqBuff.content=0;
 	seqBuff.pos=0;
 
+	if(initSpacedSeed(&spacedSeed, &mask)) die("pattern longer than 32 bases");
+
 	fprintf(stderr,"reading file: %s\n",inputName);
 	if(strcmp("-",inputName)==0) input=stdin;
 	else input=fopen(inputName,"r");
@@ -382,56 +379,33 @@ void processInputFile(const char * inputName, guint32 *freq, KmerFreqEntry* kfre
 			if(seqBuff.buff[jj]==0) fprintf(stderr,"."); else
 				fprintf(stderr,"%c",seqBuff.buff[jj]);} fprintf(stderr,"\n");}
 
-		if( seqBuff.content + 1 > patternLen )
+		if( seqBuff.content + 1 > patternLen ) {
+			// roll the forward word and the reverse complement word along the buffer
+			resetSpacedSeedWindow(&window);
+			resetSpacedSeedWindow(&reverseWindow);
+			for(kk=0;kk<patternLen-1;kk++) {
+				currentBase = sampledBase(seqBuff.buff[kk]);
+				pushSpacedSeedBase(&spacedSeed, &window, currentBase);
+				pushSpacedSeedReverseBase(&spacedSeed, &reverseWindow, currentBase);
+			}
 			for(jj=0;jj<seqBuff.content-patternLen+1;jj++)
 			{
-				badWord=0;
-				badReverseWord=0;
-				pos=0;
-
-				for(kk=0;kk<patternLen;kk++)
-				{
-					currentBase = seqBuff.buff[jj+kk];
-					currentRevBase = seqBuff.buff[jj+patternLen-1-kk];
-					xDEBUG(DEB_REVCOMP, fprintf(stderr, "base %c revBase %c\n", currentBase, currentRevBase););
-					if (currentBase > 'a' && currentBase < 'z')  {
-						currentBase += 'A'-'a';
-					}
-					if (currentRevBase > 'a' && currentRevBase < 'z')  {
-						currentRevBase += 'A'-'a';
-					}
-					if(pattern[kk]) {
-						if (!(currentBase == 'A' || currentBase == 'C' ||
-								currentBase == 'G' || currentBase=='T') ) {
-							badWord=1;
-						}
-						seq[pos]=currentBase;
-						if (!(currentRevBase == 'A' || currentRevBase == 'C' ||
-								currentRevBase == 'G' || currentRevBase=='T') ) {
-							badReverseWord=1;
-						}
-						rev[patternWeight-pos-1]=currentRevBase;
-						pos ++;
-					}
-				} // build word from current sequence
-				seq[pos]='\0';
-				rev[pos]='\0';
-				revseq[pos]='\0';
-				xDEBUG(DEB_REVCOMP, fprintf(stderr, "pos=%d patternLen=%d\n", pos, patternLen));
-				if(!badWord) {
-					getKeyForSeq(seq, &key);
-					if(debug) fprintf(stderr,"getting key for %s : %u\n",seq, key);
+				currentBase = sampledBase(seqBuff.buff[jj+patternLen-1]);
+				pushSpacedSeedBase(&spacedSeed, &window, currentBase);
+				pushSpacedSeedReverseBase(&spacedSeed, &reverseWindow, currentBase);
+				if(spacedSeedKeyIsValid(&spacedSeed, &window)) {
+					key = spacedSeedKey(&spacedSeed, &window);
+					if(debug) fprintf(stderr,"getting key for word at %u : %u\n", jj, key);
 					if((freq[key] + 1) > 0 ) {
 						freq[key]++;  // don't increment if it would overflow
 						if (readable) {
 							kfreq[key].kmerFrequency ++;
 						}
 					}
-				}  // good word, make and store
-				if(!badReverseWord){ 	// add reverse compliment
-					revComp(rev, revseq, pos);
-					getKeyForSeq(revseq, &key);
-					if(debug) fprintf(stderr,"getting key for %s->%s : %u\n",rev, revseq, key);
+				}  // good word, store
+				if(spacedSeedKeyIsValid(&spacedSeed, &reverseWindow)){ 	// add reverse compliment
+					key = spacedSeedKey(&spacedSeed, &reverseWindow);
+					if(debug) fprintf(stderr,"getting reverse complement key for word at %u : %u\n", jj, key);
 					if((freq[key] + 1) > 0 ) {
 						freq[key]++;  // don't increment if it would overflow
 						if (readable) {
@@ -440,6 +414,7 @@ void processInputFile(const char * inputName, guint32 *freq, KmerFreqEntry* kfre
 					}
 				}
 			}  // loop jj over sequence buffer
+		}
 		if(debug) fprintf(stderr,"\n");
 	}  // while read from input file
 	fclose(input); input=NULL;
@@ -55,9 +55,6 @@ void printParseResults(int argc, char ** argv, int firstFile);
 /** Process input file.*/
 void processInputFile(const char *inputName, guint32* freq, KmerFreqEntry *kfreq);
 
-/** Compute reverse complement.*/
-static inline void revComp(const char *seq, char *rev, int len);
-
 /** Compare two kmer frequency entries based on frequency.*/
 int compareKmerFrequencyEntry(const void *p1, const void*p2);
 
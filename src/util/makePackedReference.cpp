@@ -0,0 +1,94 @@
+/*
+Copyright (c) 2004-2016 Baylor College of Medicine.
+Use of this software is governed by a license.
+See the included file LICENSE for details.
+*/
+
+/* makePackedReference.cpp
+   Converts a FASTA reference (or a .fof list of FASTA files) into a packed reference file that
+   pash3 maps instead of parsing the FASTA files: 2 bits per base, a table of the runs of bases
+   other than ACGT, and a table of the sequence names and lengths.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "FastaUtil.h"
+#include "PackedReference.h"
+#include "err.h"
+
+//***** GLOBAL VARIABLES
+int inputID=0,	// location in argv of input file name
+outputID=0;	// location in argv of output file name
+//***** GLOBAL VARIABLES
+
+
+//***** printUsage
+void printUsage() {
+	fprintf(stderr,"makePackedReference - tool distributed with Pash version 3.01.03\n"
+			"Converts a FASTA reference into a packed reference for pash3 --referenceGenome.\n"
+			"The packed reference holds 2 bits per base, the runs of bases other than ACGT,\n"
+			"and the sequence names and lengths, so that pash3 maps it instead of parsing\n"
+			"the FASTA files.  The output file name must end in " PACKED_REFERENCE_SUFFIX ".\n"
+			"Usage: \n"
+			"pash3_makePackedReference -i <FASTA or .fof file> -o <outputFile" PACKED_REFERENCE_SUFFIX ">\n"
+			"\n");
+}
+//***** printUsage
+
+
+//***** parse_makePackedReference
+// parse input parameters
+void parse_makePackedReference(int argc, char ** argv)
+{
+	int ii=0;
+
+	if (argc==1) {
+		printUsage();
+		exit(0);
+	}
+	if (!strcmp(argv[1],"--help")) {
+		printUsage();
+		exit(0);
+	}
+	for(ii=1;ii<argc;ii++)
+	{
+		if(strcmp("-i",argv[ii])==0)
+		{
+			ii++;
+			if(ii>=argc) die("must specify input file after -i");
+			inputID=ii;
+		}
+		else if(strcmp("-o",argv[ii])==0)
+		{
+			ii++;
+			if(ii>=argc) die("must specify output file after -o");
+			outputID=ii;
+		}
+		else die("parameter error");
+	}
+	if(inputID==0 || outputID==0) die("missing parameter");
+	if(!isPackedReferenceFile(argv[outputID])) die("output file name must end in " PACKED_REFERENCE_SUFFIX);
+}
+//***** parse_makePackedReference
+
+
+//***** main
+int main(int argc, char ** argv)
+{
+	parse_makePackedReference(argc, argv);
+	FastaUtil* fastaUtil = initFastaUtil(argv[inputID]);
+	PackedReference* packedReference = packFastaUtil(fastaUtil);
+	writePackedReference(packedReference, argv[outputID]);
+	guint64 totalLength = 0;
+	for (guint32 i=1; i<=packedReference->numberOfSequences; i++) {
+		totalLength += packedReference->sequences[i].length;
+	}
+	printf("Packed %u sequences, %llu bases, %u runs of bases other than ACGT into %s\n",
+			packedReference->numberOfSequences, (unsigned long long) totalLength,
+			packedReference->numberOfRuns, argv[outputID]);
+	freePackedReference(packedReference);
+	return 0;
+}
+//**** main